@@ -36,6 +36,9 @@ class ParamServerServiceImpl : public ParamServerService {
 
   ps::toolkit::OperatingLog sparse_table_create_log_;
   ps::toolkit::OperatingLog sparse_table_save_log_;
+  ps::toolkit::OperatingLog sparse_table_save_delta_log_;
+  ps::toolkit::OperatingLog sparse_table_save_status_log_;
+  ps::toolkit::OperatingLog sparse_table_load_log_;
   ps::toolkit::OperatingLog sparse_table_assign_log_;
   ps::toolkit::OperatingLog sparse_table_pull_log_;
   ps::toolkit::OperatingLog sparse_table_push_log_;
@@ -44,6 +47,9 @@ class ParamServerServiceImpl : public ParamServerService {
   ps::toolkit::OperatingLog sparse_table_feature_num_log_;
   ps::toolkit::OperatingLog embedding_table_create_log_;
   ps::toolkit::OperatingLog embedding_table_save_log_;
+  ps::toolkit::OperatingLog embedding_table_save_delta_log_;
+  ps::toolkit::OperatingLog embedding_table_save_status_log_;
+  ps::toolkit::OperatingLog embedding_table_load_log_;
   ps::toolkit::OperatingLog embedding_table_assign_log_;
   ps::toolkit::OperatingLog embedding_table_pull_log_;
   ps::toolkit::OperatingLog embedding_table_push_log_;
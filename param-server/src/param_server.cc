@@ -8,6 +8,8 @@
 #include "utils/proto/ps.pb.h"
 #include "toolkit/mpi_agent.h"
 #include "toolkit/thread_group.h"
+#include "toolkit/task_pool.h"
+#include "toolkit/fs_agent.h"
 #include "toolkit/data_reader.h"
 #include "runtime/config_manager.h"
 #include "model/distributed_runner/rtsparse_offline_runner.h"
@@ -66,6 +68,8 @@ int main(int argc, char **argv) {
   LOG(INFO) << "Step-3: starting rpc server ...";
   int port = -1;
   if (!is_worker) {
+    ps::toolkit::global_table_task_pool().set_thread_num(ConfigManager::pick_server_thread_num());
+    ps::toolkit::FSAgent::localfs_mkdir(ConfigManager::pick_sparse_tier_rule().cold_path_);
     if (server.AddService(&ps_service_impl, brpc::SERVER_DOESNT_OWN_SERVICE) != 0) {
       LOG(FATAL) << "Fail to add service.";
     }
@@ -17,6 +17,7 @@ void ParamServerServiceImpl::remote_call(google::protobuf::RpcController *cntl_b
   // This object helps you to call done->Run() in RAII style. If you need
   // to process the request asynchronously, pass done_guard.release().
   brpc::ClosureGuard done_guard(done);
+  brpc::Controller *cntl = static_cast<brpc::Controller *>(cntl_base);
 
   int ret = ps::message::SUCCESS;
   uint32_t message_type = request->message_type();
@@ -37,6 +38,27 @@ void ParamServerServiceImpl::remote_call(google::protobuf::RpcController *cntl_b
     sparse_table_save_log_.record(ts1, ts2);
     break;
 
+   case ps::message::SPARSE_TABLE_VER1_SAVE_DELTA:
+    ts1 = absl::Now();
+    ret = sparse_kv_ver1_table_server_.save_delta(*request, response);
+    ts2 = absl::Now();
+    sparse_table_save_delta_log_.record(ts1, ts2);
+    break;
+
+   case ps::message::SPARSE_TABLE_VER1_SAVE_STATUS:
+    ts1 = absl::Now();
+    ret = sparse_kv_ver1_table_server_.save_status(*request, response);
+    ts2 = absl::Now();
+    sparse_table_save_status_log_.record(ts1, ts2);
+    break;
+
+   case ps::message::SPARSE_TABLE_VER1_LOAD:
+    ts1 = absl::Now();
+    ret = sparse_kv_ver1_table_server_.load(*request, response);
+    ts2 = absl::Now();
+    sparse_table_load_log_.record(ts1, ts2);
+    break;
+
    case ps::message::SPARSE_TABLE_VER1_ASSIGN:
     ts1 = absl::Now();
     ret = sparse_kv_ver1_table_server_.assign(*request, response);
@@ -46,14 +68,14 @@ void ParamServerServiceImpl::remote_call(google::protobuf::RpcController *cntl_b
 
    case ps::message::SPARSE_TABLE_VER1_PULL:
     ts1 = absl::Now();
-    ret = sparse_kv_ver1_table_server_.pull(*request, response);
+    ret = sparse_kv_ver1_table_server_.pull(*request, response, cntl);
     ts2 = absl::Now();
     sparse_table_pull_log_.record(ts1, ts2);
     break;
 
    case ps::message::SPARSE_TABLE_VER1_PUSH:
     ts1 = absl::Now();
-    ret = sparse_kv_ver1_table_server_.push(*request, response);
+    ret = sparse_kv_ver1_table_server_.push(*request, response, cntl);
     ts2 = absl::Now();
     sparse_table_push_log_.record(ts1, ts2);
     break;
@@ -93,6 +115,27 @@ void ParamServerServiceImpl::remote_call(google::protobuf::RpcController *cntl_b
     embedding_table_save_log_.record(ts1, ts2);
     break;
 
+   case ps::message::EMBEDDING_TABLE_VER1_SAVE_DELTA:
+    ts1 = absl::Now();
+    ret = embedding_ver1_table_server_.save_delta(*request, response);
+    ts2 = absl::Now();
+    embedding_table_save_delta_log_.record(ts1, ts2);
+    break;
+
+   case ps::message::EMBEDDING_TABLE_VER1_SAVE_STATUS:
+    ts1 = absl::Now();
+    ret = embedding_ver1_table_server_.save_status(*request, response);
+    ts2 = absl::Now();
+    embedding_table_save_status_log_.record(ts1, ts2);
+    break;
+
+   case ps::message::EMBEDDING_TABLE_VER1_LOAD:
+    ts1 = absl::Now();
+    ret = embedding_ver1_table_server_.load(*request, response);
+    ts2 = absl::Now();
+    embedding_table_load_log_.record(ts1, ts2);
+    break;
+
    case ps::message::EMBEDDING_TABLE_VER1_ASSIGN:
     ts1 = absl::Now();
     ret = embedding_ver1_table_server_.assign(*request, response);
@@ -102,14 +145,14 @@ void ParamServerServiceImpl::remote_call(google::protobuf::RpcController *cntl_b
 
    case ps::message::EMBEDDING_TABLE_VER1_PULL:
     ts1 = absl::Now();
-    ret = embedding_ver1_table_server_.pull(*request, response);
+    ret = embedding_ver1_table_server_.pull(*request, response, cntl);
     ts2 = absl::Now();
     embedding_table_pull_log_.record(ts1, ts2);
     break;
 
    case ps::message::EMBEDDING_TABLE_VER1_PUSH:
     ts1 = absl::Now();
-    ret = embedding_ver1_table_server_.push(*request, response);
+    ret = embedding_ver1_table_server_.push(*request, response, cntl);
     ts2 = absl::Now();
     embedding_table_push_log_.record(ts1, ts2);
     break;
@@ -157,14 +200,14 @@ void ParamServerServiceImpl::remote_call(google::protobuf::RpcController *cntl_b
 
    case ps::message::DENSE_TABLE_VER1_PULL:
     ts1 = absl::Now();
-    ret = dense_value_ver1_table_server_.pull(*request, response);
+    ret = dense_value_ver1_table_server_.pull(*request, response, cntl);
     ts2 = absl::Now();
     dense_table_pull_log_.record(ts1, ts2);
     break;
 
    case ps::message::DENSE_TABLE_VER1_PUSH:
     ts1 = absl::Now();
-    ret = dense_value_ver1_table_server_.push(*request, response);
+    ret = dense_value_ver1_table_server_.push(*request, response, cntl);
     ts2 = absl::Now();
     dense_table_push_log_.record(ts1, ts2);
     break;
@@ -199,14 +242,14 @@ void ParamServerServiceImpl::remote_call(google::protobuf::RpcController *cntl_b
 
    case ps::message::SUMMARY_TABLE_VER1_PULL:
     ts1 = absl::Now();
-    ret = summary_value_ver1_table_server_.pull(*request, response);
+    ret = summary_value_ver1_table_server_.pull(*request, response, cntl);
     ts2 = absl::Now();
     summary_table_pull_log_.record(ts1, ts2);
     break;
 
    case ps::message::SUMMARY_TABLE_VER1_PUSH:
     ts1 = absl::Now();
-    ret = summary_value_ver1_table_server_.push(*request, response);
+    ret = summary_value_ver1_table_server_.push(*request, response, cntl);
     ts2 = absl::Now();
     summary_table_push_log_.record(ts1, ts2);
     break;
@@ -236,6 +279,9 @@ int ParamServerServiceImpl::shutdown() {
 
   sparse_table_create_log_.set_name("sparse_table_create");
   sparse_table_save_log_.set_name("sparse_table_save");
+  sparse_table_save_delta_log_.set_name("sparse_table_save_delta");
+  sparse_table_save_status_log_.set_name("sparse_table_save_status");
+  sparse_table_load_log_.set_name("sparse_table_load");
   sparse_table_assign_log_.set_name("sparse_table_assign");
   sparse_table_pull_log_.set_name("sparse_table_pull");
   sparse_table_push_log_.set_name("sparse_table_push");
@@ -244,6 +290,9 @@ int ParamServerServiceImpl::shutdown() {
   sparse_table_feature_num_log_.set_name("sparse_table_feature_num");
   embedding_table_create_log_.set_name("embedding_table_create");
   embedding_table_save_log_.set_name("embedding_table_save");
+  embedding_table_save_delta_log_.set_name("embedding_table_save_delta");
+  embedding_table_save_status_log_.set_name("embedding_table_save_status");
+  embedding_table_load_log_.set_name("embedding_table_load");
   embedding_table_assign_log_.set_name("embedding_table_assing");
   embedding_table_pull_log_.set_name("embedding_table_pull");
   embedding_table_push_log_.set_name("embedding_table_push");
@@ -265,6 +314,9 @@ int ParamServerServiceImpl::shutdown() {
 
   sparse_table_create_log_.log();
   sparse_table_save_log_.log();
+  sparse_table_save_delta_log_.log();
+  sparse_table_save_status_log_.log();
+  sparse_table_load_log_.log();
   sparse_table_assign_log_.log();
   sparse_table_pull_log_.log();
   sparse_table_push_log_.log();
@@ -273,6 +325,9 @@ int ParamServerServiceImpl::shutdown() {
   sparse_table_feature_num_log_.log();
   embedding_table_create_log_.log();
   embedding_table_save_log_.log();
+  embedding_table_save_delta_log_.log();
+  embedding_table_save_status_log_.log();
+  embedding_table_load_log_.log();
   embedding_table_assign_log_.log();
   embedding_table_pull_log_.log();
   embedding_table_push_log_.log();
@@ -10,6 +10,9 @@ namespace message {
 enum MessageType {
   SPARSE_TABLE_VER1_CREATE = 1,
   SPARSE_TABLE_VER1_SAVE,
+  SPARSE_TABLE_VER1_SAVE_DELTA,
+  SPARSE_TABLE_VER1_SAVE_STATUS,
+  SPARSE_TABLE_VER1_LOAD,
   SPARSE_TABLE_VER1_ASSIGN,
   SPARSE_TABLE_VER1_PULL,
   SPARSE_TABLE_VER1_PUSH,
@@ -18,6 +21,9 @@ enum MessageType {
   SPARSE_TABLE_VER1_FEATURE_NUM,
   EMBEDDING_TABLE_VER1_CREATE,
   EMBEDDING_TABLE_VER1_SAVE,
+  EMBEDDING_TABLE_VER1_SAVE_DELTA,
+  EMBEDDING_TABLE_VER1_SAVE_STATUS,
+  EMBEDDING_TABLE_VER1_LOAD,
   EMBEDDING_TABLE_VER1_ASSIGN,
   EMBEDDING_TABLE_VER1_PULL,
   EMBEDDING_TABLE_VER1_PUSH,
@@ -55,6 +61,10 @@ enum ErrNo {
   UPDATE_NONEXISTENT_SARSE_FEATURE,      // attempt to update a sparse feature that does not exist
   ASSIGN_NONEXISTENT_SARSE_FEATURE,      // attempt to assign a sparse feature that does not exist
   UNKNOWN_OPTIMIZER,                     // attempt to use unknow optimizer
+  SNAPSHOT_IO_ERROR,                     // failed to write a table snapshot
+  SNAPSHOT_FORMAT_ERROR,                 // table snapshot is truncated, corrupted or of another table type
+  SNAPSHOT_CHAIN_ERROR,                  // delta snapshot does not follow the snapshot loaded before
+  SNAPSHOT_IN_PROGRESS,                  // table snapshot is still being written in the background
   UNKNOWN_ERROR,                         // rpc call finished with unknown error
 };
 
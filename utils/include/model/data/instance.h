@@ -23,13 +23,13 @@ struct Instance {
 
   int fea_num_;
   std::vector<ps::param_table::SparseFeatureVer1> feas_;
-  std::vector<ps::param_table::SparseValueVer1>   fea_pulls_;
-  std::vector<ps::param_table::SparseValueVer1>   fea_pushs_;
+  std::vector<ps::param_table::SparseValueVer1Pull> fea_pulls_;
+  std::vector<ps::param_table::SparseValueVer1Push> fea_pushs_;
 
   int memory_fea_num_;
   std::vector<ps::param_table::SparseFeatureVer1> memory_feas_;
-  std::vector<ps::param_table::SparseEmbeddingVer1> memory_fea_pulls_;
-  std::vector<ps::param_table::SparseEmbeddingVer1> memory_fea_pushs_;
+  std::vector<ps::param_table::SparseEmbeddingVer1Pull> memory_fea_pulls_;
+  std::vector<ps::param_table::SparseEmbeddingVer1Push> memory_fea_pushs_;
 
   std::map<std::string, std::vector<float> > vec_values_;
 
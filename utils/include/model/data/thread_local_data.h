@@ -31,6 +31,14 @@ struct VectorInput {
   std::shared_ptr<MatrixOutput> vinput_;
 };
 
+// a batch with the parameters it was pulled with, handed from the prefetcher to a training thread.
+struct PulledBatch {
+  int batch_size_ = 0;
+  std::vector<Instance> minibatch_;
+  std::vector<ps::param_table::DenseValueVer1Pull> dnn_pulls_;
+  std::vector<ps::param_table::SummaryValueVer1> dnn_summary_pulls_;
+};
+
 struct ThreadLocalData {
   int tid_ = -1;
   int batch_size_ = 0;
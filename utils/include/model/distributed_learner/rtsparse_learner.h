@@ -6,6 +6,7 @@
 #include "param_table/dense_value_ver1_table.h"
 #include "param_table/summary_value_ver1_table.h"
 #include "param_table/sparse_kv_ver1_table.h"
+#include "param_table/sparse_kv_ver1_cache.h"
 #include "param_table/sparse_embedding_ver1_table.h"
 
 #include "toolkit/channel.h"
@@ -37,13 +38,19 @@ class RTSparseLearner {
   void end_pass();
   void set_testmode(bool mode);
 
-  // void load_model(const std::string& path, const std::string& converter);    // not implement
   // void save_model(const std::string& path, const std::string& converter);    // not implement
   // void write_done_file(const std::string&path, const std::string& done_str); // not implement
 
   // realtime sparse-leaner▒▒▒▒▒▒▒
   void process_data(ps::toolkit::Channel<Record> in_chan);
   void save_param_table(const std::string& path);
+  // restores the sparse tables from a model saved by save_param_table, a delta saved
+  // by save_param_table_delta is loaded the same way on top of its predecessor.
+  void load_param_table(const std::string& path);
+  // saves the sparse features changed since the last save or load.
+  void save_param_table_delta(const std::string& path);
+  // folds a base model and its deltas into a new base model at out.
+  void compact_param_table(const std::vector<std::string>& chain, const std::string& out);
 
  private:
   // plugins
@@ -59,6 +66,8 @@ class RTSparseLearner {
   ps::param_table::SummaryValueVer1TableClient    summary_table_client_;
   ps::param_table::SparseKVVer1TableClient        sparse_table_client_;
   ps::param_table::SparseEmbeddingVer1TableClient memory_table_client_;
+  // serves sparse_table_client_ pulls and pushes when the worker enables sparse_cache.
+  ps::param_table::SparseKVVer1Cache              sparse_cache_;
 
   // -----
   bool use_sync_comm_ = false;
@@ -103,6 +112,7 @@ class RTSparseLearner {
   ps::toolkit::OperatingLog perf_pull_sparse_;
   ps::toolkit::OperatingLog perf_pull_dense_;
   ps::toolkit::OperatingLog perf_push_sparse_;
+  ps::toolkit::OperatingLog perf_prefetch_wait_;
   ps::toolkit::OperatingLog perf_push_dense_;
 
   // internal initialize and finalize
@@ -110,9 +120,12 @@ class RTSparseLearner {
   void finalize_param_table();
   void initialize_thread_local_data();
   void finalize_thread_local_data();
+  // sends the gradients buffered by sparse_cache_, and with drop empties it, then waits for
+  // every sparse push in flight, on every worker.
+  void flush_sparse_table(bool drop);
 
   // training stages
-  void pull_params(ThreadLocalData *data);
+  void pull_params(PulledBatch *batch);
   void preprocess(ThreadLocalData *data);
   void feed_forward(ThreadLocalData *data);
   void back_propagate(ThreadLocalData *data);
@@ -121,6 +134,11 @@ class RTSparseLearner {
   // local tools
   void init_pushs(ThreadLocalData *data);
   void record_to_instance(const Record& rec, Instance *ins);
+  void records_to_batch(const std::vector<Record>& buffer, PulledBatch *batch);
+  // runs every stage after the pull on batch, whose buffers are swapped into data.
+  void train_batch(ThreadLocalData *data, PulledBatch *batch);
+  // reads and pulls batches for one training thread until in_chan is drained, then closes out_chan.
+  void prefetch_data_thread(ps::toolkit::Channel<Record> in_chan, ps::toolkit::Channel<PulledBatch> out_chan);
   void process_data_thread(int tid, ps::toolkit::Channel<Record> in_chan);
 };
 
@@ -0,0 +1,40 @@
+#ifndef UTILS_INCLUDE_PARAM_TABLE_DATA_ADAGRAD_KERNEL_H_
+#define UTILS_INCLUDE_PARAM_TABLE_DATA_ADAGRAD_KERNEL_H_
+
+namespace ps {
+namespace param_table {
+
+// Vector kernels of the sparse optimizers. The instruction set (AVX-512, AVX2 or
+// plain C) is picked once from the running cpu, all paths give the same results
+// up to float rounding. Callers check lower <= upper once per batch.
+
+// w[i] = clamp(w[i] + step * g[i] * g_scale_inv, lower, upper), returns the sum of
+// (g[i] * g_scale_inv)^2 for the g2sum update.
+float adagrad_kernel(const int n, float *w, const float *g, const float g_scale_inv, const float step,
+                     const float lower, const float upper);
+
+// per dimension decayed AdaGrad of the dic embedding:
+//   g2sum[i] = decay_rate * g2sum[i] + (g[i] * g_scale_inv)^2
+//   w[i] = clamp(w[i] + learning_rate * g[i] * sqrt((1 + epsilon) / (g2sum[i] / d2sum + epsilon)), lower, upper)
+void decayed_adagrad_kernel(const int n, float *w, float *g2sum, const float *g, const float g_scale_inv,
+                            const float learning_rate, const float decay_rate, const float d2sum,
+                            const float epsilon, const float lower, const float upper);
+
+// name of the instruction set in use, e.g. for logging.
+const char* adagrad_kernel_isa();
+
+typedef float (*AdagradKernel)(const int, float *, const float *, const float, const float,
+                               const float, const float);
+typedef void (*DecayedAdagradKernel)(const int, float *, float *, const float *, const float,
+                                     const float, const float, const float,
+                                     const float, const float, const float);
+
+// kernels of one instruction set ("scalar", "avx2" or "avx512") whatever is in use,
+// NULL when the cpu lacks it. lets tests check every path against the scalar one.
+AdagradKernel adagrad_kernel_of(const char *isa);
+DecayedAdagradKernel decayed_adagrad_kernel_of(const char *isa);
+
+} // namespace param_table
+} // namespace ps
+
+#endif // UTILS_INCLUDE_PARAM_TABLE_DATA_ADAGRAD_KERNEL_H_
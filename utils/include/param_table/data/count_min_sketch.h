@@ -0,0 +1,39 @@
+#ifndef UTILS_INCLUDE_PARAM_TABLE_DATA_COUNT_MIN_SKETCH_H_
+#define UTILS_INCLUDE_PARAM_TABLE_DATA_COUNT_MIN_SKETCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace ps {
+namespace param_table {
+
+// Count-min sketch of 8-bit saturating counters, it never under-estimates a count.
+// Counts are added with conservative update, which keeps the over-estimation of
+// rare keys low. Not thread safe.
+class CountMinSketch {
+ public:
+  // width is rounded up to a power of 2.
+  explicit CountMinSketch(const size_t width);
+  CountMinSketch(const CountMinSketch&) = delete;
+  ~CountMinSketch();
+
+  // returns the estimated count of key after adding count.
+  uint32_t add(const uint64_t key, const uint32_t count);
+  uint32_t estimate(const uint64_t key) const;
+  // halves every counter, so keys that stop showing up are forgotten.
+  void decay();
+
+  static const uint32_t kMaxCount = UINT8_MAX;
+
+ private:
+  static const int kDepth = 4;
+
+  size_t mask_;
+  std::vector<uint8_t> counter_;
+};
+
+} // namespace param_table
+} // namespace ps
+
+#endif // UTILS_INCLUDE_PARAM_TABLE_DATA_COUNT_MIN_SKETCH_H_
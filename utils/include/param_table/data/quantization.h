@@ -0,0 +1,30 @@
+#ifndef UTILS_INCLUDE_PARAM_TABLE_DATA_QUANTIZATION_H_
+#define UTILS_INCLUDE_PARAM_TABLE_DATA_QUANTIZATION_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace ps {
+namespace param_table {
+
+// Storage of float vectors with 32 (plain), 16 (fp16) or 8 bits per element. 8-bit
+// vectors are int8 with one float scale in front, so the largest magnitude maps to 127.
+// Encoded data has no alignment requirement.
+// quantize() rounds stochastically, to the upper neighbour with a probability of the
+// distance to the lower one, so the stored value is unbiased and updates smaller than a
+// step still add up over many pushes instead of being rounded away.
+size_t quantized_bytes(const int bits, const size_t n);
+void quantize(const float *x, const size_t n, const int bits, char *out);
+void dequantize(const char *in, const size_t n, const int bits, float *x);
+
+// round to nearest even, overflow goes to inf.
+uint16_t float_to_half(const float f);
+// rounds to one of the two halves around f, the upper one in magnitude when u, uniform
+// in [0, 1), is below the relative distance of f to the lower one.
+uint16_t float_to_half_stochastic(const float f, const float u);
+float half_to_float(const uint16_t h);
+
+} // namespace param_table
+} // namespace ps
+
+#endif // UTILS_INCLUDE_PARAM_TABLE_DATA_QUANTIZATION_H_
@@ -1,7 +1,9 @@
 #ifndef UTILS_INCLUDE_PARAM_TABLE_DATA_SPARSE_EMBEDDING_VER1_H_
 #define UTILS_INCLUDE_PARAM_TABLE_DATA_SPARSE_EMBEDDING_VER1_H_
 
+#include <stdint.h>
 #include <string>
+#include <vector>
 #include "runtime/config_manager.h"
 #include "param_table/data/sparse_kv_ver1.h"
 
@@ -22,13 +24,62 @@ struct SparseEmbeddingVer1 {
   float delta_score_;
 };
 
+// embedding handed to workers on pull.
+struct SparseEmbeddingVer1Pull {
+  SparseSlotVer1 slot_;
+  float count_;
+  std::vector<float> embedding_;
+  uint64_t version_;
+};
+
+// gradient pushed by workers, count_ is the count to add.
+struct SparseEmbeddingVer1Push {
+  SparseSlotVer1 slot_;
+  float count_;
+  std::vector<float> embedding_;
+  uint64_t version_;
+};
+
+// storage form of SparseEmbeddingVer1 inside the table. embedding_ is kept with
+// vector_bits_ bits per element (see param_table/data/quantization.h) followed by
+// ada_g2sum_, which stays fp32 unless the embedding is quantized, then it is fp16.
+struct SparseEmbeddingVer1Packed {
+  SparseSlotVer1 slot_;
+  int silent_days_;
+
+  float count_;
+  float ada_d2sum_;
+
+  uint64_t version_;
+  float delta_score_;
+
+  // stripe decay epoch the value was last brought up to date at.
+  uint32_t decay_epoch_;
+
+  uint8_t vector_bits_;
+  uint16_t embedding_dim_;
+  uint16_t g2sum_dim_;
+  std::vector<char> data_;
+};
+
 SparseEmbeddingVer1 sparse_embedding_ver1_default();
 int sparse_embedding_ver1_init(SparseEmbeddingVer1 *value, const ps::runtime::TrainingRule& rule);
-int sparse_embedding_ver1_push(SparseEmbeddingVer1 *value, const SparseEmbeddingVer1& grad, const ps::runtime::TrainingRule& rule);
-int sparse_embedding_ver1_merge(SparseEmbeddingVer1 *value, const SparseEmbeddingVer1& new_value, const ps::runtime::TrainingRule& rule);
+int sparse_embedding_ver1_pull(SparseEmbeddingVer1Pull *pull, const SparseEmbeddingVer1& value);
+int sparse_embedding_ver1_push(SparseEmbeddingVer1 *value, const SparseEmbeddingVer1Push& grad, const ps::runtime::TrainingRule& rule);
+// same as sparse_embedding_ver1_push on every value[i], grad[i], with the rule checked once.
+int sparse_embedding_ver1_push_batch(const std::vector<SparseEmbeddingVer1 *>& value,
+                                     const std::vector<const SparseEmbeddingVer1Push *>& grad,
+                                     const ps::runtime::TrainingRule& rule);
+int sparse_embedding_ver1_merge(SparseEmbeddingVer1Push *value, const SparseEmbeddingVer1Push& new_value, const ps::runtime::TrainingRule& rule);
 int sparse_embedding_ver1_to_string(const SparseKeyVer1& key, const SparseEmbeddingVer1& value, std::string *str);
-int sparse_embedding_ver1_time_decay(SparseEmbeddingVer1 *value, const ps::runtime::TrainingRule& rule);
+// applies days time decays at once, count and embedding are scaled by sparse_embedding_ver1_decay_factor.
+float sparse_embedding_ver1_decay_factor(const uint32_t days, const ps::runtime::TrainingRule& rule);
+int sparse_embedding_ver1_time_decay(SparseEmbeddingVer1 *value, const uint32_t days, const ps::runtime::TrainingRule& rule);
 bool sparse_embedding_ver1_shrink(const SparseEmbeddingVer1& value, const ps::runtime::TrainingRule& rule);
+void sparse_embedding_ver1_pack(const SparseEmbeddingVer1& value, const int vector_bits, SparseEmbeddingVer1Packed *packed);
+void sparse_embedding_ver1_unpack(const SparseEmbeddingVer1Packed& packed, SparseEmbeddingVer1 *value);
+// what sparse_embedding_ver1_pull takes from the unpacked value, read straight from packed.
+void sparse_embedding_ver1_unpack_pull(const SparseEmbeddingVer1Packed& packed, SparseEmbeddingVer1Pull *pull);
 
 } // namespace param_table
 } // namespace ps
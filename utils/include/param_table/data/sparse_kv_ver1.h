@@ -4,6 +4,7 @@
 #include <vector>
 #include <string>
 #include "runtime/config_manager.h"
+#include "toolkit/hash.h"
 
 namespace ps {
 namespace param_table {
@@ -38,17 +39,88 @@ struct SparseValueVer1 {
   float delta_score_;
 };
 
+// what workers read of a feature: weights, show / clk and version, no optimizer state.
+struct SparseValueVer1Pull {
+  SparseSlotVer1 slot_;
+
+  float show_;
+  float clk_;
+
+  float lr_w_;
+  float fm_w_;
+  std::vector<float> fm_v_;
+  float mf_w_;
+  std::vector<float> mf_v_;
+  float wide_w_;
+
+  uint64_t version_;
+};
+
+// gradient pushed by workers, show_ and clk_ are the counts to add.
+struct SparseValueVer1Push {
+  SparseSlotVer1 slot_;
+
+  float show_;
+  float clk_;
+
+  float lr_w_;
+  float fm_w_;
+  std::vector<float> fm_v_;
+  float mf_w_;
+  std::vector<float> mf_v_;
+  float wide_w_;
+
+  uint64_t version_;
+  // SparseFieldVer1 bits of the sub-models with a gradient, the others are neither sent nor applied.
+  uint8_t fields_;
+};
+
+// sub-models stored by a feature besides lr and cvm, decided by its slot.
+enum SparseFieldVer1 {
+  SPARSE_FIELD_FM   = 0x1,
+  SPARSE_FIELD_MF   = 0x2,
+  SPARSE_FIELD_WIDE = 0x4,
+  SPARSE_FIELD_ALL  = 0x7,
+};
+
 struct SparseFeatureVer1 {
   SparseKeyVer1  sign_;
   SparseSlotVer1 slot_;
 };
 
+// a sign goes to server hash % server_num unless a PartitionRing routes it, and to a shard
+// on that server by an independently seeded hash.
+inline size_t sparse_feature_server_id(const SparseKeyVer1& sign, const size_t server_num) {
+  return ps::toolkit::hash_mix64(sign) % server_num;
+}
+inline size_t sparse_feature_shard_id(const SparseKeyVer1& sign, const size_t shard_num) {
+  return ps::toolkit::hash_mix64(sign, 1) % shard_num;
+}
+
+// SparseFieldVer1 bits of the slot, every field unless use_slot_schema is set.
+inline uint8_t sparse_value_ver1_schema(const SparseSlotVer1 slot, const ps::runtime::TrainingRule& rule) {
+  if (!rule.sparse_.use_slot_schema_) {
+    return SPARSE_FIELD_ALL;
+  }
+  return slot < rule.sparse_.slot_schema_.size() ? rule.sparse_.slot_schema_[slot] : 0;
+}
+
 SparseValueVer1 sparse_value_ver1_default();
 int sparse_value_ver1_init(SparseValueVer1 *value, const ps::runtime::TrainingRule& rule);
-int sparse_value_ver1_push(SparseValueVer1 *value, const SparseValueVer1& grad, const ps::runtime::TrainingRule& rule);
-int sparse_value_ver1_merge(SparseValueVer1 *value, const SparseValueVer1& new_value, const ps::runtime::TrainingRule& rule);
+// clears the sub-models the slot of the value does not use.
+int sparse_value_ver1_apply_schema(SparseValueVer1 *value, const ps::runtime::TrainingRule& rule);
+int sparse_value_ver1_pull(SparseValueVer1Pull *pull, const SparseValueVer1& value);
+int sparse_value_ver1_push(SparseValueVer1 *value, const SparseValueVer1Push& grad, const ps::runtime::TrainingRule& rule);
+// same as sparse_value_ver1_push on every value[i], grad[i], with the rule checked once.
+int sparse_value_ver1_push_batch(const std::vector<SparseValueVer1 *>& value,
+                                 const std::vector<const SparseValueVer1Push *>& grad, const ps::runtime::TrainingRule& rule);
+int sparse_value_ver1_merge(SparseValueVer1Push *value, const SparseValueVer1Push& new_value, const ps::runtime::TrainingRule& rule);
+// clears the fields_ bits of the sub-models whose gradients are all zero, and drops their vectors.
+int sparse_value_ver1_mask_push(SparseValueVer1Push *grad);
 int sparse_value_ver1_to_string(const SparseKeyVer1& key, const SparseValueVer1& value, std::string *str);
-int sparse_value_ver1_time_decay(SparseValueVer1 *value, const ps::runtime::TrainingRule& rule);
+// applies days time decays at once, show and clk are scaled by sparse_value_ver1_decay_factor.
+float sparse_value_ver1_decay_factor(const uint32_t days, const ps::runtime::TrainingRule& rule);
+int sparse_value_ver1_time_decay(SparseValueVer1 *value, const uint32_t days, const ps::runtime::TrainingRule& rule);
 bool sparse_value_ver1_shrink(const SparseValueVer1& value, const ps::runtime::TrainingRule& rule);
 
 } // namespace param_table
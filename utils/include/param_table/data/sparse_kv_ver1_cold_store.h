@@ -0,0 +1,43 @@
+#ifndef UTILS_INCLUDE_PARAM_TABLE_DATA_SPARSE_KV_VER1_COLD_STORE_H_
+#define UTILS_INCLUDE_PARAM_TABLE_DATA_SPARSE_KV_VER1_COLD_STORE_H_
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+
+namespace ps {
+namespace param_table {
+
+// Local disk file of fixed-size slab rows for features that went cold.
+// write/free/pin/unpin must be serialized by the caller, read may run concurrently.
+class SparseValueVer1ColdStore {
+ public:
+  SparseValueVer1ColdStore(const std::string& file, const size_t stride);
+  SparseValueVer1ColdStore(const SparseValueVer1ColdStore&) = delete;
+  ~SparseValueVer1ColdStore();
+
+  uint64_t write(const char *data);
+  void read(const uint64_t offset, char *data) const;
+  void free(const uint64_t offset);
+  // while pinned, freed rows are not reused, so a snapshot can still read them.
+  void pin();
+  void unpin();
+
+  size_t size() const;
+  // offsets of all rows ever written, live or free, are below end().
+  uint64_t end() const;
+
+ private:
+  std::string file_;
+  int fd_;
+  size_t stride_;
+  uint64_t end_;
+  std::vector<uint64_t> free_list_;
+  uint32_t pin_count_;
+  std::vector<uint64_t> pinned_free_list_;
+};
+
+} // namespace param_table
+} // namespace ps
+
+#endif // UTILS_INCLUDE_PARAM_TABLE_DATA_SPARSE_KV_VER1_COLD_STORE_H_
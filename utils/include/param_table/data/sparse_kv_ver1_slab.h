@@ -0,0 +1,145 @@
+#ifndef UTILS_INCLUDE_PARAM_TABLE_DATA_SPARSE_KV_VER1_SLAB_H_
+#define UTILS_INCLUDE_PARAM_TABLE_DATA_SPARSE_KV_VER1_SLAB_H_
+
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include "param_table/data/sparse_kv_ver1.h"
+
+namespace ps {
+namespace param_table {
+
+// scalar part of a slab row, followed inline by fm_v[fm_dim] and mf_v[mf_dim] if the
+// layout of the row has them, each quantized to the vector bits of the slab (see
+// param_table/data/quantization.h).
+struct SparseValueVer1Row {
+  SparseSlotVer1 slot_;
+  int silent_days_;
+
+  float show_;
+  float clk_;
+
+  float lr_w_;
+  float lr_g2sum_;
+
+  float fm_w_;
+  float fm_w_g2sum_;
+  float fm_v_g2sum_;
+
+  float mf_w_;
+  float mf_w_g2sum_;
+  float mf_v_g2sum_;
+
+  float wide_w_;
+  float wide_g2sum_;
+
+  float delta_score_;
+  // checkpoint epoch of the last change, kept by the table for delta snapshots.
+  uint32_t checkpoint_epoch_;
+  // decay epoch of the table the row was last brought up to date at, time decay is
+  // applied lazily when the row is read.
+  uint32_t decay_epoch_;
+  // links of the row in the shrink timing wheel of the table.
+  uint32_t wheel_prev_;
+  uint32_t wheel_next_;
+  // SPARSE_FIELD_FM and SPARSE_FIELD_MF bits of the vectors stored after the row.
+  uint32_t layout_;
+  uint64_t version_;
+  // key the row is stored under, lets the table walk rows by index.
+  SparseKeyVer1 key_;
+};
+
+class SparseValueVer1Slab;
+
+// Read-only view of a slab at the moment it was taken, see SparseValueVer1Slab::snapshot.
+class SparseValueVer1SlabSnapshot {
+ public:
+  SparseValueVer1SlabSnapshot();
+  ~SparseValueVer1SlabSnapshot() = default;
+
+  void load(const uint32_t index, SparseValueVer1 *value) const;
+  const char* data(const uint32_t index) const;
+
+ private:
+  friend class SparseValueVer1Slab;
+
+  const SparseValueVer1Slab *slab_;
+  std::vector<std::vector<std::shared_ptr<char> > > blocks_;
+};
+
+// Fixed-stride storage of SparseValueVer1, rows are addressed by a 32-bit index.
+// Rows live in fixed size blocks, so growing the slab never moves existing rows.
+// Blocks are copy-on-write: a snapshot shares them with the slab, and the slab
+// copies a shared block before its first change.
+// Every layout, i.e. set of vectors a row stores, has its own stride and blocks, the
+// layout is kept in the top bits of the row index.
+class SparseValueVer1Slab {
+ public:
+  SparseValueVer1Slab(const int fm_dim, const int mf_dim, const int vector_bits = 32);
+  SparseValueVer1Slab(const SparseValueVer1Slab&) = delete;
+  ~SparseValueVer1Slab();
+
+  // allocates a row storing the vectors of the SparseFieldVer1 bits in fields.
+  uint32_t alloc(const uint8_t fields = SPARSE_FIELD_ALL);
+  void free(const uint32_t index);
+
+  void load(const uint32_t index, SparseValueVer1 *value) const;
+  // vectors the row has no room for are dropped.
+  void store(const uint32_t index, const SparseValueVer1& value);
+  // raw rows are up to stride() bytes, e.g. for moving a row to the cold tier and back,
+  // copy() pads a row to stride() bytes.
+  void decode(const char *data, SparseValueVer1 *value) const;
+  // what sparse_value_ver1_pull takes from the decoded row, read straight from the raw row.
+  void decode_pull(const char *data, SparseValueVer1Pull *pull) const;
+  const char* data(const uint32_t index) const;
+  void copy(const uint32_t index, char *data) const;
+
+  // takes the current rows, callers hold off writers while this runs.
+  void snapshot(SparseValueVer1SlabSnapshot *snapshot) const;
+
+  SparseValueVer1Row* row(const uint32_t index);
+  const SparseValueVer1Row* row(const uint32_t index) const;
+
+  int fm_dim() const;
+  int mf_dim() const;
+  int vector_bits() const;
+  size_t stride() const;
+  size_t size() const;
+  // bytes of the live rows.
+  size_t live_bytes() const;
+  // all rows ever allocated, live or free, are at(i) for i below used(). positions move
+  // when rows of another layout are allocated.
+  uint32_t used() const;
+  uint32_t at(uint32_t position) const;
+  size_t memory_usage() const;
+
+ private:
+  friend class SparseValueVer1SlabSnapshot;
+
+  static const int    kBlockShift = 14;
+  static const size_t kBlockRows  = (1UL << kBlockShift);
+  static const int    kLayoutShift = 30;
+  static const int    kLayoutNum = 4;
+
+  struct Layout {
+    size_t stride_;
+    uint32_t used_;
+    std::vector<uint32_t> free_list_;
+    std::vector<std::shared_ptr<char> > blocks_;
+  };
+
+  const char* data(const std::vector<std::shared_ptr<char> >& blocks, const uint32_t index) const;
+
+  int fm_dim_;
+  int mf_dim_;
+  int vector_bits_;
+  size_t fm_bytes_;
+  size_t stride_;
+  std::vector<Layout> layout_;
+};
+
+} // namespace param_table
+} // namespace ps
+
+#endif // UTILS_INCLUDE_PARAM_TABLE_DATA_SPARSE_KV_VER1_SLAB_H_
+
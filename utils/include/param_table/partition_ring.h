@@ -0,0 +1,40 @@
+#ifndef UTILS_INCLUDE_PARAM_TABLE_PARTITION_RING_H_
+#define UTILS_INCLUDE_PARAM_TABLE_PARTITION_RING_H_
+
+#include <stdint.h>
+#include <vector>
+#include "param_table/data/sparse_kv_ver1.h"
+
+namespace ps {
+namespace param_table {
+
+// routes sparse keys to servers. every server owns vnode_num points of a hash ring, placed
+// by its id alone, and a key goes to the owner of the first point at or after its hash, so
+// growing or shrinking the cluster only moves the keys of the arcs that change owner.
+// vnode_num == 0 is the hash % server_num routing used before the ring.
+class PartitionRing {
+ public:
+  PartitionRing();
+  PartitionRing(const uint32_t server_num, const uint32_t vnode_num);
+
+  uint32_t server_num() const;
+  uint32_t vnode_num() const;
+  bool operator==(const PartitionRing& other) const;
+
+  size_t server_id(const SparseKeyVer1& sign) const;
+  // servers of old_ring owning any key that server_id owns in this ring, sorted.
+  std::vector<size_t> source_servers(const PartitionRing& old_ring, const size_t server_id) const;
+
+ private:
+  size_t owner(const uint64_t hash) const;
+
+  uint32_t server_num_;
+  uint32_t vnode_num_;
+  std::vector<uint64_t> token_;
+  std::vector<uint32_t> token_owner_;
+};
+
+} // namespace param_table
+} // namespace ps
+
+#endif // UTILS_INCLUDE_PARAM_TABLE_PARTITION_RING_H_
@@ -0,0 +1,229 @@
+#ifndef UTILS_INCLUDE_PARAM_TABLE_SNAPSHOT_H_
+#define UTILS_INCLUDE_PARAM_TABLE_SNAPSHOT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include "absl/container/flat_hash_map.h"
+#include "message/types.h"
+#include "toolkit/archive.h"
+#include "toolkit/fs_agent.h"
+#include "toolkit/thread_group.h"
+#include "param_table/data/sparse_kv_ver1.h"
+
+namespace ps {
+namespace param_table {
+
+enum SnapshotTableType {
+  SNAPSHOT_SPARSE_KV_VER1 = 1,
+  SNAPSHOT_SPARSE_EMBEDDING_VER1 = 2,
+};
+
+// a base snapshot holds the whole table, a delta holds the features changed since
+// the previous snapshot of the chain and tombstones of the features removed since.
+enum SnapshotType {
+  SNAPSHOT_BASE = 0,
+  SNAPSHOT_DELTA = 1,
+};
+
+// every record starts with its type and the feature key, values follow the key.
+enum SnapshotRecordType {
+  SNAPSHOT_RECORD_VALUE = 0,
+  SNAPSHOT_RECORD_TOMBSTONE = 1,
+};
+
+// readers take every version up to the current one. from SNAPSHOT_VERSION_SPARSE_FIELDS
+// on, sparse kv values only hold the sub-models of their slot, from SNAPSHOT_VERSION_RING
+// on, the header records the partition ring of the writer, from SNAPSHOT_VERSION_VECTOR_G2SUM
+// on, sparse kv values keep the g2sums of their fm / mf vectors, from SNAPSHOT_VERSION_DECAY_EPOCH
+// on, the header records the time decays the values went through.
+enum SnapshotVersion {
+  SNAPSHOT_VERSION_BASE = 1,
+  SNAPSHOT_VERSION_SPARSE_FIELDS = 2,
+  SNAPSHOT_VERSION_RING = 3,
+  SNAPSHOT_VERSION_VECTOR_G2SUM = 4,
+  SNAPSHOT_VERSION_DECAY_EPOCH = 5,
+};
+
+struct SnapshotHeader {
+  uint32_t version_;
+  uint32_t table_type_;
+  uint32_t snapshot_type_;
+  // position in the chain, a delta of epoch e applies on top of the snapshot of epoch e - 1.
+  uint32_t epoch_;
+  // topology of the cluster that wrote the snapshot, a part file holds the
+  // features of shard (part_id_ % shard_num_) on server (part_id_ / shard_num_).
+  uint32_t server_num_;
+  uint32_t shard_num_;
+  uint32_t part_id_;
+  // features went to servers by PartitionRing(server_num_, vnode_num_), 0 before the ring.
+  uint32_t vnode_num_;
+  // values are decayed up to this decay epoch of the writer, 0 before it was recorded.
+  // a time decay changes no value in place, values of an older snapshot of the chain
+  // catch up by the difference when they are read back.
+  uint32_t decay_epoch_;
+};
+
+// a snapshot saved in the background, id_[i] is the save id on server i.
+struct SnapshotHandle {
+  std::vector<uint64_t> id_;
+};
+
+// Binary snapshot of one table shard, laid out as
+//   header | block ... | end mark | footer index | footer offset | magic
+// where a block is {bytes, record_num, records} and records are BinaryArchive
+// encoded by the table. Files are written and read strictly sequentially, so they
+// can be streamed through hdfs pipes; the footer index is checked against the
+// blocks actually read to detect truncated or corrupted files.
+class SnapshotWriter {
+ public:
+  SnapshotWriter(std::shared_ptr<FILE> fd, const SnapshotHeader& header);
+  SnapshotWriter(const SnapshotWriter&) = delete;
+  ~SnapshotWriter();
+
+  // records are appended to archive(), call end_record() after each of them.
+  ps::toolkit::BinaryArchive& archive();
+  int end_record();
+  int finish();
+
+ private:
+  int write(const void *data, size_t size);
+  int flush_block();
+
+  std::shared_ptr<FILE> fd_;
+  ps::toolkit::BinaryArchive ar_;
+  uint64_t offset_;
+  uint64_t record_num_;
+  std::vector<uint64_t> block_offset_;
+  std::vector<uint64_t> block_record_num_;
+  int ret_;
+};
+
+class SnapshotReader {
+ public:
+  explicit SnapshotReader(std::shared_ptr<FILE> fd);
+  SnapshotReader(const SnapshotReader&) = delete;
+  ~SnapshotReader();
+
+  int read_header(SnapshotHeader *header);
+  // loads the next block into archive(), *record_num is set to 0 after the last one.
+  int next_block(uint64_t *record_num);
+  ps::toolkit::BinaryArchive& archive();
+
+ private:
+  int read(void *data, size_t size);
+  int read_footer();
+
+  std::shared_ptr<FILE> fd_;
+  ps::toolkit::BinaryArchive ar_;
+  uint64_t offset_;
+  std::vector<uint64_t> block_offset_;
+  std::vector<uint64_t> block_record_num_;
+};
+
+// part files of a snapshot directory, sorted by name.
+std::vector<std::string> snapshot_part_files(const std::string& path);
+std::string snapshot_part_file(const std::string& path, const size_t part_id);
+int snapshot_read_header(const std::string& file, SnapshotHeader *header);
+// checks that chain is a base followed by consecutive deltas of one table written by
+// one topology, *last is set to the header of the newest snapshot in the chain.
+int snapshot_check_chain(const std::vector<std::string>& chain, const uint32_t table_type, SnapshotHeader *last);
+
+// VALUE records go through snapshot_write_value(ar, value), snapshot_read_value(ar, version, &value)
+// and snapshot_time_decay(&value, days), defined next to the table of VALUE.
+template <class VALUE>
+int snapshot_compact_part(const std::vector<std::string>& chain, const std::string& out,
+                          SnapshotHeader header, const size_t part_id) {
+  int ret = ps::message::SUCCESS;
+
+  absl::flat_hash_map<SparseKeyVer1, VALUE> data;
+  uint32_t decay_epoch = 0;
+  for (size_t c = 0; c < chain.size() && ret == ps::message::SUCCESS; ++c) {
+    SnapshotReader reader(ps::toolkit::FSAgent::fs_open_read(snapshot_part_file(chain[c], part_id), ""));
+    SnapshotHeader part_header;
+    ret = reader.read_header(&part_header);
+    if (ret == ps::message::SUCCESS && part_header.decay_epoch_ > decay_epoch) {
+      for (auto iter = data.begin(); iter != data.end(); ++iter) {
+        snapshot_time_decay(&(iter->second), part_header.decay_epoch_ - decay_epoch);
+      }
+    }
+    if (ret == ps::message::SUCCESS) {
+      decay_epoch = std::max(decay_epoch, part_header.decay_epoch_);
+    }
+
+    uint64_t record_num = 0;
+    while (ret == ps::message::SUCCESS) {
+      ret = reader.next_block(&record_num);
+      if (ret != ps::message::SUCCESS || record_num == 0) {
+        break;
+      }
+      ps::toolkit::BinaryArchive& ar = reader.archive();
+      for (uint64_t r = 0; r < record_num; ++r) {
+        uint8_t type = ar.get<uint8_t>();
+        SparseKeyVer1 key = ar.get<SparseKeyVer1>();
+        if (type == SNAPSHOT_RECORD_TOMBSTONE) {
+          data.erase(key);
+        } else {
+          snapshot_read_value(ar, part_header.version_, &(data[key]));
+        }
+      }
+    }
+  }
+  if (ret != ps::message::SUCCESS) {
+    return ret;
+  }
+
+  header.snapshot_type_ = SNAPSHOT_BASE;
+  header.part_id_ = part_id;
+  header.decay_epoch_ = decay_epoch;
+  SnapshotWriter writer(ps::toolkit::FSAgent::fs_open_write(snapshot_part_file(out, part_id), ""), header);
+  ps::toolkit::BinaryArchive& ar = writer.archive();
+  for (auto iter = data.begin(); iter != data.end() && ret == ps::message::SUCCESS; ++iter) {
+    ar << (uint8_t)SNAPSHOT_RECORD_VALUE << iter->first;
+    snapshot_write_value(ar, iter->second);
+    ret = writer.end_record();
+  }
+  if (ret == ps::message::SUCCESS) {
+    ret = writer.finish();
+  }
+
+  return ret;
+}
+
+// folds a snapshot chain into a new base snapshot at out, which keeps the epoch of
+// the last delta so later deltas still apply. parts are independent, the caller
+// compacts the parts with part_id % worker_num == worker_id.
+template <class VALUE>
+int snapshot_compact(const std::vector<std::string>& chain, const std::string& out, const uint32_t table_type,
+                     const size_t worker_id, const size_t worker_num) {
+  SnapshotHeader header;
+  int ret = snapshot_check_chain(chain, table_type, &header);
+  if (ret != ps::message::SUCCESS) {
+    return ret;
+  }
+
+  std::vector<size_t> parts;
+  for (size_t p = worker_id; p < (size_t)header.server_num_ * header.shard_num_; p += worker_num) {
+    parts.push_back(p);
+  }
+  std::vector<int> tmp_ret(parts.size(), ps::message::SUCCESS);
+  ps::toolkit::parallel_run_dynamic(parts.size(), [&chain, &out, &header, &parts, &tmp_ret](int thr_id, int i) {
+    tmp_ret[i] = snapshot_compact_part<VALUE>(chain, out, header, parts[i]);
+  });
+
+  for (size_t i = 0; i < parts.size(); ++i) {
+    if (tmp_ret[i] != ps::message::SUCCESS) {
+      ret = tmp_ret[i];
+      break;
+    }
+  }
+  return ret;
+}
+
+} // namespace param_table
+} // namespace ps
+
+#endif // UTILS_INCLUDE_PARAM_TABLE_SNAPSHOT_H_
@@ -3,13 +3,57 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <bvar/bvar.h>
+#include <brpc/controller.h>
 #include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
 #include "absl/synchronization/mutex.h"
 #include "param_table/data/sparse_embedding_ver1.h"
+#include "param_table/snapshot.h"
+#include "param_table/partition_ring.h"
 
 namespace ps {
 namespace param_table {
 
+// rows are shared with the snapshots of background saves, a row still held by one is
+// replaced instead of written over.
+typedef std::shared_ptr<SparseEmbeddingVer1Packed> SparseEmbeddingVer1Row;
+
+// a shard is split into one or more independently locked stripes.
+struct SparseEmbeddingVer1Stripe {
+  SparseEmbeddingVer1Stripe();
+  SparseEmbeddingVer1Stripe(const SparseEmbeddingVer1Stripe&) = delete;
+  ~SparseEmbeddingVer1Stripe();
+
+  absl::flat_hash_map<SparseKeyVer1, SparseEmbeddingVer1Row> data_;
+  absl::Mutex rw_mutex_;
+  // number of time decays of the stripe, rows catch up with it when read.
+  uint32_t decay_epoch_;
+
+  // delta snapshots: keys changed and removed since the last snapshot, dirty_ is
+  // dropped for full_dirty_ once it stops being much smaller than data_.
+  absl::flat_hash_set<SparseKeyVer1> dirty_;
+  bool full_dirty_;
+  std::vector<SparseKeyVer1> removed_;
+
+  // bytes of the packed vectors of data_, the share of the table memory limit, 0 when
+  // there is none, and rows evicted for it.
+  size_t vector_bytes_;
+  size_t memory_budget_;
+  uint64_t evicted_;
+};
+
+// point-in-time view of the rows of a stripe taken by a background save, the rows
+// themselves are shared with the stripe.
+struct SparseEmbeddingVer1StripeSnapshot {
+  std::vector<std::pair<SparseKeyVer1, std::shared_ptr<const SparseEmbeddingVer1Packed> > > rows_;
+  std::vector<SparseKeyVer1> removed_;
+  uint32_t decay_epoch_;
+};
+
 class SparseEmbeddingVer1Shard {
  public:
   SparseEmbeddingVer1Shard();
@@ -17,40 +61,86 @@ class SparseEmbeddingVer1Shard {
   ~SparseEmbeddingVer1Shard();
 
   int resize(uint64_t size);
-  int save(const std::string& file);
+  // background save: freeze runs between lock_shared and unlock_shared and starts the
+  // next delta, write may run concurrently with training, release drops the snapshot
+  // and hands its changes back to the next delta if the write failed.
+  void lock_shared();
+  void unlock_shared();
+  void freeze(const SnapshotHeader& header, std::vector<SparseEmbeddingVer1StripeSnapshot> *snapshot);
+  int write(const std::string& file, const SnapshotHeader& header,
+            const std::vector<SparseEmbeddingVer1StripeSnapshot>& snapshot) const;
+  void release(const bool is_written, std::vector<SparseEmbeddingVer1StripeSnapshot> *snapshot);
+  // adds or overwrites features, used when loading a snapshot whose values are decayed
+  // up to decay_epoch. values are moved from. catch_up_decay first brings the stripes up
+  // to that epoch.
+  int insert(const std::vector<SparseKeyVer1>& key, std::vector<SparseEmbeddingVer1> *value,
+             const uint32_t decay_epoch);
+  void catch_up_decay(const uint32_t decay_epoch);
+  int erase(const std::vector<SparseKeyVer1>& key);
+  // starts a new delta chain at the loaded snapshot.
+  void reset_checkpoint();
   int assign(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseEmbeddingVer1>& value);
-  int push(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseEmbeddingVer1>& value);
-  int pull(const std::vector<SparseFeatureVer1>& key, std::vector<SparseEmbeddingVer1> *value, const bool is_training);
+  int push(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseEmbeddingVer1Push>& value);
+  int pull(const std::vector<SparseFeatureVer1>& key, std::vector<SparseEmbeddingVer1Pull> *value, const bool is_training);
   int time_decay();
   int shrink();
   uint64_t feature_num();
+  // bytes held by live rows, and rows evicted to stay within the memory limit.
+  size_t memory_usage();
+  uint64_t evicted_num();
 
  private:
-  absl::flat_hash_map<SparseKeyVer1, SparseEmbeddingVer1> data_;
-  absl::Mutex rw_mutex_;
+  size_t locate(const SparseKeyVer1& key) const;
+  int write_text(const std::string& file, const std::vector<SparseEmbeddingVer1StripeSnapshot>& snapshot) const;
+
+  std::vector<SparseEmbeddingVer1Stripe> stripe_;
 };
 
 class SparseEmbeddingVer1Table {
  public:
   SparseEmbeddingVer1Table();
-  SparseEmbeddingVer1Table(const std::string &name);
+  SparseEmbeddingVer1Table(const std::string &name, const PartitionRing& ring);
   SparseEmbeddingVer1Table(const SparseEmbeddingVer1Table&) = delete;
   ~SparseEmbeddingVer1Table();
 
   const std::string& name() const;
 
   int resize(uint64_t size);
-  int save(const std::string& path);
+  // saves return at once and write the table as it was at the call in the background,
+  // save_status(*handle) is SNAPSHOT_IN_PROGRESS until the snapshot is complete.
+  int save(const std::string& path, uint64_t *handle);
+  int save_delta(const std::string& path, uint64_t *handle);
+  int save_status(const uint64_t handle);
+  int load(const std::string& path);
   int assign(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseEmbeddingVer1>& value);
-  int push(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseEmbeddingVer1>& value);
-  int pull(const std::vector<SparseFeatureVer1>& key, std::vector<SparseEmbeddingVer1> *value, const bool is_training);
+  int push(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseEmbeddingVer1Push>& value);
+  int pull(const std::vector<SparseFeatureVer1>& key, std::vector<SparseEmbeddingVer1Pull> *value, const bool is_training);
   int time_decay();
   int shrink();
   uint64_t feature_num();
+  size_t memory_usage();
+  uint64_t evicted_num();
 
  private:
+  int save_snapshot(const std::string& path, const uint32_t snapshot_type, uint64_t *handle);
+
   std::string name_;
+  // the ring the clients route with, recorded in every snapshot.
+  PartitionRing ring_;
   std::vector<SparseEmbeddingVer1Shard> shard_;
+  // epoch of the last snapshot saved or loaded.
+  uint32_t checkpoint_epoch_;
+
+  // background save state, guarded by save_mutex_ together with checkpoint_epoch_.
+  absl::Mutex save_mutex_;
+  std::thread save_thread_;
+  bool is_saving_;
+  uint64_t save_id_;
+  absl::flat_hash_map<uint64_t, int> save_ret_;
+
+  // exported as <name>_memory_bytes and <name>_evicted_features, tables without a name are not exported.
+  std::unique_ptr<bvar::PassiveStatus<uint64_t> > memory_var_;
+  std::unique_ptr<bvar::PassiveStatus<uint64_t> > evicted_var_;
 };
 
 class SparseEmbeddingVer1TableServer {
@@ -61,9 +151,12 @@ class SparseEmbeddingVer1TableServer {
 
   int create(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
   int save(const ps::ParamServerRequest& request, ps::ParamServerResponse *response) const;
+  int save_delta(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
+  int save_status(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
+  int load(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
   int assign(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
-  int push(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
-  int pull(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
+  int push(const ps::ParamServerRequest& request, ps::ParamServerResponse *response, brpc::Controller *cntl);
+  int pull(const ps::ParamServerRequest& request, ps::ParamServerResponse *response, brpc::Controller *cntl);
   int time_decay(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
   int shrink(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
   int feature_num(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
@@ -82,16 +175,29 @@ class SparseEmbeddingVer1TableClient {
   const std::string& name() const;
 
   int create(const std::string& name);
+  // save and save_delta block until the snapshot is written, the async versions
+  // return at once and save_status(handle) tells when it is done. all of them except
+  // save_status are called by every worker, the handle is the same on all of them.
   int save(const std::string& path) const;
+  int save_delta(const std::string& path) const;
+  int save_async(const std::string& path, SnapshotHandle *handle) const;
+  int save_delta_async(const std::string& path, SnapshotHandle *handle) const;
+  int save_status(const SnapshotHandle& handle) const;
+  int save_wait(const SnapshotHandle& handle) const;
+  int load(const std::string& path) const;
+  // folds a base snapshot and its deltas into a new base, called by every worker.
+  int compact(const std::vector<std::string>& chain, const std::string& out) const;
   int assign(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseEmbeddingVer1>& value) const;
-  int push(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseEmbeddingVer1>& value) const;
-  int pull(const std::vector<SparseFeatureVer1>&key, std::vector<SparseEmbeddingVer1> *value, const bool is_training) const;
+  int push(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseEmbeddingVer1Push>& value) const;
+  int pull(const std::vector<SparseFeatureVer1>&key, std::vector<SparseEmbeddingVer1Pull> *value, const bool is_training) const;
   int time_decay() const;
   int shrink() const;
   uint64_t feature_num() const;
 
  private:
   std::string name_;
+  // chosen by rank 0 at create, broadcast to the other workers and sent to the servers.
+  PartitionRing ring_;
 
 }; // DenseTableClient
 
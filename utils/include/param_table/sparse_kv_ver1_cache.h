@@ -0,0 +1,85 @@
+#ifndef UTILS_INCLUDE_PARAM_TABLE_SPARSE_KV_VER1_CACHE_H_
+#define UTILS_INCLUDE_PARAM_TABLE_SPARSE_KV_VER1_CACHE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <bvar/bvar.h>
+#include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+#include "runtime/config_manager.h"
+#include "param_table/data/sparse_kv_ver1.h"
+#include "param_table/sparse_kv_ver1_table.h"
+
+namespace ps {
+namespace param_table {
+
+// a pulled feature, the time and batch it was pulled at, and the gradients pushed to it since.
+struct SparseKVVer1CacheEntry {
+  SparseValueVer1Pull value_;
+  SparseValueVer1Push grad_;
+  bool has_grad_;
+  uint64_t batch_;
+  int64_t time_ms_;
+  uint32_t hits_;
+};
+
+struct SparseKVVer1CacheStripe {
+  absl::Mutex mutex_;
+  absl::flat_hash_map<SparseKeyVer1, SparseKVVer1CacheEntry> data_;
+  // keys of data_ in clock order, the hand is at the front.
+  std::deque<SparseKeyVer1> clock_;
+};
+
+// bounded-staleness cache in front of a SparseKVVer1TableClient, shared by the threads of
+// a worker. every pull counts as a batch. an expired entry first sends its gradients and is
+// pulled again when asked for. a background sweep sends the gradients of expired entries
+// nobody asks for, and drops them unless they were hit since the last sweep. a full stripe
+// makes room with the clock: the hand skips entries hit since it last passed, once.
+class SparseKVVer1Cache {
+ public:
+  SparseKVVer1Cache();
+  SparseKVVer1Cache(const SparseKVVer1Cache&) = delete;
+  ~SparseKVVer1Cache();
+
+  void initialize(const SparseKVVer1TableClient *client, const ps::runtime::SparseCacheRule& rule);
+  bool enabled() const;
+
+  int pull(const std::vector<SparseFeatureVer1>& key, std::vector<SparseValueVer1Pull> *value, const bool is_training);
+  int push(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseValueVer1Push>& value);
+  // sends every buffered gradient, with drop set the cached values are forgotten too.
+  int flush(const bool drop);
+
+  double hit_rate() const;
+
+ private:
+  const SparseKVVer1TableClient *client_;
+  ps::runtime::SparseCacheRule rule_;
+  std::vector<SparseKVVer1CacheStripe> stripe_;
+  size_t stripe_capacity_;
+  std::atomic<uint64_t> batch_;
+
+  absl::Mutex sweep_mutex_;
+  bool stop_;
+  std::thread sweep_thread_;
+
+  bvar::Adder<uint64_t> lookup_num_;
+  bvar::Adder<uint64_t> hit_num_;
+  bvar::IntRecorder staleness_ms_;
+  std::unique_ptr<bvar::PassiveStatus<double> > hit_rate_var_;
+
+  size_t locate(const SparseKeyVer1& key) const;
+  bool is_fresh(const SparseKVVer1CacheEntry& entry, const uint64_t batch, const int64_t now_ms) const;
+  // removes the entry under the clock hand, its gradients are appended to flush_key/flush_grad.
+  void evict(SparseKVVer1CacheStripe *stripe, std::vector<SparseFeatureVer1> *flush_key, std::vector<SparseValueVer1Push> *flush_grad);
+  int sweep();
+  void sweep_loop();
+};
+
+} // namespace param_table
+} // namespace ps
+
+#endif // UTILS_INCLUDE_PARAM_TABLE_SPARSE_KV_VER1_CACHE_H_
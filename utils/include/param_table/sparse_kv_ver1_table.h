@@ -3,13 +3,80 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <bvar/bvar.h>
+#include <brpc/controller.h>
 #include "absl/container/flat_hash_map.h"
 #include "absl/synchronization/mutex.h"
 #include "param_table/data/sparse_kv_ver1.h"
+#include "param_table/data/sparse_kv_ver1_slab.h"
+#include "param_table/data/sparse_kv_ver1_cold_store.h"
+#include "param_table/data/count_min_sketch.h"
+#include "param_table/snapshot.h"
+#include "param_table/partition_ring.h"
 
 namespace ps {
 namespace param_table {
 
+// cold rows keep their decay epoch in the stored row, like hot ones, and the checkpoint
+// epoch of the hot row they came from, so a change moved to the cold tier still goes
+// to the next delta.
+struct SparseKVVer1ColdEntry {
+  uint64_t offset_;
+  uint32_t checkpoint_epoch_;
+};
+
+// a shard is split into one or more independently locked stripes.
+struct SparseKVVer1Stripe {
+  SparseKVVer1Stripe();
+  SparseKVVer1Stripe(const SparseKVVer1Stripe&) = delete;
+  ~SparseKVVer1Stripe();
+
+  absl::flat_hash_map<SparseKeyVer1, uint32_t> index_;
+  SparseValueVer1Slab slab_;
+  absl::Mutex rw_mutex_;
+
+  // cold tier, cold_store_ is NULL when it is disabled.
+  absl::flat_hash_map<SparseKeyVer1, SparseKVVer1ColdEntry> cold_index_;
+  std::unique_ptr<SparseValueVer1ColdStore> cold_store_;
+  // number of time decays of the stripe, rows catch up with it when read.
+  uint32_t decay_epoch_;
+
+  // shows of features not created yet, sketch_ is NULL when feature admission is disabled.
+  std::unique_ptr<CountMinSketch> sketch_;
+
+  // delta snapshots: hot rows stamped with checkpoint_epoch_ changed since the last
+  // snapshot, full_dirty_ marks every row as changed, removed_ keeps shrunk keys.
+  uint32_t checkpoint_epoch_;
+  bool full_dirty_;
+  std::vector<SparseKeyVer1> removed_;
+
+  // background shrink: wheel_[e % wheel_.size()] heads the list of rows last written at
+  // decay epoch e, buckets older than the wheel move to expired_ as (epoch, head) and are
+  // swept first. the sweep then walks slab rows from sweep_row_ and cold rows from
+  // sweep_cold_offset_. wheel_ is empty when the background shrink is disabled.
+  std::vector<uint32_t> wheel_;
+  std::vector<std::pair<uint32_t, uint32_t> > expired_;
+  uint32_t sweep_row_;
+  uint64_t sweep_cold_offset_;
+
+  // share of the table memory limit, 0 when there is none, and rows evicted for it.
+  size_t memory_budget_;
+  uint64_t evicted_;
+};
+
+// point-in-time copy of a stripe taken by a background save. hot rows are read through
+// slab blocks shared with the stripe, cold rows from the cold store, which is pinned.
+struct SparseKVVer1StripeSnapshot {
+  std::vector<std::pair<SparseKeyVer1, uint32_t> > rows_;
+  std::vector<std::pair<SparseKeyVer1, SparseKVVer1ColdEntry> > cold_rows_;
+  std::vector<SparseKeyVer1> removed_;
+  SparseValueVer1SlabSnapshot slab_;
+  uint32_t decay_epoch_;
+};
+
 class SparseKVVer1Shard {
  public:
   SparseKVVer1Shard();
@@ -17,40 +84,99 @@ class SparseKVVer1Shard {
   ~SparseKVVer1Shard();
 
   int resize(uint64_t size);
-  int save(const std::string& file);
+  // background save: freeze runs between lock_shared and unlock_shared and starts the
+  // next delta, write may run concurrently with training, release drops the snapshot
+  // and hands its changes back to the next delta if the write failed.
+  void lock_shared();
+  void unlock_shared();
+  void freeze(const SnapshotHeader& header, std::vector<SparseKVVer1StripeSnapshot> *snapshot);
+  int write(const std::string& file, const SnapshotHeader& header,
+            const std::vector<SparseKVVer1StripeSnapshot>& snapshot) const;
+  void release(const bool is_written, std::vector<SparseKVVer1StripeSnapshot> *snapshot);
+  // adds or overwrites features, used when loading a snapshot whose values are decayed
+  // up to decay_epoch. catch_up_decay first brings the stripes up to that epoch.
+  int insert(const std::vector<SparseKeyVer1>& key, const std::vector<SparseValueVer1>& value,
+             const uint32_t decay_epoch);
+  void catch_up_decay(const uint32_t decay_epoch);
+  int erase(const std::vector<SparseKeyVer1>& key);
+  // starts a new delta chain at the loaded snapshot of the given epoch.
+  void reset_checkpoint(const uint32_t epoch);
   int assign(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseValueVer1>& value);
-  int push(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseValueVer1>& value);
-  int pull(const std::vector<SparseFeatureVer1>& key, std::vector<SparseValueVer1> *value, const bool is_training);
+  // the gradient of key[i] is value[index[i]], as the value of key[i] goes to (*value)[index[i]] on pulls.
+  int push(const std::vector<SparseFeatureVer1>& key, const std::vector<size_t>& index,
+           const std::vector<SparseValueVer1Push>& value);
+  int pull(const std::vector<SparseFeatureVer1>& key, const std::vector<size_t>& index,
+           std::vector<SparseValueVer1Pull> *value, const bool is_training);
   int time_decay();
   int shrink();
+  // background shrink step over at most max_rows rows of one stripe, returns the rows seen.
+  size_t sweep(const size_t max_rows);
   uint64_t feature_num();
+  // bytes held by live index entries and hot rows, and rows evicted to stay within the
+  // memory limit, which only caps the hot ones.
+  size_t memory_usage();
+  uint64_t evicted_num();
 
  private:
-  absl::flat_hash_map<SparseKeyVer1, SparseValueVer1> data_;
-  absl::Mutex rw_mutex_;
+  size_t locate(const SparseKeyVer1& key) const;
+  int write_text(const std::string& file, const std::vector<SparseKVVer1StripeSnapshot>& snapshot) const;
+
+  std::vector<SparseKVVer1Stripe> stripe_;
+  // stripe the next sweep works on, only touched by the background shrink thread.
+  size_t sweep_stripe_;
 };
 
 class SparseKVVer1Table {
  public:
   SparseKVVer1Table();
-  SparseKVVer1Table(const std::string &name);
+  SparseKVVer1Table(const std::string &name, const PartitionRing& ring);
   SparseKVVer1Table(const SparseKVVer1Table&) = delete;
   ~SparseKVVer1Table();
 
   const std::string& name() const;
 
   int resize(uint64_t size);
-  int save(const std::string& path);
+  // saves return at once and write the table as it was at the call in the background,
+  // save_status(*handle) is SNAPSHOT_IN_PROGRESS until the snapshot is complete.
+  int save(const std::string& path, uint64_t *handle);
+  int save_delta(const std::string& path, uint64_t *handle);
+  int save_status(const uint64_t handle);
+  int load(const std::string& path);
   int assign(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseValueVer1>& value);
-  int push(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseValueVer1>& value);
-  int pull(const std::vector<SparseFeatureVer1>& key, std::vector<SparseValueVer1> *value, const bool is_training);
+  int push(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseValueVer1Push>& value);
+  int pull(const std::vector<SparseFeatureVer1>& key, std::vector<SparseValueVer1Pull> *value, const bool is_training);
   int time_decay();
   int shrink();
   uint64_t feature_num();
+  size_t memory_usage();
+  uint64_t evicted_num();
 
  private:
+  int save_snapshot(const std::string& path, const uint32_t snapshot_type, uint64_t *handle);
+  void shrink_loop();
+
   std::string name_;
+  // the ring the clients route with, recorded in every snapshot.
+  PartitionRing ring_;
   std::vector<SparseKVVer1Shard> shard_;
+  // epoch of the last snapshot saved or loaded.
+  uint32_t checkpoint_epoch_;
+
+  // background save state, guarded by save_mutex_ together with checkpoint_epoch_.
+  absl::Mutex save_mutex_;
+  std::thread save_thread_;
+  bool is_saving_;
+  uint64_t save_id_;
+  absl::flat_hash_map<uint64_t, int> save_ret_;
+
+  // background shrink, runs when background_shrink is configured until is_stopping_.
+  absl::Mutex shrink_mutex_;
+  std::thread shrink_thread_;
+  bool is_stopping_;
+
+  // exported as <name>_memory_bytes and <name>_evicted_features, tables without a name are not exported.
+  std::unique_ptr<bvar::PassiveStatus<uint64_t> > memory_var_;
+  std::unique_ptr<bvar::PassiveStatus<uint64_t> > evicted_var_;
 };
 
 class SparseKVVer1TableServer {
@@ -61,9 +187,12 @@ class SparseKVVer1TableServer {
 
   int create(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
   int save(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
+  int save_delta(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
+  int save_status(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
+  int load(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
   int assign(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
-  int push(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
-  int pull(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
+  int push(const ps::ParamServerRequest& request, ps::ParamServerResponse *response, brpc::Controller *cntl);
+  int pull(const ps::ParamServerRequest& request, ps::ParamServerResponse *response, brpc::Controller *cntl);
   int time_decay(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
   int shrink(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
   int feature_num(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
@@ -73,25 +202,67 @@ class SparseKVVer1TableServer {
 
 }; // DenseTable
 
+// asynchronous pushes and assigns a client has in flight to each server. acquire() blocks
+// while a server already has limit of them, a limit of 0 never blocks. wait_all() returns
+// the number failed since its last call.
+class SparseKVVer1PushWindow {
+ public:
+  explicit SparseKVVer1PushWindow(const size_t server_num);
+  SparseKVVer1PushWindow(const SparseKVVer1PushWindow&) = delete;
+  ~SparseKVVer1PushWindow() = default;
+
+  void acquire(const size_t server_id, const int limit);
+  void release(const size_t server_id, const bool failed);
+  int wait_all();
+
+ private:
+  absl::Mutex mutex_;
+  std::vector<int> in_flight_;
+  int total_;
+  int failed_;
+};
+
 class SparseKVVer1TableClient {
  public:
   SparseKVVer1TableClient();
   SparseKVVer1TableClient(const SparseKVVer1TableClient&) = delete;
-  ~SparseKVVer1TableClient() = default;
+  ~SparseKVVer1TableClient();
 
   const std::string& name() const;
 
   int create(const std::string& name);
+  // save and save_delta block until the snapshot is written, the async versions
+  // return at once and save_status(handle) tells when it is done. all of them except
+  // save_status are called by every worker, the handle is the same on all of them.
   int save(const std::string& path) const;
+  int save_delta(const std::string& path) const;
+  int save_async(const std::string& path, SnapshotHandle *handle) const;
+  int save_delta_async(const std::string& path, SnapshotHandle *handle) const;
+  int save_status(const SnapshotHandle& handle) const;
+  int save_wait(const SnapshotHandle& handle) const;
+  int load(const std::string& path) const;
+  // folds a base snapshot and its deltas into a new base, called by every worker.
+  int compact(const std::vector<std::string>& chain, const std::string& out) const;
   int assign(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseValueVer1>& value) const;
-  int push(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseValueVer1>& value) const;
-  int pull(const std::vector<SparseFeatureVer1>&key, std::vector<SparseValueVer1> *value, const bool is_training) const;
+  // assign and push return once their requests are sent, blocking while the push window
+  // of a server is full, and flush() waits until all of them are answered. with a negative
+  // push_window they wait for their own requests and return their status, as push_wait does.
+  int push(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseValueVer1Push>& value) const;
+  int push_wait(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseValueVer1Push>& value) const;
+  int pull(const std::vector<SparseFeatureVer1>&key, std::vector<SparseValueVer1Pull> *value, const bool is_training) const;
+  int flush() const;
   int time_decay() const;
   int shrink() const;
   uint64_t feature_num() const;
 
  private:
+  int send_push(const std::vector<SparseFeatureVer1>& key, const std::vector<SparseValueVer1Push>& value,
+                const bool wait) const;
+
   std::string name_;
+  // chosen by rank 0 at create, broadcast to the other workers and sent to the servers.
+  PartitionRing ring_;
+  std::unique_ptr<SparseKVVer1PushWindow> window_;
 
 }; // DenseTableClient
 
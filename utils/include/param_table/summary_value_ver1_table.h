@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <string>
+#include <brpc/controller.h>
 #include "absl/container/flat_hash_map.h"
 #include "absl/synchronization/mutex.h"
 #include "param_table/data/summary_value_ver1.h"
@@ -66,8 +67,8 @@ class SummaryValueVer1TableServer {
   int save(const ps::ParamServerRequest& request, ps::ParamServerResponse *response) const;
   int resize(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
   int assign(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
-  int push(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
-  int pull(const ps::ParamServerRequest& request, ps::ParamServerResponse *response);
+  int push(const ps::ParamServerRequest& request, ps::ParamServerResponse *response, brpc::Controller *cntl);
+  int pull(const ps::ParamServerRequest& request, ps::ParamServerResponse *response, brpc::Controller *cntl);
 
  private:
   absl::flat_hash_map<std::string, SummaryValueVer1Table*> tables_;
@@ -1,6 +1,7 @@
 #ifndef UTILS_INCLUDE_INCLUDE_CONFIG_MANAGER_H_
 #define UTILS_INCLUDE_INCLUDE_CONFIG_MANAGER_H_
 
+#include <float.h>
 #include <vector>
 #include <string>
 #include "toolkit/config.h"
@@ -15,6 +16,43 @@ struct ShardInfo {
   int mpi_rank_;
 };
 
+// sparse features silent for cold_after_silent_days_ days and scored below keep_delta_score_
+// are moved to local disk under cold_path_, an empty cold_path_ keeps everything in memory.
+struct SparseTierRule {
+  std::string cold_path_ = "";
+  int   cold_after_silent_days_ = 3;
+  float keep_delta_score_ = FLT_MAX;
+};
+
+// unseen sparse features are created once a count-min sketch of sketch_width_ counters
+// per shard has seen show_threshold_ shows of them, or earlier by chance with the
+// create_clk_prob_ / create_nonclk_prob_ of the training rule. until then pulls get
+// the default value and pushes are dropped. show_threshold_ = 0 creates every feature
+// at its first training pull.
+struct SparseAdmissionRule {
+  int    show_threshold_ = 0;
+  size_t sketch_width_ = (1UL << 22);
+};
+
+// with background_ set, sparse kv tables shrink continuously: every tick_ms_ a sweeper
+// checks up to tick_rows_ rows of one stripe per shard, and shrink() returns at once.
+struct SparseShrinkRule {
+  bool   background_ = false;
+  int    tick_ms_ = 100;
+  size_t tick_rows_ = 16384;
+};
+
+// each sparse kv or embedding table may use up to table_bytes_ (0 = no limit) of memory
+// for its hot rows. once a stripe reaches high_watermark_ of its share, it evicts rows
+// down to low_watermark_. kv tables evict the lowest scored of sample_num_ random rows
+// each time (sampled LFU), embedding tables the lowest scored rows of the stripe.
+struct SparseMemoryRule {
+  size_t table_bytes_ = 0;
+  float  high_watermark_ = 0.95;
+  float  low_watermark_ = 0.9;
+  int    sample_num_ = 8;
+};
+
 struct VecInput {
   std::string name_;
   int dim_;
@@ -158,7 +196,14 @@ struct WideTrainingRule {
 };
 
 struct SparseTrainingRule {
+  // embedding vectors are stored with quantized_embedding_bits_ (16: fp16, 8: int8)
+  // bits per element when use_quantized_embedding_ is set.
   bool use_quantized_embedding_;
+  int  quantized_embedding_bits_;
+  // with use_slot_schema_, features only keep the sub-models their slot is listed in:
+  // slot_schema_[slot] has bit 0 set for fm, bit 1 for mf and bit 2 for wide.
+  bool use_slot_schema_;
+  std::vector<uint8_t> slot_schema_;
   float create_clk_prob_;
   float create_nonclk_prob_;
   float clk_coeff_;
@@ -190,6 +235,15 @@ struct DataShufflerRule {
   std::string delete_instance_with_out_slot_;
 };
 
+// workers keep up to capacity_ (0 = disabled) pulled sparse features in a process wide
+// cache. an entry is served until it is max_stale_batches_ batches or max_stale_ms_ ms
+// old (0 = no bound), pushes to it are merged locally and sent when it expires.
+struct SparseCacheRule {
+  size_t capacity_ = 0;
+  int    max_stale_batches_ = 0;
+  int    max_stale_ms_ = 0;
+};
+
 struct OfflineWorkerRule {
   bool shuffle_data_;
   bool test_per_step_;
@@ -279,6 +333,8 @@ struct WorkerRule {
   int position_slot_;
   std::vector<uint64_t> position_feas_;
   DataShufflerRule data_shuffler_rule_;
+  SparseCacheRule sparse_cache_rule_;
+  int prefetch_depth_;            // batches pulled ahead of training, 0 pulls each batch in turn
   std::string train_mode_;
   OfflineWorkerRule offline_worker_rule_;
   OnlineWorkerRule  online_worker_rule_;
@@ -302,6 +358,7 @@ class ConfigManager {
   // runtime config
   static void regist_local_thread_num(const int local_thread_num);
   static void regist_write_thread_num(const int write_thread_num);
+  static void regist_server_thread_num(const int server_thread_num);
   static void regist_disk_buffer_size(const size_t disk_buffer_size);
   static void regist_hdfs_buffer_size(const size_t hdfs_buffer_size);
   static void regist_hdfs_command(const std::string& hdfs_command);
@@ -309,6 +366,7 @@ class ConfigManager {
 
   static int pick_local_thread_num();
   static int pick_write_thread_num();
+  static int pick_server_thread_num();
   static size_t pick_disk_buffer_size();
   static size_t pick_hdfs_buffer_size();
   static const std::string& pick_hdfs_command();
@@ -328,6 +386,29 @@ class ConfigManager {
   static const int pick_local_shard_num();
   static const ShardInfo& pick_local_shard_info(const int local_shard_id);
   static const ShardInfo& pick_global_shard_info(const int global_shard_id);
+  static void regist_sparse_map_stripe_num(const int sparse_map_stripe_num);
+  static const int pick_sparse_map_stripe_num();
+  static void regist_sparse_tier_rule(const SparseTierRule& rule);
+  static const SparseTierRule& pick_sparse_tier_rule();
+  static void regist_sparse_admission_rule(const SparseAdmissionRule& rule);
+  static const SparseAdmissionRule& pick_sparse_admission_rule();
+  static void regist_sparse_shrink_rule(const SparseShrinkRule& rule);
+  static const SparseShrinkRule& pick_sparse_shrink_rule();
+  static void regist_sparse_memory_rule(const SparseMemoryRule& rule);
+  static const SparseMemoryRule& pick_sparse_memory_rule();
+  static void regist_text_snapshot(const bool text_snapshot);
+  static const bool pick_text_snapshot();
+  // sparse pushes a client keeps in flight to one server, 0 (the default) means unbounded.
+  // a negative window makes push and assign wait for their own requests instead.
+  static void regist_push_window(const int push_window);
+  static const int pick_push_window();
+  // points per server on the sparse partition ring, 0 (the default) routes by hash % server_num.
+  // the ring only balances keys within a few percent from about 256 points on. a snapshot
+  // written under another server_num or ring_vnode_num is loaded by every server scanning
+  // all the old parts its keys may come from: all of them for hash % server_num routing,
+  // the few sharing an arc with it on the ring, so changing the value costs one full scan.
+  static void regist_ring_vnode_num(const int ring_vnode_num);
+  static const int pick_ring_vnode_num();
 
   // model config
   static void regist_training_rule(const TrainingRule& rule);
@@ -8,6 +8,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <butil/logging.h>
+#include <butil/iobuf.h>
 
 namespace ps {
 namespace toolkit {
@@ -56,6 +57,13 @@ class ArchiveBase {
   void read_back(void* data, size_t size);
   void write(const void* data, size_t size);
 
+  // with a source, reads past the end of the buffer go on with the next blocks of source,
+  // served in place while a read stays within a block. with a sink, a full buffer is
+  // appended to sink and reused. neither is owned.
+  void set_source(butil::IOBufAsZeroCopyInputStream *source);
+  void set_sink(butil::IOBuf *sink);
+  void flush();
+
   template<class T>
   void get_raw(T& x) {
     prepare_read(sizeof(T));
@@ -80,8 +88,11 @@ class ArchiveBase {
   char *cursor_;
   char *finish_;
   char *limit_;
+  butil::IOBufAsZeroCopyInputStream *source_;
+  butil::IOBuf *sink_;
 
   void free_buffer();
+  void refill(size_t size);
 };
 
 class BinaryArchive : public ArchiveBase {
@@ -138,6 +149,32 @@ BinaryArchive& operator>>(BinaryArchive& ar, std::vector<T>& p) {
 BinaryArchive& operator<<(BinaryArchive& ar, const std::string& s);
 BinaryArchive& operator>>(BinaryArchive& ar, std::string& s);
 
+// rpc payloads travel as brpc attachments, which brpc does not compress. they start with a
+// byte telling whether the rest is snappy compressed, as it is once it is large enough to
+// gain from it. a PayloadWriter gathers what is written in an IOBuf, finish() moves it to
+// the attachment. a PayloadReader reads the blocks of a payload as they are, without
+// flattening it first. both live on the stack of the call, bthreads may change pthreads.
+class PayloadWriter : public BinaryArchive {
+ public:
+  PayloadWriter();
+  PayloadWriter(const PayloadWriter&) = delete;
+
+  void finish(butil::IOBuf *payload);
+
+ private:
+  butil::IOBuf data_;
+};
+
+class PayloadReader : public BinaryArchive {
+ public:
+  explicit PayloadReader(const butil::IOBuf& payload);
+  PayloadReader(const PayloadReader&) = delete;
+
+ private:
+  butil::IOBuf data_;
+  butil::IOBufAsZeroCopyInputStream stream_;
+};
+
 // template<class T1, class T2>
 // BinaryArchive& operator<<(BinaryArchive& ar, const std::pair<T1, T2>& x) {
 //   return ar << x.first << x.second;
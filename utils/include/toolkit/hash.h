@@ -0,0 +1,27 @@
+#ifndef UTILS_INCLUDE_TOOLKIT_HASH_H_
+#define UTILS_INCLUDE_TOOLKIT_HASH_H_
+
+#include <stdint.h>
+
+namespace ps {
+namespace toolkit {
+
+// murmur3 64-bit finalizer. Unlike absl::Hash it is stable across processes,
+// so workers and servers can agree on key placement.
+inline uint64_t hash_mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+inline uint64_t hash_mix64(uint64_t x, uint64_t seed) {
+  return hash_mix64(x ^ hash_mix64(seed + 0x9e3779b97f4a7c15ULL));
+}
+
+} // namespace toolkit
+} // namespace ps
+
+#endif // UTILS_INCLUDE_TOOLKIT_HASH_H_
@@ -0,0 +1,39 @@
+#ifndef UTILS_INCLUDE_TOOLKIT_TASK_POOL_H_
+#define UTILS_INCLUDE_TOOLKIT_TASK_POOL_H_
+
+#include <functional>
+
+namespace ps {
+namespace toolkit {
+
+// Fans a batch out to bthreads. Unlike ThreadGroup, several callers may call run() at
+// the same time; the caller works on its own batch too and waits on a bthread event,
+// which suspends only its bthread. The tasks themselves may still block their pthread.
+class TaskPool {
+ public:
+  explicit TaskPool(int thread_num = 0);
+  TaskPool(const TaskPool&) = delete;
+
+  // the most bthreads started to help a single run(), 0 runs batches inline.
+  int thread_num();
+  void set_thread_num(int thread_num);
+
+  // calls func(0) ... func(n - 1) and returns after all of them finished.
+  void run(int n, std::function<void (int)> func);
+
+ private:
+  struct Batch;
+
+  static void *run_helper(void *arg);
+  static void work(Batch *batch);
+
+  int thread_num_;
+};
+
+// pool used by param tables to serve a single request on several shards at once.
+TaskPool& global_table_task_pool();
+
+} // namespace toolkit
+} // namespace ps
+
+#endif // UTILS_INCLUDE_TOOLKIT_TASK_POOL_H_
@@ -52,6 +52,18 @@ string errno_to_string(int err_no) {
     case UNKNOWN_OPTIMIZER:
       res = "unknown optimizer";
       break;
+    case SNAPSHOT_IO_ERROR:
+      res = "failed to write a table snapshot";
+      break;
+    case SNAPSHOT_FORMAT_ERROR:
+      res = "table snapshot is truncated, corrupted or of another table type";
+      break;
+    case SNAPSHOT_CHAIN_ERROR:
+      res = "delta snapshot does not follow the snapshot loaded before";
+      break;
+    case SNAPSHOT_IN_PROGRESS:
+      res = "table snapshot is still being written in the background";
+      break;
     default:
       res = string("err_no: ") + to_string(err_no);
   }
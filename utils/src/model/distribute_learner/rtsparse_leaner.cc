@@ -1,5 +1,6 @@
 #include "model/distributed_learner/rtsparse_learner.h"
 
+#include <thread>
 #include "absl/time/time.h"
 #include "absl/strings/numbers.h"
 #include "toolkit/mpi_agent.h"
@@ -21,10 +22,14 @@ using ps::toolkit::parallel_run;
 using ps::runtime::ConfigManager;
 using ps::runtime::TrainingRule;
 using ps::param_table::SparseFeatureVer1;
-using ps::param_table::SparseValueVer1;
-using ps::param_table::SparseEmbeddingVer1;
+using ps::param_table::SparseValueVer1Pull;
+using ps::param_table::SparseValueVer1Push;
+using ps::param_table::sparse_value_ver1_mask_push;
+using ps::param_table::SparseEmbeddingVer1Pull;
+using ps::param_table::SparseEmbeddingVer1Push;
 using ps::param_table::DenseValueVer1;
 using ps::param_table::SummaryValueVer1;
+using ps::param_table::SnapshotHandle;
 
 namespace ps {
 namespace model {
@@ -75,6 +80,7 @@ void RTSparseLearner::initialize() {
   perf_push_dense_.set_name("push dense");
   perf_pull_sparse_.set_name("pull sparse");
   perf_push_sparse_.set_name("push sparse");
+  perf_prefetch_wait_.set_name("prefetch wait");
 
   use_sync_comm_ = false;
   is_initialized_ = true;
@@ -125,6 +131,7 @@ void RTSparseLearner::end_day() {
 }
 
 void RTSparseLearner::time_decay() {
+  flush_sparse_table(true);
   sparse_table_client_.time_decay();
   memory_table_client_.time_decay();
   MPIAgent::mpi_barrier_group();
@@ -140,7 +147,7 @@ void RTSparseLearner::shrink_table() {
     sparse_feature_num_before_shrink = sparse_table_client_.feature_num();
     memory_feature_num_before_shrink = memory_table_client_.feature_num();
   }
-  MPIAgent::mpi_barrier_group();
+  flush_sparse_table(true);
 
   sparse_table_client_.shrink();
   memory_table_client_.shrink();
@@ -185,10 +192,17 @@ void RTSparseLearner::begin_pass(TrainingPhase phase) {
   perf_pull_sparse_.clear();
   perf_push_dense_.clear();
   perf_push_sparse_.clear();
+  perf_prefetch_wait_.clear();
   MPIAgent::mpi_barrier_group();
 }
 
 void RTSparseLearner::end_pass() {
+  // cached features keep their values across passes, their gradients are sent now.
+  flush_sparse_table(false);
+  if (sparse_cache_.enabled()) {
+    LOG(INFO) << "sparse cache hit rate: " << sparse_cache_.hit_rate();
+  }
+
   // calculate auc
   MPIAgent::mpi_barrier_group();
   lr_auc_.compute();
@@ -227,6 +241,7 @@ void RTSparseLearner::end_pass() {
   perf_pull_sparse_.log();
   perf_push_dense_.log();
   perf_push_sparse_.log();
+  perf_prefetch_wait_.log();
   MPIAgent::mpi_barrier_group();
 }
 
@@ -273,39 +288,43 @@ void RTSparseLearner::back_propagate(ThreadLocalData *data) {
   cvm_plugin_.back_propagate(data);
 }
 
-void RTSparseLearner::pull_params(ThreadLocalData *data) {
+void RTSparseLearner::pull_params(PulledBatch *batch) {
   absl::Time ts1;
   absl::Time ts2;
 
   if (phase_ == TrainingPhase::JOINING) {
     ts1 = absl::Now();
-    dense_table_client_.pull(&(data->dnn_pulls_));
-    summary_table_client_.pull(&(data->dnn_summary_pulls_));
+    dense_table_client_.pull(&(batch->dnn_pulls_));
+    summary_table_client_.pull(&(batch->dnn_summary_pulls_));
     ts2 = absl::Now();
     perf_pull_dense_.record(ts1, ts2);
   }
 
   ts1 = absl::Now();
   vector<SparseFeatureVer1> feas;
-  vector<SparseValueVer1> fea_pulls;
+  vector<SparseValueVer1Pull> fea_pulls;
   vector<SparseFeatureVer1> memory_feas;
-  vector<SparseEmbeddingVer1> memory_fea_pulls;
+  vector<SparseEmbeddingVer1Pull> memory_fea_pulls;
 
-  for (int i = 0; i < data->batch_size_; ++i) {
-    feas.insert(feas.end(), data->minibatch_[i].feas_.begin(), data->minibatch_[i].feas_.end());
-    memory_feas.insert(memory_feas.end(), data->minibatch_[i].memory_feas_.begin(), data->minibatch_[i].memory_feas_.end());
+  for (int i = 0; i < batch->batch_size_; ++i) {
+    feas.insert(feas.end(), batch->minibatch_[i].feas_.begin(), batch->minibatch_[i].feas_.end());
+    memory_feas.insert(memory_feas.end(), batch->minibatch_[i].memory_feas_.begin(), batch->minibatch_[i].memory_feas_.end());
+  }
+  if (sparse_cache_.enabled()) {
+    sparse_cache_.pull(feas, &(fea_pulls), (!test_mode_));
+  } else {
+    sparse_table_client_.pull(feas, &(fea_pulls), (!test_mode_));
   }
-  sparse_table_client_.pull(feas, &(fea_pulls), (!test_mode_));
   memory_table_client_.pull(memory_feas, &(memory_fea_pulls), (!test_mode_));
 
-  for (int i = 0, j1 = 0, j2 = 0; i < data->batch_size_; ++i) {
-    data->minibatch_[i].fea_pulls_.assign(fea_pulls.begin() + j1, fea_pulls.begin() + j1 + data->minibatch_[i].feas_.size());
-    j1 += data->minibatch_[i].feas_.size();
-    CHECK(data->minibatch_[i].feas_.size() == data->minibatch_[i].fea_pulls_.size());
+  for (int i = 0, j1 = 0, j2 = 0; i < batch->batch_size_; ++i) {
+    batch->minibatch_[i].fea_pulls_.assign(fea_pulls.begin() + j1, fea_pulls.begin() + j1 + batch->minibatch_[i].feas_.size());
+    j1 += batch->minibatch_[i].feas_.size();
+    CHECK(batch->minibatch_[i].feas_.size() == batch->minibatch_[i].fea_pulls_.size());
 
-    data->minibatch_[i].memory_fea_pulls_.assign(memory_fea_pulls.begin() + j2, memory_fea_pulls.begin() + j2 + data->minibatch_[i].memory_feas_.size());
-    j2 += data->minibatch_[i].memory_feas_.size();
-    CHECK(data->minibatch_[i].memory_feas_.size() == data->minibatch_[i].memory_fea_pulls_.size());
+    batch->minibatch_[i].memory_fea_pulls_.assign(memory_fea_pulls.begin() + j2, memory_fea_pulls.begin() + j2 + batch->minibatch_[i].memory_feas_.size());
+    j2 += batch->minibatch_[i].memory_feas_.size();
+    CHECK(batch->minibatch_[i].memory_feas_.size() == batch->minibatch_[i].memory_fea_pulls_.size());
   }
   ts2 = absl::Now();
   perf_pull_sparse_.record(ts1, ts2);
@@ -328,9 +347,9 @@ void RTSparseLearner::push_params(ThreadLocalData *data) {
 
   ts1 = absl::Now();
   vector<SparseFeatureVer1> feas;
-  vector<SparseValueVer1> fea_pushs;
+  vector<SparseValueVer1Push> fea_pushs;
   vector<SparseFeatureVer1> memory_feas;
-  vector<SparseEmbeddingVer1> memory_fea_pushs;
+  vector<SparseEmbeddingVer1Push> memory_fea_pushs;
 
   for (int i = 0; i < data->batch_size_; ++i) {
     feas.insert(feas.end(), data->minibatch_[i].feas_.begin(), data->minibatch_[i].feas_.end());
@@ -338,7 +357,15 @@ void RTSparseLearner::push_params(ThreadLocalData *data) {
     memory_feas.insert(memory_feas.end(), data->minibatch_[i].memory_feas_.begin(), data->minibatch_[i].memory_feas_.end());
     memory_fea_pushs.insert(memory_fea_pushs.end(), data->minibatch_[i].memory_fea_pushs_.begin(), data->minibatch_[i].memory_fea_pushs_.end());
   }
-  sparse_table_client_.push(feas, fea_pushs);
+  // sub-models without gradient, e.g. fm and mf outside their slots or in UPDATING, are not sent.
+  for (size_t i = 0; i < fea_pushs.size(); ++i) {
+    sparse_value_ver1_mask_push(&(fea_pushs[i]));
+  }
+  if (sparse_cache_.enabled()) {
+    sparse_cache_.push(feas, fea_pushs);
+  } else {
+    sparse_table_client_.push(feas, fea_pushs);
+  }
   memory_table_client_.push(memory_feas, memory_fea_pushs);
   ts2 = absl::Now();
   perf_push_sparse_.record(ts1, ts2);
@@ -362,6 +389,7 @@ void RTSparseLearner::initialize_param_table() {
   summary_table_client_.create("ctr_dnn_summary_param");
   sparse_table_client_.create("ctr_feature");
   memory_table_client_.create("ctr_memory");
+  sparse_cache_.initialize(&sparse_table_client_, ConfigManager::pick_worker_rule().sparse_cache_rule_);
   MPIAgent::mpi_barrier_group();
 
   dense_table_client_.resize(ps_dnn_plugin_.tot_param_len());
@@ -381,10 +409,21 @@ void RTSparseLearner::initialize_param_table() {
 }
 
 void RTSparseLearner::finalize_param_table() {
+  flush_sparse_table(true);
+}
+
+void RTSparseLearner::flush_sparse_table(bool drop) {
+  if (sparse_cache_.enabled()) {
+    sparse_cache_.flush(drop);
+  }
+  if (ps::message::SUCCESS != sparse_table_client_.flush()) {
+    LOG(ERROR) << "some sparse pushes were lost before the barrier.";
+  }
   MPIAgent::mpi_barrier_group();
 }
 
 void RTSparseLearner::save_param_table(const string& path) {
+  flush_sparse_table(false);
   if (MPIAgent::mpi_rank_group() == 0) {
     FSAgent::hdfs_mkdir(path + "/param");
     FSAgent::hdfs_mkdir(path + "/summary");
@@ -392,10 +431,62 @@ void RTSparseLearner::save_param_table(const string& path) {
     FSAgent::hdfs_mkdir(path + "/memory");
   }
 
+  // the sparse tables are written by the servers in the background, both at once.
+  SnapshotHandle feature_handle;
+  SnapshotHandle memory_handle;
+  sparse_table_client_.save_async(path + "/feature", &feature_handle);
+  memory_table_client_.save_async(path + "/memory", &memory_handle);
+
   dense_table_client_.save(path + "/param");
   summary_table_client_.save(path + "/summary");
-  sparse_table_client_.save(path + "/feature");
-  memory_table_client_.save(path + "/memory");
+  CHECK(ps::message::SUCCESS == sparse_table_client_.save_wait(feature_handle));
+  CHECK(ps::message::SUCCESS == memory_table_client_.save_wait(memory_handle));
+}
+
+void RTSparseLearner::load_param_table(const string& path) {
+  flush_sparse_table(true);
+  sparse_table_client_.load(path + "/feature");
+  memory_table_client_.load(path + "/memory");
+  MPIAgent::mpi_barrier_group();
+
+  if (MPIAgent::mpi_rank_group() == 0) {
+    fprintf(stdout, "Sparse feature num: %llu\n", (unsigned long long)sparse_table_client_.feature_num());
+    fprintf(stdout, "Memory feature num: %llu\n", (unsigned long long)memory_table_client_.feature_num());
+  }
+  MPIAgent::mpi_barrier_group();
+}
+
+void RTSparseLearner::save_param_table_delta(const string& path) {
+  flush_sparse_table(false);
+  if (MPIAgent::mpi_rank_group() == 0) {
+    FSAgent::hdfs_mkdir(path + "/feature");
+    FSAgent::hdfs_mkdir(path + "/memory");
+  }
+
+  SnapshotHandle feature_handle;
+  SnapshotHandle memory_handle;
+  sparse_table_client_.save_delta_async(path + "/feature", &feature_handle);
+  memory_table_client_.save_delta_async(path + "/memory", &memory_handle);
+  CHECK(ps::message::SUCCESS == sparse_table_client_.save_wait(feature_handle));
+  CHECK(ps::message::SUCCESS == memory_table_client_.save_wait(memory_handle));
+}
+
+void RTSparseLearner::compact_param_table(const vector<string>& chain, const string& out) {
+  vector<string> feature_chain;
+  vector<string> memory_chain;
+  for (const string& path : chain) {
+    feature_chain.push_back(path + "/feature");
+    memory_chain.push_back(path + "/memory");
+  }
+  if (MPIAgent::mpi_rank_group() == 0) {
+    FSAgent::hdfs_mkdir(out + "/feature");
+    FSAgent::hdfs_mkdir(out + "/memory");
+  }
+  MPIAgent::mpi_barrier_group();
+
+  CHECK(ps::message::SUCCESS == sparse_table_client_.compact(feature_chain, out + "/feature"));
+  CHECK(ps::message::SUCCESS == memory_table_client_.compact(memory_chain, out + "/memory"));
+  MPIAgent::mpi_barrier_group();
 }
 
 void RTSparseLearner::init_pushs(ThreadLocalData *data) {
@@ -417,6 +508,7 @@ void RTSparseLearner::init_pushs(ThreadLocalData *data) {
       ins.fea_pushs_[f].mf_w_    = 0;
       ins.fea_pushs_[f].mf_v_.assign(mf_dim, 0.0);
       ins.fea_pushs_[f].wide_w_  = 0;
+      ins.fea_pushs_[f].fields_  = ps::param_table::SPARSE_FIELD_ALL;
     }
 
     // for memory dnn
@@ -486,63 +578,122 @@ void RTSparseLearner::record_to_instance(const Record& rec, Instance *ins) {
   ins->memory_fea_pushs_.resize(std::max((size_t)ins->memory_fea_num_, ins->memory_fea_pushs_.size()));
 }
 
-void RTSparseLearner::process_data_thread(int tid, Channel<Record> in_chan) {
-  ThreadLocalData *data = &(thread_local_data_[tid]);
-  data->phase_ = phase_;
+void RTSparseLearner::records_to_batch(const vector<Record>& buffer, PulledBatch *batch) {
+  CHECK(buffer.size() <= (size_t)ConfigManager::pick_worker_rule().batch_size_);
+
+  batch->batch_size_ = (int)buffer.size();
+  batch->minibatch_.resize(batch->batch_size_);
+  for (int i = 0; i < batch->batch_size_; ++i) {
+    record_to_instance(buffer[i], &(batch->minibatch_[i]));
+  }
+}
 
+void RTSparseLearner::train_batch(ThreadLocalData *data, PulledBatch *batch) {
   absl::Time ts1;
   absl::Time ts2;
 
-  vector<Record> buffer;
-  while (in_chan->read(buffer) > 0) {
-    CHECK(buffer.size() <= (size_t)ConfigManager::pick_worker_rule().batch_size_);
+  data->batch_size_ = batch->batch_size_;
+  data->minibatch_.swap(batch->minibatch_);
+  data->dnn_pulls_.swap(batch->dnn_pulls_);
+  data->dnn_summary_pulls_.swap(batch->dnn_summary_pulls_);
+
+  ts1 = absl::Now();
+  preprocess(data);
+  ts2 = absl::Now();
+  perf_preprocess_.record(ts1, ts2);
 
-    data->batch_size_ = (int)buffer.size();
-    data->minibatch_.resize(data->batch_size_);
-    for (int i = 0; i < data->batch_size_; ++i) {
-      record_to_instance(buffer[i], &(data->minibatch_[i]));
+  ts1 = absl::Now();
+  feed_forward(data);
+  ts2 = absl::Now();
+  perf_forward_.record(ts1, ts2);
+
+  ts1 = absl::Now();
+  back_propagate(data);
+  ts2 = absl::Now();
+  perf_back_propagate_.record(ts1, ts2);
+
+  ts1 = absl::Now();
+  push_params(data);
+  ts2 = absl::Now();
+  perf_push_.record(ts1, ts2);
+
+  ts1 = absl::Now();
+  for (int i = 0; i < data->batch_size_; ++i) {
+    lr_auc_.add(data->minibatch_[i].lr_pred_, data->minibatch_[i].label_);
+    mf_auc_.add(data->minibatch_[i].mf_pred_, data->minibatch_[i].label_);
+    fm_auc_.add(data->minibatch_[i].fm_pred_, data->minibatch_[i].label_);
+    adq_auc_.add(data->minibatch_[i].adq_, data->minibatch_[i].label_);
+    if (phase_ == TrainingPhase::JOINING) {
+      for (int j = 0; j < dnn_auc_num_; ++j) {
+        dnn_auc_[j].add(data->minibatch_[i].dnn_preds_[j], data->minibatch_[i].label_);
+      }
     }
+  }
+  ts2 = absl::Now();
+  perf_auc_.record(ts1, ts2);
+}
+
+void RTSparseLearner::prefetch_data_thread(Channel<Record> in_chan, Channel<PulledBatch> out_chan) {
+  absl::Time ts1;
+  absl::Time ts2;
+
+  vector<Record> buffer;
+  while (in_chan->read(buffer) > 0) {
+    PulledBatch batch;
+    records_to_batch(buffer, &batch);
 
     ts1 = absl::Now();
-    pull_params(data);
+    pull_params(&batch);
     ts2 = absl::Now();
     perf_pull_.record(ts1, ts2);
 
-    ts1 = absl::Now();
-    preprocess(data);
-    ts2 = absl::Now();
-    perf_preprocess_.record(ts1, ts2);
+    CHECK(out_chan->put(std::move(batch)));
+  }
+  out_chan->close();
+}
 
-    ts1 = absl::Now();
-    feed_forward(data);
-    ts2 = absl::Now();
-    perf_forward_.record(ts1, ts2);
+void RTSparseLearner::process_data_thread(int tid, Channel<Record> in_chan) {
+  ThreadLocalData *data = &(thread_local_data_[tid]);
+  data->phase_ = phase_;
 
-    ts1 = absl::Now();
-    back_propagate(data);
-    ts2 = absl::Now();
-    perf_back_propagate_.record(ts1, ts2);
+  absl::Time ts1;
+  absl::Time ts2;
 
-    ts1 = absl::Now();
-    push_params(data);
-    ts2 = absl::Now();
-    perf_push_.record(ts1, ts2);
+  PulledBatch batch;
+  int prefetch_depth = ConfigManager::pick_worker_rule().prefetch_depth_;
+  if (prefetch_depth == 0) {
+    vector<Record> buffer;
+    while (in_chan->read(buffer) > 0) {
+      records_to_batch(buffer, &batch);
 
-    ts1 = absl::Now();
-    for (int i = 0; i < data->batch_size_; ++i) {
-      lr_auc_.add(data->minibatch_[i].lr_pred_, data->minibatch_[i].label_);
-      mf_auc_.add(data->minibatch_[i].mf_pred_, data->minibatch_[i].label_);
-      fm_auc_.add(data->minibatch_[i].fm_pred_, data->minibatch_[i].label_);
-      adq_auc_.add(data->minibatch_[i].adq_, data->minibatch_[i].label_);
-      if (phase_ == TrainingPhase::JOINING) {
-        for (int j = 0; j < dnn_auc_num_; ++j) {
-          dnn_auc_[j].add(data->minibatch_[i].dnn_preds_[j], data->minibatch_[i].label_);
-        }
-      }
+      ts1 = absl::Now();
+      pull_params(&batch);
+      ts2 = absl::Now();
+      perf_pull_.record(ts1, ts2);
+
+      train_batch(data, &batch);
     }
+    return;
+  }
+
+  // the prefetcher holds one pulled batch and the channel depth - 1 more, so the
+  // parameters of a batch may be pulled up to depth batches before it is trained.
+  Channel<PulledBatch> pulled_chan = ps::toolkit::make_channel<PulledBatch>(prefetch_depth - 1);
+  std::thread prefetcher([this, in_chan, pulled_chan]() {
+    prefetch_data_thread(in_chan, pulled_chan);
+  });
+
+  while (true) {
+    ts1 = absl::Now();
+    bool has_batch = pulled_chan->get(batch);
     ts2 = absl::Now();
-    perf_auc_.record(ts1, ts2);
+    perf_prefetch_wait_.record(ts1, ts2);
+    if (!has_batch) {
+      break;
+    }
+    train_batch(data, &batch);
   }
+  prefetcher.join();
 }
 
 void RTSparseLearner::process_data(Channel<Record> in_chan) {
@@ -221,8 +221,7 @@ void RTSparseOfflineRunner::initialize() {
   if (load_model_path_ != "" && (load_prior_model == true || recover_mode == true) ) {
     rank0_fprintf(stdout, "begin load model: load_prior_model=%d, recover_mode=%d, load_model_path=%s\n",
                   load_prior_model, recover_mode, load_model_path_.c_str());
-    // learner_.load_model(load_model_path_, model_converter); // to be continue
-    // learner_.print_stat();                                  // to be continue
+    learner_.load_param_table(load_model_path_);
   }
 
   // remove trained days
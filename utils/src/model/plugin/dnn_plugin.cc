@@ -19,8 +19,10 @@ using ps::param_table::DenseValueVer1Push;
 using ps::param_table::SummaryValueVer1;
 using ps::param_table::SparseFeatureVer1;
 using ps::param_table::SparseKeyVer1;
-using ps::param_table::SparseValueVer1;
-using ps::param_table::SparseEmbeddingVer1;
+using ps::param_table::SparseValueVer1Pull;
+using ps::param_table::SparseValueVer1Push;
+using ps::param_table::SparseEmbeddingVer1Pull;
+using ps::param_table::SparseEmbeddingVer1Push;
 
 namespace ps {
 namespace model {
@@ -171,9 +173,9 @@ void ELSDNNPlugin::sparse_feature_to_tensor(ThreadLocalData *data) {
     // fill cvm input
     int fea_num = data->minibatch_[i].fea_num_;
     const SparseFeatureVer1* feas    = &(data->minibatch_[i].feas_[0]);
-    const SparseValueVer1* fea_pulls = &(data->minibatch_[i].fea_pulls_[0]);
+    const SparseValueVer1Pull* fea_pulls = &(data->minibatch_[i].fea_pulls_[0]);
     for (int j = 0; j < fea_num; ++j) {
-      const SparseValueVer1& fea_pull = fea_pulls[j];
+      const SparseValueVer1Pull& fea_pull = fea_pulls[j];
       int idx = base_slot_mapping_.get(feas[j].slot_);
       if (idx >= 0) {
         show_mat(i, idx) += fea_pull.show_;
@@ -200,11 +202,11 @@ void ELSDNNPlugin::sparse_feature_to_tensor(ThreadLocalData *data) {
 
     // fill memory input
     const SparseFeatureVer1   *memory_feas  = &(data->minibatch_[i].memory_feas_[0]);
-    const SparseEmbeddingVer1 *memory_pulls = &(data->minibatch_[i].memory_fea_pulls_[0]);
+    const SparseEmbeddingVer1Pull *memory_pulls = &(data->minibatch_[i].memory_fea_pulls_[0]);
 
     int memory_fea_num = data->minibatch_[i].memory_fea_num_;
     for (int j = 0; j < memory_fea_num; ++j) {
-      const SparseEmbeddingVer1& memory_pull = memory_pulls[j];
+      const SparseEmbeddingVer1Pull& memory_pull = memory_pulls[j];
       int idx = memory_slot_mapping_.get(memory_feas[j].slot_);
       if (idx >= 0) {
         if(!(memory_pull.embedding_.empty())) {
@@ -256,9 +258,9 @@ void ELSDNNPlugin::tensor_to_sparse_grad(ThreadLocalData *data) {
     // cvm grad
     int fea_num = data->minibatch_[i].fea_num_;
     const SparseFeatureVer1 *feas = &(data->minibatch_[i].feas_[0]);
-    SparseValueVer1 *fea_pushs = &(data->minibatch_[i].fea_pushs_[0]);
+    SparseValueVer1Push *fea_pushs = &(data->minibatch_[i].fea_pushs_[0]);
     for (int j = 0; j < fea_num; ++j) {
-      SparseValueVer1& fea_push = fea_pushs[j];
+      SparseValueVer1Push& fea_push = fea_pushs[j];
       int idx = base_slot_mapping_.get(feas[j].slot_);
       if (idx >= 0) {
         if (data->dnn_lr_input_->has_gradient()) {
@@ -286,9 +288,9 @@ void ELSDNNPlugin::tensor_to_sparse_grad(ThreadLocalData *data) {
     // memory grad
     int memory_fea_num = data->minibatch_[i].memory_fea_num_;
     const SparseFeatureVer1 *memory_feas = &(data->minibatch_[i].memory_feas_[0]);
-    SparseEmbeddingVer1 *memory_pushs    = &(data->minibatch_[i].memory_fea_pushs_[0]);
+    SparseEmbeddingVer1Push *memory_pushs    = &(data->minibatch_[i].memory_fea_pushs_[0]);
     for (int j = 0; j < memory_fea_num; ++j) {
-      SparseEmbeddingVer1& memory_push = memory_pushs[j];
+      SparseEmbeddingVer1Push& memory_push = memory_pushs[j];
       int idx = memory_slot_mapping_.get(memory_feas[j].slot_);
       if(idx >= 0){
         if((data->dnn_memory_input_->has_gradient())) {
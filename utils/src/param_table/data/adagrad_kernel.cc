@@ -0,0 +1,213 @@
+#include "param_table/data/adagrad_kernel.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace ps {
+namespace param_table {
+
+static inline float clamp(const float x, const float lower, const float upper) {
+  return std::min(std::max(x, lower), upper);
+}
+
+static float adagrad_scalar(const int n, float *w, const float *g, const float g_scale_inv, const float step,
+                            const float lower, const float upper) {
+  float add_g2sum = 0.0f;
+  for (int i = 0; i < n; ++i) {
+    float scaled_grad = g[i] * g_scale_inv;
+    w[i] = clamp(w[i] + step * scaled_grad, lower, upper);
+    add_g2sum += scaled_grad * scaled_grad;
+  }
+  return add_g2sum;
+}
+
+static void decayed_adagrad_scalar(const int n, float *w, float *g2sum, const float *g, const float g_scale_inv,
+                                   const float learning_rate, const float decay_rate, const float d2sum,
+                                   const float epsilon, const float lower, const float upper) {
+  float d2sum_inv = 1.0f / d2sum;
+  for (int i = 0; i < n; ++i) {
+    float scaled_grad = g[i] * g_scale_inv;
+    g2sum[i] = decay_rate * g2sum[i] + scaled_grad * scaled_grad;
+    float scale = sqrtf((1.0f + epsilon) / (g2sum[i] * d2sum_inv + epsilon));
+    w[i] = clamp(w[i] + learning_rate * g[i] * scale, lower, upper);
+  }
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2")))
+static float adagrad_avx2(const int n, float *w, const float *g, const float g_scale_inv, const float step,
+                          const float lower, const float upper) {
+  const __m256 v_inv = _mm256_set1_ps(g_scale_inv);
+  const __m256 v_step = _mm256_set1_ps(step);
+  const __m256 v_lower = _mm256_set1_ps(lower);
+  const __m256 v_upper = _mm256_set1_ps(upper);
+  __m256 v_sum = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 sg = _mm256_mul_ps(_mm256_loadu_ps(g + i), v_inv);
+    __m256 x = _mm256_add_ps(_mm256_loadu_ps(w + i), _mm256_mul_ps(v_step, sg));
+    _mm256_storeu_ps(w + i, _mm256_min_ps(_mm256_max_ps(x, v_lower), v_upper));
+    v_sum = _mm256_add_ps(v_sum, _mm256_mul_ps(sg, sg));
+  }
+  float sum[8];
+  _mm256_storeu_ps(sum, v_sum);
+  float add_g2sum = ((sum[0] + sum[4]) + (sum[1] + sum[5])) + ((sum[2] + sum[6]) + (sum[3] + sum[7]));
+  return add_g2sum + adagrad_scalar(n - i, w + i, g + i, g_scale_inv, step, lower, upper);
+}
+
+__attribute__((target("avx2")))
+static void decayed_adagrad_avx2(const int n, float *w, float *g2sum, const float *g, const float g_scale_inv,
+                                 const float learning_rate, const float decay_rate, const float d2sum,
+                                 const float epsilon, const float lower, const float upper) {
+  const __m256 v_inv = _mm256_set1_ps(g_scale_inv);
+  const __m256 v_lr = _mm256_set1_ps(learning_rate);
+  const __m256 v_decay = _mm256_set1_ps(decay_rate);
+  const __m256 v_d2sum_inv = _mm256_set1_ps(1.0f / d2sum);
+  const __m256 v_eps = _mm256_set1_ps(epsilon);
+  const __m256 v_eps1 = _mm256_set1_ps(1.0f + epsilon);
+  const __m256 v_lower = _mm256_set1_ps(lower);
+  const __m256 v_upper = _mm256_set1_ps(upper);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 vg = _mm256_loadu_ps(g + i);
+    __m256 sg = _mm256_mul_ps(vg, v_inv);
+    __m256 g2 = _mm256_add_ps(_mm256_mul_ps(v_decay, _mm256_loadu_ps(g2sum + i)), _mm256_mul_ps(sg, sg));
+    _mm256_storeu_ps(g2sum + i, g2);
+    __m256 scale = _mm256_sqrt_ps(_mm256_div_ps(v_eps1, _mm256_add_ps(_mm256_mul_ps(g2, v_d2sum_inv), v_eps)));
+    __m256 x = _mm256_add_ps(_mm256_loadu_ps(w + i), _mm256_mul_ps(_mm256_mul_ps(v_lr, vg), scale));
+    _mm256_storeu_ps(w + i, _mm256_min_ps(_mm256_max_ps(x, v_lower), v_upper));
+  }
+  decayed_adagrad_scalar(n - i, w + i, g2sum + i, g + i, g_scale_inv,
+                         learning_rate, decay_rate, d2sum, epsilon, lower, upper);
+}
+
+__attribute__((target("avx512f")))
+static float adagrad_avx512(const int n, float *w, const float *g, const float g_scale_inv, const float step,
+                            const float lower, const float upper) {
+  const __m512 v_inv = _mm512_set1_ps(g_scale_inv);
+  const __m512 v_step = _mm512_set1_ps(step);
+  const __m512 v_lower = _mm512_set1_ps(lower);
+  const __m512 v_upper = _mm512_set1_ps(upper);
+  __m512 v_sum = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 sg = _mm512_mul_ps(_mm512_loadu_ps(g + i), v_inv);
+    __m512 x = _mm512_add_ps(_mm512_loadu_ps(w + i), _mm512_mul_ps(v_step, sg));
+    _mm512_storeu_ps(w + i, _mm512_min_ps(_mm512_max_ps(x, v_lower), v_upper));
+    v_sum = _mm512_add_ps(v_sum, _mm512_mul_ps(sg, sg));
+  }
+  // a tail of 8 or more still gets the avx2 loop.
+  return _mm512_reduce_add_ps(v_sum) + adagrad_avx2(n - i, w + i, g + i, g_scale_inv, step, lower, upper);
+}
+
+__attribute__((target("avx512f")))
+static void decayed_adagrad_avx512(const int n, float *w, float *g2sum, const float *g, const float g_scale_inv,
+                                   const float learning_rate, const float decay_rate, const float d2sum,
+                                   const float epsilon, const float lower, const float upper) {
+  const __m512 v_inv = _mm512_set1_ps(g_scale_inv);
+  const __m512 v_lr = _mm512_set1_ps(learning_rate);
+  const __m512 v_decay = _mm512_set1_ps(decay_rate);
+  const __m512 v_d2sum_inv = _mm512_set1_ps(1.0f / d2sum);
+  const __m512 v_eps = _mm512_set1_ps(epsilon);
+  const __m512 v_eps1 = _mm512_set1_ps(1.0f + epsilon);
+  const __m512 v_lower = _mm512_set1_ps(lower);
+  const __m512 v_upper = _mm512_set1_ps(upper);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 vg = _mm512_loadu_ps(g + i);
+    __m512 sg = _mm512_mul_ps(vg, v_inv);
+    __m512 g2 = _mm512_add_ps(_mm512_mul_ps(v_decay, _mm512_loadu_ps(g2sum + i)), _mm512_mul_ps(sg, sg));
+    _mm512_storeu_ps(g2sum + i, g2);
+    __m512 scale = _mm512_sqrt_ps(_mm512_div_ps(v_eps1, _mm512_add_ps(_mm512_mul_ps(g2, v_d2sum_inv), v_eps)));
+    __m512 x = _mm512_add_ps(_mm512_loadu_ps(w + i), _mm512_mul_ps(_mm512_mul_ps(v_lr, vg), scale));
+    _mm512_storeu_ps(w + i, _mm512_min_ps(_mm512_max_ps(x, v_lower), v_upper));
+  }
+  decayed_adagrad_avx2(n - i, w + i, g2sum + i, g + i, g_scale_inv,
+                       learning_rate, decay_rate, d2sum, epsilon, lower, upper);
+}
+
+#endif
+
+struct AdagradKernels {
+  AdagradKernels() :
+    isa_("scalar"),
+    adagrad_(adagrad_scalar),
+    decayed_adagrad_(decayed_adagrad_scalar) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      isa_ = "avx512";
+      adagrad_ = adagrad_avx512;
+      decayed_adagrad_ = decayed_adagrad_avx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+      isa_ = "avx2";
+      adagrad_ = adagrad_avx2;
+      decayed_adagrad_ = decayed_adagrad_avx2;
+    }
+#endif
+  }
+
+  const char *isa_;
+  AdagradKernel adagrad_;
+  DecayedAdagradKernel decayed_adagrad_;
+};
+
+static const AdagradKernels& kernels() {
+  static const AdagradKernels kernels;
+  return kernels;
+}
+
+float adagrad_kernel(const int n, float *w, const float *g, const float g_scale_inv, const float step,
+                     const float lower, const float upper) {
+  return kernels().adagrad_(n, w, g, g_scale_inv, step, lower, upper);
+}
+
+void decayed_adagrad_kernel(const int n, float *w, float *g2sum, const float *g, const float g_scale_inv,
+                            const float learning_rate, const float decay_rate, const float d2sum,
+                            const float epsilon, const float lower, const float upper) {
+  kernels().decayed_adagrad_(n, w, g2sum, g, g_scale_inv, learning_rate, decay_rate, d2sum, epsilon, lower, upper);
+}
+
+const char* adagrad_kernel_isa() {
+  return kernels().isa_;
+}
+
+AdagradKernel adagrad_kernel_of(const char *isa) {
+  if (strcmp(isa, "scalar") == 0) {
+    return adagrad_scalar;
+  }
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (strcmp(isa, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+    return adagrad_avx2;
+  }
+  if (strcmp(isa, "avx512") == 0 && __builtin_cpu_supports("avx512f")) {
+    return adagrad_avx512;
+  }
+#endif
+  return NULL;
+}
+
+DecayedAdagradKernel decayed_adagrad_kernel_of(const char *isa) {
+  if (strcmp(isa, "scalar") == 0) {
+    return decayed_adagrad_scalar;
+  }
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (strcmp(isa, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+    return decayed_adagrad_avx2;
+  }
+  if (strcmp(isa, "avx512") == 0 && __builtin_cpu_supports("avx512f")) {
+    return decayed_adagrad_avx512;
+  }
+#endif
+  return NULL;
+}
+
+} // namespace param_table
+} // namespace ps
@@ -0,0 +1,59 @@
+#include "param_table/data/count_min_sketch.h"
+
+#include <algorithm>
+#include "toolkit/hash.h"
+
+namespace ps {
+namespace param_table {
+
+const uint32_t CountMinSketch::kMaxCount;
+
+CountMinSketch::CountMinSketch(const size_t width) :
+  mask_(0),
+  counter_() {
+  size_t size = 1;
+  while (size < width) {
+    size <<= 1;
+  }
+  mask_ = size - 1;
+  counter_.assign(size * kDepth, 0);
+}
+
+CountMinSketch::~CountMinSketch() {
+}
+
+uint32_t CountMinSketch::add(const uint64_t key, const uint32_t count) {
+  size_t index[kDepth];
+  uint32_t current = kMaxCount;
+  for (int d = 0; d < kDepth; ++d) {
+    index[d] = d * (mask_ + 1) + (ps::toolkit::hash_mix64(key, d) & mask_);
+    current = std::min(current, (uint32_t)counter_[index[d]]);
+  }
+
+  // only the counters below the new estimate are raised.
+  uint32_t target = std::min(current + count, kMaxCount);
+  for (int d = 0; d < kDepth; ++d) {
+    if (counter_[index[d]] < target) {
+      counter_[index[d]] = target;
+    }
+  }
+  return target;
+}
+
+uint32_t CountMinSketch::estimate(const uint64_t key) const {
+  uint32_t current = kMaxCount;
+  for (int d = 0; d < kDepth; ++d) {
+    size_t index = d * (mask_ + 1) + (ps::toolkit::hash_mix64(key, d) & mask_);
+    current = std::min(current, (uint32_t)counter_[index]);
+  }
+  return current;
+}
+
+void CountMinSketch::decay() {
+  for (size_t i = 0; i < counter_.size(); ++i) {
+    counter_[i] >>= 1;
+  }
+}
+
+} // namespace param_table
+} // namespace ps
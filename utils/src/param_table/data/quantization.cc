@@ -0,0 +1,163 @@
+#include "param_table/data/quantization.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <butil/logging.h>
+#include "absl/random/random.h"
+
+namespace ps {
+namespace param_table {
+
+uint16_t float_to_half(const float f) {
+  uint32_t x = 0;
+  memcpy(&x, &f, sizeof(x));
+  uint32_t sign = (x >> 16) & 0x8000;
+  uint32_t exp = (x >> 23) & 0xff;
+  uint32_t mant = x & 0x7fffff;
+
+  if (exp == 0xff) {
+    return sign | 0x7c00 | (mant != 0 ? 0x200 : 0);
+  }
+  int e = (int)exp - 127 + 15;
+  if (e >= 0x1f) {
+    return sign | 0x7c00;
+  }
+  if (e <= 0) {
+    // subnormal half, or zero.
+    if (e < -10) {
+      return sign;
+    }
+    mant |= 0x800000;
+    uint32_t shift = 14 - e;
+    uint32_t half = mant >> shift;
+    uint32_t rem = mant & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rem > halfway || (rem == halfway && (half & 1))) {
+      ++half;
+    }
+    return sign | half;
+  }
+
+  // a carry out of the mantissa correctly bumps the exponent.
+  uint32_t half = sign | ((uint32_t)e << 10) | (mant >> 13);
+  uint32_t rem = mant & 0x1fff;
+  if (rem > 0x1000 || (rem == 0x1000 && (half & 1))) {
+    ++half;
+  }
+  return half;
+}
+
+uint16_t float_to_half_stochastic(const float f, const float u) {
+  uint16_t sign = (f < 0.0f) ? 0x8000 : 0;
+  float a = fabsf(f);
+  uint16_t h = float_to_half(a);
+  if (isnan(a) || h >= 0x7c00) {
+    return float_to_half(f);
+  }
+
+  float r = half_to_float(h);
+  if (r == a) {
+    return sign | h;
+  }
+  // positive halves are ordered like their bit patterns.
+  uint16_t lo = (r < a) ? h : (uint16_t)(h - 1);
+  if (lo == 0x7bff) {
+    return sign | lo;
+  }
+  uint16_t hi = (uint16_t)(lo + 1);
+  float lo_value = half_to_float(lo);
+  float p = (a - lo_value) / (half_to_float(hi) - lo_value);
+  return sign | ((u < p) ? hi : lo);
+}
+
+float half_to_float(const uint16_t h) {
+  uint32_t sign = ((uint32_t)h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t x = 0;
+
+  if (exp == 0x1f) {
+    x = sign | 0x7f800000 | (mant << 13);
+  } else if (exp == 0) {
+    if (mant == 0) {
+      x = sign;
+    } else {
+      int e = -1;
+      do {
+        ++e;
+        mant <<= 1;
+      } while (!(mant & 0x400));
+      x = sign | ((uint32_t)(127 - 15 - e) << 23) | ((mant & 0x3ff) << 13);
+    }
+  } else {
+    x = sign | ((exp + 112) << 23) | (mant << 13);
+  }
+
+  float f = 0.0f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+size_t quantized_bytes(const int bits, const size_t n) {
+  switch (bits) {
+   case 32:
+    return n * sizeof(float);
+   case 16:
+    return n * sizeof(uint16_t);
+   case 8:
+    return sizeof(float) + n * sizeof(int8_t);
+   default:
+    LOG(FATAL) << "unsupported quantization bits: " << bits;
+  }
+  return 0;
+}
+
+void quantize(const float *x, const size_t n, const int bits, char *out) {
+  thread_local absl::BitGen gen;
+  if (bits == 32) {
+    memcpy(out, x, n * sizeof(float));
+  } else if (bits == 16) {
+    for (size_t i = 0; i < n; ++i) {
+      uint16_t h = float_to_half_stochastic(x[i], absl::Uniform<float>(gen, 0.0f, 1.0f));
+      memcpy(out + i * sizeof(uint16_t), &h, sizeof(h));
+    }
+  } else {
+    CHECK(bits == 8) << "unsupported quantization bits: " << bits;
+    float absmax = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+      absmax = std::max(absmax, fabsf(x[i]));
+    }
+    float scale = absmax / 127.0f;
+    memcpy(out, &scale, sizeof(scale));
+    int8_t *q = reinterpret_cast<int8_t *>(out + sizeof(float));
+    float inv_scale = (scale > 0.0f) ? 1.0f / scale : 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+      float y = floorf(x[i] * inv_scale + absl::Uniform<float>(gen, 0.0f, 1.0f));
+      q[i] = (int8_t)std::max(-127.0f, std::min(127.0f, y));
+    }
+  }
+}
+
+void dequantize(const char *in, const size_t n, const int bits, float *x) {
+  if (bits == 32) {
+    memcpy(x, in, n * sizeof(float));
+  } else if (bits == 16) {
+    for (size_t i = 0; i < n; ++i) {
+      uint16_t h = 0;
+      memcpy(&h, in + i * sizeof(uint16_t), sizeof(h));
+      x[i] = half_to_float(h);
+    }
+  } else {
+    CHECK(bits == 8) << "unsupported quantization bits: " << bits;
+    float scale = 0.0f;
+    memcpy(&scale, in, sizeof(scale));
+    const int8_t *q = reinterpret_cast<const int8_t *>(in + sizeof(float));
+    for (size_t i = 0; i < n; ++i) {
+      x[i] = q[i] * scale;
+    }
+  }
+}
+
+} // namespace param_table
+} // namespace ps
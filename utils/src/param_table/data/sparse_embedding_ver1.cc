@@ -1,9 +1,12 @@
 #include "param_table/data/sparse_embedding_ver1.h"
 
 #include <math.h>
+#include <algorithm>
 #include <butil/logging.h>
 #include "absl/strings/str_format.h"
 #include "absl/random/random.h"
+#include "param_table/data/adagrad_kernel.h"
+#include "param_table/data/quantization.h"
 
 using std::string;
 using ps::runtime::TrainingRule;
@@ -31,7 +34,7 @@ SparseEmbeddingVer1 sparse_embedding_ver1_default() {
 }
 
 int sparse_embedding_ver1_init(SparseEmbeddingVer1 *value, const TrainingRule& rule) {
-  static absl::BitGen gen;
+  thread_local absl::BitGen gen;
   int ret = 0;
   const SparseTrainingRule& conf = rule.sparse_;
 
@@ -51,49 +54,62 @@ int sparse_embedding_ver1_init(SparseEmbeddingVer1 *value, const TrainingRule& r
   return ret;
 }
 
-int sparse_embedding_ver1_push(SparseEmbeddingVer1 *value, const SparseEmbeddingVer1& grad, const TrainingRule& rule) {
-  int ret = 0;
+int sparse_embedding_ver1_pull(SparseEmbeddingVer1Pull *pull, const SparseEmbeddingVer1& value) {
+  pull->slot_ = value.slot_;
+  pull->count_ = value.count_;
+  pull->embedding_ = value.embedding_;
+  pull->version_ = value.version_;
+  return 0;
+}
 
+static void push_one(SparseEmbeddingVer1 *value, const SparseEmbeddingVer1Push& grad, const SparseTrainingRule& conf) {
   // CHECK(value->slot_ == grad.slot_) << "slot: " << value->slot_ << ", newslot: " << grad.slot_;
 
-  const SparseTrainingRule& conf = rule.sparse_;
   value->count_ += grad.count_;
   value->delta_score_ += grad.count_;
   if ((grad.embedding_.size() != 0) && (value->embedding_.size() != 0)) {
     if (grad.count_ > 0) {
       float g_scale = grad.count_;
       if (conf.dic_rule_.version_aware_ && value->version_ > grad.version_) {
-        g_scale *= sqrt(1.0 + (value->version_ - grad.version_));
+        g_scale *= sqrtf(1.0f + (value->version_ - grad.version_));
       }
       value->ada_d2sum_ = conf.dic_rule_.ada_decay_rate_ * value->ada_d2sum_ + 1.0;
 
-      for (int i = 0; i < conf.dic_rule_.dim_; ++i){
-        float origin_grad = grad.embedding_[i];
-        float scaled_grad = grad.embedding_[i] / g_scale;
-
-        value->ada_g2sum_[i] = conf.dic_rule_.ada_decay_rate_ * value->ada_g2sum_[i] + scaled_grad * scaled_grad;
-        float scale = sqrt((1.0 + conf.dic_rule_.ada_epsilon_) / (value->ada_g2sum_[i] / value->ada_d2sum_ + conf.dic_rule_.ada_epsilon_));
-
-        value->embedding_[i] += conf.dic_rule_.learning_rate_ * origin_grad * scale;
-        bound(&(value->embedding_[i]), conf.dic_rule_.weight_lower_bound_, conf.dic_rule_.weight_upper_bound_);
-      }
+      decayed_adagrad_kernel(conf.dic_rule_.dim_, &(value->embedding_[0]), &(value->ada_g2sum_[0]),
+                             &(grad.embedding_[0]), 1.0f / g_scale, conf.dic_rule_.learning_rate_,
+                             conf.dic_rule_.ada_decay_rate_, value->ada_d2sum_, conf.dic_rule_.ada_epsilon_,
+                             conf.dic_rule_.weight_lower_bound_, conf.dic_rule_.weight_upper_bound_);
     }
   }
   ++(value->version_);
   value->silent_days_ = 0;
+}
 
-  return ret;
+int sparse_embedding_ver1_push(SparseEmbeddingVer1 *value, const SparseEmbeddingVer1Push& grad, const TrainingRule& rule) {
+  CHECK(!(rule.sparse_.dic_rule_.weight_lower_bound_ > rule.sparse_.dic_rule_.weight_upper_bound_));
+  push_one(value, grad, rule.sparse_);
+  return 0;
+}
+
+int sparse_embedding_ver1_push_batch(const std::vector<SparseEmbeddingVer1 *>& value,
+                                     const std::vector<const SparseEmbeddingVer1Push *>& grad, const TrainingRule& rule) {
+  CHECK(value.size() == grad.size());
+  CHECK(!(rule.sparse_.dic_rule_.weight_lower_bound_ > rule.sparse_.dic_rule_.weight_upper_bound_));
+  for (size_t i = 0; i < value.size(); ++i) {
+    push_one(value[i], *(grad[i]), rule.sparse_);
+  }
+  return 0;
 }
 
-int sparse_embedding_ver1_merge(SparseEmbeddingVer1 *value, const SparseEmbeddingVer1& new_value, const ps::runtime::TrainingRule& rule) {
+int sparse_embedding_ver1_merge(SparseEmbeddingVer1Push *value, const SparseEmbeddingVer1Push& new_value, const ps::runtime::TrainingRule& rule) {
   int ret = 0;
   // const SparseTrainingRule& conf = rule.sparse_;
 
   if (value->embedding_.size() < new_value.embedding_.size()) {
-    value->embedding_.assign(0, new_value.embedding_.size());
+    value->embedding_.resize(new_value.embedding_.size(), 0.0);
   }
   for (size_t i = 0; i < value->embedding_.size() && i < new_value.embedding_.size(); ++i) {
-    value->embedding_[i] += new_value.embedding_.size();
+    value->embedding_[i] += new_value.embedding_[i];
   }
   value->count_ += new_value.count_;
   value->version_ = std::min(value->version_, new_value.version_);
@@ -124,13 +140,24 @@ int sparse_embedding_ver1_to_string(const SparseKeyVer1& key, const SparseEmbedd
   return ret;
 }
 
-int sparse_embedding_ver1_time_decay(SparseEmbeddingVer1 *value, const ps::runtime::TrainingRule& rule) {
+float sparse_embedding_ver1_decay_factor(const uint32_t days, const ps::runtime::TrainingRule& rule) {
+  if (days == 0) {
+    return 1.0f;
+  }
+  return (days == 1) ? rule.sparse_.dic_rule_.decay_rate_ : powf(rule.sparse_.dic_rule_.decay_rate_, days);
+}
+
+int sparse_embedding_ver1_time_decay(SparseEmbeddingVer1 *value, const uint32_t days, const ps::runtime::TrainingRule& rule) {
   int ret = 0;
+  if (days == 0) {
+    return ret;
+  }
 
-  ++(value->silent_days_);
-  value->count_ *= rule.sparse_.dic_rule_.decay_rate_;
+  float decay = sparse_embedding_ver1_decay_factor(days, rule);
+  value->silent_days_ += days;
+  value->count_ *= decay;
   for (size_t i = 0; i < value->embedding_.size(); ++i) {
-    value->embedding_[i] *= rule.sparse_.dic_rule_.decay_rate_;
+    value->embedding_[i] *= decay;
   }
 
   return ret;
@@ -140,6 +167,60 @@ bool sparse_embedding_ver1_shrink(const SparseEmbeddingVer1& value, const ps::ru
   return (value.count_ < rule.sparse_.dic_rule_.delete_threshold_) || (value.silent_days_ > rule.sparse_.dic_rule_.delete_after_silent_days_);
 }
 
+static const float kMaxHalf = 65504.0f;
+
+void sparse_embedding_ver1_pack(const SparseEmbeddingVer1& value, const int vector_bits, SparseEmbeddingVer1Packed *packed) {
+  CHECK(value.embedding_.size() <= UINT16_MAX && value.ada_g2sum_.size() <= UINT16_MAX);
+
+  packed->slot_ = value.slot_;
+  packed->silent_days_ = value.silent_days_;
+  packed->count_ = value.count_;
+  packed->ada_d2sum_ = value.ada_d2sum_;
+  packed->version_ = value.version_;
+  packed->delta_score_ = value.delta_score_;
+
+  int g2sum_bits = (vector_bits == 32) ? 32 : 16;
+  size_t embedding_bytes = quantized_bytes(vector_bits, value.embedding_.size());
+  packed->vector_bits_ = vector_bits;
+  packed->embedding_dim_ = value.embedding_.size();
+  packed->g2sum_dim_ = value.ada_g2sum_.size();
+  packed->data_.resize(embedding_bytes + quantized_bytes(g2sum_bits, value.ada_g2sum_.size()));
+  quantize(value.embedding_.data(), value.embedding_.size(), vector_bits, packed->data_.data());
+  if (g2sum_bits == 32) {
+    quantize(value.ada_g2sum_.data(), value.ada_g2sum_.size(), g2sum_bits, packed->data_.data() + embedding_bytes);
+  } else {
+    // g2sum only grows between decays, keep it finite rather than let fp16 overflow to inf.
+    std::vector<float> g2sum(value.ada_g2sum_);
+    for (size_t i = 0; i < g2sum.size(); ++i) {
+      g2sum[i] = std::min(g2sum[i], kMaxHalf);
+    }
+    quantize(g2sum.data(), g2sum.size(), g2sum_bits, packed->data_.data() + embedding_bytes);
+  }
+}
+
+void sparse_embedding_ver1_unpack(const SparseEmbeddingVer1Packed& packed, SparseEmbeddingVer1 *value) {
+  value->slot_ = packed.slot_;
+  value->silent_days_ = packed.silent_days_;
+  value->count_ = packed.count_;
+  value->ada_d2sum_ = packed.ada_d2sum_;
+  value->version_ = packed.version_;
+  value->delta_score_ = packed.delta_score_;
+
+  int g2sum_bits = (packed.vector_bits_ == 32) ? 32 : 16;
+  size_t embedding_bytes = quantized_bytes(packed.vector_bits_, packed.embedding_dim_);
+  value->embedding_.resize(packed.embedding_dim_);
+  value->ada_g2sum_.resize(packed.g2sum_dim_);
+  dequantize(packed.data_.data(), packed.embedding_dim_, packed.vector_bits_, value->embedding_.data());
+  dequantize(packed.data_.data() + embedding_bytes, packed.g2sum_dim_, g2sum_bits, value->ada_g2sum_.data());
+}
+
+void sparse_embedding_ver1_unpack_pull(const SparseEmbeddingVer1Packed& packed, SparseEmbeddingVer1Pull *pull) {
+  pull->slot_ = packed.slot_;
+  pull->count_ = packed.count_;
+  pull->version_ = packed.version_;
+  pull->embedding_.resize(packed.embedding_dim_);
+  dequantize(packed.data_.data(), packed.embedding_dim_, packed.vector_bits_, pull->embedding_.data());
+}
+
 } // namespace param_table
 } // namespace ps
-
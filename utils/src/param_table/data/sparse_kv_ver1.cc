@@ -1,9 +1,11 @@
 #include "param_table/data/sparse_kv_ver1.h"
 
 #include <math.h>
+#include <algorithm>
 #include <butil/logging.h>
 #include "absl/strings/str_format.h"
 #include "absl/random/random.h"
+#include "param_table/data/adagrad_kernel.h"
 
 using std::string;
 using ps::runtime::SparseTrainingRule;
@@ -19,7 +21,7 @@ static inline void bound(float *x, const float lower_bound, const float upper_bo
 }
 
 static inline float random(const float initial_range) {
-  static absl::BitGen gen;
+  thread_local absl::BitGen gen;
   return absl::uniform_real_distribution<float>(-initial_range, initial_range)(gen);
 }
 
@@ -97,31 +99,79 @@ int sparse_value_ver1_init(SparseValueVer1 *value, const TrainingRule& rule) {
   return ret;
 }
 
-static inline void adagrad(int n, float *w, const float *g, float g_scale, const float learning_rate,
-                           float *g2sum, const float initial_g2sum,
-                           const float weight_lower_bound, const float weight_upper_bound,
-                           const bool version_aware, const uint64_t version_diff) {
+int sparse_value_ver1_apply_schema(SparseValueVer1 *value, const TrainingRule& rule) {
+  uint8_t fields = sparse_value_ver1_schema(value->slot_, rule);
+  if (!(fields & SPARSE_FIELD_FM)) {
+    value->fm_w_ = 0;
+    value->fm_w_g2sum_ = 0;
+    value->fm_v_.clear();
+    value->fm_v_g2sum_ = 0;
+  }
+  if (!(fields & SPARSE_FIELD_MF)) {
+    value->mf_w_ = 0;
+    value->mf_w_g2sum_ = 0;
+    value->mf_v_.clear();
+    value->mf_v_g2sum_ = 0;
+  }
+  if (!(fields & SPARSE_FIELD_WIDE)) {
+    value->wide_w_ = 0;
+    value->wide_g2sum_ = 0;
+  }
+  return 0;
+}
+
+static inline void check_bound(const float lower_bound, const float upper_bound) {
+  CHECK(!(lower_bound > upper_bound));
+}
+
+static inline float g_scale_inv(float g_scale, const bool version_aware, const uint64_t version_diff) {
   if (g_scale <= 0) {
     g_scale = 1.0;
   }
   if (version_aware && version_diff > 0) {
-    g_scale *= sqrt(1.0 + version_diff);
+    g_scale *= sqrtf(1.0f + version_diff);
   }
-  float add_g2sum = 0.0;
-  for (int i = 0; i < n; ++i) {
-    float scaled_grad = g[i] / g_scale;
-    w[i] += learning_rate * scaled_grad * sqrt(initial_g2sum / (initial_g2sum + (*g2sum)));
-    bound(&(w[i]), weight_lower_bound, weight_upper_bound);
-    add_g2sum += scaled_grad * scaled_grad;
+  return 1.0f / g_scale;
+}
+
+// the learning rate scale only depends on g2sum before the update, so it is taken once per vector.
+static inline void adagrad(int n, float *w, const float *g, const float g_scale_inv, const float learning_rate,
+                           float *g2sum, const float initial_g2sum,
+                           const float weight_lower_bound, const float weight_upper_bound) {
+  float step = learning_rate * sqrtf(initial_g2sum / (initial_g2sum + (*g2sum)));
+  if (n == 1) {
+    float scaled_grad = g[0] * g_scale_inv;
+    w[0] = std::min(std::max(w[0] + step * scaled_grad, weight_lower_bound), weight_upper_bound);
+    (*g2sum) += scaled_grad * scaled_grad;
+  } else {
+    (*g2sum) += adagrad_kernel(n, w, g, g_scale_inv, step, weight_lower_bound, weight_upper_bound) / n;
   }
+}
 
-  (*g2sum) += add_g2sum / n;
+static void check_push_rule(const SparseTrainingRule& conf) {
+  check_bound(conf.lr_rule_.weight_lower_bound_, conf.lr_rule_.weight_upper_bound_);
+  check_bound(conf.fm_rule_.weight_lower_bound_, conf.fm_rule_.weight_upper_bound_);
+  check_bound(conf.mf_rule_.weight_lower_bound_, conf.mf_rule_.weight_upper_bound_);
+  check_bound(conf.wide_rule_.weight_lower_bound_, conf.wide_rule_.weight_upper_bound_);
 }
 
-int sparse_value_ver1_push(SparseValueVer1 *value, const SparseValueVer1& grad, const TrainingRule& rule) {
-  int ret = 0;
-  const SparseTrainingRule& conf = rule.sparse_;
+int sparse_value_ver1_pull(SparseValueVer1Pull *pull, const SparseValueVer1& value) {
+  pull->slot_ = value.slot_;
+  pull->show_ = value.show_;
+  pull->clk_ = value.clk_;
+  pull->lr_w_ = value.lr_w_;
+  pull->fm_w_ = value.fm_w_;
+  pull->fm_v_ = value.fm_v_;
+  pull->mf_w_ = value.mf_w_;
+  pull->mf_v_ = value.mf_v_;
+  pull->wide_w_ = value.wide_w_;
+  pull->version_ = value.version_;
+  return 0;
+}
 
+static void push_one(SparseValueVer1 *value, const SparseValueVer1Push& grad, const TrainingRule& rule) {
+  const SparseTrainingRule& conf = rule.sparse_;
+  uint8_t fields = sparse_value_ver1_schema(value->slot_, rule) & grad.fields_;
   // CHECK(value->slot_ == grad.slot_) << "slot: " << value->slot_ << ", newslot: " << grad.slot_;
   value->silent_days_ = 0;
 
@@ -132,48 +182,66 @@ int sparse_value_ver1_push(SparseValueVer1 *value, const SparseValueVer1& grad,
   uint64_t version_diff = value->version_ - grad.version_;
 
   // lr update
-  adagrad(1, &(value->lr_w_), &(grad.lr_w_), grad.show_, conf.lr_rule_.learning_rate_,
+  adagrad(1, &(value->lr_w_), &(grad.lr_w_),
+          g_scale_inv(grad.show_, conf.lr_rule_.version_aware_, version_diff), conf.lr_rule_.learning_rate_,
           &(value->lr_g2sum_), conf.lr_rule_.initial_g2sum_,
-          conf.lr_rule_.weight_lower_bound_, conf.lr_rule_.weight_upper_bound_,
-          conf.lr_rule_.version_aware_, version_diff);
+          conf.lr_rule_.weight_lower_bound_, conf.lr_rule_.weight_upper_bound_);
 
   // fm update
-  adagrad(1, &(value->fm_w_), &(grad.fm_w_), grad.show_, conf.fm_rule_.learning_rate_,
-          &(value->fm_w_g2sum_), conf.fm_rule_.initial_g2sum_,
-          conf.fm_rule_.weight_lower_bound_, conf.fm_rule_.weight_upper_bound_,
-          conf.fm_rule_.version_aware_, version_diff);
-  if (!(grad.fm_v_.empty() || value->fm_v_.empty())) {
-    adagrad(conf.fm_rule_.dim_, &(value->fm_v_[0]), &(grad.fm_v_[0]), grad.show_, conf.fm_rule_.learning_rate_,
-            &(value->fm_v_g2sum_), conf.fm_rule_.initial_g2sum_,
-            conf.fm_rule_.weight_lower_bound_, conf.fm_rule_.weight_upper_bound_,
-            conf.fm_rule_.version_aware_, version_diff);
+  if (fields & SPARSE_FIELD_FM) {
+    float fm_g_scale_inv = g_scale_inv(grad.show_, conf.fm_rule_.version_aware_, version_diff);
+    adagrad(1, &(value->fm_w_), &(grad.fm_w_), fm_g_scale_inv, conf.fm_rule_.learning_rate_,
+            &(value->fm_w_g2sum_), conf.fm_rule_.initial_g2sum_,
+            conf.fm_rule_.weight_lower_bound_, conf.fm_rule_.weight_upper_bound_);
+    if (!(grad.fm_v_.empty() || value->fm_v_.empty())) {
+      adagrad(conf.fm_rule_.dim_, &(value->fm_v_[0]), &(grad.fm_v_[0]), fm_g_scale_inv, conf.fm_rule_.learning_rate_,
+              &(value->fm_v_g2sum_), conf.fm_rule_.initial_g2sum_,
+              conf.fm_rule_.weight_lower_bound_, conf.fm_rule_.weight_upper_bound_);
+    }
   }
 
   // mf update
-  adagrad(1, &(value->mf_w_), &(grad.mf_w_), grad.show_, conf.mf_rule_.learning_rate_,
-          &(value->mf_w_g2sum_), conf.mf_rule_.initial_g2sum_,
-          conf.mf_rule_.weight_lower_bound_, conf.mf_rule_.weight_upper_bound_,
-          conf.mf_rule_.version_aware_, version_diff);
-  if (!(grad.mf_v_.empty() || value->mf_v_.empty())) {
-    adagrad(conf.mf_rule_.dim_, &(value->mf_v_[0]), &(grad.mf_v_[0]), grad.show_, conf.mf_rule_.learning_rate_,
-            &(value->mf_v_g2sum_), conf.mf_rule_.initial_g2sum_,
-            conf.mf_rule_.weight_lower_bound_, conf.mf_rule_.weight_upper_bound_,
-            conf.mf_rule_.version_aware_, version_diff);
+  if (fields & SPARSE_FIELD_MF) {
+    float mf_g_scale_inv = g_scale_inv(grad.show_, conf.mf_rule_.version_aware_, version_diff);
+    adagrad(1, &(value->mf_w_), &(grad.mf_w_), mf_g_scale_inv, conf.mf_rule_.learning_rate_,
+            &(value->mf_w_g2sum_), conf.mf_rule_.initial_g2sum_,
+            conf.mf_rule_.weight_lower_bound_, conf.mf_rule_.weight_upper_bound_);
+    if (!(grad.mf_v_.empty() || value->mf_v_.empty())) {
+      adagrad(conf.mf_rule_.dim_, &(value->mf_v_[0]), &(grad.mf_v_[0]), mf_g_scale_inv, conf.mf_rule_.learning_rate_,
+              &(value->mf_v_g2sum_), conf.mf_rule_.initial_g2sum_,
+              conf.mf_rule_.weight_lower_bound_, conf.mf_rule_.weight_upper_bound_);
+    }
   }
 
   // wide update
-  adagrad(1, &(value->wide_w_), &(grad.wide_w_), grad.show_, conf.wide_rule_.learning_rate_,
-          &(value->wide_g2sum_), conf.wide_rule_.initial_g2sum_,
-          conf.wide_rule_.weight_lower_bound_, conf.wide_rule_.weight_upper_bound_,
-          conf.wide_rule_.version_aware_, version_diff);
+  if (fields & SPARSE_FIELD_WIDE) {
+    adagrad(1, &(value->wide_w_), &(grad.wide_w_),
+            g_scale_inv(grad.show_, conf.wide_rule_.version_aware_, version_diff), conf.wide_rule_.learning_rate_,
+            &(value->wide_g2sum_), conf.wide_rule_.initial_g2sum_,
+            conf.wide_rule_.weight_lower_bound_, conf.wide_rule_.weight_upper_bound_);
+  }
 
   ++(value->version_);
   value->delta_score_ += (grad.show_ - grad.clk_) * conf.nonclk_coeff_ + grad.clk_ * conf.clk_coeff_;
+}
 
-  return ret;
+int sparse_value_ver1_push(SparseValueVer1 *value, const SparseValueVer1Push& grad, const TrainingRule& rule) {
+  check_push_rule(rule.sparse_);
+  push_one(value, grad, rule);
+  return 0;
+}
+
+int sparse_value_ver1_push_batch(const std::vector<SparseValueVer1 *>& value,
+                                 const std::vector<const SparseValueVer1Push *>& grad, const TrainingRule& rule) {
+  CHECK(value.size() == grad.size());
+  check_push_rule(rule.sparse_);
+  for (size_t i = 0; i < value.size(); ++i) {
+    push_one(value[i], *(grad[i]), rule);
+  }
+  return 0;
 }
 
-int sparse_value_ver1_merge(SparseValueVer1 *value, const SparseValueVer1& new_value, const ps::runtime::TrainingRule& rule) {
+int sparse_value_ver1_merge(SparseValueVer1Push *value, const SparseValueVer1Push& new_value, const ps::runtime::TrainingRule& rule) {
   int ret = 0;
   // const SparseTrainingRule& conf = rule.sparse_;
 
@@ -183,21 +251,58 @@ int sparse_value_ver1_merge(SparseValueVer1 *value, const SparseValueVer1& new_v
   value->lr_w_ += new_value.lr_w_;
 
   value->fm_w_ += new_value.fm_w_;
-  for (size_t i = 0; i < value->fm_v_.size() && i < new_value.fm_v_.size(); ++i) {
-    value->fm_v_[i] += new_value.fm_v_[i];
+  if (value->fm_v_.empty()) {
+    value->fm_v_ = new_value.fm_v_;
+  } else {
+    for (size_t i = 0; i < value->fm_v_.size() && i < new_value.fm_v_.size(); ++i) {
+      value->fm_v_[i] += new_value.fm_v_[i];
+    }
   }
 
   value->mf_w_ += new_value.mf_w_;
-  for (size_t i = 0; i < value->mf_v_.size() && i < new_value.mf_v_.size(); ++i) {
-    value->mf_v_[i] += new_value.mf_v_[i];
+  if (value->mf_v_.empty()) {
+    value->mf_v_ = new_value.mf_v_;
+  } else {
+    for (size_t i = 0; i < value->mf_v_.size() && i < new_value.mf_v_.size(); ++i) {
+      value->mf_v_[i] += new_value.mf_v_[i];
+    }
   }
 
   value->wide_w_ += new_value.wide_w_;
   value->version_ = std::min(value->version_, new_value.version_);
+  value->fields_ |= new_value.fields_;
 
   return ret;
 }
 
+static inline bool all_zero(const float w, const std::vector<float>& v) {
+  if (w != 0) {
+    return false;
+  }
+  for (size_t i = 0; i < v.size(); ++i) {
+    if (v[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int sparse_value_ver1_mask_push(SparseValueVer1Push *grad) {
+  // a zero gradient leaves weights and g2sum of adagrad as they are, so skipping it changes nothing.
+  if ((grad->fields_ & SPARSE_FIELD_FM) && all_zero(grad->fm_w_, grad->fm_v_)) {
+    grad->fields_ &= ~SPARSE_FIELD_FM;
+    grad->fm_v_.clear();
+  }
+  if ((grad->fields_ & SPARSE_FIELD_MF) && all_zero(grad->mf_w_, grad->mf_v_)) {
+    grad->fields_ &= ~SPARSE_FIELD_MF;
+    grad->mf_v_.clear();
+  }
+  if ((grad->fields_ & SPARSE_FIELD_WIDE) && grad->wide_w_ == 0) {
+    grad->fields_ &= ~SPARSE_FIELD_WIDE;
+  }
+  return 0;
+}
+
 int sparse_value_ver1_to_string(const SparseKeyVer1& key, const SparseValueVer1& value, std::string *str) {
   int ret = 0;
   (*str) = absl::StrFormat("%llu %u %d %llu %f %f %f",
@@ -239,11 +344,22 @@ int sparse_value_ver1_to_string(const SparseKeyVer1& key, const SparseValueVer1&
   return ret;
 }
 
-int sparse_value_ver1_time_decay(SparseValueVer1 *value, const ps::runtime::TrainingRule& rule) {
+float sparse_value_ver1_decay_factor(const uint32_t days, const ps::runtime::TrainingRule& rule) {
+  if (days == 0) {
+    return 1.0f;
+  }
+  return (days == 1) ? rule.sparse_.cvm_rule_.decay_rate_ : powf(rule.sparse_.cvm_rule_.decay_rate_, days);
+}
+
+int sparse_value_ver1_time_decay(SparseValueVer1 *value, const uint32_t days, const ps::runtime::TrainingRule& rule) {
   int ret = 0;
-  ++(value->silent_days_);
-  value->show_ *= rule.sparse_.cvm_rule_.decay_rate_;
-  value->clk_  *= rule.sparse_.cvm_rule_.decay_rate_;
+  if (days == 0) {
+    return ret;
+  }
+  float decay = sparse_value_ver1_decay_factor(days, rule);
+  value->silent_days_ += days;
+  value->show_ *= decay;
+  value->clk_  *= decay;
   return ret;
 }
 
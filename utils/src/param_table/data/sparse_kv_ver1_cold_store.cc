@@ -0,0 +1,89 @@
+#include "param_table/data/sparse_kv_ver1_cold_store.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <butil/logging.h>
+
+using std::string;
+
+namespace ps {
+namespace param_table {
+
+SparseValueVer1ColdStore::SparseValueVer1ColdStore(const string& file, const size_t stride) :
+  file_(file),
+  fd_(-1),
+  stride_(stride),
+  end_(0),
+  free_list_(),
+  pin_count_(0),
+  pinned_free_list_() {
+  fd_ = open(file_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  PCHECK(fd_ >= 0) << "can not open cold store file: " << file_;
+}
+
+SparseValueVer1ColdStore::~SparseValueVer1ColdStore() {
+  if (fd_ >= 0) {
+    close(fd_);
+    unlink(file_.c_str());
+  }
+}
+
+uint64_t SparseValueVer1ColdStore::write(const char *data) {
+  uint64_t offset = end_;
+  if (!free_list_.empty()) {
+    offset = free_list_.back();
+    free_list_.pop_back();
+  } else {
+    end_ += stride_;
+  }
+
+  size_t done = 0;
+  while (done < stride_) {
+    ssize_t n = pwrite(fd_, data + done, stride_ - done, offset + done);
+    PCHECK(n > 0) << "write cold store file fail: " << file_;
+    done += n;
+  }
+
+  return offset;
+}
+
+void SparseValueVer1ColdStore::read(const uint64_t offset, char *data) const {
+  size_t done = 0;
+  while (done < stride_) {
+    ssize_t n = pread(fd_, data + done, stride_ - done, offset + done);
+    PCHECK(n > 0) << "read cold store file fail: " << file_;
+    done += n;
+  }
+}
+
+void SparseValueVer1ColdStore::free(const uint64_t offset) {
+  CHECK(offset < end_);
+  if (pin_count_ > 0) {
+    pinned_free_list_.push_back(offset);
+  } else {
+    free_list_.push_back(offset);
+  }
+}
+
+void SparseValueVer1ColdStore::pin() {
+  ++pin_count_;
+}
+
+void SparseValueVer1ColdStore::unpin() {
+  CHECK(pin_count_ > 0);
+  if (--pin_count_ == 0) {
+    free_list_.insert(free_list_.end(), pinned_free_list_.begin(), pinned_free_list_.end());
+    pinned_free_list_.clear();
+  }
+}
+
+uint64_t SparseValueVer1ColdStore::end() const {
+  return end_;
+}
+
+size_t SparseValueVer1ColdStore::size() const {
+  return end_ / stride_ - free_list_.size() - pinned_free_list_.size();
+}
+
+} // namespace param_table
+} // namespace ps
@@ -0,0 +1,305 @@
+#include "param_table/data/sparse_kv_ver1_slab.h"
+
+#include <string.h>
+#include <algorithm>
+#include <butil/logging.h>
+#include "param_table/data/quantization.h"
+
+using std::shared_ptr;
+using std::vector;
+
+namespace ps {
+namespace param_table {
+
+static shared_ptr<char> new_block(const size_t bytes) {
+  return shared_ptr<char>(new char[bytes], std::default_delete<char[]>());
+}
+
+SparseValueVer1SlabSnapshot::SparseValueVer1SlabSnapshot() :
+  slab_(NULL),
+  blocks_() {
+}
+
+void SparseValueVer1SlabSnapshot::load(const uint32_t index, SparseValueVer1 *value) const {
+  slab_->decode(data(index), value);
+}
+
+const char* SparseValueVer1SlabSnapshot::data(const uint32_t index) const {
+  return slab_->data(blocks_[index >> SparseValueVer1Slab::kLayoutShift], index);
+}
+
+SparseValueVer1Slab::SparseValueVer1Slab(const int fm_dim, const int mf_dim, const int vector_bits) :
+  fm_dim_(std::max(fm_dim, 0)),
+  mf_dim_(std::max(mf_dim, 0)),
+  vector_bits_(vector_bits),
+  fm_bytes_(0),
+  stride_(0),
+  layout_(kLayoutNum) {
+  fm_bytes_ = quantized_bytes(vector_bits_, fm_dim_);
+  for (int l = 0; l < kLayoutNum; ++l) {
+    size_t stride = sizeof(SparseValueVer1Row);
+    if (l & SPARSE_FIELD_FM) {
+      stride += fm_bytes_;
+    }
+    if (l & SPARSE_FIELD_MF) {
+      stride += quantized_bytes(vector_bits_, mf_dim_);
+    }
+    layout_[l].stride_ = (stride + alignof(SparseValueVer1Row) - 1) / alignof(SparseValueVer1Row) * alignof(SparseValueVer1Row);
+    layout_[l].used_ = 0;
+    stride_ = std::max(stride_, layout_[l].stride_);
+  }
+}
+
+SparseValueVer1Slab::~SparseValueVer1Slab() {
+}
+
+uint32_t SparseValueVer1Slab::alloc(const uint8_t fields) {
+  const uint32_t l = fields & (SPARSE_FIELD_FM | SPARSE_FIELD_MF);
+  Layout& layout = layout_[l];
+  uint32_t index = 0;
+
+  if (!layout.free_list_.empty()) {
+    index = layout.free_list_.back();
+    layout.free_list_.pop_back();
+  } else {
+    // the two highest indexes are left to the table as markers.
+    CHECK(layout.used_ < (1U << kLayoutShift) - 2) << "sparse slab is full, rows = " << layout.used_;
+    if (layout.used_ >= layout.blocks_.size() * kBlockRows) {
+      layout.blocks_.push_back(new_block(kBlockRows * layout.stride_));
+    }
+    index = layout.used_++;
+  }
+  index |= (l << kLayoutShift);
+  memset(row(index), 0, layout.stride_);
+  row(index)->layout_ = l;
+
+  return index;
+}
+
+void SparseValueVer1Slab::free(const uint32_t index) {
+  Layout& layout = layout_[index >> kLayoutShift];
+  CHECK((index & ((1U << kLayoutShift) - 1)) < layout.used_);
+  layout.free_list_.push_back(index & ((1U << kLayoutShift) - 1));
+}
+
+void SparseValueVer1Slab::load(const uint32_t index, SparseValueVer1 *value) const {
+  decode(reinterpret_cast<const char *>(row(index)), value);
+}
+
+void SparseValueVer1Slab::decode(const char *data, SparseValueVer1 *value) const {
+  const SparseValueVer1Row *r = reinterpret_cast<const SparseValueVer1Row *>(data);
+
+  value->slot_ = r->slot_;
+  value->silent_days_ = r->silent_days_;
+
+  value->show_ = r->show_;
+  value->clk_ = r->clk_;
+
+  value->lr_w_ = r->lr_w_;
+  value->lr_g2sum_ = r->lr_g2sum_;
+
+  const char *v = reinterpret_cast<const char *>(r + 1);
+  value->fm_w_ = r->fm_w_;
+  value->fm_w_g2sum_ = r->fm_w_g2sum_;
+  if (r->layout_ & SPARSE_FIELD_FM) {
+    value->fm_v_.resize(fm_dim_);
+    dequantize(v, fm_dim_, vector_bits_, value->fm_v_.data());
+    v += fm_bytes_;
+  } else {
+    value->fm_v_.clear();
+  }
+  value->fm_v_g2sum_ = r->fm_v_g2sum_;
+
+  value->mf_w_ = r->mf_w_;
+  value->mf_w_g2sum_ = r->mf_w_g2sum_;
+  if (r->layout_ & SPARSE_FIELD_MF) {
+    value->mf_v_.resize(mf_dim_);
+    dequantize(v, mf_dim_, vector_bits_, value->mf_v_.data());
+  } else {
+    value->mf_v_.clear();
+  }
+  value->mf_v_g2sum_ = r->mf_v_g2sum_;
+
+  value->wide_w_ = r->wide_w_;
+  value->wide_g2sum_ = r->wide_g2sum_;
+
+  value->version_ = r->version_;
+  value->delta_score_ = r->delta_score_;
+}
+
+void SparseValueVer1Slab::decode_pull(const char *data, SparseValueVer1Pull *pull) const {
+  const SparseValueVer1Row *r = reinterpret_cast<const SparseValueVer1Row *>(data);
+
+  pull->slot_ = r->slot_;
+  pull->show_ = r->show_;
+  pull->clk_ = r->clk_;
+  pull->lr_w_ = r->lr_w_;
+
+  const char *v = reinterpret_cast<const char *>(r + 1);
+  pull->fm_w_ = r->fm_w_;
+  if (r->layout_ & SPARSE_FIELD_FM) {
+    pull->fm_v_.resize(fm_dim_);
+    dequantize(v, fm_dim_, vector_bits_, pull->fm_v_.data());
+    v += fm_bytes_;
+  } else {
+    pull->fm_v_.clear();
+  }
+
+  pull->mf_w_ = r->mf_w_;
+  if (r->layout_ & SPARSE_FIELD_MF) {
+    pull->mf_v_.resize(mf_dim_);
+    dequantize(v, mf_dim_, vector_bits_, pull->mf_v_.data());
+  } else {
+    pull->mf_v_.clear();
+  }
+
+  pull->wide_w_ = r->wide_w_;
+  pull->version_ = r->version_;
+}
+
+// vectors shorter than the configured dim are zero padded, longer ones are truncated.
+static void store_vector(const vector<float>& x, const int dim, const int bits, char *data) {
+  if (x.size() >= (size_t)dim) {
+    quantize(x.data(), dim, bits, data);
+  } else {
+    vector<float> padded(x);
+    padded.resize(dim, 0.0f);
+    quantize(padded.data(), dim, bits, data);
+  }
+}
+
+void SparseValueVer1Slab::store(const uint32_t index, const SparseValueVer1& value) {
+  SparseValueVer1Row *r = row(index);
+
+  r->slot_ = value.slot_;
+  r->silent_days_ = value.silent_days_;
+
+  r->show_ = value.show_;
+  r->clk_ = value.clk_;
+
+  r->lr_w_ = value.lr_w_;
+  r->lr_g2sum_ = value.lr_g2sum_;
+
+  char *v = reinterpret_cast<char *>(r + 1);
+  if (r->layout_ & SPARSE_FIELD_FM) {
+    store_vector(value.fm_v_, fm_dim_, vector_bits_, v);
+    v += fm_bytes_;
+  }
+  r->fm_w_ = value.fm_w_;
+  r->fm_w_g2sum_ = value.fm_w_g2sum_;
+  r->fm_v_g2sum_ = value.fm_v_g2sum_;
+
+  if (r->layout_ & SPARSE_FIELD_MF) {
+    store_vector(value.mf_v_, mf_dim_, vector_bits_, v);
+  }
+  r->mf_w_ = value.mf_w_;
+  r->mf_w_g2sum_ = value.mf_w_g2sum_;
+  r->mf_v_g2sum_ = value.mf_v_g2sum_;
+
+  r->wide_w_ = value.wide_w_;
+  r->wide_g2sum_ = value.wide_g2sum_;
+
+  r->version_ = value.version_;
+  r->delta_score_ = value.delta_score_;
+}
+
+SparseValueVer1Row* SparseValueVer1Slab::row(const uint32_t index) {
+  Layout& layout = layout_[index >> kLayoutShift];
+  shared_ptr<char>& block = layout.blocks_[(index & ((1U << kLayoutShift) - 1)) >> kBlockShift];
+  // a snapshot still holds the block, it keeps the old rows and the slab moves on to a copy.
+  if (!block.unique()) {
+    shared_ptr<char> copy = new_block(kBlockRows * layout.stride_);
+    memcpy(copy.get(), block.get(), kBlockRows * layout.stride_);
+    block = copy;
+  }
+  return reinterpret_cast<SparseValueVer1Row *>(block.get() + (index & (kBlockRows - 1)) * layout.stride_);
+}
+
+const SparseValueVer1Row* SparseValueVer1Slab::row(const uint32_t index) const {
+  return reinterpret_cast<const SparseValueVer1Row *>(data(index));
+}
+
+const char* SparseValueVer1Slab::data(const vector<shared_ptr<char> >& blocks, const uint32_t index) const {
+  return blocks[(index & ((1U << kLayoutShift) - 1)) >> kBlockShift].get()
+    + (index & (kBlockRows - 1)) * layout_[index >> kLayoutShift].stride_;
+}
+
+const char* SparseValueVer1Slab::data(const uint32_t index) const {
+  return data(layout_[index >> kLayoutShift].blocks_, index);
+}
+
+void SparseValueVer1Slab::copy(const uint32_t index, char *data) const {
+  size_t stride = layout_[index >> kLayoutShift].stride_;
+  memcpy(data, this->data(index), stride);
+  memset(data + stride, 0, stride_ - stride);
+}
+
+void SparseValueVer1Slab::snapshot(SparseValueVer1SlabSnapshot *snapshot) const {
+  snapshot->slab_ = this;
+  snapshot->blocks_.resize(kLayoutNum);
+  for (int l = 0; l < kLayoutNum; ++l) {
+    snapshot->blocks_[l] = layout_[l].blocks_;
+  }
+}
+
+int SparseValueVer1Slab::fm_dim() const {
+  return fm_dim_;
+}
+
+int SparseValueVer1Slab::mf_dim() const {
+  return mf_dim_;
+}
+
+int SparseValueVer1Slab::vector_bits() const {
+  return vector_bits_;
+}
+
+size_t SparseValueVer1Slab::stride() const {
+  return stride_;
+}
+
+size_t SparseValueVer1Slab::size() const {
+  size_t size = 0;
+  for (const Layout& layout : layout_) {
+    size += layout.used_ - layout.free_list_.size();
+  }
+  return size;
+}
+
+size_t SparseValueVer1Slab::live_bytes() const {
+  size_t bytes = 0;
+  for (const Layout& layout : layout_) {
+    bytes += (layout.used_ - layout.free_list_.size()) * layout.stride_;
+  }
+  return bytes;
+}
+
+uint32_t SparseValueVer1Slab::used() const {
+  uint32_t used = 0;
+  for (const Layout& layout : layout_) {
+    used += layout.used_;
+  }
+  return used;
+}
+
+uint32_t SparseValueVer1Slab::at(uint32_t position) const {
+  for (uint32_t l = 0; l < (uint32_t)kLayoutNum; ++l) {
+    if (position < layout_[l].used_) {
+      return (l << kLayoutShift) | position;
+    }
+    position -= layout_[l].used_;
+  }
+  LOG(FATAL) << "slab position out of range.";
+  return 0;
+}
+
+size_t SparseValueVer1Slab::memory_usage() const {
+  size_t bytes = 0;
+  for (const Layout& layout : layout_) {
+    bytes += layout.blocks_.size() * kBlockRows * layout.stride_ + layout.free_list_.capacity() * sizeof(uint32_t);
+  }
+  return bytes;
+}
+
+} // namespace param_table
+} // namespace ps
@@ -0,0 +1,107 @@
+#include "param_table/partition_ring.h"
+
+#include <algorithm>
+#include <utility>
+#include <butil/logging.h>
+#include "toolkit/hash.h"
+
+using std::vector;
+using std::pair;
+
+namespace ps {
+namespace param_table {
+
+static const uint64_t kRingSeed = 2;
+
+PartitionRing::PartitionRing() :
+  server_num_(0),
+  vnode_num_(0),
+  token_(),
+  token_owner_() {
+}
+
+PartitionRing::PartitionRing(const uint32_t server_num, const uint32_t vnode_num) :
+  server_num_(server_num),
+  vnode_num_(vnode_num),
+  token_(),
+  token_owner_() {
+  CHECK(server_num_ > 0);
+  if (vnode_num_ == 0) {
+    return;
+  }
+
+  vector<pair<uint64_t, uint32_t> > point;
+  point.reserve((size_t)server_num_ * vnode_num_);
+  for (uint32_t s = 0; s < server_num_; ++s) {
+    for (uint32_t v = 0; v < vnode_num_; ++v) {
+      point.push_back(std::make_pair(ps::toolkit::hash_mix64(((uint64_t)s << 32) | v, kRingSeed), s));
+    }
+  }
+  std::sort(point.begin(), point.end());
+
+  token_.resize(point.size());
+  token_owner_.resize(point.size());
+  for (size_t i = 0; i < point.size(); ++i) {
+    token_[i] = point[i].first;
+    token_owner_[i] = point[i].second;
+  }
+}
+
+uint32_t PartitionRing::server_num() const {
+  return server_num_;
+}
+
+uint32_t PartitionRing::vnode_num() const {
+  return vnode_num_;
+}
+
+bool PartitionRing::operator==(const PartitionRing& other) const {
+  return server_num_ == other.server_num_ && vnode_num_ == other.vnode_num_;
+}
+
+size_t PartitionRing::owner(const uint64_t hash) const {
+  size_t i = std::lower_bound(token_.begin(), token_.end(), hash) - token_.begin();
+  return token_owner_[i == token_.size() ? 0 : i];
+}
+
+size_t PartitionRing::server_id(const SparseKeyVer1& sign) const {
+  if (vnode_num_ == 0) {
+    return sparse_feature_server_id(sign, server_num_);
+  }
+  return owner(ps::toolkit::hash_mix64(sign));
+}
+
+vector<size_t> PartitionRing::source_servers(const PartitionRing& old_ring, const size_t server_id) const {
+  vector<size_t> source;
+  if (*this == old_ring) {
+    source.push_back(server_id);
+    return source;
+  }
+  // modulo routing scatters every server over the whole key space.
+  if (vnode_num_ == 0 || old_ring.vnode_num_ == 0) {
+    for (size_t s = 0; s < old_ring.server_num_; ++s) {
+      source.push_back(s);
+    }
+    return source;
+  }
+
+  // the points of both rings cut the key space into arcs with one owner in each,
+  // the arc ending at a point is owned by the owner of that point's hash.
+  vector<uint64_t> bound(token_);
+  bound.insert(bound.end(), old_ring.token_.begin(), old_ring.token_.end());
+  vector<bool> is_source(old_ring.server_num_, false);
+  for (size_t i = 0; i < bound.size(); ++i) {
+    if (owner(bound[i]) == server_id) {
+      is_source[old_ring.owner(bound[i])] = true;
+    }
+  }
+  for (size_t s = 0; s < is_source.size(); ++s) {
+    if (is_source[s]) {
+      source.push_back(s);
+    }
+  }
+  return source;
+}
+
+} // namespace param_table
+} // namespace ps
@@ -0,0 +1,266 @@
+#include "param_table/snapshot.h"
+
+#include <algorithm>
+#include <butil/logging.h>
+#include "absl/strings/match.h"
+#include "absl/strings/str_format.h"
+#include "message/types.h"
+#include "toolkit/fs_agent.h"
+
+using std::string;
+using std::vector;
+using std::shared_ptr;
+
+using ps::toolkit::BinaryArchive;
+using ps::toolkit::FSAgent;
+
+namespace ps {
+namespace param_table {
+
+static const uint32_t kSnapshotMagic   = 0x50534e50; // "PSNP"
+static const uint32_t kSnapshotVersion = SNAPSHOT_VERSION_DECAY_EPOCH;
+static const size_t   kBlockBytes      = (4UL << 20);
+
+SnapshotWriter::SnapshotWriter(shared_ptr<FILE> fd, const SnapshotHeader& header) :
+  fd_(fd),
+  ar_(),
+  offset_(0),
+  record_num_(0),
+  block_offset_(),
+  block_record_num_(),
+  ret_(ps::message::SUCCESS) {
+  BinaryArchive ar;
+  ar << kSnapshotMagic << kSnapshotVersion << header.table_type_
+     << header.snapshot_type_ << header.epoch_
+     << header.server_num_ << header.shard_num_ << header.part_id_ << header.vnode_num_
+     << header.decay_epoch_;
+  ret_ = write(ar.buffer(), ar.length());
+  ar_.reserve(kBlockBytes + (kBlockBytes >> 4));
+}
+
+SnapshotWriter::~SnapshotWriter() {
+}
+
+BinaryArchive& SnapshotWriter::archive() {
+  return ar_;
+}
+
+int SnapshotWriter::end_record() {
+  ++record_num_;
+  if (ar_.length() >= kBlockBytes) {
+    return flush_block();
+  }
+  return ret_;
+}
+
+int SnapshotWriter::finish() {
+  flush_block();
+
+  uint64_t end_mark[2] = {0, 0};
+  write(end_mark, sizeof(end_mark));
+
+  uint64_t footer_offset = offset_;
+  uint64_t total_record_num = 0;
+  BinaryArchive ar;
+  ar << (uint64_t)block_offset_.size();
+  for (size_t i = 0; i < block_offset_.size(); ++i) {
+    ar << block_offset_[i] << block_record_num_[i];
+    total_record_num += block_record_num_[i];
+  }
+  ar << total_record_num << footer_offset << kSnapshotMagic;
+  write(ar.buffer(), ar.length());
+
+  if (ret_ == ps::message::SUCCESS && 0 != fflush(fd_.get())) {
+    ret_ = ps::message::SNAPSHOT_IO_ERROR;
+  }
+  return ret_;
+}
+
+int SnapshotWriter::write(const void *data, size_t size) {
+  if (ret_ == ps::message::SUCCESS && size > 0) {
+    if (fwrite(data, 1, size, fd_.get()) != size) {
+      ret_ = ps::message::SNAPSHOT_IO_ERROR;
+    }
+    offset_ += size;
+  }
+  return ret_;
+}
+
+int SnapshotWriter::flush_block() {
+  if (record_num_ > 0) {
+    uint64_t block[2] = {(uint64_t)ar_.length(), record_num_};
+    block_offset_.push_back(offset_);
+    block_record_num_.push_back(record_num_);
+    write(block, sizeof(block));
+    write(ar_.buffer(), ar_.length());
+    ar_.clear();
+    record_num_ = 0;
+  }
+  return ret_;
+}
+
+SnapshotReader::SnapshotReader(shared_ptr<FILE> fd) :
+  fd_(fd),
+  ar_(),
+  offset_(0),
+  block_offset_(),
+  block_record_num_() {
+}
+
+SnapshotReader::~SnapshotReader() {
+}
+
+BinaryArchive& SnapshotReader::archive() {
+  return ar_;
+}
+
+int SnapshotReader::read(void *data, size_t size) {
+  if (fread(data, 1, size, fd_.get()) != size) {
+    return ps::message::SNAPSHOT_FORMAT_ERROR;
+  }
+  offset_ += size;
+  return ps::message::SUCCESS;
+}
+
+int SnapshotReader::read_header(SnapshotHeader *header) {
+  uint32_t buffer[8];
+  int ret = read(buffer, sizeof(buffer));
+  if (ret != ps::message::SUCCESS) {
+    return ret;
+  }
+  if (buffer[0] != kSnapshotMagic || buffer[1] > kSnapshotVersion) {
+    return ps::message::SNAPSHOT_FORMAT_ERROR;
+  }
+
+  header->version_       = buffer[1];
+  header->table_type_    = buffer[2];
+  header->snapshot_type_ = buffer[3];
+  header->epoch_         = buffer[4];
+  header->server_num_    = buffer[5];
+  header->shard_num_     = buffer[6];
+  header->part_id_       = buffer[7];
+  header->vnode_num_     = 0;
+  header->decay_epoch_   = 0;
+  if (header->version_ >= SNAPSHOT_VERSION_RING) {
+    ret = read(&(header->vnode_num_), sizeof(header->vnode_num_));
+  }
+  if (ret == ps::message::SUCCESS && header->version_ >= SNAPSHOT_VERSION_DECAY_EPOCH) {
+    ret = read(&(header->decay_epoch_), sizeof(header->decay_epoch_));
+  }
+  return ret;
+}
+
+int SnapshotReader::next_block(uint64_t *record_num) {
+  uint64_t block_offset = offset_;
+  uint64_t block[2];
+  int ret = read(block, sizeof(block));
+  if (ret != ps::message::SUCCESS) {
+    return ret;
+  }
+
+  *record_num = block[1];
+  if (block[1] == 0) {
+    return read_footer();
+  }
+
+  block_offset_.push_back(block_offset);
+  block_record_num_.push_back(block[1]);
+  ar_.clear();
+  ar_.resize(block[0]);
+  return read(ar_.buffer(), block[0]);
+}
+
+int SnapshotReader::read_footer() {
+  uint64_t footer_offset = offset_;
+  uint64_t block_num = 0;
+  int ret = read(&block_num, sizeof(block_num));
+  if (ret != ps::message::SUCCESS) {
+    return ret;
+  }
+  if (block_num != block_offset_.size()) {
+    return ps::message::SNAPSHOT_FORMAT_ERROR;
+  }
+
+  ar_.clear();
+  ar_.resize(block_num * 2 * sizeof(uint64_t) + 2 * sizeof(uint64_t) + sizeof(uint32_t));
+  ret = read(ar_.buffer(), ar_.length());
+  if (ret != ps::message::SUCCESS) {
+    return ret;
+  }
+
+  uint64_t total_record_num = 0;
+  for (size_t i = 0; i < block_num; ++i) {
+    uint64_t offset = ar_.get<uint64_t>();
+    uint64_t record_num = ar_.get<uint64_t>();
+    if (offset != block_offset_[i] || record_num != block_record_num_[i]) {
+      return ps::message::SNAPSHOT_FORMAT_ERROR;
+    }
+    total_record_num += record_num;
+  }
+  if (ar_.get<uint64_t>() != total_record_num ||
+      ar_.get<uint64_t>() != footer_offset ||
+      ar_.get<uint32_t>() != kSnapshotMagic) {
+    return ps::message::SNAPSHOT_FORMAT_ERROR;
+  }
+  return ret;
+}
+
+vector<string> snapshot_part_files(const string& path) {
+  vector<string> files;
+  for (const string& file : FSAgent::fs_list(path)) {
+    size_t pos = file.find_last_of('/');
+    string name = (pos == string::npos) ? file : file.substr(pos + 1);
+    if (absl::StartsWith(name, "part-")) {
+      files.push_back(file);
+    }
+  }
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+string snapshot_part_file(const string& path, const size_t part_id) {
+  return path + absl::StrFormat("/part-%05d", part_id);
+}
+
+int snapshot_read_header(const string& file, SnapshotHeader *header) {
+  SnapshotReader reader(FSAgent::fs_open_read(file, ""));
+  return reader.read_header(header);
+}
+
+int snapshot_check_chain(const vector<string>& chain, const uint32_t table_type, SnapshotHeader *last) {
+  int ret = ps::message::SUCCESS;
+
+  SnapshotHeader prev;
+  for (size_t i = 0; i < chain.size() && ret == ps::message::SUCCESS; ++i) {
+    vector<string> files = snapshot_part_files(chain[i]);
+    if (files.empty()) {
+      ret = ps::message::SNAPSHOT_CHAIN_ERROR;
+      break;
+    }
+    ret = snapshot_read_header(files[0], last);
+    if (ret != ps::message::SUCCESS) {
+      break;
+    }
+    if (last->table_type_ != table_type) {
+      ret = ps::message::SNAPSHOT_FORMAT_ERROR;
+    } else if (i == 0 && last->snapshot_type_ != SNAPSHOT_BASE) {
+      ret = ps::message::SNAPSHOT_CHAIN_ERROR;
+    } else if (i > 0 && (last->snapshot_type_ != SNAPSHOT_DELTA || last->epoch_ != prev.epoch_ + 1
+               || last->server_num_ != prev.server_num_ || last->shard_num_ != prev.shard_num_
+               || last->vnode_num_ != prev.vnode_num_ || last->decay_epoch_ < prev.decay_epoch_)) {
+      ret = ps::message::SNAPSHOT_CHAIN_ERROR;
+    }
+    prev = *last;
+  }
+  if (chain.empty()) {
+    ret = ps::message::SNAPSHOT_CHAIN_ERROR;
+  }
+  if (ret != ps::message::SUCCESS) {
+    LOG(ERROR) << "invalid snapshot chain: " << ps::message::errno_to_string(ret);
+  }
+
+  return ret;
+}
+
+} // namespace param_table
+} // namespace ps
@@ -1,11 +1,14 @@
 #include "param_table/sparse_embedding_ver1_table.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <unistd.h>
-#include <atomic>
 #include <memory>
+#include <thread>
 #include <algorithm>
 #include <butil/logging.h>
+#include <bthread/bthread.h>
+#include <bthread/countdown_event.h>
 #include "absl/hash/hash.h"
 #include "absl/strings/str_format.h"
 #include "message/types.h"
@@ -14,14 +17,16 @@
 #include "toolkit/rpc_agent.h"
 #include "toolkit/fs_agent.h"
 #include "toolkit/thread_group.h"
+#include "toolkit/task_pool.h"
 
 using std::vector;
 using std::string;
-using std::atomic;
 using std::unique_ptr;
 using std::shared_ptr;
 
 using ps::toolkit::BinaryArchive;
+using ps::toolkit::PayloadReader;
+using ps::toolkit::PayloadWriter;
 using ps::toolkit::MPIAgent;
 using ps::toolkit::RPCAgent;
 using ps::toolkit::FSAgent;
@@ -43,6 +48,35 @@ static BinaryArchive& operator>>(BinaryArchive& ar, SparseEmbeddingVer1& val) {
   return ar;
 }
 
+// embedding values are written whole in every snapshot version.
+static void snapshot_write_value(BinaryArchive& ar, const SparseEmbeddingVer1& val) {
+  ar << val;
+}
+static void snapshot_read_value(BinaryArchive& ar, const uint32_t version, SparseEmbeddingVer1 *val) {
+  ar >> *val;
+}
+static void snapshot_time_decay(SparseEmbeddingVer1 *val, const uint32_t days) {
+  sparse_embedding_ver1_time_decay(val, days, ConfigManager::pick_training_rule());
+}
+
+static BinaryArchive& operator<<(BinaryArchive& ar, const SparseEmbeddingVer1Pull& val) {
+  ar << val.slot_ << val.version_ << val.count_ << val.embedding_;
+  return ar;
+}
+static BinaryArchive& operator>>(BinaryArchive& ar, SparseEmbeddingVer1Pull& val) {
+  ar >> val.slot_ >> val.version_ >> val.count_ >> val.embedding_;
+  return ar;
+}
+
+static BinaryArchive& operator<<(BinaryArchive& ar, const SparseEmbeddingVer1Push& val) {
+  ar << val.slot_ << val.version_ << val.count_ << val.embedding_;
+  return ar;
+}
+static BinaryArchive& operator>>(BinaryArchive& ar, SparseEmbeddingVer1Push& val) {
+  ar >> val.slot_ >> val.version_ >> val.count_ >> val.embedding_;
+  return ar;
+}
+
 static BinaryArchive& operator<<(BinaryArchive& ar, const SparseFeatureVer1& val) {
   ar << val.sign_ << val.slot_;
   return ar;
@@ -67,6 +101,36 @@ static BinaryArchive& operator>>(BinaryArchive& ar, vector<SparseEmbeddingVer1>&
   return ar;
 }
 
+static BinaryArchive& operator<<(BinaryArchive& ar, const vector<SparseEmbeddingVer1Pull>& p) {
+  ar << (size_t)p.size();
+  for (const auto& x : p) {
+    ar << x;
+  }
+  return ar;
+}
+static BinaryArchive& operator>>(BinaryArchive& ar, vector<SparseEmbeddingVer1Pull>& p) {
+  p.resize(ar.get<size_t>());
+  for (auto& x : p) {
+    ar >> x;
+  }
+  return ar;
+}
+
+static BinaryArchive& operator<<(BinaryArchive& ar, const vector<SparseEmbeddingVer1Push>& p) {
+  ar << (size_t)p.size();
+  for (const auto& x : p) {
+    ar << x;
+  }
+  return ar;
+}
+static BinaryArchive& operator>>(BinaryArchive& ar, vector<SparseEmbeddingVer1Push>& p) {
+  p.resize(ar.get<size_t>());
+  for (auto& x : p) {
+    ar >> x;
+  }
+  return ar;
+}
+
 static BinaryArchive& operator<<(BinaryArchive& ar, const vector<SparseFeatureVer1>& p) {
   ar << (size_t)p.size();
   for (const auto& x : p) {
@@ -82,25 +146,252 @@ static BinaryArchive& operator>>(BinaryArchive& ar, vector<SparseFeatureVer1>& p
   return ar;
 }
 
-SparseEmbeddingVer1Shard::SparseEmbeddingVer1Shard() :
+static int embedding_bits() {
+  const ps::runtime::SparseTrainingRule& rule = ConfigManager::pick_training_rule().sparse_;
+  return rule.use_quantized_embedding_ ? rule.quantized_embedding_bits_ : 32;
+}
+
+SparseEmbeddingVer1Stripe::SparseEmbeddingVer1Stripe() :
   data_(),
-  rw_mutex_() {
+  rw_mutex_(),
+  decay_epoch_(0),
+  dirty_(),
+  full_dirty_(false),
+  removed_(),
+  vector_bytes_(0),
+  memory_budget_(0),
+  evicted_(0) {
+  size_t table_bytes = ConfigManager::pick_sparse_memory_rule().table_bytes_;
+  if (table_bytes > 0) {
+    size_t stripe_num = (size_t)ConfigManager::pick_local_shard_num() * ConfigManager::pick_sparse_map_stripe_num();
+    memory_budget_ = std::max(table_bytes / std::max(stripe_num, (size_t)1), (size_t)1);
+  }
+}
+
+SparseEmbeddingVer1Stripe::~SparseEmbeddingVer1Stripe() {
+}
+
+SparseEmbeddingVer1Shard::SparseEmbeddingVer1Shard() :
+  stripe_(ConfigManager::pick_sparse_map_stripe_num()) {
 }
 
 SparseEmbeddingVer1Shard::~SparseEmbeddingVer1Shard() {
 }
 
-int SparseEmbeddingVer1Shard::save(const string& file) {
+// callers hold the stripe writer lock.
+static void mark_dirty(SparseEmbeddingVer1Stripe& stripe, const SparseKeyVer1& key) {
+  if (stripe.full_dirty_) {
+    return;
+  }
+  stripe.dirty_.insert(key);
+  if (stripe.dirty_.size() * 2 > stripe.data_.size()) {
+    stripe.full_dirty_ = true;
+    stripe.dirty_.clear();
+  }
+}
+
+// time decay is lazy: a table time decay only bumps decay_epoch_ of the stripes, rows
+// keep the epoch they were last brought up to date at and catch up when they are read.
+static void load_row(const SparseEmbeddingVer1Packed& packed, const uint32_t decay_epoch, SparseEmbeddingVer1 *value) {
+  sparse_embedding_ver1_unpack(packed, value);
+  sparse_embedding_ver1_time_decay(value, decay_epoch - packed.decay_epoch_, ConfigManager::pick_training_rule());
+}
+
+// a pull reads the packed row in place instead of unpacking it.
+static void pull_row(const SparseEmbeddingVer1Packed& packed, const uint32_t decay_epoch, SparseEmbeddingVer1Pull *pull) {
+  sparse_embedding_ver1_unpack_pull(packed, pull);
+  uint32_t days = decay_epoch - packed.decay_epoch_;
+  if (days > 0) {
+    float decay = sparse_embedding_ver1_decay_factor(days, ConfigManager::pick_training_rule());
+    pull->count_ *= decay;
+    for (size_t i = 0; i < pull->embedding_.size(); ++i) {
+      pull->embedding_[i] *= decay;
+    }
+  }
+}
+
+// what a feature not created yet pulls, without allocating.
+static void pull_default(const SparseSlotVer1 slot, SparseEmbeddingVer1Pull *pull) {
+  static const SparseEmbeddingVer1 value = sparse_embedding_ver1_default();
+  sparse_embedding_ver1_pull(pull, value);
+  pull->slot_ = slot;
+}
+
+// creates the row if it is empty. new references to a row are only taken under the
+// stripe lock, so a row seen unshared here stays unshared.
+static void store_row(SparseEmbeddingVer1Stripe& stripe, const SparseEmbeddingVer1& value,
+                      SparseEmbeddingVer1Row *row) {
+  if (*row) {
+    stripe.vector_bytes_ -= (*row)->data_.capacity();
+  }
+  if (!*row || row->use_count() > 1) {
+    *row = std::make_shared<SparseEmbeddingVer1Packed>();
+  }
+  sparse_embedding_ver1_pack(value, embedding_bits(), row->get());
+  (*row)->decay_epoch_ = stripe.decay_epoch_;
+  stripe.vector_bytes_ += (*row)->data_.capacity();
+}
+
+// callers erase the row from data_ afterwards.
+static void free_row(SparseEmbeddingVer1Stripe& stripe, const SparseEmbeddingVer1Packed& packed) {
+  stripe.vector_bytes_ -= packed.data_.capacity();
+}
+
+typedef std::pair<SparseKeyVer1, SparseEmbeddingVer1Row> RowSlot;
+
+// bytes of the live rows, hash slots, rows and packed vectors. make_shared puts the
+// reference counts next to the row.
+static size_t memory_usage(const SparseEmbeddingVer1Stripe& stripe) {
+  size_t row_bytes = sizeof(RowSlot) + 1 + sizeof(SparseEmbeddingVer1Packed) + 2 * sizeof(long);
+  return stripe.data_.size() * row_bytes + stripe.vector_bytes_;
+}
+
+// rows that are rarely clicked and long silent go first, read in place.
+static float eviction_score(const SparseEmbeddingVer1Stripe& stripe, const SparseEmbeddingVer1Packed& packed) {
+  int silent_days = packed.silent_days_ + (int)(stripe.decay_epoch_ - packed.decay_epoch_);
+  return packed.delta_score_ / (1.0f + silent_days);
+}
+
+// sparse_embedding_ver1_shrink of the decayed row, read in place.
+static bool shrink_row(const SparseEmbeddingVer1Stripe& stripe, const SparseEmbeddingVer1Packed& packed) {
+  const ps::runtime::TrainingRule& rule = ConfigManager::pick_training_rule();
+  uint32_t days = stripe.decay_epoch_ - packed.decay_epoch_;
+  float count = packed.count_ * sparse_embedding_ver1_decay_factor(days, rule);
+  return (count < rule.sparse_.dic_rule_.delete_threshold_) ||
+         (packed.silent_days_ + (int)days > rule.sparse_.dic_rule_.delete_after_silent_days_);
+}
+
+// once the stripe reaches the high watermark of its budget, drops the lowest scored rows
+// down to the low watermark as a shrink would. rows are about the same size, so one pass
+// over the scores picks them all. keys in created, just created by the calling request,
+// are kept. callers hold the writer lock.
+static void enforce_memory_budget(SparseEmbeddingVer1Stripe& stripe, const absl::flat_hash_set<SparseKeyVer1>& created) {
+  if (stripe.memory_budget_ == 0) {
+    return;
+  }
+  const ps::runtime::SparseMemoryRule& rule = ConfigManager::pick_sparse_memory_rule();
+  size_t usage = memory_usage(stripe);
+  if (usage < (size_t)(stripe.memory_budget_ * rule.high_watermark_)) {
+    return;
+  }
+
+  size_t low = (size_t)(stripe.memory_budget_ * rule.low_watermark_);
+  vector<std::pair<float, SparseKeyVer1> > candidate;
+  candidate.reserve(stripe.data_.size());
+  for (auto iter = stripe.data_.begin(); iter != stripe.data_.end(); ++iter) {
+    if (created.find(iter->first) == created.end()) {
+      candidate.push_back(std::make_pair(eviction_score(stripe, *(iter->second)), iter->first));
+    }
+  }
+  size_t evict_num = (size_t)ceil((double)(usage - low) * stripe.data_.size() / usage);
+  evict_num = std::min(evict_num, candidate.size());
+  std::nth_element(candidate.begin(), candidate.begin() + evict_num, candidate.end());
+  for (size_t i = 0; i < evict_num; ++i) {
+    auto iter = stripe.data_.find(candidate[i].second);
+    free_row(stripe, *(iter->second));
+    stripe.removed_.push_back(iter->first);
+    stripe.data_.erase(iter);
+    ++stripe.evicted_;
+  }
+}
+
+size_t SparseEmbeddingVer1Shard::locate(const SparseKeyVer1& key) const {
+  if (stripe_.size() == 1) {
+    return 0;
+  }
+  return absl::Hash<SparseKeyVer1>()(key) % stripe_.size();
+}
+
+static bool is_text_snapshot(const SnapshotHeader& header) {
+  return header.snapshot_type_ == SNAPSHOT_BASE && ConfigManager::pick_text_snapshot();
+}
+
+void SparseEmbeddingVer1Shard::lock_shared() {
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    stripe_[s].rw_mutex_.ReaderLock();
+  }
+}
+
+void SparseEmbeddingVer1Shard::unlock_shared() {
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    stripe_[s].rw_mutex_.ReaderUnlock();
+  }
+}
+
+void SparseEmbeddingVer1Shard::freeze(const SnapshotHeader& header, vector<SparseEmbeddingVer1StripeSnapshot> *snapshot) {
+  bool is_delta = (header.snapshot_type_ == SNAPSHOT_DELTA);
+  snapshot->resize(stripe_.size());
+  // readers never touch dirty_, full_dirty_ or removed_, so the shared lock is enough to reset them here.
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    SparseEmbeddingVer1Stripe& stripe = stripe_[s];
+    SparseEmbeddingVer1StripeSnapshot& frozen = (*snapshot)[s];
+    frozen.decay_epoch_ = stripe.decay_epoch_;
+    // rows are referenced, writes during the save replace them in the stripe.
+    if (is_delta && !stripe.full_dirty_) {
+      frozen.rows_.reserve(stripe.dirty_.size());
+      for (auto key = stripe.dirty_.begin(); key != stripe.dirty_.end(); ++key) {
+        auto iter = stripe.data_.find(*key);
+        if (iter != stripe.data_.end()) {
+          frozen.rows_.push_back(*iter);
+        }
+      }
+    } else {
+      frozen.rows_.assign(stripe.data_.begin(), stripe.data_.end());
+    }
+    if (is_text_snapshot(header)) {
+      continue;
+    }
+    if (is_delta) {
+      frozen.removed_.swap(stripe.removed_);
+    }
+    stripe.removed_.clear();
+    stripe.dirty_.clear();
+    stripe.full_dirty_ = false;
+  }
+}
+
+int SparseEmbeddingVer1Shard::write(const string& file, const SnapshotHeader& header,
+                                    const vector<SparseEmbeddingVer1StripeSnapshot>& snapshot) const {
+  if (is_text_snapshot(header)) {
+    return write_text(file, snapshot);
+  }
+
+  SnapshotWriter writer(FSAgent::fs_open_write(file, ""), header);
+  BinaryArchive& ar = writer.archive();
   int ret = ps::message::SUCCESS;
+  SparseEmbeddingVer1 value;
+  for (size_t s = 0; s < snapshot.size() && ret == ps::message::SUCCESS; ++s) {
+    const SparseEmbeddingVer1StripeSnapshot& frozen = snapshot[s];
+    for (size_t i = 0; i < frozen.removed_.size() && ret == ps::message::SUCCESS; ++i) {
+      ar << (uint8_t)SNAPSHOT_RECORD_TOMBSTONE << frozen.removed_[i];
+      ret = writer.end_record();
+    }
+    for (size_t i = 0; i < frozen.rows_.size() && ret == ps::message::SUCCESS; ++i) {
+      load_row(*(frozen.rows_[i].second), header.decay_epoch_, &value);
+      ar << (uint8_t)SNAPSHOT_RECORD_VALUE << frozen.rows_[i].first;
+      snapshot_write_value(ar, value);
+      ret = writer.end_record();
+    }
+  }
+  if (ret == ps::message::SUCCESS) {
+    ret = writer.finish();
+  }
+
+  return ret;
+}
 
-  if (data_.size() > 0) {
-    string converter = "";
-    shared_ptr<FILE> fd = FSAgent::hdfs_open_write(file, converter);
-    for (auto iter : data_) {
+int SparseEmbeddingVer1Shard::write_text(const string& file, const vector<SparseEmbeddingVer1StripeSnapshot>& snapshot) const {
+  int ret = ps::message::SUCCESS;
+
+  string converter = "";
+  shared_ptr<FILE> fd = FSAgent::hdfs_open_write(file, converter);
+  SparseEmbeddingVer1 value;
+  for (size_t s = 0; s < snapshot.size(); ++s) {
+    const SparseEmbeddingVer1StripeSnapshot& frozen = snapshot[s];
+    for (size_t i = 0; i < frozen.rows_.size(); ++i) {
       string line;
-      rw_mutex_.WriterLock();
-      sparse_embedding_ver1_to_string(iter.first, iter.second, &line);
-      rw_mutex_.WriterUnlock();
+      load_row(*(frozen.rows_[i].second), frozen.decay_epoch_, &value);
+      sparse_embedding_ver1_to_string(frozen.rows_[i].first, value, &line);
 
       line = line + string("\n");
       fwrite(line.c_str(), sizeof(char), line.length(), fd.get());
@@ -110,36 +401,127 @@ int SparseEmbeddingVer1Shard::save(const string& file) {
   return ret;
 }
 
+void SparseEmbeddingVer1Shard::release(const bool is_written, vector<SparseEmbeddingVer1StripeSnapshot> *snapshot) {
+  for (size_t s = 0; s < snapshot->size() && !is_written; ++s) {
+    SparseEmbeddingVer1Stripe& stripe = stripe_[s];
+    SparseEmbeddingVer1StripeSnapshot& frozen = (*snapshot)[s];
+    // the changes taken by a failed save go to the next one.
+    stripe.rw_mutex_.WriterLock();
+    stripe.removed_.insert(stripe.removed_.end(), frozen.removed_.begin(), frozen.removed_.end());
+    stripe.full_dirty_ = true;
+    stripe.dirty_.clear();
+    stripe.rw_mutex_.WriterUnlock();
+  }
+  snapshot->clear();
+}
+
+int SparseEmbeddingVer1Shard::insert(const vector<SparseKeyVer1>& key, vector<SparseEmbeddingVer1> *value,
+                                     const uint32_t decay_epoch) {
+  CHECK(key.size() == value->size());
+
+  vector<vector<size_t> > group(stripe_.size());
+  for (size_t i = 0; i < key.size(); ++i) {
+    group[locate(key[i])].push_back(i);
+  }
+
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    if (group[s].empty()) {
+      continue;
+    }
+    SparseEmbeddingVer1Stripe& stripe = stripe_[s];
+    stripe.rw_mutex_.WriterLock();
+    for (size_t i : group[s]) {
+      SparseEmbeddingVer1Row& row = stripe.data_[key[i]];
+      store_row(stripe, (*value)[i], &row);
+      // values of an older snapshot than the stripe catch up when read.
+      row->decay_epoch_ = std::min(decay_epoch, stripe.decay_epoch_);
+    }
+    // loaded rows compete with each other on their scores.
+    enforce_memory_budget(stripe, absl::flat_hash_set<SparseKeyVer1>());
+    stripe.rw_mutex_.WriterUnlock();
+  }
+
+  return ps::message::SUCCESS;
+}
+
+int SparseEmbeddingVer1Shard::erase(const vector<SparseKeyVer1>& key) {
+  vector<vector<size_t> > group(stripe_.size());
+  for (size_t i = 0; i < key.size(); ++i) {
+    group[locate(key[i])].push_back(i);
+  }
+
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    if (group[s].empty()) {
+      continue;
+    }
+    SparseEmbeddingVer1Stripe& stripe = stripe_[s];
+    stripe.rw_mutex_.WriterLock();
+    for (size_t i : group[s]) {
+      auto iter = stripe.data_.find(key[i]);
+      if (iter != stripe.data_.end()) {
+        free_row(stripe, *(iter->second));
+        stripe.data_.erase(iter);
+      }
+    }
+    stripe.rw_mutex_.WriterUnlock();
+  }
+
+  return ps::message::SUCCESS;
+}
+
+void SparseEmbeddingVer1Shard::reset_checkpoint() {
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    SparseEmbeddingVer1Stripe& stripe = stripe_[s];
+    stripe.rw_mutex_.WriterLock();
+    stripe.dirty_.clear();
+    stripe.full_dirty_ = false;
+    stripe.removed_.clear();
+    stripe.rw_mutex_.WriterUnlock();
+  }
+}
+
 int SparseEmbeddingVer1Shard::assign(const vector<SparseFeatureVer1>& key, const vector<SparseEmbeddingVer1>& value) {
   int ret = ps::message::SUCCESS;
 
   CHECK(key.size() == value.size());
 
-  rw_mutex_.WriterLock();
+  vector<vector<size_t> > group(stripe_.size());
   for (size_t i = 0; i < key.size(); ++i) {
-    auto iter = data_.find(key[i].sign_);
-    if (iter == data_.end()) {
-      ret = ps::message::ASSIGN_NONEXISTENT_SARSE_FEATURE;
-      break;
-    }
+    group[locate(key[i].sign_)].push_back(i);
   }
-  if (ret == ps::message::SUCCESS) {
-    for (size_t i = 0; i < key.size(); ++i) {
-      auto iter = data_.find(key[i].sign_);
-      iter->second = value[i];
+
+  for (size_t s = 0; s < stripe_.size() && ret == ps::message::SUCCESS; ++s) {
+    if (group[s].empty()) {
+      continue;
     }
+    SparseEmbeddingVer1Stripe& stripe = stripe_[s];
+    stripe.rw_mutex_.WriterLock();
+    for (size_t i : group[s]) {
+      auto iter = stripe.data_.find(key[i].sign_);
+      if (iter == stripe.data_.end()) {
+        ret = ps::message::ASSIGN_NONEXISTENT_SARSE_FEATURE;
+        break;
+      }
+    }
+    if (ret == ps::message::SUCCESS) {
+      for (size_t i : group[s]) {
+        auto iter = stripe.data_.find(key[i].sign_);
+        store_row(stripe, value[i], &(iter->second));
+        mark_dirty(stripe, key[i].sign_);
+      }
+    }
+    stripe.rw_mutex_.WriterUnlock();
   }
-  rw_mutex_.WriterUnlock();
 
   return ret;
 }
 
-int SparseEmbeddingVer1Shard::push(const vector<SparseFeatureVer1>& key, const vector<SparseEmbeddingVer1>& value) {
+int SparseEmbeddingVer1Shard::push(const vector<SparseFeatureVer1>& key, const vector<SparseEmbeddingVer1Push>& value) {
   int ret = ps::message::SUCCESS;
 
   CHECK(key.size() == value.size());
 
-  absl::flat_hash_map<SparseKeyVer1, SparseEmbeddingVer1> merge;
+  absl::flat_hash_map<SparseKeyVer1, SparseEmbeddingVer1Push> merge;
   for (size_t i = 0; i < key.size(); ++i) {
     auto iter = merge.find(key[i].sign_);
     if (iter == merge.end()) {
@@ -152,51 +534,121 @@ int SparseEmbeddingVer1Shard::push(const vector<SparseFeatureVer1>& key, const v
     }
   }
 
-  rw_mutex_.WriterLock();
+  typedef std::pair<const SparseKeyVer1, SparseEmbeddingVer1Push> MergeItem;
+  vector<vector<const MergeItem *> > group(stripe_.size());
   for (auto i = merge.begin(); i != merge.end(); ++i) {
-    auto iter = data_.find(i->first);
-    if (iter == data_.end()) {
-      ret = ps::message::UPDATE_NONEXISTENT_SARSE_FEATURE;
-      break;
-    }
+    group[locate(i->first)].push_back(&(*i));
   }
-  if (ret == ps::message::SUCCESS) {
-    for (auto i = merge.begin(); i != merge.end(); ++i) {
-      auto iter = data_.find(i->first);
-      // some kind of feature like "query - title" may make this check fail.
-      // CHECK(key[i].slot_ == iter->second.slot_ && key[i].slot_ == value[i].slot_)
-      //   << "sign: " << key[i].sign_ << ", slot-1: " << key[i].slot_
-      //   << ", slot-2: " << iter->second.slot_ << ", slot-3: " << value[i].slot_;
-      CHECK(iter != data_.end());
-      ret = sparse_embedding_ver1_push(&(iter->second), i->second, ConfigManager::pick_training_rule());
+
+  vector<SparseEmbeddingVer1> current;
+  vector<SparseEmbeddingVer1Row *> rows;
+  vector<SparseEmbeddingVer1 *> batch_value;
+  vector<const SparseEmbeddingVer1Push *> batch_grad;
+  for (size_t s = 0; s < stripe_.size() && ret == ps::message::SUCCESS; ++s) {
+    if (group[s].empty()) {
+      continue;
+    }
+    SparseEmbeddingVer1Stripe& stripe = stripe_[s];
+    stripe.rw_mutex_.WriterLock();
+    for (const MergeItem *i : group[s]) {
+      auto iter = stripe.data_.find(i->first);
+      if (iter == stripe.data_.end()) {
+        ret = ps::message::UPDATE_NONEXISTENT_SARSE_FEATURE;
+        break;
+      }
+    }
+    if (ret == ps::message::SUCCESS) {
+      // rows of a stripe are unpacked into scratch values and updated as one batch.
+      if (current.size() < group[s].size()) {
+        current.resize(group[s].size());
+      }
+      rows.clear();
+      batch_value.clear();
+      batch_grad.clear();
+      for (const MergeItem *i : group[s]) {
+        auto iter = stripe.data_.find(i->first);
+        // some kind of feature like "query - title" may make this check fail.
+        // CHECK(key[i].slot_ == iter->second.slot_ && key[i].slot_ == value[i].slot_)
+        //   << "sign: " << key[i].sign_ << ", slot-1: " << key[i].slot_
+        //   << ", slot-2: " << iter->second.slot_ << ", slot-3: " << value[i].slot_;
+        CHECK(iter != stripe.data_.end());
+        SparseEmbeddingVer1& cur = current[rows.size()];
+        load_row(*(iter->second), stripe.decay_epoch_, &cur);
+        rows.push_back(&(iter->second));
+        batch_value.push_back(&cur);
+        batch_grad.push_back(&(i->second));
+        mark_dirty(stripe, i->first);
+      }
+      ret = sparse_embedding_ver1_push_batch(batch_value, batch_grad, ConfigManager::pick_training_rule());
+      for (size_t r = 0; r < rows.size(); ++r) {
+        store_row(stripe, current[r], rows[r]);
+      }
     }
+    stripe.rw_mutex_.WriterUnlock();
   }
-  rw_mutex_.WriterUnlock();
 
   return ret;
 }
 
-int SparseEmbeddingVer1Shard::pull(const vector<SparseFeatureVer1>& key, vector<SparseEmbeddingVer1> *value, const bool is_training) {
+int SparseEmbeddingVer1Shard::pull(const vector<SparseFeatureVer1>& key, vector<SparseEmbeddingVer1Pull> *value, const bool is_training) {
   int ret = ps::message::SUCCESS;
 
   value->resize(key.size());
-  rw_mutex_.WriterLock();
+
+  vector<vector<size_t> > group(stripe_.size());
   for (size_t i = 0; i < key.size(); ++i) {
-    auto iter = data_.find(key[i].sign_);
-    if (iter == data_.end()) {
-      if (is_training) {
-        ret = sparse_embedding_ver1_init(&(data_[key[i].sign_]), ConfigManager::pick_training_rule());
-        data_[key[i].sign_].slot_ = key[i].slot_;
-        (*value)[i] = data_[key[i].sign_];
+    group[locate(key[i].sign_)].push_back(i);
+  }
+
+  SparseEmbeddingVer1 out;
+  vector<size_t> missing;
+  absl::flat_hash_set<SparseKeyVer1> created;
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    if (group[s].empty()) {
+      continue;
+    }
+    SparseEmbeddingVer1Stripe& stripe = stripe_[s];
+
+    // lookups share the lock, missing keys are created afterwards in a short exclusive pass.
+    missing.clear();
+    stripe.rw_mutex_.ReaderLock();
+    for (size_t i : group[s]) {
+      auto iter = stripe.data_.find(key[i].sign_);
+      if (iter != stripe.data_.end()) {
+        pull_row(*(iter->second), stripe.decay_epoch_, &((*value)[i]));
+      } else if (is_training) {
+        missing.push_back(i);
       } else {
-        (*value)[i] = sparse_embedding_ver1_default();
-        (*value)[i].slot_ = key[i].slot_;
+        pull_default(key[i].slot_, &((*value)[i]));
+      }
+    }
+    stripe.rw_mutex_.ReaderUnlock();
+
+    if (missing.empty()) {
+      continue;
+    }
+
+    created.clear();
+    stripe.rw_mutex_.WriterLock();
+    for (size_t i : missing) {
+      // the key may have been created by another pull between the two passes.
+      auto iter = stripe.data_.find(key[i].sign_);
+      if (iter != stripe.data_.end()) {
+        pull_row(*(iter->second), stripe.decay_epoch_, &((*value)[i]));
+      } else {
+        SparseEmbeddingVer1Row& new_row = stripe.data_[key[i].sign_];
+        ret = sparse_embedding_ver1_init(&out, ConfigManager::pick_training_rule());
+        out.slot_ = key[i].slot_;
+        // hand out the stored value, which may be quantized.
+        store_row(stripe, out, &new_row);
+        pull_row(*new_row, stripe.decay_epoch_, &((*value)[i]));
+        mark_dirty(stripe, key[i].sign_);
+        created.insert(key[i].sign_);
       }
-    } else {
-      (*value)[i] = data_[key[i].sign_];
     }
+    enforce_memory_budget(stripe, created);
+    stripe.rw_mutex_.WriterUnlock();
   }
-  rw_mutex_.WriterUnlock();
 
   return ret;
 }
@@ -204,61 +656,337 @@ int SparseEmbeddingVer1Shard::pull(const vector<SparseFeatureVer1>& key, vector<
 int SparseEmbeddingVer1Shard::time_decay() {
   int ret = ps::message::SUCCESS;
 
-  for (auto iter : data_) {
-    sparse_embedding_ver1_time_decay(&(iter.second), ConfigManager::pick_training_rule());
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    SparseEmbeddingVer1Stripe& stripe = stripe_[s];
+    stripe.rw_mutex_.WriterLock();
+    // rows are not marked dirty: snapshots carry the decay epoch they were written at
+    // and the rows of older snapshots catch up on load like stored rows do.
+    ++stripe.decay_epoch_;
+    stripe.rw_mutex_.WriterUnlock();
   }
 
   return ret;
 }
 
+void SparseEmbeddingVer1Shard::catch_up_decay(const uint32_t decay_epoch) {
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    SparseEmbeddingVer1Stripe& stripe = stripe_[s];
+    stripe.rw_mutex_.WriterLock();
+    stripe.decay_epoch_ = std::max(stripe.decay_epoch_, decay_epoch);
+    stripe.rw_mutex_.WriterUnlock();
+  }
+}
+
 int SparseEmbeddingVer1Shard::shrink() {
   int ret = ps::message::SUCCESS;
 
-  for (auto iter : data_) {
-    if (sparse_embedding_ver1_shrink(iter.second, ConfigManager::pick_training_rule())) {
-      data_.erase(iter.first);
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    SparseEmbeddingVer1Stripe& stripe = stripe_[s];
+    stripe.rw_mutex_.WriterLock();
+    for (auto iter = stripe.data_.begin(); iter != stripe.data_.end();) {
+      if (shrink_row(stripe, *(iter->second))) {
+        stripe.removed_.push_back(iter->first);
+        free_row(stripe, *(iter->second));
+        stripe.data_.erase(iter++);
+      } else {
+        ++iter;
+      }
     }
+    stripe.rw_mutex_.WriterUnlock();
   }
 
   return ret;
 }
 
 uint64_t SparseEmbeddingVer1Shard::feature_num() {
-  return data_.size();
+  uint64_t feature_num = 0;
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    feature_num += stripe_[s].data_.size();
+  }
+  return feature_num;
+}
+
+size_t SparseEmbeddingVer1Shard::memory_usage() {
+  size_t bytes = 0;
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    stripe_[s].rw_mutex_.ReaderLock();
+    bytes += ps::param_table::memory_usage(stripe_[s]);
+    stripe_[s].rw_mutex_.ReaderUnlock();
+  }
+  return bytes;
+}
+
+uint64_t SparseEmbeddingVer1Shard::evicted_num() {
+  uint64_t evicted_num = 0;
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    stripe_[s].rw_mutex_.ReaderLock();
+    evicted_num += stripe_[s].evicted_;
+    stripe_[s].rw_mutex_.ReaderUnlock();
+  }
+  return evicted_num;
+}
+
+static uint64_t table_memory_usage(void *table) {
+  return static_cast<SparseEmbeddingVer1Table *>(table)->memory_usage();
+}
+
+static uint64_t table_evicted_num(void *table) {
+  return static_cast<SparseEmbeddingVer1Table *>(table)->evicted_num();
 }
 
 SparseEmbeddingVer1Table::SparseEmbeddingVer1Table() :
   name_(""),
-  shard_(31) {
+  ring_(),
+  shard_(ConfigManager::pick_local_shard_num()),
+  checkpoint_epoch_(0),
+  save_mutex_(),
+  save_thread_(),
+  is_saving_(false),
+  save_id_(0),
+  save_ret_(),
+  memory_var_(),
+  evicted_var_() {
 }
 
-SparseEmbeddingVer1Table::SparseEmbeddingVer1Table(const string& name) :
+SparseEmbeddingVer1Table::SparseEmbeddingVer1Table(const string& name, const PartitionRing& ring) :
   name_(name),
-  shard_(31) {
+  ring_(ring),
+  shard_(ConfigManager::pick_local_shard_num()),
+  checkpoint_epoch_(0),
+  save_mutex_(),
+  save_thread_(),
+  is_saving_(false),
+  save_id_(0),
+  save_ret_(),
+  memory_var_(),
+  evicted_var_() {
+  memory_var_.reset(new bvar::PassiveStatus<uint64_t>(name_ + "_memory_bytes", table_memory_usage, this));
+  evicted_var_.reset(new bvar::PassiveStatus<uint64_t>(name_ + "_evicted_features", table_evicted_num, this));
 }
 
 SparseEmbeddingVer1Table::~SparseEmbeddingVer1Table() {
+  memory_var_.reset();
+  evicted_var_.reset();
+  if (save_thread_.joinable()) {
+    save_thread_.join();
+  }
 }
 
 const string& SparseEmbeddingVer1Table::name() const {
   return name_;
 }
 
-int SparseEmbeddingVer1Table::save(const string& path) {
+int SparseEmbeddingVer1Table::save(const string& path, uint64_t *handle) {
+  return save_snapshot(path, SNAPSHOT_BASE, handle);
+}
+
+int SparseEmbeddingVer1Table::save_delta(const string& path, uint64_t *handle) {
+  return save_snapshot(path, SNAPSHOT_DELTA, handle);
+}
+
+int SparseEmbeddingVer1Table::save_status(const uint64_t handle) {
+  absl::MutexLock lock(&save_mutex_);
+  // the save thread sets save_ret_ and clears is_saving_ together.
+  auto iter = save_ret_.find(handle);
+  if (iter != save_ret_.end()) {
+    return iter->second;
+  }
+  if (is_saving_ && handle == save_id_) {
+    return ps::message::SNAPSHOT_IN_PROGRESS;
+  }
+  LOG(ERROR) << "unknown save handle " << handle << " of embedding table " << name_;
+  return ps::message::UNKNOWN_ERROR;
+}
+
+int SparseEmbeddingVer1Table::save_snapshot(const string& path, const uint32_t snapshot_type, uint64_t *handle) {
+  absl::MutexLock lock(&save_mutex_);
+  if (is_saving_) {
+    return ps::message::SNAPSHOT_IN_PROGRESS;
+  }
+  if (save_thread_.joinable()) {
+    save_thread_.join();
+  }
+
+  size_t mpi_rank = MPIAgent::mpi_rank_group();
+  size_t shard_size = shard_.size();
+  SnapshotHeader header = {};
+  header.table_type_ = SNAPSHOT_SPARSE_EMBEDDING_VER1;
+  header.snapshot_type_ = snapshot_type;
+  header.epoch_ = checkpoint_epoch_ + 1;
+  header.server_num_ = ring_.server_num();
+  header.shard_num_ = shard_size;
+  header.vnode_num_ = ring_.vnode_num();
+
+  // all stripes are frozen at the same moment, writers only wait while the rows are
+  // taken, the rows themselves are written out in the background.
+  shared_ptr<vector<vector<SparseEmbeddingVer1StripeSnapshot> > > snapshot(
+    new vector<vector<SparseEmbeddingVer1StripeSnapshot> >(shard_size));
+  for (size_t i = 0; i < shard_size; ++i) {
+    shard_[i].lock_shared();
+  }
+  ps::toolkit::ThreadGroup thread_pool(shard_size);
+  thread_pool.run([this, &header, &snapshot](int i) {
+    this->shard_[i].freeze(header, &((*snapshot)[i]));
+  });
+  for (size_t i = 0; i < shard_size; ++i) {
+    shard_[i].unlock_shared();
+  }
+  // rows are written decayed up to the newest stripe, a time decay may have been
+  // half way through the shards when they were frozen.
+  for (size_t i = 0; i < shard_size; ++i) {
+    for (const SparseEmbeddingVer1StripeSnapshot& frozen : (*snapshot)[i]) {
+      header.decay_epoch_ = std::max(header.decay_epoch_, frozen.decay_epoch_);
+    }
+  }
+
+  is_saving_ = true;
+  *handle = ++save_id_;
+  uint64_t save_id = save_id_;
+  save_thread_ = std::thread([this, path, header, snapshot, save_id, mpi_rank, shard_size]() {
+    int ret = ps::message::SUCCESS;
+
+    vector<int> tmp_ret(shard_size, ps::message::SUCCESS);
+    ps::toolkit::ThreadGroup thread_pool(shard_size);
+    thread_pool.run([this, &path, &header, &snapshot, &tmp_ret, mpi_rank, shard_size](int i) {
+      SnapshotHeader part_header = header;
+      part_header.part_id_ = mpi_rank * shard_size + i;
+      tmp_ret[i] = this->shard_[i].write(snapshot_part_file(path, part_header.part_id_), part_header, (*snapshot)[i]);
+    });
+    for (size_t i = 0; i < shard_size; ++i) {
+      if (ps::message::SUCCESS != tmp_ret[i]) {
+        ret = tmp_ret[i];
+        break;
+      }
+    }
+    for (size_t i = 0; i < shard_size; ++i) {
+      this->shard_[i].release(ps::message::SUCCESS == ret, &((*snapshot)[i]));
+    }
+    LOG(INFO) << "save embedding table: " << this->name_ << ", path = " << path << ", ret = " << ret;
+
+    absl::MutexLock lock(&(this->save_mutex_));
+    if (ps::message::SUCCESS == ret && !is_text_snapshot(header)) {
+      this->checkpoint_epoch_ = header.epoch_;
+    }
+    this->save_ret_[save_id] = ret;
+    this->is_saving_ = false;
+  });
+
+  return ps::message::SUCCESS;
+}
+
+int SparseEmbeddingVer1Table::load(const string& path) {
   int ret = ps::message::SUCCESS;
 
+  absl::MutexLock lock(&save_mutex_);
+  if (is_saving_) {
+    return ps::message::SNAPSHOT_IN_PROGRESS;
+  }
+
+  vector<string> files = snapshot_part_files(path);
+  if (files.empty()) {
+    LOG(WARNING) << "no snapshot found in " << path;
+    return ret;
+  }
+
   size_t mpi_rank = MPIAgent::mpi_rank_group();
   size_t shard_size = shard_.size();
+  SnapshotHeader header;
+  ret = snapshot_read_header(files[0], &header);
+  if (ps::message::SUCCESS != ret) {
+    return ret;
+  }
+  if (header.snapshot_type_ == SNAPSHOT_DELTA && header.epoch_ != checkpoint_epoch_ + 1) {
+    LOG(ERROR) << "delta snapshot " << path << " of epoch " << header.epoch_
+               << " does not follow epoch " << checkpoint_epoch_;
+    return ps::message::SNAPSHOT_CHAIN_ERROR;
+  }
+  for (size_t i = 0; i < shard_size; ++i) {
+    shard_[i].reset_checkpoint();
+  }
 
-  ps::toolkit::ThreadGroup thread_pool(shard_.size());
-  thread_pool.run([this, mpi_rank, shard_size, path](int i) {
-      string part_file = path + absl::StrFormat("/part-%05d", mpi_rank * shard_size + i);
-      this->shard_[i].save(part_file);
+  // a snapshot written by the same topology is read back part by part, otherwise every
+  // server scans the parts of the old servers sharing an arc of the ring with it, and
+  // keeps the features routed to itself.
+  PartitionRing old_ring(header.server_num_, header.vnode_num_);
+  bool same_topology = (old_ring == ring_ && header.shard_num_ == shard_size);
+  files.clear();
+  for (size_t server_id : ring_.source_servers(old_ring, mpi_rank)) {
+    for (size_t i = 0; i < header.shard_num_; ++i) {
+      files.push_back(snapshot_part_file(path, server_id * header.shard_num_ + i));
+    }
+  }
+
+  vector<int> tmp_ret(files.size(), ps::message::SUCCESS);
+  ps::toolkit::TaskPool thread_pool(std::min(files.size(), shard_size) - 1);
+  thread_pool.run(files.size(), [this, &files, &tmp_ret, same_topology, mpi_rank, shard_size](int i) {
+    SnapshotReader reader(FSAgent::fs_open_read(files[i], ""));
+    SnapshotHeader part_header;
+    int part_ret = reader.read_header(&part_header);
+    if (ps::message::SUCCESS == part_ret && part_header.table_type_ != SNAPSHOT_SPARSE_EMBEDDING_VER1) {
+      part_ret = ps::message::SNAPSHOT_FORMAT_ERROR;
+    }
+    if (ps::message::SUCCESS == part_ret) {
+      for (size_t b = 0; b < shard_size; ++b) {
+        this->shard_[b].catch_up_decay(part_header.decay_epoch_);
+      }
+    }
+
+    vector<vector<SparseKeyVer1> > tmp_key(shard_size);
+    vector<vector<SparseEmbeddingVer1> > tmp_value(shard_size);
+    vector<vector<SparseKeyVer1> > tmp_removed(shard_size);
+    uint64_t record_num = 0;
+    while (ps::message::SUCCESS == part_ret) {
+      part_ret = reader.next_block(&record_num);
+      if (ps::message::SUCCESS != part_ret || 0 == record_num) {
+        break;
+      }
+      BinaryArchive& ar = reader.archive();
+      for (uint64_t r = 0; r < record_num; ++r) {
+        uint8_t type = ar.get<uint8_t>();
+        SparseKeyVer1 key = ar.get<SparseKeyVer1>();
+        SparseEmbeddingVer1 value;
+        if (type == SNAPSHOT_RECORD_VALUE) {
+          snapshot_read_value(ar, part_header.version_, &value);
+        }
+        if (!same_topology && ring_.server_id(key) != mpi_rank) {
+          continue;
+        }
+        size_t bin = sparse_feature_shard_id(key, shard_size);
+        if (type == SNAPSHOT_RECORD_TOMBSTONE) {
+          tmp_removed[bin].push_back(key);
+        } else {
+          tmp_key[bin].push_back(key);
+          tmp_value[bin].push_back(std::move(value));
+        }
+      }
+      // tombstones precede the values in a delta, so a removed and re-created key ends up present.
+      for (size_t b = 0; b < shard_size; ++b) {
+        if (!tmp_removed[b].empty()) {
+          this->shard_[b].erase(tmp_removed[b]);
+          tmp_removed[b].clear();
+        }
+        if (!tmp_key[b].empty()) {
+          this->shard_[b].insert(tmp_key[b], &tmp_value[b], part_header.decay_epoch_);
+          tmp_key[b].clear();
+          tmp_value[b].clear();
+        }
+      }
+    }
+    if (ps::message::SUCCESS != part_ret) {
+      LOG(ERROR) << "load snapshot " << files[i] << " failed: " << ps::message::errno_to_string(part_ret);
+    }
+    tmp_ret[i] = part_ret;
   });
-  // for (size_t i = 0; i < shard_.size(); ++i) {
-  //   string part_file = path + absl::StrFormat("/part-%05d", MPIAgent::mpi_rank_group() * shard_.size() + i);
-  //   shard_[i].save(part_file);
-  // }
+
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (ps::message::SUCCESS != tmp_ret[i]) {
+      ret = tmp_ret[i];
+      break;
+    }
+  }
+  if (ps::message::SUCCESS == ret) {
+    checkpoint_epoch_ = header.epoch_;
+  }
 
   return ret;
 }
@@ -272,8 +1000,7 @@ int SparseEmbeddingVer1Table::assign(const vector<SparseFeatureVer1>& key, const
   vector<vector<SparseEmbeddingVer1> >   tmp_value(bin_num);
 
   for (size_t i = 0; i < key.size(); ++i) {
-    // size_t bin = absl::Hash<SparseKeyVer1>()(key[i].sign_) % bin_num;
-    size_t bin = key[i].sign_ % bin_num;
+    size_t bin = sparse_feature_shard_id(key[i].sign_, bin_num);
     tmp_key[bin].push_back(key[i]);
     tmp_value[bin].push_back(value[i]);
   }
@@ -288,17 +1015,16 @@ int SparseEmbeddingVer1Table::assign(const vector<SparseFeatureVer1>& key, const
   return ret;
 }
 
-int SparseEmbeddingVer1Table::push(const vector<SparseFeatureVer1>& key, const vector<SparseEmbeddingVer1>& value) {
+int SparseEmbeddingVer1Table::push(const vector<SparseFeatureVer1>& key, const vector<SparseEmbeddingVer1Push>& value) {
   int ret = ps::message::SUCCESS;
 
   CHECK(key.size() == value.size());
   size_t bin_num = shard_.size();
   vector<vector<SparseFeatureVer1> > tmp_key(bin_num);
-  vector<vector<SparseEmbeddingVer1> > tmp_value(bin_num);
+  vector<vector<SparseEmbeddingVer1Push> > tmp_value(bin_num);
 
   for (size_t i = 0; i < key.size(); ++i) {
-    // size_t bin = absl::Hash<SparseKeyVer1>()(key[i].sign_) % bin_num;
-    size_t bin = key[i].sign_ % bin_num;
+    size_t bin = sparse_feature_shard_id(key[i].sign_, bin_num);
     tmp_key[bin].push_back(key[i]);
     tmp_value[bin].push_back(value[i]);
   }
@@ -313,7 +1039,7 @@ int SparseEmbeddingVer1Table::push(const vector<SparseFeatureVer1>& key, const v
   return ret;
 }
 
-int SparseEmbeddingVer1Table::pull(const vector<SparseFeatureVer1>& key, vector<SparseEmbeddingVer1> *value, const bool is_training) {
+int SparseEmbeddingVer1Table::pull(const vector<SparseFeatureVer1>& key, vector<SparseEmbeddingVer1Pull> *value, const bool is_training) {
   int ret = ps::message::SUCCESS;
 
   value->resize(key.size());
@@ -322,14 +1048,13 @@ int SparseEmbeddingVer1Table::pull(const vector<SparseFeatureVer1>& key, vector<
   vector<vector<size_t> > tmp_index(bin_num);
 
   for (size_t i = 0; i < key.size(); ++i) {
-    // size_t bin = absl::Hash<SparseKeyVer1>()(key[i].sign_) % bin_num;
-    size_t bin = key[i].sign_ % bin_num;
+    size_t bin = sparse_feature_shard_id(key[i].sign_, bin_num);
     tmp_key[bin].push_back(key[i]);
     tmp_index[bin].push_back(i);
   }
 
   for (size_t i = 0; i < bin_num; ++i) {
-    vector<SparseEmbeddingVer1> tmp_value;
+    vector<SparseEmbeddingVer1Pull> tmp_value;
     ret = shard_[i].pull(tmp_key[i], &(tmp_value), is_training);
     if (ps::message::SUCCESS != ret) {
       break;
@@ -373,6 +1098,22 @@ uint64_t SparseEmbeddingVer1Table::feature_num() {
   return feature_num;
 }
 
+size_t SparseEmbeddingVer1Table::memory_usage() {
+  size_t bytes = 0;
+  for (auto iter = shard_.begin(); iter != shard_.end(); ++iter) {
+    bytes += iter->memory_usage();
+  }
+  return bytes;
+}
+
+uint64_t SparseEmbeddingVer1Table::evicted_num() {
+  uint64_t evicted_num = 0;
+  for (auto iter = shard_.begin(); iter != shard_.end(); ++iter) {
+    evicted_num += iter->evicted_num();
+  }
+  return evicted_num;
+}
+
 SparseEmbeddingVer1TableServer::SparseEmbeddingVer1TableServer() :
   tables_() {
 }
@@ -391,7 +1132,10 @@ int SparseEmbeddingVer1TableServer::create(const ParamServerRequest& request, Pa
   if (iter != tables_.end()) {
     ret = ps::message::REGIST_EXISTING_SPARSE_TABLE;
   } else {
-    tables_[table_name] = new SparseEmbeddingVer1Table(table_name);
+    BinaryArchive iar;
+    iar.set_read_buffer(request.message());
+    uint32_t vnode_num = iar.get<uint32_t>();
+    tables_[table_name] = new SparseEmbeddingVer1Table(table_name, PartitionRing(MPIAgent::mpi_size_group(), vnode_num));
     if (NULL == tables_[table_name]) {
       ret = ps::message::CAN_NOT_ALLOCATE_MEMORY;
     }
@@ -407,11 +1151,71 @@ int SparseEmbeddingVer1TableServer::save(const ParamServerRequest& request, Para
   const string& table_name = request.table_name();
   auto iter = tables_.find(table_name);
   if (iter != tables_.end()) {
-    ret = iter->second->save(request.message());
+    uint64_t handle = 0;
+    ret = iter->second->save(request.message(), &handle);
+
+    BinaryArchive oar;
+    oar << handle;
+    string message;
+    oar.release(&message);
+    response->set_message(message);
+  } else {
+    ret = ps::message::PICK_NONEXISTENT_SPARSE_TABLE;
+  }
+  LOG(INFO) << "start save embedding table: " << table_name << ", path = " << request.message() << ", ret = " << ret;
+
+  response->set_return_value(ret);
+  return ret;
+}
+
+int SparseEmbeddingVer1TableServer::save_delta(const ParamServerRequest& request, ParamServerResponse *response) {
+  int ret = ps::message::SUCCESS;
+  const string& table_name = request.table_name();
+  auto iter = tables_.find(table_name);
+  if (iter != tables_.end()) {
+    uint64_t handle = 0;
+    ret = iter->second->save_delta(request.message(), &handle);
+
+    BinaryArchive oar;
+    oar << handle;
+    string message;
+    oar.release(&message);
+    response->set_message(message);
+  } else {
+    ret = ps::message::PICK_NONEXISTENT_SPARSE_TABLE;
+  }
+  LOG(INFO) << "start save delta of embedding table: " << table_name << ", path = " << request.message() << ", ret = " << ret;
+
+  response->set_return_value(ret);
+  return ret;
+}
+
+int SparseEmbeddingVer1TableServer::save_status(const ParamServerRequest& request, ParamServerResponse *response) {
+  int ret = ps::message::SUCCESS;
+  const string& table_name = request.table_name();
+  auto iter = tables_.find(table_name);
+  if (iter != tables_.end()) {
+    BinaryArchive iar;
+    iar.set_read_buffer(request.message());
+    ret = iter->second->save_status(iar.get<uint64_t>());
+  } else {
+    ret = ps::message::PICK_NONEXISTENT_SPARSE_TABLE;
+  }
+
+  response->set_return_value(ret);
+  return ret;
+}
+
+int SparseEmbeddingVer1TableServer::load(const ParamServerRequest& request, ParamServerResponse *response) {
+  int ret = ps::message::SUCCESS;
+  const string& table_name = request.table_name();
+  auto iter = tables_.find(table_name);
+  if (iter != tables_.end()) {
+    ret = iter->second->load(request.message());
   } else {
     ret = ps::message::PICK_NONEXISTENT_SPARSE_TABLE;
   }
-  LOG(INFO) << "save embedding table: " << table_name << ", path = " << request.message() << ", ret = " << ret;
+  LOG(INFO) << "load embedding table: " << table_name << ", path = " << request.message() << ", ret = " << ret;
 
   response->set_return_value(ret);
   return ret;
@@ -440,18 +1244,16 @@ int SparseEmbeddingVer1TableServer::assign(const ParamServerRequest& request, Pa
   return ret;
 }
 
-int SparseEmbeddingVer1TableServer::push(const ParamServerRequest& request, ParamServerResponse *response) {
+int SparseEmbeddingVer1TableServer::push(const ParamServerRequest& request, ParamServerResponse *response, brpc::Controller *cntl) {
   int ret = ps::message::SUCCESS;
   const string& table_name = request.table_name();
   auto iter = tables_.find(table_name);
   if (iter != tables_.end()) {
-    string message = request.message();
-    BinaryArchive ar;
-    ar.set_read_buffer(message);
+    PayloadReader ar(cntl->request_attachment());
 
     vector<SparseFeatureVer1> push_key;
     ar >> push_key;
-    vector<SparseEmbeddingVer1> push_value;
+    vector<SparseEmbeddingVer1Push> push_value;
     ar >> push_value;
 
     ret = iter->second->push(push_key, push_value);
@@ -463,31 +1265,25 @@ int SparseEmbeddingVer1TableServer::push(const ParamServerRequest& request, Para
   return ret;
 }
 
-int SparseEmbeddingVer1TableServer::pull(const ParamServerRequest& request, ParamServerResponse *response) {
+int SparseEmbeddingVer1TableServer::pull(const ParamServerRequest& request, ParamServerResponse *response, brpc::Controller *cntl) {
   int ret = ps::message::SUCCESS;
   const string& table_name = request.table_name();
   auto iter = tables_.find(table_name);
   if (iter != tables_.end()) {
-    string message = request.message();
-    BinaryArchive ar;
-    ar.set_read_buffer(message);
+    PayloadReader ar(cntl->request_attachment());
 
     vector<SparseFeatureVer1> pull_key;
     ar >> pull_key;
 
     bool is_training = request.is_training();
 
-    vector<SparseEmbeddingVer1> pull_value;
+    vector<SparseEmbeddingVer1Pull> pull_value;
     ret = iter->second->pull(pull_key, &pull_value, is_training);
     if (ret == ps::message::SUCCESS) {
       CHECK(pull_key.size() == pull_value.size());
-      BinaryArchive oar;
+      PayloadWriter oar;
       oar << pull_value;
-
-      string message;
-      oar.release(&message);
-
-      response->set_message(message);
+      oar.finish(&(cntl->response_attachment()));
     }
   } else {
     ret = ps::message::PICK_NONEXISTENT_SPARSE_TABLE;
@@ -560,6 +1356,10 @@ int SparseEmbeddingVer1TableClient::create(const string& name) {
   int ret = 0;
   name_ = name;
 
+  uint32_t vnode_num = (uint32_t)ConfigManager::pick_ring_vnode_num();
+  MPIAgent::mpi_bcast_group(&vnode_num, 1, 0);
+  ring_ = PartitionRing(MPIAgent::mpi_size_group(), vnode_num);
+
   DLOG(INFO) << "create embedding table: " << name_;
   if (MPIAgent::mpi_rank_group() == 0) {
     ParamServerRequest request;
@@ -567,6 +1367,12 @@ int SparseEmbeddingVer1TableClient::create(const string& name) {
     request.set_message_type(ps::message::EMBEDDING_TABLE_VER1_CREATE);
     request.set_table_name(name_);
 
+    BinaryArchive ar;
+    ar << vnode_num;
+    string message;
+    ar.release(&message);
+    request.set_message(message);
+
     ret = RPCAgent::send_to_all(request, &response);
     if (0 != ret) {
       LOG(FATAL) << "rpc call EMBEDDING_TABLE_VER1_CREATE, ret = " << ret;
@@ -586,7 +1392,134 @@ int SparseEmbeddingVer1TableClient::create(const string& name) {
   return ret;
 }
 
-static void handle_async_save_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id, atomic<int> *count) {
+// save_wait polls the servers, first after kSaveFirstPollUs and then backing off
+// up to every kSaveMaxPollUs.
+static const int64_t kSaveFirstPollUs = 10000;
+static const int64_t kSaveMaxPollUs = 1000000;
+
+static int start_save(const string& name, const ps::message::MessageType message_type,
+                      const string& path, SnapshotHandle *handle) {
+  int ret = 0;
+
+  handle->id_.clear();
+  if (MPIAgent::mpi_rank_group() == 0) {
+    ParamServerRequest request;
+    vector<ParamServerResponse> response;
+    request.set_message_type(message_type);
+    request.set_table_name(name);
+    request.set_message(path);
+
+    ret = RPCAgent::send_to_all(request, &response);
+    if (0 != ret) {
+      LOG(FATAL) << "rpc call EMBEDDING_TABLE_VER1_SAVE, ret = " << ret;
+    } else {
+      for (size_t i = 0; i < response.size(); ++i) {
+        ret = response[i].return_value();
+        if (ps::message::SUCCESS != ret) {
+          LOG(FATAL) << "ErrNo = " << ps::message::errno_to_string(ret)
+                     << ", message_type = " << request.message_type()
+                     << ", table_name = " << request.table_name();
+          continue;
+        }
+
+        BinaryArchive oar;
+        oar.set_read_buffer(response[i].message());
+        handle->id_.push_back(oar.get<uint64_t>());
+      }
+    }
+  }
+  // every worker gets the handle, so any of them can wait for the save.
+  MPIAgent::mpi_bcast_group(&ret, 1, 0);
+  uint64_t id_num = handle->id_.size();
+  MPIAgent::mpi_bcast_group(&id_num, 1, 0);
+  handle->id_.resize(id_num);
+  MPIAgent::mpi_bcast_group(handle->id_.data(), (int)id_num, 0);
+
+  return ret;
+}
+
+// asks every server for the save of handle, the servers answer at once.
+static int query_save(const string& name, const SnapshotHandle& handle) {
+  int ret = ps::message::SUCCESS;
+
+  ParamServerRequest request;
+  request.set_message_type(ps::message::EMBEDDING_TABLE_VER1_SAVE_STATUS);
+  request.set_table_name(name);
+  for (size_t i = 0; i < handle.id_.size(); ++i) {
+    BinaryArchive iar;
+    iar << handle.id_[i];
+    string message;
+    iar.release(&message);
+    request.set_message(message);
+
+    ParamServerResponse response;
+    if (0 != RPCAgent::send_to_one(request, &response, i)) {
+      LOG(FATAL) << "rpc call EMBEDDING_TABLE_VER1_SAVE_STATUS failed";
+    }
+    int tmp_ret = response.return_value();
+    if (ps::message::SNAPSHOT_IN_PROGRESS == tmp_ret) {
+      ret = tmp_ret;
+    } else if (ps::message::SUCCESS != tmp_ret) {
+      return tmp_ret;
+    }
+  }
+
+  return ret;
+}
+
+int SparseEmbeddingVer1TableClient::save(const string& path) const {
+  SnapshotHandle handle;
+
+  LOG(INFO) << "save embedding table: " << name_ << ", path = " << path;
+  int ret = save_async(path, &handle);
+  if (ps::message::SUCCESS == ret) {
+    ret = save_wait(handle);
+  }
+  LOG(INFO) << "finish save embedding table: " << name_ << ", path = " << path << ", ret = " << ret;
+
+  return ret;
+}
+
+int SparseEmbeddingVer1TableClient::save_delta(const string& path) const {
+  SnapshotHandle handle;
+
+  LOG(INFO) << "save delta of embedding table: " << name_ << ", path = " << path;
+  int ret = save_delta_async(path, &handle);
+  if (ps::message::SUCCESS == ret) {
+    ret = save_wait(handle);
+  }
+  LOG(INFO) << "finish save delta of embedding table: " << name_ << ", path = " << path << ", ret = " << ret;
+
+  return ret;
+}
+
+int SparseEmbeddingVer1TableClient::save_async(const string& path, SnapshotHandle *handle) const {
+  return start_save(name_, ps::message::EMBEDDING_TABLE_VER1_SAVE, path, handle);
+}
+
+int SparseEmbeddingVer1TableClient::save_delta_async(const string& path, SnapshotHandle *handle) const {
+  return start_save(name_, ps::message::EMBEDDING_TABLE_VER1_SAVE_DELTA, path, handle);
+}
+
+int SparseEmbeddingVer1TableClient::save_status(const SnapshotHandle& handle) const {
+  return query_save(name_, handle);
+}
+
+int SparseEmbeddingVer1TableClient::save_wait(const SnapshotHandle& handle) const {
+  int ret = ps::message::SUCCESS;
+  // rank 0 waits on the servers, the other workers on rank 0.
+  if (MPIAgent::mpi_rank_group() == 0) {
+    int64_t poll_us = kSaveFirstPollUs;
+    while (ps::message::SNAPSHOT_IN_PROGRESS == (ret = query_save(name_, handle))) {
+      bthread_usleep(poll_us);
+      poll_us = std::min(poll_us * 2, kSaveMaxPollUs);
+    }
+  }
+  MPIAgent::mpi_bcast_group(&ret, 1, 0);
+  return ret;
+}
+
+static void handle_async_load_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id, bthread::CountdownEvent *count) {
   // std::unique_ptr makes sure response will be deleted before returning.
   unique_ptr<brpc::Controller> cntl_guard(cntl);
   unique_ptr<ParamServerResponse> response_guard(response);
@@ -604,45 +1537,53 @@ static void handle_async_save_response(brpc::Controller *cntl, ParamServerRespon
     }
   }
   if (NULL != count) {
-    --(*count);
+    count->signal();
   }
 
   return;
 }
 
-int SparseEmbeddingVer1TableClient::save(const string& path) const {
+int SparseEmbeddingVer1TableClient::load(const string& path) const {
   int ret = 0;
 
-  LOG(INFO) << "save embedding table: " << name_ << ", path = " << path;
+  LOG(INFO) << "load embedding table: " << name_ << ", path = " << path;
   if (MPIAgent::mpi_rank_group() == 0) {
     size_t mpi_size = MPIAgent::mpi_size_group();
-    atomic<int> count(mpi_size);
+    bthread::CountdownEvent count(mpi_size);
 
     ParamServerRequest request;
-    request.set_message_type(ps::message::EMBEDDING_TABLE_VER1_SAVE);
+    request.set_message_type(ps::message::EMBEDDING_TABLE_VER1_LOAD);
     request.set_table_name(name_);
     request.set_message(path);
 
     for (size_t i = 0; i < mpi_size; ++i) {
       ParamServerResponse *response = new ParamServerResponse();
       brpc::Controller *cntl = new brpc::Controller();
-      google::protobuf::Closure *done = brpc::NewCallback(&handle_async_save_response, cntl, response, i, &count);
+      google::protobuf::Closure *done = brpc::NewCallback(&handle_async_load_response, cntl, response, i, &count);
 
       ret = RPCAgent::send_to_one_async(request, response, i, cntl, done);
       if (0 != ret) {
-        LOG(FATAL) << "rpc call EMBEDDING_TABLE_VER1_SAVE, ret = " << ret;
+        LOG(FATAL) << "rpc call EMBEDDING_TABLE_VER1_LOAD, ret = " << ret;
         continue;
       }
     }
 
-    while (count > 0) {
-      usleep(5000);
-    }
+    count.wait();
   }
-  LOG(INFO) << "finish save embedding table: " << name_ << ", path = " << path;
+  LOG(INFO) << "finish load embedding table: " << name_ << ", path = " << path;
+
+  return ret;
+}
+
+int SparseEmbeddingVer1TableClient::compact(const vector<string>& chain, const string& out) const {
+  LOG(INFO) << "compact embedding table: " << name_ << ", " << chain.size() << " snapshots into " << out;
+  int ret = snapshot_compact<SparseEmbeddingVer1>(chain, out, SNAPSHOT_SPARSE_EMBEDDING_VER1,
+                                                  MPIAgent::mpi_rank_group(), MPIAgent::mpi_size_group());
+  LOG(INFO) << "finish compact embedding table: " << name_ << ", ret = " << ret;
 
   return ret;
 }
+
 static void handle_async_assign_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id) {
   // std::unique_ptr makes sure cntl/response will be deleted before returning.
   unique_ptr<brpc::Controller> cntl_guard(cntl);
@@ -677,8 +1618,7 @@ int SparseEmbeddingVer1TableClient::assign(const vector<SparseFeatureVer1>& key,
   tmp_value.resize(mpi_size);
 
   for (size_t i = 0; i < key.size(); ++i) {
-    // size_t partition_id = absl::Hash<SparseKeyVer1>()(key[i].sign_) % mpi_size;
-    size_t partition_id = key[i].sign_ % mpi_size;
+    size_t partition_id = ring_.server_id(key[i].sign_);
     tmp_key[partition_id].push_back(key[i]);
     tmp_value[partition_id].push_back(value[i]);
   }
@@ -710,6 +1650,22 @@ int SparseEmbeddingVer1TableClient::assign(const vector<SparseFeatureVer1>& key,
   return ret;
 }
 
+// uniq_key gets the distinct keys of key in first-seen order, uniq_index maps key[i] to its position there.
+static void dedup_keys(const vector<SparseFeatureVer1>& key, vector<SparseFeatureVer1> *uniq_key, vector<uint32_t> *uniq_index) {
+  absl::flat_hash_map<SparseKeyVer1, uint32_t> position;
+  position.reserve(key.size());
+  uniq_key->clear();
+  uniq_key->reserve(key.size());
+  uniq_index->resize(key.size());
+  for (size_t i = 0; i < key.size(); ++i) {
+    auto res = position.emplace(key[i].sign_, (uint32_t)uniq_key->size());
+    if (res.second) {
+      uniq_key->push_back(key[i]);
+    }
+    (*uniq_index)[i] = res.first->second;
+  }
+}
+
 static void handle_async_push_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id) {
   // std::unique_ptr makes sure cntl/response will be deleted before returning.
   unique_ptr<brpc::Controller> cntl_guard(cntl);
@@ -731,23 +1687,40 @@ static void handle_async_push_response(brpc::Controller *cntl, ParamServerRespon
   return;
 }
 
-int SparseEmbeddingVer1TableClient::push(const vector<SparseFeatureVer1>& key, const vector<SparseEmbeddingVer1>& value) const {
+int SparseEmbeddingVer1TableClient::push(const vector<SparseFeatureVer1>& key, const vector<SparseEmbeddingVer1Push>& value) const {
   int ret = 0;
 
   CHECK(key.size() == value.size());
   size_t mpi_size = MPIAgent::mpi_size_group();
 
   DLOG(INFO) << "push embedding table: " << name_;
-  vector<vector<SparseFeatureVer1> > tmp_key;
-  vector<vector<SparseEmbeddingVer1> > tmp_value;
-  tmp_key.resize(mpi_size);
-  tmp_value.resize(mpi_size);
-
+  // gradients of a key repeated in the batch are merged before they are sent.
+  vector<SparseFeatureVer1> uniq_key;
+  vector<uint32_t> uniq_index;
+  dedup_keys(key, &uniq_key, &uniq_index);
+  vector<SparseEmbeddingVer1Push> uniq_value(uniq_key.size());
+  vector<bool> is_set(uniq_key.size(), false);
   for (size_t i = 0; i < key.size(); ++i) {
-    // size_t partition_id = absl::Hash<SparseKeyVer1>()(key[i].sign_) % mpi_size;
-    size_t partition_id = key[i].sign_ % mpi_size;
-    tmp_key[partition_id].push_back(key[i]);
-    tmp_value[partition_id].push_back(value[i]);
+    uint32_t u = uniq_index[i];
+    if (!is_set[u]) {
+      uniq_value[u] = value[i];
+      is_set[u] = true;
+    } else {
+      ret = sparse_embedding_ver1_merge(&(uniq_value[u]), value[i], ConfigManager::pick_training_rule());
+    }
+  }
+
+  vector<vector<SparseFeatureVer1> > tmp_key(mpi_size);
+  vector<vector<SparseEmbeddingVer1Push> > tmp_value(mpi_size);
+  for (size_t i = 0; i < mpi_size; ++i) {
+    tmp_key[i].reserve(uniq_key.size() / mpi_size + 1);
+    tmp_value[i].reserve(uniq_key.size() / mpi_size + 1);
+  }
+
+  for (size_t i = 0; i < uniq_key.size(); ++i) {
+    size_t partition_id = ring_.server_id(uniq_key[i].sign_);
+    tmp_key[partition_id].push_back(uniq_key[i]);
+    tmp_value[partition_id].push_back(std::move(uniq_value[i]));
   }
 
   for (size_t i = 0; i < mpi_size; ++i) {
@@ -756,14 +1729,11 @@ int SparseEmbeddingVer1TableClient::push(const vector<SparseFeatureVer1>& key, c
     request.set_message_type(ps::message::EMBEDDING_TABLE_VER1_PUSH);
     request.set_table_name(name_);
 
-    BinaryArchive ar;
+    brpc::Controller *cntl = new brpc::Controller();
+    PayloadWriter ar;
     ar << tmp_key[i] << tmp_value[i];
+    ar.finish(&(cntl->request_attachment()));
 
-    string message;
-    ar.release(&message);
-    request.set_message(message);
-
-    brpc::Controller *cntl = new brpc::Controller();
     google::protobuf::Closure *done = brpc::NewCallback(&handle_async_push_response, cntl, response, i);
 
     ret = RPCAgent::send_to_one_async(request, response, i, cntl, done);
@@ -777,7 +1747,7 @@ int SparseEmbeddingVer1TableClient::push(const vector<SparseFeatureVer1>& key, c
 }
 
 void handle_async_pull_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id,
-    vector<vector<uint32_t> > *tmp_mapping, vector<SparseEmbeddingVer1> *value, atomic<int> *count) {
+    vector<vector<uint32_t> > *tmp_mapping, vector<SparseEmbeddingVer1Pull> *value, bthread::CountdownEvent *count) {
   // std::unique_ptr makes sure response will be deleted before returning.
   unique_ptr<brpc::Controller> cntl_guard(cntl);
   unique_ptr<ParamServerResponse> response_guard(response);
@@ -793,61 +1763,63 @@ void handle_async_pull_response(brpc::Controller *cntl, ParamServerResponse *res
                  << ": " << response->message() << " (attached = " << cntl->response_attachment() << ")"
                  << ", latency = " << cntl->latency_us() << "us";
 
-      vector<SparseEmbeddingVer1> tmp_value;
-      BinaryArchive oar;
-      oar.set_read_buffer(response->message());
-      oar >> tmp_value;
-
-      CHECK(tmp_value.size() == (*tmp_mapping)[server_id].size());
-      for (size_t i = 0; i < tmp_value.size(); ++i) {
-        (*value)[(*tmp_mapping)[server_id][i]] = tmp_value[i];
+      // values are read straight into their place in the caller's vector.
+      PayloadReader oar(cntl->response_attachment());
+      const vector<uint32_t>& mapping = (*tmp_mapping)[server_id];
+      CHECK(oar.get<size_t>() == mapping.size());
+      for (size_t i = 0; i < mapping.size(); ++i) {
+        oar >> (*value)[mapping[i]];
       }
     }
   }
   if (NULL != count) {
-    --(*count);
+    count->signal();
   }
 
   return;
 }
 
-int SparseEmbeddingVer1TableClient::pull(const vector<SparseFeatureVer1>&key, vector<SparseEmbeddingVer1> *value, const bool is_training) const {
+int SparseEmbeddingVer1TableClient::pull(const vector<SparseFeatureVer1>&key, vector<SparseEmbeddingVer1Pull> *value, const bool is_training) const {
   int ret = 0;
 
   value->resize(key.size());
   size_t mpi_size = MPIAgent::mpi_size_group();
-  atomic<int> count(mpi_size);
+  bthread::CountdownEvent count(mpi_size);
 
   DLOG(INFO) << "pull embedding table: " << name_;
-  vector<vector<SparseFeatureVer1> > tmp_key;
-  vector<vector<uint32_t> > tmp_mapping;
-  tmp_key.resize(mpi_size);
-  tmp_mapping.resize(mpi_size);
+  // every distinct key is pulled once and fanned back out by index.
+  vector<SparseFeatureVer1> uniq_key;
+  vector<uint32_t> uniq_index;
+  dedup_keys(key, &uniq_key, &uniq_index);
+  vector<SparseEmbeddingVer1Pull> uniq_value(uniq_key.size());
+
+  vector<vector<SparseFeatureVer1> > tmp_key(mpi_size);
+  vector<vector<uint32_t> > tmp_mapping(mpi_size);
+  for (size_t i = 0; i < mpi_size; ++i) {
+    tmp_key[i].reserve(uniq_key.size() / mpi_size + 1);
+    tmp_mapping[i].reserve(uniq_key.size() / mpi_size + 1);
+  }
 
-  for (size_t i = 0; i < key.size(); ++i) {
-    // size_t partition_id = absl::Hash<SparseKeyVer1>()(key[i].sign_) % mpi_size;
-    size_t partition_id = key[i].sign_ % mpi_size;
-    tmp_key[partition_id].push_back(key[i]);
+  for (size_t i = 0; i < uniq_key.size(); ++i) {
+    size_t partition_id = ring_.server_id(uniq_key[i].sign_);
+    tmp_key[partition_id].push_back(uniq_key[i]);
     tmp_mapping[partition_id].push_back(i);
   }
 
   for (size_t i = 0; i < mpi_size; ++i) {
-    BinaryArchive ar;
-    ar << tmp_key[i];
-
-    string message;
-    ar.release(&message);
-
     ParamServerRequest request;
     ParamServerResponse *response = new ParamServerResponse();
     request.set_message_type(ps::message::EMBEDDING_TABLE_VER1_PULL);
     request.set_table_name(name_);
-    request.set_message(message);
     request.set_is_training(is_training);
 
     brpc::Controller *cntl = new brpc::Controller();
+    PayloadWriter ar;
+    ar << tmp_key[i];
+    ar.finish(&(cntl->request_attachment()));
+
     google::protobuf::Closure *done = brpc::NewCallback(&handle_async_pull_response, cntl, response, i,
-      &tmp_mapping, value, &count);
+      &tmp_mapping, &uniq_value, &count);
 
     ret = RPCAgent::send_to_one_async(request, response, i, cntl,  done);
     if (0 != ret) {
@@ -856,14 +1828,16 @@ int SparseEmbeddingVer1TableClient::pull(const vector<SparseFeatureVer1>&key, ve
     }
   }
 
-  while (count > 0) {
-    usleep(5000);
+  count.wait();
+
+  for (size_t i = 0; i < key.size(); ++i) {
+    (*value)[i] = uniq_value[uniq_index[i]];
   }
 
   return ret;
 }
 
-static void handle_async_time_decay_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id, atomic<int> *count) {
+static void handle_async_time_decay_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id, bthread::CountdownEvent *count) {
   // std::unique_ptr makes sure response will be deleted before returning.
   unique_ptr<brpc::Controller> cntl_guard(cntl);
   unique_ptr<ParamServerResponse> response_guard(response);
@@ -881,7 +1855,7 @@ static void handle_async_time_decay_response(brpc::Controller *cntl, ParamServer
     }
   }
   if (NULL != count) {
-    --(*count);
+    count->signal();
   }
 
   return;
@@ -893,7 +1867,7 @@ int SparseEmbeddingVer1TableClient::time_decay() const {
   LOG(INFO) << "embedding table time decay: " << name_;
   if (MPIAgent::mpi_rank_group() == 0) {
     size_t mpi_size = MPIAgent::mpi_size_group();
-    atomic<int> count(mpi_size);
+    bthread::CountdownEvent count(mpi_size);
 
     ParamServerRequest request;
     request.set_message_type(ps::message::EMBEDDING_TABLE_VER1_TIME_DECAY);
@@ -911,16 +1885,14 @@ int SparseEmbeddingVer1TableClient::time_decay() const {
       }
     }
 
-    while (count > 0) {
-      usleep(5000);
-    }
+    count.wait();
   }
   LOG(INFO) << "finish embedding table time decay: " << name_;
 
   return ret;
 }
 
-static void handle_async_shrink_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id, atomic<int> *count) {
+static void handle_async_shrink_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id, bthread::CountdownEvent *count) {
   // std::unique_ptr makes sure response will be deleted before returning.
   unique_ptr<brpc::Controller> cntl_guard(cntl);
   unique_ptr<ParamServerResponse> response_guard(response);
@@ -938,7 +1910,7 @@ static void handle_async_shrink_response(brpc::Controller *cntl, ParamServerResp
     }
   }
   if (NULL != count) {
-    --(*count);
+    count->signal();
   }
 
   return;
@@ -950,7 +1922,7 @@ int SparseEmbeddingVer1TableClient::shrink() const {
   LOG(INFO) << "shrink embedding table: " << name_;
   if (MPIAgent::mpi_rank_group() == 0) {
     size_t mpi_size = MPIAgent::mpi_size_group();
-    atomic<int> count(mpi_size);
+    bthread::CountdownEvent count(mpi_size);
 
     ParamServerRequest request;
     request.set_message_type(ps::message::EMBEDDING_TABLE_VER1_SHRINK);
@@ -968,9 +1940,7 @@ int SparseEmbeddingVer1TableClient::shrink() const {
       }
     }
 
-    while (count > 0) {
-      usleep(5000);
-    }
+    count.wait();
   }
   LOG(INFO) << "finish shrink embedding table: " << name_;
 
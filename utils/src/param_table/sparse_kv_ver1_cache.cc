@@ -0,0 +1,350 @@
+#include "param_table/sparse_kv_ver1_cache.h"
+
+#include <algorithm>
+#include <butil/logging.h>
+#include "absl/hash/hash.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "message/types.h"
+
+using std::vector;
+using ps::runtime::ConfigManager;
+using ps::runtime::SparseCacheRule;
+
+namespace ps {
+namespace param_table {
+
+static const size_t kCacheStripeNum = 16;
+// sweep period when only max_stale_batches bounds the staleness.
+static const int64_t kCacheSweepIntervalMs = 1000;
+
+static double cache_hit_rate(void *arg) {
+  return static_cast<const SparseKVVer1Cache *>(arg)->hit_rate();
+}
+
+SparseKVVer1Cache::SparseKVVer1Cache() :
+  client_(NULL),
+  stripe_(kCacheStripeNum),
+  stripe_capacity_(0),
+  batch_(0),
+  stop_(false) {
+}
+
+SparseKVVer1Cache::~SparseKVVer1Cache() {
+  if (sweep_thread_.joinable()) {
+    {
+      absl::MutexLock lock(&sweep_mutex_);
+      stop_ = true;
+    }
+    sweep_thread_.join();
+  }
+}
+
+void SparseKVVer1Cache::initialize(const SparseKVVer1TableClient *client, const SparseCacheRule& rule) {
+  client_ = client;
+  rule_ = rule;
+  if (!enabled()) {
+    return;
+  }
+  const std::string& name = client_->name();
+  lookup_num_.expose(name + "_cache_lookups");
+  hit_num_.expose(name + "_cache_hits");
+  staleness_ms_.expose(name + "_cache_staleness_ms");
+  hit_rate_var_.reset(new bvar::PassiveStatus<double>(name + "_cache_hit_rate", cache_hit_rate, this));
+
+  stripe_capacity_ = (rule_.capacity_ + stripe_.size() - 1) / stripe_.size();
+  sweep_thread_ = std::thread(&SparseKVVer1Cache::sweep_loop, this);
+}
+
+bool SparseKVVer1Cache::enabled() const {
+  return client_ != NULL && rule_.capacity_ > 0;
+}
+
+size_t SparseKVVer1Cache::locate(const SparseKeyVer1& key) const {
+  return absl::Hash<SparseKeyVer1>()(key) % stripe_.size();
+}
+
+bool SparseKVVer1Cache::is_fresh(const SparseKVVer1CacheEntry& entry, const uint64_t batch, const int64_t now_ms) const {
+  if (rule_.max_stale_batches_ > 0 && batch - entry.batch_ >= (uint64_t)rule_.max_stale_batches_) {
+    return false;
+  }
+  if (rule_.max_stale_ms_ > 0 && now_ms - entry.time_ms_ >= rule_.max_stale_ms_) {
+    return false;
+  }
+  return true;
+}
+
+int SparseKVVer1Cache::pull(const vector<SparseFeatureVer1>& key, vector<SparseValueVer1Pull> *value, const bool is_training) {
+  int ret = ps::message::SUCCESS;
+
+  value->resize(key.size());
+  uint64_t batch = ++batch_;
+  int64_t now_ms = absl::ToUnixMillis(absl::Now());
+
+  vector<vector<size_t> > group(stripe_.size());
+  for (size_t i = 0; i < key.size(); ++i) {
+    group[locate(key[i].sign_)].push_back(i);
+  }
+
+  uint64_t hit = 0;
+  vector<SparseFeatureVer1> miss_key;
+  vector<size_t> miss_index;
+  vector<SparseFeatureVer1> flush_key;
+  vector<SparseValueVer1Push> flush_grad;
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    if (group[s].empty()) {
+      continue;
+    }
+    SparseKVVer1CacheStripe& stripe = stripe_[s];
+    absl::MutexLock lock(&stripe.mutex_);
+    for (size_t i : group[s]) {
+      auto iter = stripe.data_.find(key[i].sign_);
+      if (iter != stripe.data_.end()) {
+        SparseKVVer1CacheEntry& entry = iter->second;
+        if (is_fresh(entry, batch, now_ms)) {
+          (*value)[i] = entry.value_;
+          ++entry.hits_;
+          ++hit;
+          staleness_ms_ << (now_ms - entry.time_ms_);
+          continue;
+        }
+        // expired, its gradients go out before it is pulled again.
+        if (entry.has_grad_) {
+          flush_key.push_back(key[i]);
+          flush_grad.push_back(entry.grad_);
+          entry.has_grad_ = false;
+        }
+      }
+      miss_key.push_back(key[i]);
+      miss_index.push_back(i);
+    }
+  }
+  lookup_num_ << key.size();
+  hit_num_ << hit;
+
+  // the gradients must be applied before the keys are pulled again, otherwise the new
+  // entries miss them for another staleness window.
+  if (!flush_key.empty()) {
+    ret = client_->push_wait(flush_key, flush_grad);
+    flush_key.clear();
+    flush_grad.clear();
+  }
+  if (miss_key.empty()) {
+    return ret;
+  }
+
+  vector<SparseValueVer1Pull> miss_value;
+  int pull_ret = client_->pull(miss_key, &miss_value, is_training);
+  CHECK(miss_value.size() == miss_key.size());
+  if (ret == ps::message::SUCCESS) {
+    ret = pull_ret;
+  }
+
+  for (size_t j = 0; j < miss_key.size(); ++j) {
+    SparseKVVer1CacheStripe& stripe = stripe_[locate(miss_key[j].sign_)];
+    absl::MutexLock lock(&stripe.mutex_);
+    auto iter = stripe.data_.find(miss_key[j].sign_);
+    if (iter != stripe.data_.end()) {
+      // gradients pushed meanwhile stay buffered.
+      iter->second.value_ = miss_value[j];
+      iter->second.batch_ = batch;
+      iter->second.time_ms_ = now_ms;
+      iter->second.hits_ = 0;
+    } else if (is_training) {
+      if (stripe.data_.size() >= stripe_capacity_) {
+        evict(&stripe, &flush_key, &flush_grad);
+      }
+      SparseKVVer1CacheEntry& entry = stripe.data_[miss_key[j].sign_];
+      entry.value_ = miss_value[j];
+      entry.has_grad_ = false;
+      entry.batch_ = batch;
+      entry.time_ms_ = now_ms;
+      entry.hits_ = 0;
+      stripe.clock_.push_back(miss_key[j].sign_);
+    }
+    (*value)[miss_index[j]] = std::move(miss_value[j]);
+  }
+
+  if (!flush_key.empty()) {
+    int push_ret = client_->push(flush_key, flush_grad);
+    if (ret == ps::message::SUCCESS) {
+      ret = push_ret;
+    }
+  }
+
+  return ret;
+}
+
+int SparseKVVer1Cache::push(const vector<SparseFeatureVer1>& key, const vector<SparseValueVer1Push>& value) {
+  int ret = ps::message::SUCCESS;
+
+  CHECK(key.size() == value.size());
+
+  vector<vector<size_t> > group(stripe_.size());
+  for (size_t i = 0; i < key.size(); ++i) {
+    group[locate(key[i].sign_)].push_back(i);
+  }
+
+  vector<SparseFeatureVer1> direct_key;
+  vector<SparseValueVer1Push> direct_value;
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    if (group[s].empty()) {
+      continue;
+    }
+    SparseKVVer1CacheStripe& stripe = stripe_[s];
+    absl::MutexLock lock(&stripe.mutex_);
+    for (size_t i : group[s]) {
+      auto iter = stripe.data_.find(key[i].sign_);
+      if (iter == stripe.data_.end()) {
+        direct_key.push_back(key[i]);
+        direct_value.push_back(value[i]);
+      } else if (iter->second.has_grad_) {
+        int merge_ret = sparse_value_ver1_merge(&(iter->second.grad_), value[i], ConfigManager::pick_training_rule());
+        if (ret == ps::message::SUCCESS) {
+          ret = merge_ret;
+        }
+      } else {
+        iter->second.grad_ = value[i];
+        iter->second.has_grad_ = true;
+      }
+    }
+  }
+
+  if (!direct_key.empty()) {
+    int push_ret = client_->push(direct_key, direct_value);
+    if (ret == ps::message::SUCCESS) {
+      ret = push_ret;
+    }
+  }
+
+  return ret;
+}
+
+int SparseKVVer1Cache::flush(const bool drop) {
+  int ret = ps::message::SUCCESS;
+
+  vector<SparseFeatureVer1> flush_key;
+  vector<SparseValueVer1Push> flush_grad;
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    SparseKVVer1CacheStripe& stripe = stripe_[s];
+    absl::MutexLock lock(&stripe.mutex_);
+    for (auto& item : stripe.data_) {
+      if (item.second.has_grad_) {
+        SparseFeatureVer1 fea;
+        fea.sign_ = item.first;
+        fea.slot_ = item.second.grad_.slot_;
+        flush_key.push_back(fea);
+        flush_grad.push_back(item.second.grad_);
+        item.second.has_grad_ = false;
+      }
+    }
+    if (drop) {
+      stripe.data_.clear();
+      stripe.clock_.clear();
+    }
+  }
+
+  if (!flush_key.empty()) {
+    ret = client_->push(flush_key, flush_grad);
+  }
+
+  return ret;
+}
+
+void SparseKVVer1Cache::evict(SparseKVVer1CacheStripe *stripe, vector<SparseFeatureVer1> *flush_key, vector<SparseValueVer1Push> *flush_grad) {
+  while (!stripe->clock_.empty()) {
+    SparseKeyVer1 sign = stripe->clock_.front();
+    stripe->clock_.pop_front();
+    auto iter = stripe->data_.find(sign);
+    CHECK(iter != stripe->data_.end());
+    SparseKVVer1CacheEntry& entry = iter->second;
+    if (entry.hits_ > 0) {
+      entry.hits_ = 0;
+      stripe->clock_.push_back(sign);
+      continue;
+    }
+    if (entry.has_grad_) {
+      SparseFeatureVer1 fea;
+      fea.sign_ = sign;
+      fea.slot_ = entry.grad_.slot_;
+      flush_key->push_back(fea);
+      flush_grad->push_back(entry.grad_);
+    }
+    stripe->data_.erase(iter);
+    return;
+  }
+}
+
+int SparseKVVer1Cache::sweep() {
+  int ret = ps::message::SUCCESS;
+
+  uint64_t batch = batch_;
+  int64_t now_ms = absl::ToUnixMillis(absl::Now());
+  vector<SparseFeatureVer1> flush_key;
+  vector<SparseValueVer1Push> flush_grad;
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    SparseKVVer1CacheStripe& stripe = stripe_[s];
+    absl::MutexLock lock(&stripe.mutex_);
+    size_t n = stripe.clock_.size();
+    for (size_t i = 0; i < n; ++i) {
+      SparseKeyVer1 sign = stripe.clock_.front();
+      stripe.clock_.pop_front();
+      auto iter = stripe.data_.find(sign);
+      CHECK(iter != stripe.data_.end());
+      SparseKVVer1CacheEntry& entry = iter->second;
+      if (is_fresh(entry, batch, now_ms)) {
+        stripe.clock_.push_back(sign);
+        continue;
+      }
+      if (entry.has_grad_) {
+        SparseFeatureVer1 fea;
+        fea.sign_ = sign;
+        fea.slot_ = entry.grad_.slot_;
+        flush_key.push_back(fea);
+        flush_grad.push_back(entry.grad_);
+        entry.has_grad_ = false;
+      }
+      if (entry.hits_ == 0) {
+        stripe.data_.erase(iter);
+        continue;
+      }
+      // hit while fresh, kept for one more sweep in case it is pulled again.
+      entry.hits_ = 0;
+      stripe.clock_.push_back(sign);
+    }
+  }
+
+  if (!flush_key.empty()) {
+    ret = client_->push(flush_key, flush_grad);
+  }
+
+  return ret;
+}
+
+void SparseKVVer1Cache::sweep_loop() {
+  int64_t interval_ms = kCacheSweepIntervalMs;
+  if (rule_.max_stale_ms_ > 0) {
+    interval_ms = std::max<int64_t>(1, rule_.max_stale_ms_ / 2);
+  }
+  sweep_mutex_.Lock();
+  while (!sweep_mutex_.AwaitWithTimeout(absl::Condition(&stop_), absl::Milliseconds(interval_ms))) {
+    sweep_mutex_.Unlock();
+    int ret = sweep();
+    if (ret != ps::message::SUCCESS) {
+      LOG(WARNING) << "fail to send the gradients of expired entries of " << client_->name() << ", ret = " << ret;
+    }
+    sweep_mutex_.Lock();
+  }
+  sweep_mutex_.Unlock();
+}
+
+double SparseKVVer1Cache::hit_rate() const {
+  uint64_t lookup = lookup_num_.get_value();
+  if (lookup == 0) {
+    return 0.0;
+  }
+  return (double)hit_num_.get_value() / lookup;
+}
+
+} // namespace param_table
+} // namespace ps
@@ -3,17 +3,24 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <atomic>
+#include <deque>
 #include <memory>
+#include <thread>
 #include <algorithm>
 #include <butil/logging.h>
+#include <bthread/bthread.h>
+#include <bthread/countdown_event.h>
 #include "absl/hash/hash.h"
+#include "absl/random/random.h"
 #include "absl/strings/str_format.h"
+#include "absl/time/time.h"
 #include "message/types.h"
 #include "toolkit/archive.h"
 #include "toolkit/mpi_agent.h"
 #include "toolkit/rpc_agent.h"
 #include "toolkit/fs_agent.h"
 #include "toolkit/thread_group.h"
+#include "toolkit/task_pool.h"
 
 using std::vector;
 using std::string;
@@ -22,6 +29,8 @@ using std::unique_ptr;
 using std::shared_ptr;
 
 using ps::toolkit::BinaryArchive;
+using ps::toolkit::PayloadReader;
+using ps::toolkit::PayloadWriter;
 using ps::toolkit::MPIAgent;
 using ps::toolkit::RPCAgent;
 using ps::toolkit::FSAgent;
@@ -30,25 +39,159 @@ using ps::runtime::ConfigManager;
 namespace ps {
 namespace param_table {
 
-static BinaryArchive& operator<<(BinaryArchive& ar, const SparseValueVer1& val) {
+// sub-models the slot of a value does not use are left out, the fields byte tells which are there.
+// the g2sums of the fm / mf vectors only go to snapshots, assigns start them from 0.
+static void write_value(BinaryArchive& ar, const SparseValueVer1& val, const bool with_v_g2sum) {
+  uint8_t fields = sparse_value_ver1_schema(val.slot_, ConfigManager::pick_training_rule());
   ar << val.slot_ << val.version_ << val.delta_score_
      << val.silent_days_ << val.show_ << val.clk_
-     << val.lr_w_ << val.lr_g2sum_
-     << val.fm_w_ << val.fm_w_g2sum_ << val.fm_v_
-     << val.mf_w_ << val.mf_w_g2sum_ << val.mf_v_
-     << val.wide_w_ << val.wide_g2sum_;
+     << val.lr_w_ << val.lr_g2sum_ << fields;
+  if (fields & SPARSE_FIELD_FM) {
+    ar << val.fm_w_ << val.fm_w_g2sum_ << val.fm_v_;
+    if (with_v_g2sum) {
+      ar << val.fm_v_g2sum_;
+    }
+  }
+  if (fields & SPARSE_FIELD_MF) {
+    ar << val.mf_w_ << val.mf_w_g2sum_ << val.mf_v_;
+    if (with_v_g2sum) {
+      ar << val.mf_v_g2sum_;
+    }
+  }
+  if (fields & SPARSE_FIELD_WIDE) {
+    ar << val.wide_w_ << val.wide_g2sum_;
+  }
+}
+static void read_value(BinaryArchive& ar, SparseValueVer1 *val, const bool with_v_g2sum) {
+  uint8_t fields = 0;
+  ar >> val->slot_ >> val->version_ >> val->delta_score_
+     >> val->silent_days_ >> val->show_ >> val->clk_
+     >> val->lr_w_ >> val->lr_g2sum_ >> fields;
+  val->fm_v_g2sum_ = 0;
+  val->mf_v_g2sum_ = 0;
+  if (fields & SPARSE_FIELD_FM) {
+    ar >> val->fm_w_ >> val->fm_w_g2sum_ >> val->fm_v_;
+    if (with_v_g2sum) {
+      ar >> val->fm_v_g2sum_;
+    }
+  } else {
+    val->fm_w_ = 0;
+    val->fm_w_g2sum_ = 0;
+    val->fm_v_.clear();
+  }
+  if (fields & SPARSE_FIELD_MF) {
+    ar >> val->mf_w_ >> val->mf_w_g2sum_ >> val->mf_v_;
+    if (with_v_g2sum) {
+      ar >> val->mf_v_g2sum_;
+    }
+  } else {
+    val->mf_w_ = 0;
+    val->mf_w_g2sum_ = 0;
+    val->mf_v_.clear();
+  }
+  if (fields & SPARSE_FIELD_WIDE) {
+    ar >> val->wide_w_ >> val->wide_g2sum_;
+  } else {
+    val->wide_w_ = 0;
+    val->wide_g2sum_ = 0;
+  }
+}
+
+static BinaryArchive& operator<<(BinaryArchive& ar, const SparseValueVer1& val) {
+  write_value(ar, val, false);
   return ar;
 }
 static BinaryArchive& operator>>(BinaryArchive& ar, SparseValueVer1& val) {
-  ar >> val.slot_ >> val.version_ >> val.delta_score_
-     >> val.silent_days_ >> val.show_ >> val.clk_
-     >> val.lr_w_ >> val.lr_g2sum_
-     >> val.fm_w_ >> val.fm_w_g2sum_ >> val.fm_v_
-     >> val.mf_w_ >> val.mf_w_g2sum_ >> val.mf_v_
-     >> val.wide_w_ >> val.wide_g2sum_;
+  read_value(ar, &val, false);
+  return ar;
+}
+
+// pulls and pushes carry no optimizer state, and like values only the sub-models of their slot,
+// pushes only those of them in mask.
+template <class T>
+static void write_model(BinaryArchive& ar, const T& val, const uint8_t mask) {
+  uint8_t fields = sparse_value_ver1_schema(val.slot_, ConfigManager::pick_training_rule()) & mask;
+  ar << val.slot_ << val.version_ << val.show_ << val.clk_ << val.lr_w_ << fields;
+  if (fields & SPARSE_FIELD_FM) {
+    ar << val.fm_w_ << val.fm_v_;
+  }
+  if (fields & SPARSE_FIELD_MF) {
+    ar << val.mf_w_ << val.mf_v_;
+  }
+  if (fields & SPARSE_FIELD_WIDE) {
+    ar << val.wide_w_;
+  }
+}
+template <class T>
+static uint8_t read_model(BinaryArchive& ar, T *val) {
+  uint8_t fields = 0;
+  ar >> val->slot_ >> val->version_ >> val->show_ >> val->clk_ >> val->lr_w_ >> fields;
+  if (fields & SPARSE_FIELD_FM) {
+    ar >> val->fm_w_ >> val->fm_v_;
+  } else {
+    val->fm_w_ = 0;
+    val->fm_v_.clear();
+  }
+  if (fields & SPARSE_FIELD_MF) {
+    ar >> val->mf_w_ >> val->mf_v_;
+  } else {
+    val->mf_w_ = 0;
+    val->mf_v_.clear();
+  }
+  if (fields & SPARSE_FIELD_WIDE) {
+    ar >> val->wide_w_;
+  } else {
+    val->wide_w_ = 0;
+  }
+  return fields;
+}
+
+static BinaryArchive& operator<<(BinaryArchive& ar, const SparseValueVer1Pull& val) {
+  write_model(ar, val, SPARSE_FIELD_ALL);
+  return ar;
+}
+static BinaryArchive& operator>>(BinaryArchive& ar, SparseValueVer1Pull& val) {
+  read_model(ar, &val);
+  return ar;
+}
+
+static BinaryArchive& operator<<(BinaryArchive& ar, const SparseValueVer1Push& val) {
+  write_model(ar, val, val.fields_);
+  return ar;
+}
+static BinaryArchive& operator>>(BinaryArchive& ar, SparseValueVer1Push& val) {
+  val.fields_ = read_model(ar, &val);
   return ar;
 }
 
+// values of snapshots older than SNAPSHOT_VERSION_SPARSE_FIELDS.
+static void read_full_value(BinaryArchive& ar, SparseValueVer1 *val) {
+  ar >> val->slot_ >> val->version_ >> val->delta_score_
+     >> val->silent_days_ >> val->show_ >> val->clk_
+     >> val->lr_w_ >> val->lr_g2sum_
+     >> val->fm_w_ >> val->fm_w_g2sum_ >> val->fm_v_
+     >> val->mf_w_ >> val->mf_w_g2sum_ >> val->mf_v_
+     >> val->wide_w_ >> val->wide_g2sum_;
+  val->fm_v_g2sum_ = 0;
+  val->mf_v_g2sum_ = 0;
+}
+
+// snapshot records keep the whole value, optimizer state included.
+static void snapshot_write_value(BinaryArchive& ar, const SparseValueVer1& val) {
+  write_value(ar, val, true);
+}
+static void snapshot_read_value(BinaryArchive& ar, const uint32_t version, SparseValueVer1 *val) {
+  if (version < SNAPSHOT_VERSION_SPARSE_FIELDS) {
+    read_full_value(ar, val);
+    sparse_value_ver1_apply_schema(val, ConfigManager::pick_training_rule());
+  } else {
+    read_value(ar, val, version >= SNAPSHOT_VERSION_VECTOR_G2SUM);
+  }
+}
+static void snapshot_time_decay(SparseValueVer1 *val, const uint32_t days) {
+  sparse_value_ver1_time_decay(val, days, ConfigManager::pick_training_rule());
+}
+
 static BinaryArchive& operator<<(BinaryArchive& ar, const SparseFeatureVer1& val) {
   ar << val.sign_ << val.slot_;
   return ar;
@@ -73,6 +216,36 @@ static BinaryArchive& operator>>(BinaryArchive& ar, vector<SparseValueVer1>& p)
   return ar;
 }
 
+static BinaryArchive& operator<<(BinaryArchive& ar, const vector<SparseValueVer1Pull>& p) {
+  ar << (size_t)p.size();
+  for (const auto& x : p) {
+    ar << x;
+  }
+  return ar;
+}
+static BinaryArchive& operator>>(BinaryArchive& ar, vector<SparseValueVer1Pull>& p) {
+  p.resize(ar.get<size_t>());
+  for (auto& x : p) {
+    ar >> x;
+  }
+  return ar;
+}
+
+static BinaryArchive& operator<<(BinaryArchive& ar, const vector<SparseValueVer1Push>& p) {
+  ar << (size_t)p.size();
+  for (const auto& x : p) {
+    ar << x;
+  }
+  return ar;
+}
+static BinaryArchive& operator>>(BinaryArchive& ar, vector<SparseValueVer1Push>& p) {
+  p.resize(ar.get<size_t>());
+  for (auto& x : p) {
+    ar >> x;
+  }
+  return ar;
+}
+
 static BinaryArchive& operator<<(BinaryArchive& ar, const vector<SparseFeatureVer1>& p) {
   ar << (size_t)p.size();
   for (const auto& x : p) {
@@ -88,25 +261,432 @@ static BinaryArchive& operator>>(BinaryArchive& ar, vector<SparseFeatureVer1>& p
   return ar;
 }
 
+static int embedding_bits() {
+  const ps::runtime::SparseTrainingRule& rule = ConfigManager::pick_training_rule().sparse_;
+  return rule.use_quantized_embedding_ ? rule.quantized_embedding_bits_ : 32;
+}
+
+SparseKVVer1Stripe::SparseKVVer1Stripe() :
+  index_(),
+  slab_(ConfigManager::pick_training_rule().sparse_.fm_rule_.dim_,
+        ConfigManager::pick_training_rule().sparse_.mf_rule_.dim_,
+        embedding_bits()),
+  rw_mutex_(),
+  cold_index_(),
+  cold_store_(),
+  decay_epoch_(0),
+  sketch_(),
+  checkpoint_epoch_(1),
+  full_dirty_(false),
+  removed_(),
+  wheel_(),
+  expired_(),
+  sweep_row_(0),
+  sweep_cold_offset_(0),
+  memory_budget_(0),
+  evicted_(0) {
+  const string& cold_path = ConfigManager::pick_sparse_tier_rule().cold_path_;
+  if (!cold_path.empty()) {
+    static atomic<uint64_t> cold_store_id(0);
+    string file = cold_path + absl::StrFormat("/sparse-kv-%d-%llu.cold", (int)getpid(),
+                                              (unsigned long long)(cold_store_id++));
+    cold_store_.reset(new SparseValueVer1ColdStore(file, slab_.stride()));
+  }
+  const ps::runtime::SparseAdmissionRule& admission = ConfigManager::pick_sparse_admission_rule();
+  if (admission.show_threshold_ > 0) {
+    size_t width = admission.sketch_width_ / ConfigManager::pick_sparse_map_stripe_num();
+    sketch_.reset(new CountMinSketch(std::max(width, (size_t)1024)));
+  }
+  if (ConfigManager::pick_sparse_shrink_rule().background_) {
+    int silent_days = ConfigManager::pick_training_rule().sparse_.delete_after_silent_days_;
+    wheel_.assign(std::max(silent_days, 0) + 1, UINT32_MAX);
+  }
+  size_t table_bytes = ConfigManager::pick_sparse_memory_rule().table_bytes_;
+  if (table_bytes > 0) {
+    size_t stripe_num = (size_t)ConfigManager::pick_local_shard_num() * ConfigManager::pick_sparse_map_stripe_num();
+    memory_budget_ = std::max(table_bytes / std::max(stripe_num, (size_t)1), (size_t)1);
+  }
+}
+
+SparseKVVer1Stripe::~SparseKVVer1Stripe() {
+}
+
 SparseKVVer1Shard::SparseKVVer1Shard() :
-  data_(),
-  rw_mutex_() {
+  stripe_(ConfigManager::pick_sparse_map_stripe_num()),
+  sweep_stripe_(0) {
 }
 
 SparseKVVer1Shard::~SparseKVVer1Shard() {
 }
 
-int SparseKVVer1Shard::save(const string& file) {
+// cold tier helpers, callers hold the stripe lock.
+static bool is_cold(const SparseKVVer1Stripe& stripe, const SparseKeyVer1& key) {
+  return stripe.cold_store_ && stripe.cold_index_.find(key) != stripe.cold_index_.end();
+}
+
+static const uint32_t kNoRow    = UINT32_MAX;
+static const uint32_t kUnlinked = UINT32_MAX - 1;
+
+// head of the wheel list holding the rows last written at decay epoch epoch, callers
+// hold the stripe writer lock.
+static uint32_t& wheel_head(SparseKVVer1Stripe& stripe, const uint32_t epoch) {
+  if (stripe.decay_epoch_ - epoch < stripe.wheel_.size()) {
+    return stripe.wheel_[epoch % stripe.wheel_.size()];
+  }
+  for (size_t i = 0; i < stripe.expired_.size(); ++i) {
+    if (stripe.expired_[i].first == epoch) {
+      return stripe.expired_[i].second;
+    }
+  }
+  LOG(FATAL) << "no wheel bucket for decay epoch " << epoch;
+  return stripe.wheel_[0];
+}
+
+static void wheel_unlink(SparseKVVer1Stripe& stripe, const uint32_t row) {
+  SparseValueVer1Row *r = stripe.slab_.row(row);
+  if (r->wheel_prev_ == kUnlinked) {
+    return;
+  }
+  uint32_t prev = r->wheel_prev_;
+  uint32_t next = r->wheel_next_;
+  if (prev != kNoRow) {
+    stripe.slab_.row(prev)->wheel_next_ = next;
+  } else {
+    wheel_head(stripe, r->decay_epoch_) = next;
+  }
+  if (next != kNoRow) {
+    stripe.slab_.row(next)->wheel_prev_ = prev;
+  }
+  r = stripe.slab_.row(row);
+  r->wheel_prev_ = kUnlinked;
+  r->wheel_next_ = kNoRow;
+}
+
+// links the row into the bucket of the current decay epoch.
+static void wheel_link(SparseKVVer1Stripe& stripe, const uint32_t row) {
+  uint32_t& head = stripe.wheel_[stripe.decay_epoch_ % stripe.wheel_.size()];
+  if (head != kNoRow) {
+    stripe.slab_.row(head)->wheel_prev_ = row;
+  }
+  SparseValueVer1Row *r = stripe.slab_.row(row);
+  r->wheel_prev_ = kNoRow;
+  r->wheel_next_ = head;
+  head = row;
+}
+
+// the row only has room for the vectors of the sub-models the slot of value uses.
+static uint32_t alloc_row(SparseKVVer1Stripe& stripe, const SparseKeyVer1& key, const SparseValueVer1& value) {
+  uint32_t row = stripe.slab_.alloc(sparse_value_ver1_schema(value.slot_, ConfigManager::pick_training_rule()));
+  SparseValueVer1Row *r = stripe.slab_.row(row);
+  r->key_ = key;
+  r->wheel_prev_ = kUnlinked;
+  r->wheel_next_ = kNoRow;
+  stripe.index_[key] = row;
+  return row;
+}
+
+// callers remove the row from index_.
+static void free_row(SparseKVVer1Stripe& stripe, const uint32_t row) {
+  wheel_unlink(stripe, row);
+  stripe.slab_.free(row);
+}
+
+// time decay is lazy: a table time decay only bumps decay_epoch_ of the stripes, rows
+// keep the epoch they were last brought up to date at and catch up when they are read.
+static void decode_row(const SparseValueVer1Slab& slab, const char *data, const uint32_t decay_epoch,
+                       SparseValueVer1 *value) {
+  slab.decode(data, value);
+  uint32_t row_epoch = reinterpret_cast<const SparseValueVer1Row *>(data)->decay_epoch_;
+  sparse_value_ver1_time_decay(value, decay_epoch - row_epoch, ConfigManager::pick_training_rule());
+}
+
+static void load_row(const SparseKVVer1Stripe& stripe, const uint32_t row, SparseValueVer1 *value) {
+  decode_row(stripe.slab_, stripe.slab_.data(row), stripe.decay_epoch_, value);
+}
+
+// a pull reads the row in place instead of expanding it, only show and clk decay.
+static void pull_row(const SparseKVVer1Stripe& stripe, const uint32_t row, SparseValueVer1Pull *pull) {
+  const char *data = stripe.slab_.data(row);
+  stripe.slab_.decode_pull(data, pull);
+  uint32_t row_epoch = reinterpret_cast<const SparseValueVer1Row *>(data)->decay_epoch_;
+  float decay = sparse_value_ver1_decay_factor(stripe.decay_epoch_ - row_epoch, ConfigManager::pick_training_rule());
+  pull->show_ *= decay;
+  pull->clk_ *= decay;
+}
+
+// what a feature not created yet pulls, without allocating.
+static void pull_default(const SparseSlotVer1 slot, SparseValueVer1Pull *pull) {
+  static const SparseValueVer1 value = sparse_value_ver1_default();
+  sparse_value_ver1_pull(pull, value);
+  pull->slot_ = slot;
+}
+
+static void store_row(SparseKVVer1Stripe& stripe, const uint32_t row, const SparseValueVer1& value) {
+  stripe.slab_.store(row, value);
+  const SparseValueVer1Row *r = stripe.slab_.row(row);
+  if (!stripe.wheel_.empty() && (r->wheel_prev_ == kUnlinked || r->decay_epoch_ != stripe.decay_epoch_)) {
+    wheel_unlink(stripe, row);
+    stripe.slab_.row(row)->decay_epoch_ = stripe.decay_epoch_;
+    wheel_link(stripe, row);
+  }
+  stripe.slab_.row(row)->decay_epoch_ = stripe.decay_epoch_;
+}
+
+static void read_cold(const SparseKVVer1Stripe& stripe, const SparseKVVer1ColdEntry& entry,
+                      const uint32_t decay_epoch, SparseValueVer1 *value) {
+  thread_local vector<char> buffer;
+  buffer.resize(stripe.slab_.stride());
+  stripe.cold_store_->read(entry.offset_, buffer.data());
+  decode_row(stripe.slab_, buffer.data(), decay_epoch, value);
+}
+
+static void read_cold(const SparseKVVer1Stripe& stripe, const SparseKVVer1ColdEntry& entry, SparseValueVer1 *value) {
+  read_cold(stripe, entry, stripe.decay_epoch_, value);
+}
+
+static uint64_t write_cold(SparseKVVer1Stripe& stripe, const uint32_t row) {
+  thread_local vector<char> buffer;
+  buffer.resize(stripe.slab_.stride());
+  stripe.slab_.copy(row, buffer.data());
+  return stripe.cold_store_->write(buffer.data());
+}
+
+// moves a hot row to the cold tier, the caller drops it from index_.
+static void move_cold(SparseKVVer1Stripe& stripe, const SparseKeyVer1& key, const uint32_t row) {
+  SparseKVVer1ColdEntry entry;
+  entry.offset_ = write_cold(stripe, row);
+  entry.checkpoint_epoch_ = stripe.slab_.row(row)->checkpoint_epoch_;
+  stripe.cold_index_[key] = entry;
+  free_row(stripe, row);
+}
+
+static void mark_dirty(SparseKVVer1Stripe& stripe, const uint32_t row) {
+  stripe.slab_.row(row)->checkpoint_epoch_ = stripe.checkpoint_epoch_;
+}
+
+static void mark_clean(SparseKVVer1Stripe& stripe, const uint32_t row) {
+  stripe.slab_.row(row)->checkpoint_epoch_ = stripe.checkpoint_epoch_ - 1;
+}
+
+static bool is_dirty(const SparseKVVer1Stripe& stripe, const uint32_t row) {
+  return stripe.full_dirty_ || stripe.slab_.row(row)->checkpoint_epoch_ == stripe.checkpoint_epoch_;
+}
+
+static uint32_t promote(SparseKVVer1Stripe& stripe, const SparseKeyVer1& key, SparseValueVer1 *value) {
+  auto iter = stripe.cold_index_.find(key);
+  CHECK(iter != stripe.cold_index_.end());
+  read_cold(stripe, iter->second, value);
+  stripe.cold_store_->free(iter->second.offset_);
+  bool dirty = (iter->second.checkpoint_epoch_ == stripe.checkpoint_epoch_);
+  stripe.cold_index_.erase(iter);
+
+  uint32_t row = alloc_row(stripe, key, *value);
+  store_row(stripe, row, *value);
+  if (dirty) {
+    mark_dirty(stripe, row);
+  } else {
+    mark_clean(stripe, row);
+  }
+  return row;
+}
+
+// counts the shows of a pushed feature that does not exist yet and tells whether to create it.
+static bool admit(SparseKVVer1Stripe& stripe, const SparseKeyVer1& key, const SparseValueVer1Push& push) {
+  thread_local absl::BitGen gen;
+  const ps::runtime::SparseTrainingRule& rule = ConfigManager::pick_training_rule().sparse_;
+
+  float show = std::min(std::max(push.show_, 1.0f), (float)CountMinSketch::kMaxCount);
+  if (stripe.sketch_->add(key, (uint32_t)show) >= (uint32_t)ConfigManager::pick_sparse_admission_rule().show_threshold_) {
+    return true;
+  }
+  return absl::Bernoulli(gen, (double)(push.clk_ > 0 ? rule.create_clk_prob_ : rule.create_nonclk_prob_));
+}
+
+size_t SparseKVVer1Shard::locate(const SparseKeyVer1& key) const {
+  if (stripe_.size() == 1) {
+    return 0;
+  }
+  return absl::Hash<SparseKeyVer1>()(key) % stripe_.size();
+}
+
+typedef std::pair<SparseKeyVer1, uint32_t> IndexSlot;
+typedef std::pair<SparseKeyVer1, SparseKVVer1ColdEntry> ColdIndexSlot;
+
+// bytes of the live hot entries, index slots and rows, what the memory budget caps. slab
+// blocks only grow when no freed row is left, so capping live rows caps them as well.
+static size_t hot_memory_usage(const SparseKVVer1Stripe& stripe) {
+  return stripe.index_.size() * (sizeof(IndexSlot) + 1) + stripe.slab_.live_bytes();
+}
+
+// rows that are rarely clicked and long silent go first, read in place from the row.
+static float eviction_score(const SparseKVVer1Stripe& stripe, const uint32_t row) {
+  const SparseValueVer1Row *r = stripe.slab_.row(row);
+  uint32_t silent_days = r->silent_days_ + (stripe.decay_epoch_ - r->decay_epoch_);
+  return r->delta_score_ / (1.0f + silent_days);
+}
+
+// sampled LFU: once the stripe reaches the high watermark of its budget, evicts the lowest
+// scored of sample_num_ random hot rows until it is below the low watermark. rows in
+// created, those the calling request just created or promoted, are never picked, so the
+// stripe keeps what it is serving. evicted rows move to the cold tier if there is one,
+// otherwise they are dropped as by a shrink. callers hold the writer lock and no row
+// indexes across the call.
+static void enforce_memory_budget(SparseKVVer1Stripe& stripe, vector<uint32_t> *created) {
+  if (stripe.memory_budget_ == 0) {
+    return;
+  }
+  const ps::runtime::SparseMemoryRule& rule = ConfigManager::pick_sparse_memory_rule();
+  if (hot_memory_usage(stripe) < (size_t)(stripe.memory_budget_ * rule.high_watermark_)) {
+    return;
+  }
+
+  thread_local absl::BitGen gen;
+  std::sort(created->begin(), created->end());
+  const size_t low = (size_t)(stripe.memory_budget_ * rule.low_watermark_);
+  const SparseKVVer1Stripe& const_stripe = stripe;
+  while (stripe.index_.size() > created->size() && hot_memory_usage(stripe) > low) {
+    uint32_t victim = UINT32_MAX;
+    float victim_score = 0.0f;
+    // freed and created rows are skipped, a few more draws keep the sample size.
+    for (int draw = 0, sampled = 0; sampled < rule.sample_num_ && draw < 4 * rule.sample_num_; ++draw) {
+      uint32_t row = stripe.slab_.at(absl::Uniform<uint32_t>(gen, 0, stripe.slab_.used()));
+      auto iter = stripe.index_.find(const_stripe.slab_.row(row)->key_);
+      if (iter == stripe.index_.end() || iter->second != row ||
+          std::binary_search(created->begin(), created->end(), row)) {
+        continue;
+      }
+      ++sampled;
+      float score = eviction_score(const_stripe, row);
+      if (victim == UINT32_MAX || score < victim_score) {
+        victim = row;
+        victim_score = score;
+      }
+    }
+    if (victim == UINT32_MAX) {
+      // nothing evictable was drawn, the next request goes on.
+      break;
+    }
+    SparseKeyVer1 key = const_stripe.slab_.row(victim)->key_;
+    if (stripe.cold_store_) {
+      move_cold(stripe, key, victim);
+    } else {
+      stripe.removed_.push_back(key);
+      free_row(stripe, victim);
+    }
+    stripe.index_.erase(key);
+    ++stripe.evicted_;
+  }
+}
+
+static bool is_text_snapshot(const SnapshotHeader& header) {
+  return header.snapshot_type_ == SNAPSHOT_BASE && ConfigManager::pick_text_snapshot();
+}
+
+void SparseKVVer1Shard::lock_shared() {
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    stripe_[s].rw_mutex_.ReaderLock();
+  }
+}
+
+void SparseKVVer1Shard::unlock_shared() {
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    stripe_[s].rw_mutex_.ReaderUnlock();
+  }
+}
+
+void SparseKVVer1Shard::freeze(const SnapshotHeader& header, vector<SparseKVVer1StripeSnapshot> *snapshot) {
+  bool is_delta = (header.snapshot_type_ == SNAPSHOT_DELTA);
+  snapshot->resize(stripe_.size());
+  // readers never touch checkpoint_epoch_, full_dirty_, removed_ or the cold store pin,
+  // so the shared lock is enough to reset them here.
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    SparseKVVer1Stripe& stripe = stripe_[s];
+    SparseKVVer1StripeSnapshot& frozen = (*snapshot)[s];
+    stripe.slab_.snapshot(&(frozen.slab_));
+    frozen.decay_epoch_ = stripe.decay_epoch_;
+    frozen.rows_.reserve(is_delta ? 0 : stripe.index_.size());
+    for (auto iter = stripe.index_.begin(); iter != stripe.index_.end(); ++iter) {
+      if (!is_delta || is_dirty(stripe, iter->second)) {
+        frozen.rows_.push_back(*iter);
+      }
+    }
+    for (auto iter = stripe.cold_index_.begin(); iter != stripe.cold_index_.end(); ++iter) {
+      if (!is_delta || stripe.full_dirty_ || iter->second.checkpoint_epoch_ == stripe.checkpoint_epoch_) {
+        frozen.cold_rows_.push_back(*iter);
+      }
+    }
+    if (stripe.cold_store_) {
+      stripe.cold_store_->pin();
+    }
+    if (is_text_snapshot(header)) {
+      continue;
+    }
+    if (is_delta) {
+      frozen.removed_.swap(stripe.removed_);
+    }
+    stripe.removed_.clear();
+    stripe.checkpoint_epoch_ = header.epoch_ + 1;
+    stripe.full_dirty_ = false;
+  }
+}
+
+int SparseKVVer1Shard::write(const string& file, const SnapshotHeader& header,
+                             const vector<SparseKVVer1StripeSnapshot>& snapshot) const {
+  if (is_text_snapshot(header)) {
+    return write_text(file, snapshot);
+  }
+
+  SnapshotWriter writer(FSAgent::fs_open_write(file, ""), header);
+  BinaryArchive& ar = writer.archive();
+  int ret = ps::message::SUCCESS;
+  SparseValueVer1 value;
+  for (size_t s = 0; s < snapshot.size() && ret == ps::message::SUCCESS; ++s) {
+    const SparseKVVer1Stripe& stripe = stripe_[s];
+    const SparseKVVer1StripeSnapshot& frozen = snapshot[s];
+    for (size_t i = 0; i < frozen.removed_.size() && ret == ps::message::SUCCESS; ++i) {
+      ar << (uint8_t)SNAPSHOT_RECORD_TOMBSTONE << frozen.removed_[i];
+      ret = writer.end_record();
+    }
+    for (size_t i = 0; i < frozen.rows_.size() && ret == ps::message::SUCCESS; ++i) {
+      decode_row(stripe_[s].slab_, frozen.slab_.data(frozen.rows_[i].second), header.decay_epoch_, &value);
+      ar << (uint8_t)SNAPSHOT_RECORD_VALUE << frozen.rows_[i].first;
+      snapshot_write_value(ar, value);
+      ret = writer.end_record();
+    }
+    for (size_t i = 0; i < frozen.cold_rows_.size() && ret == ps::message::SUCCESS; ++i) {
+      read_cold(stripe, frozen.cold_rows_[i].second, header.decay_epoch_, &value);
+      ar << (uint8_t)SNAPSHOT_RECORD_VALUE << frozen.cold_rows_[i].first;
+      snapshot_write_value(ar, value);
+      ret = writer.end_record();
+    }
+  }
+  if (ret == ps::message::SUCCESS) {
+    ret = writer.finish();
+  }
+
+  return ret;
+}
+
+int SparseKVVer1Shard::write_text(const string& file, const vector<SparseKVVer1StripeSnapshot>& snapshot) const {
   int ret = ps::message::SUCCESS;
 
-  if (data_.size() > 0) {
-    string converter = "";
-    shared_ptr<FILE> fd = FSAgent::hdfs_open_write(file, converter);
-    for (auto iter : data_) {
+  string converter = "";
+  shared_ptr<FILE> fd = FSAgent::hdfs_open_write(file, converter);
+  SparseValueVer1 value;
+  for (size_t s = 0; s < snapshot.size(); ++s) {
+    const SparseKVVer1StripeSnapshot& frozen = snapshot[s];
+    for (size_t i = 0; i < frozen.rows_.size(); ++i) {
       string line;
-      rw_mutex_.WriterLock();
-      sparse_value_ver1_to_string(iter.first, iter.second, &line);
-      rw_mutex_.WriterUnlock();
+      decode_row(stripe_[s].slab_, frozen.slab_.data(frozen.rows_[i].second), frozen.decay_epoch_, &value);
+      sparse_value_ver1_to_string(frozen.rows_[i].first, value, &line);
+
+      line = line + string("\n");
+      fwrite(line.c_str(), sizeof(char), line.length(), fd.get());
+    }
+    for (size_t i = 0; i < frozen.cold_rows_.size(); ++i) {
+      string line;
+      read_cold(stripe_[s], frozen.cold_rows_[i].second, frozen.decay_epoch_, &value);
+      sparse_value_ver1_to_string(frozen.cold_rows_[i].first, value, &line);
 
       line = line + string("\n");
       fwrite(line.c_str(), sizeof(char), line.length(), fd.get());
@@ -116,155 +696,797 @@ int SparseKVVer1Shard::save(const string& file) {
   return ret;
 }
 
+void SparseKVVer1Shard::release(const bool is_written, vector<SparseKVVer1StripeSnapshot> *snapshot) {
+  for (size_t s = 0; s < snapshot->size(); ++s) {
+    SparseKVVer1Stripe& stripe = stripe_[s];
+    SparseKVVer1StripeSnapshot& frozen = (*snapshot)[s];
+    stripe.rw_mutex_.WriterLock();
+    if (stripe.cold_store_) {
+      stripe.cold_store_->unpin();
+    }
+    // the changes taken by a failed save go to the next one.
+    if (!is_written) {
+      stripe.removed_.insert(stripe.removed_.end(), frozen.removed_.begin(), frozen.removed_.end());
+      stripe.full_dirty_ = true;
+    }
+    stripe.rw_mutex_.WriterUnlock();
+  }
+  snapshot->clear();
+}
+
+int SparseKVVer1Shard::insert(const vector<SparseKeyVer1>& key, const vector<SparseValueVer1>& value,
+                              const uint32_t decay_epoch) {
+  CHECK(key.size() == value.size());
+
+  vector<vector<size_t> > group(stripe_.size());
+  for (size_t i = 0; i < key.size(); ++i) {
+    group[locate(key[i])].push_back(i);
+  }
+
+  vector<uint32_t> created;
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    if (group[s].empty()) {
+      continue;
+    }
+    SparseKVVer1Stripe& stripe = stripe_[s];
+    stripe.rw_mutex_.WriterLock();
+    for (size_t i : group[s]) {
+      auto cold = stripe.cold_index_.find(key[i]);
+      if (cold != stripe.cold_index_.end()) {
+        stripe.cold_store_->free(cold->second.offset_);
+        stripe.cold_index_.erase(cold);
+      }
+      auto iter = stripe.index_.find(key[i]);
+      uint32_t row = (iter != stripe.index_.end()) ? iter->second : alloc_row(stripe, key[i], value[i]);
+      // values of an older snapshot than the stripe are decayed here, newer ones were
+      // caught up with by catch_up_decay.
+      if (decay_epoch < stripe.decay_epoch_) {
+        SparseValueVer1 aged = value[i];
+        sparse_value_ver1_time_decay(&aged, stripe.decay_epoch_ - decay_epoch, ConfigManager::pick_training_rule());
+        store_row(stripe, row, aged);
+      } else {
+        store_row(stripe, row, value[i]);
+      }
+      mark_clean(stripe, row);
+    }
+    // loaded rows compete with each other on their scores.
+    enforce_memory_budget(stripe, &created);
+    stripe.rw_mutex_.WriterUnlock();
+  }
+
+  return ps::message::SUCCESS;
+}
+
+int SparseKVVer1Shard::erase(const vector<SparseKeyVer1>& key) {
+  vector<vector<size_t> > group(stripe_.size());
+  for (size_t i = 0; i < key.size(); ++i) {
+    group[locate(key[i])].push_back(i);
+  }
+
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    if (group[s].empty()) {
+      continue;
+    }
+    SparseKVVer1Stripe& stripe = stripe_[s];
+    stripe.rw_mutex_.WriterLock();
+    for (size_t i : group[s]) {
+      auto iter = stripe.index_.find(key[i]);
+      if (iter != stripe.index_.end()) {
+        free_row(stripe, iter->second);
+        stripe.index_.erase(iter);
+      }
+      auto cold = stripe.cold_index_.find(key[i]);
+      if (cold != stripe.cold_index_.end()) {
+        stripe.cold_store_->free(cold->second.offset_);
+        stripe.cold_index_.erase(cold);
+      }
+    }
+    stripe.rw_mutex_.WriterUnlock();
+  }
+
+  return ps::message::SUCCESS;
+}
+
+void SparseKVVer1Shard::reset_checkpoint(const uint32_t epoch) {
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    SparseKVVer1Stripe& stripe = stripe_[s];
+    stripe.rw_mutex_.WriterLock();
+    stripe.checkpoint_epoch_ = epoch + 1;
+    stripe.full_dirty_ = false;
+    stripe.removed_.clear();
+    stripe.rw_mutex_.WriterUnlock();
+  }
+}
+
 int SparseKVVer1Shard::assign(const vector<SparseFeatureVer1>& key, const vector<SparseValueVer1>& value) {
   int ret = ps::message::SUCCESS;
 
   CHECK(key.size() == value.size());
 
-  rw_mutex_.WriterLock();
+  vector<vector<size_t> > group(stripe_.size());
   for (size_t i = 0; i < key.size(); ++i) {
-    auto iter = data_.find(key[i].sign_);
-    if (iter == data_.end()) {
-      ret = ps::message::ASSIGN_NONEXISTENT_SARSE_FEATURE;
-      break;
-    }
+    group[locate(key[i].sign_)].push_back(i);
   }
-  if (ret == ps::message::SUCCESS) {
-    for (size_t i = 0; i < key.size(); ++i) {
-      auto iter = data_.find(key[i].sign_);
-      iter->second = value[i];
+
+  // promoted rows are read into one scratch value for the whole request.
+  SparseValueVer1 current;
+  vector<uint32_t> created;
+  for (size_t s = 0; s < stripe_.size() && ret == ps::message::SUCCESS; ++s) {
+    if (group[s].empty()) {
+      continue;
+    }
+    SparseKVVer1Stripe& stripe = stripe_[s];
+    stripe.rw_mutex_.WriterLock();
+    for (size_t i : group[s]) {
+      auto iter = stripe.index_.find(key[i].sign_);
+      if (iter == stripe.index_.end() && !is_cold(stripe, key[i].sign_)) {
+        ret = ps::message::ASSIGN_NONEXISTENT_SARSE_FEATURE;
+        break;
+      }
+    }
+    if (ret == ps::message::SUCCESS) {
+      created.clear();
+      for (size_t i : group[s]) {
+        auto iter = stripe.index_.find(key[i].sign_);
+        uint32_t row = 0;
+        if (iter != stripe.index_.end()) {
+          row = iter->second;
+        } else {
+          row = promote(stripe, key[i].sign_, &current);
+          created.push_back(row);
+        }
+        store_row(stripe, row, value[i]);
+        mark_dirty(stripe, row);
+      }
+      enforce_memory_budget(stripe, &created);
     }
+    stripe.rw_mutex_.WriterUnlock();
   }
-  rw_mutex_.WriterUnlock();
 
   return ret;
 }
 
-int SparseKVVer1Shard::push(const vector<SparseFeatureVer1>& key, const vector<SparseValueVer1>& value) {
+int SparseKVVer1Shard::push(const vector<SparseFeatureVer1>& key, const vector<size_t>& index,
+                            const vector<SparseValueVer1Push>& value) {
   int ret = ps::message::SUCCESS;
 
-  CHECK(key.size() == value.size());
+  CHECK(key.size() == index.size());
 
-  absl::flat_hash_map<SparseKeyVer1, SparseValueVer1> merge;
+  // gradients are referenced where they are, clients already merge repeated keys, so
+  // only a key repeated anyway is copied into merged.
+  absl::flat_hash_map<SparseKeyVer1, const SparseValueVer1Push *> merge;
+  absl::flat_hash_map<SparseKeyVer1, SparseValueVer1Push *> repeated;
+  std::deque<SparseValueVer1Push> merged;
+  merge.reserve(key.size());
   for (size_t i = 0; i < key.size(); ++i) {
-    auto iter = merge.find(key[i].sign_);
-    if (iter == merge.end()) {
-      merge[key[i].sign_] = value[i];
-    } else {
+    const SparseValueVer1Push& grad = value[index[i]];
+    auto res = merge.emplace(key[i].sign_, &grad);
+    if (!res.second) {
       // some kind of feature like "query - title" may make this check fail.
-      // CHECK(iter->second.slot_ == value[i].slot_) << "slot-1: " << iter->second.slot_
-      //   << ", slots-2: " << value[i].second.slot_;
-      ret = sparse_value_ver1_merge(&(iter->second), value[i], ConfigManager::pick_training_rule());
+      // CHECK(res.first->second->slot_ == grad.slot_) << "slot-1: " << res.first->second->slot_
+      //   << ", slots-2: " << grad.slot_;
+      auto copy = repeated.find(key[i].sign_);
+      if (copy == repeated.end()) {
+        merged.push_back(*(res.first->second));
+        copy = repeated.emplace(key[i].sign_, &(merged.back())).first;
+        res.first->second = copy->second;
+      }
+      ret = sparse_value_ver1_merge(copy->second, grad, ConfigManager::pick_training_rule());
     }
   }
 
-  rw_mutex_.WriterLock();
+  typedef std::pair<const SparseKeyVer1, const SparseValueVer1Push *> MergeItem;
+  vector<vector<const MergeItem *> > group(stripe_.size());
   for (auto i = merge.begin(); i != merge.end(); ++i) {
-    auto iter = data_.find(i->first);
-    if (iter == data_.end()) {
-      ret = ps::message::UPDATE_NONEXISTENT_SARSE_FEATURE;
-      break;
-    }
+    group[locate(i->first)].push_back(&(*i));
   }
-  if (ret == ps::message::SUCCESS) {
-    for (auto i = merge.begin(); i != merge.end(); ++i) {
-      auto iter = data_.find(i->first);
-      // some kind of feature like "query - title" may make this check fail.
-      // CHECK(key[i].slot_ == iter->second.slot_ && key[i].slot_ == value[i].slot_)
-      //   << "sign: " << key[i].sign_ << ", slot-1: " << key[i].slot_
-      //   << ", slot-2: " << iter->second.slot_ << ", slot-3: " << value[i].slot_;
-      CHECK(iter != data_.end());
-      ret = sparse_value_ver1_push(&(iter->second), i->second, ConfigManager::pick_training_rule());
+
+  // rows of a stripe are expanded into scratch values and updated as one batch.
+  vector<SparseValueVer1> current;
+  vector<uint32_t> rows;
+  vector<uint32_t> created;
+  vector<SparseValueVer1 *> batch_value;
+  vector<const SparseValueVer1Push *> batch_grad;
+  for (size_t s = 0; s < stripe_.size() && ret == ps::message::SUCCESS; ++s) {
+    if (group[s].empty()) {
+      continue;
     }
+    SparseKVVer1Stripe& stripe = stripe_[s];
+    stripe.rw_mutex_.WriterLock();
+    for (const MergeItem *i : group[s]) {
+      auto iter = stripe.index_.find(i->first);
+      if (iter == stripe.index_.end() && !is_cold(stripe, i->first) && !stripe.sketch_) {
+        ret = ps::message::UPDATE_NONEXISTENT_SARSE_FEATURE;
+        break;
+      }
+    }
+    if (ret == ps::message::SUCCESS) {
+      if (current.size() < group[s].size()) {
+        current.resize(group[s].size());
+      }
+      rows.clear();
+      created.clear();
+      batch_value.clear();
+      batch_grad.clear();
+      for (const MergeItem *i : group[s]) {
+        auto iter = stripe.index_.find(i->first);
+        // some kind of feature like "query - title" may make this check fail.
+        // CHECK(key[i].slot_ == iter->second.slot_ && key[i].slot_ == value[i].slot_)
+        //   << "sign: " << key[i].sign_ << ", slot-1: " << key[i].slot_
+        //   << ", slot-2: " << iter->second.slot_ << ", slot-3: " << value[i].slot_;
+        SparseValueVer1& cur = current[rows.size()];
+        uint32_t row = 0;
+        if (iter != stripe.index_.end()) {
+          row = iter->second;
+          load_row(stripe, row, &cur);
+        } else if (is_cold(stripe, i->first)) {
+          row = promote(stripe, i->first, &cur);
+          created.push_back(row);
+        } else if (admit(stripe, i->first, *(i->second))) {
+          ret = sparse_value_ver1_init(&cur, ConfigManager::pick_training_rule());
+          cur.slot_ = i->second->slot_;
+          sparse_value_ver1_apply_schema(&cur, ConfigManager::pick_training_rule());
+          row = alloc_row(stripe, i->first, cur);
+          created.push_back(row);
+        } else {
+          continue;
+        }
+        rows.push_back(row);
+        batch_value.push_back(&cur);
+        batch_grad.push_back(i->second);
+      }
+      ret = sparse_value_ver1_push_batch(batch_value, batch_grad, ConfigManager::pick_training_rule());
+      for (size_t r = 0; r < rows.size(); ++r) {
+        store_row(stripe, rows[r], current[r]);
+        mark_dirty(stripe, rows[r]);
+      }
+      enforce_memory_budget(stripe, &created);
+    }
+    stripe.rw_mutex_.WriterUnlock();
   }
-  rw_mutex_.WriterUnlock();
 
   return ret;
 }
 
-int SparseKVVer1Shard::pull(const vector<SparseFeatureVer1>& key, vector<SparseValueVer1> *value, const bool is_training) {
+int SparseKVVer1Shard::pull(const vector<SparseFeatureVer1>& key, const vector<size_t>& index,
+                            vector<SparseValueVer1Pull> *value, const bool is_training) {
   int ret = ps::message::SUCCESS;
 
-  value->resize(key.size());
-  rw_mutex_.WriterLock();
+  CHECK(key.size() == index.size());
+
+  vector<vector<size_t> > group(stripe_.size());
   for (size_t i = 0; i < key.size(); ++i) {
-    auto iter = data_.find(key[i].sign_);
-    if (iter == data_.end()) {
-      if (is_training) {
-        ret = sparse_value_ver1_init(&(data_[key[i].sign_]), ConfigManager::pick_training_rule());
-        data_[key[i].sign_].slot_ = key[i].slot_;
-        (*value)[i] = data_[key[i].sign_];
+    group[locate(key[i].sign_)].push_back(i);
+  }
+
+  // rows are read in place, only promoted and created ones go through out.
+  SparseValueVer1 out;
+  vector<size_t> missing;
+  vector<uint32_t> created;
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    if (group[s].empty()) {
+      continue;
+    }
+    SparseKVVer1Stripe& stripe = stripe_[s];
+
+    // lookups share the lock, missing keys are created afterwards in a short exclusive pass.
+    missing.clear();
+    stripe.rw_mutex_.ReaderLock();
+    for (size_t i : group[s]) {
+      SparseValueVer1Pull *pull = &((*value)[index[i]]);
+      auto iter = stripe.index_.find(key[i].sign_);
+      if (iter != stripe.index_.end()) {
+        pull_row(stripe, iter->second, pull);
+      } else if (is_training && (!stripe.sketch_ || is_cold(stripe, key[i].sign_))) {
+        // cold features are promoted together with the new ones, with feature admission
+        // new ones are left to push.
+        missing.push_back(i);
+      } else if (is_cold(stripe, key[i].sign_)) {
+        read_cold(stripe, stripe.cold_index_.find(key[i].sign_)->second, &out);
+        sparse_value_ver1_pull(pull, out);
       } else {
-        (*value)[i] = sparse_value_ver1_default();
-        (*value)[i].slot_ = key[i].slot_;
+        pull_default(key[i].slot_, pull);
+      }
+    }
+    stripe.rw_mutex_.ReaderUnlock();
+
+    if (missing.empty()) {
+      continue;
+    }
+
+    created.clear();
+    stripe.rw_mutex_.WriterLock();
+    for (size_t i : missing) {
+      // the key may have been created by another pull between the two passes.
+      SparseValueVer1Pull *pull = &((*value)[index[i]]);
+      auto iter = stripe.index_.find(key[i].sign_);
+      if (iter != stripe.index_.end()) {
+        pull_row(stripe, iter->second, pull);
+      } else if (is_cold(stripe, key[i].sign_)) {
+        created.push_back(promote(stripe, key[i].sign_, &out));
+        sparse_value_ver1_pull(pull, out);
+      } else if (stripe.sketch_) {
+        pull_default(key[i].slot_, pull);
+      } else {
+        ret = sparse_value_ver1_init(&out, ConfigManager::pick_training_rule());
+        out.slot_ = key[i].slot_;
+        sparse_value_ver1_apply_schema(&out, ConfigManager::pick_training_rule());
+        uint32_t row = alloc_row(stripe, key[i].sign_, out);
+        store_row(stripe, row, out);
+        mark_dirty(stripe, row);
+        created.push_back(row);
+        sparse_value_ver1_pull(pull, out);
       }
-    } else {
-      (*value)[i] = data_[key[i].sign_];
     }
+    enforce_memory_budget(stripe, &created);
+    stripe.rw_mutex_.WriterUnlock();
   }
-  rw_mutex_.WriterUnlock();
 
   return ret;
 }
 
+// drops a hot row that fails the shrink rule or moves it to the cold tier, returns
+// whether it left memory, the caller then removes it from index_.
+static bool evict_row(SparseKVVer1Stripe& stripe, const SparseKeyVer1& key, const uint32_t row,
+                      SparseValueVer1 *value) {
+  const ps::runtime::SparseTierRule& tier = ConfigManager::pick_sparse_tier_rule();
+  load_row(stripe, row, value);
+  if (sparse_value_ver1_shrink(*value, ConfigManager::pick_training_rule())) {
+    stripe.removed_.push_back(key);
+    free_row(stripe, row);
+    return true;
+  }
+  if (stripe.cold_store_ && value->silent_days_ >= tier.cold_after_silent_days_
+      && value->delta_score_ < tier.keep_delta_score_) {
+    move_cold(stripe, key, row);
+    return true;
+  }
+  return false;
+}
+
+// rows are not marked dirty: snapshots carry the decay epoch they were written at and
+// the rows of older snapshots catch up on load like stored rows do.
+static void decay_stripe(SparseKVVer1Stripe& stripe) {
+  ++stripe.decay_epoch_;
+  // the bucket of the new epoch holds the rows silent for longer than the wheel, they
+  // are handed to the background shrink.
+  if (!stripe.wheel_.empty()) {
+    uint32_t& head = stripe.wheel_[stripe.decay_epoch_ % stripe.wheel_.size()];
+    if (head != kNoRow) {
+      stripe.expired_.push_back(std::make_pair(stripe.decay_epoch_ - (uint32_t)stripe.wheel_.size(), head));
+      head = kNoRow;
+    }
+  }
+  if (stripe.sketch_) {
+    stripe.sketch_->decay();
+  }
+}
+
 int SparseKVVer1Shard::time_decay() {
   int ret = ps::message::SUCCESS;
 
-  for (auto iter : data_) {
-    sparse_value_ver1_time_decay(&(iter.second), ConfigManager::pick_training_rule());
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    SparseKVVer1Stripe& stripe = stripe_[s];
+    stripe.rw_mutex_.WriterLock();
+    decay_stripe(stripe);
+    stripe.rw_mutex_.WriterUnlock();
   }
 
   return ret;
 }
 
+void SparseKVVer1Shard::catch_up_decay(const uint32_t decay_epoch) {
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    SparseKVVer1Stripe& stripe = stripe_[s];
+    stripe.rw_mutex_.WriterLock();
+    while (stripe.decay_epoch_ < decay_epoch) {
+      decay_stripe(stripe);
+    }
+    stripe.rw_mutex_.WriterUnlock();
+  }
+}
+
 int SparseKVVer1Shard::shrink() {
   int ret = ps::message::SUCCESS;
 
-  for (auto iter : data_) {
-    if (sparse_value_ver1_shrink(iter.second, ConfigManager::pick_training_rule())) {
-      data_.erase(iter.first);
+  SparseValueVer1 value;
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    SparseKVVer1Stripe& stripe = stripe_[s];
+    stripe.rw_mutex_.WriterLock();
+    // shrink walks every hot row anyway, so silent rows also move to the cold tier here.
+    for (auto iter = stripe.index_.begin(); iter != stripe.index_.end();) {
+      if (evict_row(stripe, iter->first, iter->second, &value)) {
+        stripe.index_.erase(iter++);
+      } else {
+        ++iter;
+      }
+    }
+    for (auto iter = stripe.cold_index_.begin(); iter != stripe.cold_index_.end();) {
+      read_cold(stripe, iter->second, &value);
+      if (sparse_value_ver1_shrink(value, ConfigManager::pick_training_rule())) {
+        stripe.removed_.push_back(iter->first);
+        stripe.cold_store_->free(iter->second.offset_);
+        stripe.cold_index_.erase(iter++);
+      } else {
+        ++iter;
+      }
     }
+    stripe.rw_mutex_.WriterUnlock();
   }
 
   return ret;
 }
 
+size_t SparseKVVer1Shard::sweep(const size_t max_rows) {
+  SparseKVVer1Stripe& stripe = stripe_[sweep_stripe_];
+  const SparseKVVer1Stripe& const_stripe = stripe;
+  SparseValueVer1 value;
+  size_t n = 0;
+
+  stripe.rw_mutex_.WriterLock();
+  // rows of the wheel buckets that came due first, most of them go.
+  while (n < max_rows && !stripe.expired_.empty()) {
+    uint32_t row = stripe.expired_.back().second;
+    if (row == kNoRow) {
+      stripe.expired_.pop_back();
+      continue;
+    }
+    SparseKeyVer1 key = const_stripe.slab_.row(row)->key_;
+    wheel_unlink(stripe, row);
+    if (evict_row(stripe, key, row, &value)) {
+      stripe.index_.erase(key);
+    } else {
+      // e.g. loaded with fewer silent days, it is due again one wheel round later.
+      store_row(stripe, row, value);
+    }
+    ++n;
+  }
+  // then a slice of the walk over all rows for the ones to shrink by score.
+  while (n < max_rows && stripe.sweep_row_ < stripe.slab_.used()) {
+    uint32_t row = stripe.slab_.at(stripe.sweep_row_++);
+    SparseKeyVer1 key = const_stripe.slab_.row(row)->key_;
+    auto iter = stripe.index_.find(key);
+    if (iter != stripe.index_.end() && iter->second == row && evict_row(stripe, key, row, &value)) {
+      stripe.index_.erase(iter);
+    }
+    ++n;
+  }
+  thread_local vector<char> buffer;
+  while (n < max_rows && stripe.cold_store_ && stripe.sweep_cold_offset_ < stripe.cold_store_->end()) {
+    uint64_t offset = stripe.sweep_cold_offset_;
+    stripe.sweep_cold_offset_ += stripe.slab_.stride();
+    buffer.resize(stripe.slab_.stride());
+    stripe.cold_store_->read(offset, buffer.data());
+    SparseKeyVer1 key = reinterpret_cast<const SparseValueVer1Row *>(buffer.data())->key_;
+    auto iter = stripe.cold_index_.find(key);
+    if (iter != stripe.cold_index_.end() && iter->second.offset_ == offset) {
+      decode_row(stripe.slab_, buffer.data(), stripe.decay_epoch_, &value);
+      if (sparse_value_ver1_shrink(value, ConfigManager::pick_training_rule())) {
+        stripe.removed_.push_back(key);
+        stripe.cold_store_->free(offset);
+        stripe.cold_index_.erase(iter);
+      }
+    }
+    ++n;
+  }
+  // the stripe is done, the next tick goes on with the next one.
+  if (n < max_rows) {
+    stripe.sweep_row_ = 0;
+    stripe.sweep_cold_offset_ = 0;
+    sweep_stripe_ = (sweep_stripe_ + 1) % stripe_.size();
+  }
+  stripe.rw_mutex_.WriterUnlock();
+
+  return n;
+}
+
 uint64_t SparseKVVer1Shard::feature_num() {
-  return data_.size();
+  uint64_t feature_num = 0;
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    feature_num += stripe_[s].index_.size() + stripe_[s].cold_index_.size();
+  }
+  return feature_num;
+}
+
+size_t SparseKVVer1Shard::memory_usage() {
+  size_t bytes = 0;
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    stripe_[s].rw_mutex_.ReaderLock();
+    bytes += hot_memory_usage(stripe_[s]) + stripe_[s].cold_index_.size() * (sizeof(ColdIndexSlot) + 1);
+    stripe_[s].rw_mutex_.ReaderUnlock();
+  }
+  return bytes;
+}
+
+uint64_t SparseKVVer1Shard::evicted_num() {
+  uint64_t evicted_num = 0;
+  for (size_t s = 0; s < stripe_.size(); ++s) {
+    stripe_[s].rw_mutex_.ReaderLock();
+    evicted_num += stripe_[s].evicted_;
+    stripe_[s].rw_mutex_.ReaderUnlock();
+  }
+  return evicted_num;
+}
+
+static uint64_t table_memory_usage(void *table) {
+  return static_cast<SparseKVVer1Table *>(table)->memory_usage();
+}
+
+static uint64_t table_evicted_num(void *table) {
+  return static_cast<SparseKVVer1Table *>(table)->evicted_num();
 }
 
 SparseKVVer1Table::SparseKVVer1Table() :
   name_(""),
-  shard_(31) {
+  ring_(),
+  shard_(ConfigManager::pick_local_shard_num()),
+  checkpoint_epoch_(0),
+  save_mutex_(),
+  save_thread_(),
+  is_saving_(false),
+  save_id_(0),
+  save_ret_(),
+  shrink_mutex_(),
+  shrink_thread_(),
+  is_stopping_(false),
+  memory_var_(),
+  evicted_var_() {
+  if (ConfigManager::pick_sparse_shrink_rule().background_) {
+    shrink_thread_ = std::thread([this]() { this->shrink_loop(); });
+  }
 }
 
-SparseKVVer1Table::SparseKVVer1Table(const string& name) :
+SparseKVVer1Table::SparseKVVer1Table(const string& name, const PartitionRing& ring) :
   name_(name),
-  shard_(31) {
+  ring_(ring),
+  shard_(ConfigManager::pick_local_shard_num()),
+  checkpoint_epoch_(0),
+  save_mutex_(),
+  save_thread_(),
+  is_saving_(false),
+  save_id_(0),
+  save_ret_(),
+  shrink_mutex_(),
+  shrink_thread_(),
+  is_stopping_(false),
+  memory_var_(),
+  evicted_var_() {
+  if (ConfigManager::pick_sparse_shrink_rule().background_) {
+    shrink_thread_ = std::thread([this]() { this->shrink_loop(); });
+  }
+  memory_var_.reset(new bvar::PassiveStatus<uint64_t>(name_ + "_memory_bytes", table_memory_usage, this));
+  evicted_var_.reset(new bvar::PassiveStatus<uint64_t>(name_ + "_evicted_features", table_evicted_num, this));
 }
 
 SparseKVVer1Table::~SparseKVVer1Table() {
+  memory_var_.reset();
+  evicted_var_.reset();
+  if (shrink_thread_.joinable()) {
+    shrink_mutex_.Lock();
+    is_stopping_ = true;
+    shrink_mutex_.Unlock();
+    shrink_thread_.join();
+  }
+  if (save_thread_.joinable()) {
+    save_thread_.join();
+  }
 }
 
 const string& SparseKVVer1Table::name() const {
   return name_;
 }
 
-int SparseKVVer1Table::save(const string& path) {
+int SparseKVVer1Table::save(const string& path, uint64_t *handle) {
+  return save_snapshot(path, SNAPSHOT_BASE, handle);
+}
+
+int SparseKVVer1Table::save_delta(const string& path, uint64_t *handle) {
+  return save_snapshot(path, SNAPSHOT_DELTA, handle);
+}
+
+int SparseKVVer1Table::save_status(const uint64_t handle) {
+  absl::MutexLock lock(&save_mutex_);
+  // the save thread sets save_ret_ and clears is_saving_ together.
+  auto iter = save_ret_.find(handle);
+  if (iter != save_ret_.end()) {
+    return iter->second;
+  }
+  if (is_saving_ && handle == save_id_) {
+    return ps::message::SNAPSHOT_IN_PROGRESS;
+  }
+  LOG(ERROR) << "unknown save handle " << handle << " of sparse table " << name_;
+  return ps::message::UNKNOWN_ERROR;
+}
+
+int SparseKVVer1Table::save_snapshot(const string& path, const uint32_t snapshot_type, uint64_t *handle) {
+  absl::MutexLock lock(&save_mutex_);
+  if (is_saving_) {
+    return ps::message::SNAPSHOT_IN_PROGRESS;
+  }
+  if (save_thread_.joinable()) {
+    save_thread_.join();
+  }
+
+  size_t mpi_rank = MPIAgent::mpi_rank_group();
+  size_t shard_size = shard_.size();
+  SnapshotHeader header = {};
+  header.table_type_ = SNAPSHOT_SPARSE_KV_VER1;
+  header.snapshot_type_ = snapshot_type;
+  header.epoch_ = checkpoint_epoch_ + 1;
+  header.server_num_ = ring_.server_num();
+  header.shard_num_ = shard_size;
+  header.vnode_num_ = ring_.vnode_num();
+
+  // all stripes are frozen at the same moment, writers only wait while the rows are
+  // taken, the rows themselves are written out in the background.
+  shared_ptr<vector<vector<SparseKVVer1StripeSnapshot> > > snapshot(
+    new vector<vector<SparseKVVer1StripeSnapshot> >(shard_size));
+  for (size_t i = 0; i < shard_size; ++i) {
+    shard_[i].lock_shared();
+  }
+  ps::toolkit::ThreadGroup thread_pool(shard_size);
+  thread_pool.run([this, &header, &snapshot](int i) {
+    this->shard_[i].freeze(header, &((*snapshot)[i]));
+  });
+  for (size_t i = 0; i < shard_size; ++i) {
+    shard_[i].unlock_shared();
+  }
+  // rows are written decayed up to the newest stripe, a time decay may have been
+  // half way through the shards when they were frozen.
+  for (size_t i = 0; i < shard_size; ++i) {
+    for (const SparseKVVer1StripeSnapshot& frozen : (*snapshot)[i]) {
+      header.decay_epoch_ = std::max(header.decay_epoch_, frozen.decay_epoch_);
+    }
+  }
+
+  is_saving_ = true;
+  *handle = ++save_id_;
+  uint64_t save_id = save_id_;
+  save_thread_ = std::thread([this, path, header, snapshot, save_id, mpi_rank, shard_size]() {
+    int ret = ps::message::SUCCESS;
+
+    vector<int> tmp_ret(shard_size, ps::message::SUCCESS);
+    ps::toolkit::ThreadGroup thread_pool(shard_size);
+    thread_pool.run([this, &path, &header, &snapshot, &tmp_ret, mpi_rank, shard_size](int i) {
+      SnapshotHeader part_header = header;
+      part_header.part_id_ = mpi_rank * shard_size + i;
+      tmp_ret[i] = this->shard_[i].write(snapshot_part_file(path, part_header.part_id_), part_header, (*snapshot)[i]);
+    });
+    for (size_t i = 0; i < shard_size; ++i) {
+      if (ps::message::SUCCESS != tmp_ret[i]) {
+        ret = tmp_ret[i];
+        break;
+      }
+    }
+    for (size_t i = 0; i < shard_size; ++i) {
+      this->shard_[i].release(ps::message::SUCCESS == ret, &((*snapshot)[i]));
+    }
+    LOG(INFO) << "save sparse table: " << this->name_ << ", path = " << path << ", ret = " << ret;
+
+    absl::MutexLock lock(&(this->save_mutex_));
+    if (ps::message::SUCCESS == ret && !is_text_snapshot(header)) {
+      this->checkpoint_epoch_ = header.epoch_;
+    }
+    this->save_ret_[save_id] = ret;
+    this->is_saving_ = false;
+  });
+
+  return ps::message::SUCCESS;
+}
+
+int SparseKVVer1Table::load(const string& path) {
   int ret = ps::message::SUCCESS;
 
+  absl::MutexLock lock(&save_mutex_);
+  if (is_saving_) {
+    return ps::message::SNAPSHOT_IN_PROGRESS;
+  }
+
+  vector<string> files = snapshot_part_files(path);
+  if (files.empty()) {
+    LOG(WARNING) << "no snapshot found in " << path;
+    return ret;
+  }
+
   size_t mpi_rank = MPIAgent::mpi_rank_group();
   size_t shard_size = shard_.size();
+  SnapshotHeader header;
+  ret = snapshot_read_header(files[0], &header);
+  if (ps::message::SUCCESS != ret) {
+    return ret;
+  }
+  if (header.snapshot_type_ == SNAPSHOT_DELTA && header.epoch_ != checkpoint_epoch_ + 1) {
+    LOG(ERROR) << "delta snapshot " << path << " of epoch " << header.epoch_
+               << " does not follow epoch " << checkpoint_epoch_;
+    return ps::message::SNAPSHOT_CHAIN_ERROR;
+  }
+  for (size_t i = 0; i < shard_size; ++i) {
+    shard_[i].reset_checkpoint(header.epoch_);
+  }
 
-  ps::toolkit::ThreadGroup thread_pool(shard_.size());
-  thread_pool.run([this, mpi_rank, shard_size, path](int i) {
-    string part_file = path + absl::StrFormat("/part-%05d", mpi_rank * shard_size + i);
-    this->shard_[i].save(part_file);
+  // a snapshot written by the same topology is read back part by part, otherwise every
+  // server scans the parts of the old servers sharing an arc of the ring with it, and
+  // keeps the features routed to itself.
+  PartitionRing old_ring(header.server_num_, header.vnode_num_);
+  bool same_topology = (old_ring == ring_ && header.shard_num_ == shard_size);
+  files.clear();
+  for (size_t server_id : ring_.source_servers(old_ring, mpi_rank)) {
+    for (size_t i = 0; i < header.shard_num_; ++i) {
+      files.push_back(snapshot_part_file(path, server_id * header.shard_num_ + i));
+    }
+  }
+
+  vector<int> tmp_ret(files.size(), ps::message::SUCCESS);
+  ps::toolkit::TaskPool thread_pool(std::min(files.size(), shard_size) - 1);
+  thread_pool.run(files.size(), [this, &files, &tmp_ret, same_topology, mpi_rank, shard_size](int i) {
+    SnapshotReader reader(FSAgent::fs_open_read(files[i], ""));
+    SnapshotHeader part_header;
+    int part_ret = reader.read_header(&part_header);
+    if (ps::message::SUCCESS == part_ret && part_header.table_type_ != SNAPSHOT_SPARSE_KV_VER1) {
+      part_ret = ps::message::SNAPSHOT_FORMAT_ERROR;
+    }
+    if (ps::message::SUCCESS == part_ret) {
+      for (size_t b = 0; b < shard_size; ++b) {
+        this->shard_[b].catch_up_decay(part_header.decay_epoch_);
+      }
+    }
+
+    vector<vector<SparseKeyVer1> > tmp_key(shard_size);
+    vector<vector<SparseValueVer1> > tmp_value(shard_size);
+    vector<vector<SparseKeyVer1> > tmp_removed(shard_size);
+    uint64_t record_num = 0;
+    while (ps::message::SUCCESS == part_ret) {
+      part_ret = reader.next_block(&record_num);
+      if (ps::message::SUCCESS != part_ret || 0 == record_num) {
+        break;
+      }
+      BinaryArchive& ar = reader.archive();
+      for (uint64_t r = 0; r < record_num; ++r) {
+        uint8_t type = ar.get<uint8_t>();
+        SparseKeyVer1 key = ar.get<SparseKeyVer1>();
+        SparseValueVer1 value;
+        if (type == SNAPSHOT_RECORD_VALUE) {
+          snapshot_read_value(ar, part_header.version_, &value);
+        }
+        if (!same_topology && ring_.server_id(key) != mpi_rank) {
+          continue;
+        }
+        size_t bin = sparse_feature_shard_id(key, shard_size);
+        if (type == SNAPSHOT_RECORD_TOMBSTONE) {
+          tmp_removed[bin].push_back(key);
+        } else {
+          tmp_key[bin].push_back(key);
+          tmp_value[bin].push_back(std::move(value));
+        }
+      }
+      // tombstones precede the values in a delta, so a removed and re-created key ends up present.
+      for (size_t b = 0; b < shard_size; ++b) {
+        if (!tmp_removed[b].empty()) {
+          this->shard_[b].erase(tmp_removed[b]);
+          tmp_removed[b].clear();
+        }
+        if (!tmp_key[b].empty()) {
+          this->shard_[b].insert(tmp_key[b], tmp_value[b], part_header.decay_epoch_);
+          tmp_key[b].clear();
+          tmp_value[b].clear();
+        }
+      }
+    }
+    if (ps::message::SUCCESS != part_ret) {
+      LOG(ERROR) << "load snapshot " << files[i] << " failed: " << ps::message::errno_to_string(part_ret);
+    }
+    tmp_ret[i] = part_ret;
   });
-  // for (size_t i = 0; i < shard_.size(); ++i) {
-  //   string part_file = path + absl::StrFormat("/part-%05d", MPIAgent::mpi_rank_group() * shard_.size() + i);
-  //   shard_[i].save(part_file);
-  // }
+
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (ps::message::SUCCESS != tmp_ret[i]) {
+      ret = tmp_ret[i];
+      break;
+    }
+  }
+  if (ps::message::SUCCESS == ret) {
+    checkpoint_epoch_ = header.epoch_;
+  }
 
   return ret;
 }
@@ -278,8 +1500,7 @@ int SparseKVVer1Table::assign(const vector<SparseFeatureVer1>& key, const vector
   vector<vector<SparseValueVer1> >   tmp_value(bin_num);
 
   for (size_t i = 0; i < key.size(); ++i) {
-    // size_t bin = absl::Hash<SparseKeyVer1>()(key[i].sign_) % bin_num;
-    size_t bin = key[i].sign_ % bin_num;
+    size_t bin = sparse_feature_shard_id(key[i].sign_, bin_num);
     tmp_key[bin].push_back(key[i]);
     tmp_value[bin].push_back(value[i]);
   }
@@ -294,24 +1515,31 @@ int SparseKVVer1Table::assign(const vector<SparseFeatureVer1>& key, const vector
   return ret;
 }
 
-int SparseKVVer1Table::push(const vector<SparseFeatureVer1>& key, const vector<SparseValueVer1>& value) {
+int SparseKVVer1Table::push(const vector<SparseFeatureVer1>& key, const vector<SparseValueVer1Push>& value) {
   int ret = ps::message::SUCCESS;
 
   CHECK(key.size() == value.size());
   size_t bin_num = shard_.size();
   vector<vector<SparseFeatureVer1> > tmp_key(bin_num);
-  vector<vector<SparseValueVer1> >   tmp_value(bin_num);
+  vector<vector<size_t> > tmp_index(bin_num);
 
   for (size_t i = 0; i < key.size(); ++i) {
-    // size_t bin = absl::Hash<SparseKeyVer1>()(key[i].sign_) % bin_num;
-    size_t bin = key[i].sign_ % bin_num;
+    size_t bin = sparse_feature_shard_id(key[i].sign_, bin_num);
     tmp_key[bin].push_back(key[i]);
-    tmp_value[bin].push_back(value[i]);
+    tmp_index[bin].push_back(i);
   }
 
+  // every shard reads its own positions of value, so gradients are not copied.
+  vector<int> tmp_ret(bin_num, ps::message::SUCCESS);
+  ps::toolkit::global_table_task_pool().run(bin_num, [this, &tmp_key, &tmp_index, &tmp_ret, &value](int i) {
+    if (!tmp_key[i].empty()) {
+      tmp_ret[i] = this->shard_[i].push(tmp_key[i], tmp_index[i], value);
+    }
+  });
+
   for (size_t i = 0; i < bin_num; ++i) {
-    ret = shard_[i].push(tmp_key[i], tmp_value[i]);
-    if (ps::message::SUCCESS != ret) {
+    if (ps::message::SUCCESS != tmp_ret[i]) {
+      ret = tmp_ret[i];
       break;
     }
   }
@@ -319,7 +1547,7 @@ int SparseKVVer1Table::push(const vector<SparseFeatureVer1>& key, const vector<S
   return ret;
 }
 
-int SparseKVVer1Table::pull(const vector<SparseFeatureVer1>& key, vector<SparseValueVer1> *value, const bool is_training) {
+int SparseKVVer1Table::pull(const vector<SparseFeatureVer1>& key, vector<SparseValueVer1Pull> *value, const bool is_training) {
   int ret = ps::message::SUCCESS;
 
   value->resize(key.size());
@@ -328,21 +1556,23 @@ int SparseKVVer1Table::pull(const vector<SparseFeatureVer1>& key, vector<SparseV
   vector<vector<size_t> > tmp_index(bin_num);
 
   for (size_t i = 0; i < key.size(); ++i) {
-    // size_t bin = absl::Hash<SparseKeyVer1>()(key[i].sign_) % bin_num;
-    size_t bin = key[i].sign_ % bin_num;
+    size_t bin = sparse_feature_shard_id(key[i].sign_, bin_num);
     tmp_key[bin].push_back(key[i]);
     tmp_index[bin].push_back(i);
   }
 
-  for (size_t i = 0; i < bin_num; ++i) {
-    vector<SparseValueVer1> tmp_value;
-    ret = shard_[i].pull(tmp_key[i], &(tmp_value), is_training);
-    if (ps::message::SUCCESS != ret) {
-      break;
+  // every shard writes its own positions of value, so no merge step is needed.
+  vector<int> tmp_ret(bin_num, ps::message::SUCCESS);
+  ps::toolkit::global_table_task_pool().run(bin_num, [this, &tmp_key, &tmp_index, &tmp_ret, value, is_training](int i) {
+    if (!tmp_key[i].empty()) {
+      tmp_ret[i] = this->shard_[i].pull(tmp_key[i], tmp_index[i], value, is_training);
     }
+  });
 
-    for (size_t j = 0; j < tmp_value.size(); ++j) {
-      (*value)[tmp_index[i][j]] = tmp_value[j];
+  for (size_t i = 0; i < bin_num; ++i) {
+    if (ps::message::SUCCESS != tmp_ret[i]) {
+      ret = tmp_ret[i];
+      break;
     }
   }
 
@@ -363,6 +1593,11 @@ int SparseKVVer1Table::time_decay() {
 int SparseKVVer1Table::shrink() {
   int ret = ps::message::SUCCESS;
 
+  // the background shrink keeps removing rows, nothing to do here.
+  if (ConfigManager::pick_sparse_shrink_rule().background_) {
+    return ret;
+  }
+
   ps::toolkit::ThreadGroup thread_pool(shard_.size());
   thread_pool.run([this](int i) {
     this->shard_[i].shrink();
@@ -371,6 +1606,24 @@ int SparseKVVer1Table::shrink() {
   return ret;
 }
 
+// every tick sweeps a bounded number of rows of each shard, so training waits for at
+// most one stripe lock of tick_rows rows instead of a whole table shrink.
+void SparseKVVer1Table::shrink_loop() {
+  const ps::runtime::SparseShrinkRule& rule = ConfigManager::pick_sparse_shrink_rule();
+  while (true) {
+    shrink_mutex_.Lock();
+    bool is_stopping = shrink_mutex_.AwaitWithTimeout(absl::Condition(&is_stopping_),
+                                                      absl::Milliseconds(rule.tick_ms_));
+    shrink_mutex_.Unlock();
+    if (is_stopping) {
+      break;
+    }
+    for (size_t i = 0; i < shard_.size(); ++i) {
+      shard_[i].sweep(rule.tick_rows_);
+    }
+  }
+}
+
 uint64_t SparseKVVer1Table::feature_num() {
   uint64_t feature_num = 0;
   for (auto iter = shard_.begin(); iter != shard_.end(); ++iter) {
@@ -379,6 +1632,22 @@ uint64_t SparseKVVer1Table::feature_num() {
   return feature_num;
 }
 
+size_t SparseKVVer1Table::memory_usage() {
+  size_t bytes = 0;
+  for (auto iter = shard_.begin(); iter != shard_.end(); ++iter) {
+    bytes += iter->memory_usage();
+  }
+  return bytes;
+}
+
+uint64_t SparseKVVer1Table::evicted_num() {
+  uint64_t evicted_num = 0;
+  for (auto iter = shard_.begin(); iter != shard_.end(); ++iter) {
+    evicted_num += iter->evicted_num();
+  }
+  return evicted_num;
+}
+
 SparseKVVer1TableServer::SparseKVVer1TableServer() :
   tables_() {
 }
@@ -397,7 +1666,10 @@ int SparseKVVer1TableServer::create(const ParamServerRequest& request, ParamServ
   if (iter != tables_.end()) {
     ret = ps::message::REGIST_EXISTING_SPARSE_TABLE;
   } else {
-    tables_[table_name] = new SparseKVVer1Table(table_name);
+    BinaryArchive iar;
+    iar.set_read_buffer(request.message());
+    uint32_t vnode_num = iar.get<uint32_t>();
+    tables_[table_name] = new SparseKVVer1Table(table_name, PartitionRing(MPIAgent::mpi_size_group(), vnode_num));
     if (NULL == tables_[table_name]) {
       ret = ps::message::CAN_NOT_ALLOCATE_MEMORY;
     }
@@ -413,11 +1685,71 @@ int SparseKVVer1TableServer::save(const ParamServerRequest& request, ParamServer
   const string& table_name = request.table_name();
   auto iter = tables_.find(table_name);
   if (iter != tables_.end()) {
-    ret = iter->second->save(request.message());
+    uint64_t handle = 0;
+    ret = iter->second->save(request.message(), &handle);
+
+    BinaryArchive oar;
+    oar << handle;
+    string message;
+    oar.release(&message);
+    response->set_message(message);
+  } else {
+    ret = ps::message::PICK_NONEXISTENT_SPARSE_TABLE;
+  }
+  LOG(INFO) << "start save sparse table: " << table_name << ", path = " << request.message() << ", ret = " << ret;
+
+  response->set_return_value(ret);
+  return ret;
+}
+
+int SparseKVVer1TableServer::save_delta(const ParamServerRequest& request, ParamServerResponse *response) {
+  int ret = ps::message::SUCCESS;
+  const string& table_name = request.table_name();
+  auto iter = tables_.find(table_name);
+  if (iter != tables_.end()) {
+    uint64_t handle = 0;
+    ret = iter->second->save_delta(request.message(), &handle);
+
+    BinaryArchive oar;
+    oar << handle;
+    string message;
+    oar.release(&message);
+    response->set_message(message);
+  } else {
+    ret = ps::message::PICK_NONEXISTENT_SPARSE_TABLE;
+  }
+  LOG(INFO) << "start save delta of sparse table: " << table_name << ", path = " << request.message() << ", ret = " << ret;
+
+  response->set_return_value(ret);
+  return ret;
+}
+
+int SparseKVVer1TableServer::save_status(const ParamServerRequest& request, ParamServerResponse *response) {
+  int ret = ps::message::SUCCESS;
+  const string& table_name = request.table_name();
+  auto iter = tables_.find(table_name);
+  if (iter != tables_.end()) {
+    BinaryArchive iar;
+    iar.set_read_buffer(request.message());
+    ret = iter->second->save_status(iar.get<uint64_t>());
+  } else {
+    ret = ps::message::PICK_NONEXISTENT_SPARSE_TABLE;
+  }
+
+  response->set_return_value(ret);
+  return ret;
+}
+
+int SparseKVVer1TableServer::load(const ParamServerRequest& request, ParamServerResponse *response) {
+  int ret = ps::message::SUCCESS;
+  const string& table_name = request.table_name();
+  auto iter = tables_.find(table_name);
+  if (iter != tables_.end()) {
+    ret = iter->second->load(request.message());
   } else {
     ret = ps::message::PICK_NONEXISTENT_SPARSE_TABLE;
   }
-  LOG(INFO) << "save sparse table: " << table_name << ", path = " << request.message() << ", ret = " << ret;
+  LOG(INFO) << "load sparse table: " << table_name << ", path = " << request.message() << ", ret = " << ret;
 
   response->set_return_value(ret);
   return ret;
@@ -446,18 +1778,16 @@ int SparseKVVer1TableServer::assign(const ParamServerRequest& request, ParamServ
   return ret;
 }
 
-int SparseKVVer1TableServer::push(const ParamServerRequest& request, ParamServerResponse *response) {
+int SparseKVVer1TableServer::push(const ParamServerRequest& request, ParamServerResponse *response, brpc::Controller *cntl) {
   int ret = ps::message::SUCCESS;
   const string& table_name = request.table_name();
   auto iter = tables_.find(table_name);
   if (iter != tables_.end()) {
-    string message = request.message();
-    BinaryArchive ar;
-    ar.set_read_buffer(message);
+    PayloadReader ar(cntl->request_attachment());
 
     vector<SparseFeatureVer1> push_key;
     ar >> push_key;
-    vector<SparseValueVer1> push_value;
+    vector<SparseValueVer1Push> push_value;
     ar >> push_value;
 
     ret = iter->second->push(push_key, push_value);
@@ -469,31 +1799,25 @@ int SparseKVVer1TableServer::push(const ParamServerRequest& request, ParamServer
   return ret;
 }
 
-int SparseKVVer1TableServer::pull(const ParamServerRequest& request, ParamServerResponse *response) {
+int SparseKVVer1TableServer::pull(const ParamServerRequest& request, ParamServerResponse *response, brpc::Controller *cntl) {
   int ret = ps::message::SUCCESS;
   const string& table_name = request.table_name();
   auto iter = tables_.find(table_name);
   if (iter != tables_.end()) {
-    string message = request.message();
-    BinaryArchive ar;
-    ar.set_read_buffer(message);
+    PayloadReader ar(cntl->request_attachment());
 
     vector<SparseFeatureVer1> pull_key;
     ar >> pull_key;
 
     bool is_training = request.is_training();
 
-    vector<SparseValueVer1> pull_value;
+    vector<SparseValueVer1Pull> pull_value;
     ret = iter->second->pull(pull_key, &pull_value, is_training);
     if (ret == ps::message::SUCCESS) {
       CHECK(pull_key.size() == pull_value.size());
-      BinaryArchive oar;
+      PayloadWriter oar;
       oar << pull_value;
-
-      string message;
-      oar.release(&message);
-
-      response->set_message(message);
+      oar.finish(&(cntl->response_attachment()));
     }
   } else {
     ret = ps::message::PICK_NONEXISTENT_SPARSE_TABLE;
@@ -554,10 +1878,52 @@ int SparseKVVer1TableServer::feature_num(const ParamServerRequest& request, Para
   return ret;
 }
 
+SparseKVVer1PushWindow::SparseKVVer1PushWindow(const size_t server_num) :
+  in_flight_(server_num, 0),
+  total_(0),
+  failed_(0) {
+}
+
+void SparseKVVer1PushWindow::acquire(const size_t server_id, const int limit) {
+  CHECK(server_id < in_flight_.size());
+  const int *in_flight = &(in_flight_[server_id]);
+  auto has_room = [in_flight, limit]() { return limit <= 0 || *in_flight < limit; };
+  absl::MutexLock lock(&mutex_);
+  mutex_.Await(absl::Condition(&has_room));
+  ++in_flight_[server_id];
+  ++total_;
+}
+
+void SparseKVVer1PushWindow::release(const size_t server_id, const bool failed) {
+  absl::MutexLock lock(&mutex_);
+  CHECK(in_flight_[server_id] > 0);
+  --in_flight_[server_id];
+  --total_;
+  if (failed) {
+    ++failed_;
+  }
+}
+
+int SparseKVVer1PushWindow::wait_all() {
+  auto is_idle = [this]() { return total_ == 0; };
+  absl::MutexLock lock(&mutex_);
+  mutex_.Await(absl::Condition(&is_idle));
+  int failed = failed_;
+  failed_ = 0;
+  return failed;
+}
+
 SparseKVVer1TableClient::SparseKVVer1TableClient() :
   name_("") {
 }
 
+SparseKVVer1TableClient::~SparseKVVer1TableClient() {
+  // callbacks still running would release into a freed window.
+  if (window_) {
+    window_->wait_all();
+  }
+}
+
 const string& SparseKVVer1TableClient::name() const {
   return name_;
 }
@@ -565,6 +1931,11 @@ const string& SparseKVVer1TableClient::name() const {
 int SparseKVVer1TableClient::create(const string& name) {
   int ret = 0;
   name_ = name;
+  window_.reset(new SparseKVVer1PushWindow(MPIAgent::mpi_size_group()));
+
+  uint32_t vnode_num = (uint32_t)ConfigManager::pick_ring_vnode_num();
+  MPIAgent::mpi_bcast_group(&vnode_num, 1, 0);
+  ring_ = PartitionRing(MPIAgent::mpi_size_group(), vnode_num);
 
   DLOG(INFO) << "create sparse table: " << name_;
   if (MPIAgent::mpi_rank_group() == 0) {
@@ -573,6 +1944,12 @@ int SparseKVVer1TableClient::create(const string& name) {
     request.set_message_type(ps::message::SPARSE_TABLE_VER1_CREATE);
     request.set_table_name(name_);
 
+    BinaryArchive ar;
+    ar << vnode_num;
+    string message;
+    ar.release(&message);
+    request.set_message(message);
+
     ret = RPCAgent::send_to_all(request, &response);
     if (0 != ret) {
       LOG(FATAL) << "rpc call SPARSE_TABLE_VER1_CREATE, ret = " << ret;
@@ -592,7 +1969,134 @@ int SparseKVVer1TableClient::create(const string& name) {
   return ret;
 }
 
-static void handle_async_save_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id, atomic<int> *count) {
+// save_wait polls the servers, first after kSaveFirstPollUs and then backing off
+// up to every kSaveMaxPollUs.
+static const int64_t kSaveFirstPollUs = 10000;
+static const int64_t kSaveMaxPollUs = 1000000;
+
+static int start_save(const string& name, const ps::message::MessageType message_type,
+                      const string& path, SnapshotHandle *handle) {
+  int ret = 0;
+
+  handle->id_.clear();
+  if (MPIAgent::mpi_rank_group() == 0) {
+    ParamServerRequest request;
+    vector<ParamServerResponse> response;
+    request.set_message_type(message_type);
+    request.set_table_name(name);
+    request.set_message(path);
+
+    ret = RPCAgent::send_to_all(request, &response);
+    if (0 != ret) {
+      LOG(FATAL) << "rpc call SPARSE_TABLE_VER1_SAVE, ret = " << ret;
+    } else {
+      for (size_t i = 0; i < response.size(); ++i) {
+        ret = response[i].return_value();
+        if (ps::message::SUCCESS != ret) {
+          LOG(FATAL) << "ErrNo = " << ps::message::errno_to_string(ret)
+                     << ", message_type = " << request.message_type()
+                     << ", table_name = " << request.table_name();
+          continue;
+        }
+
+        BinaryArchive oar;
+        oar.set_read_buffer(response[i].message());
+        handle->id_.push_back(oar.get<uint64_t>());
+      }
+    }
+  }
+  // every worker gets the handle, so any of them can wait for the save.
+  MPIAgent::mpi_bcast_group(&ret, 1, 0);
+  uint64_t id_num = handle->id_.size();
+  MPIAgent::mpi_bcast_group(&id_num, 1, 0);
+  handle->id_.resize(id_num);
+  MPIAgent::mpi_bcast_group(handle->id_.data(), (int)id_num, 0);
+
+  return ret;
+}
+
+// asks every server for the save of handle, the servers answer at once.
+static int query_save(const string& name, const SnapshotHandle& handle) {
+  int ret = ps::message::SUCCESS;
+
+  ParamServerRequest request;
+  request.set_message_type(ps::message::SPARSE_TABLE_VER1_SAVE_STATUS);
+  request.set_table_name(name);
+  for (size_t i = 0; i < handle.id_.size(); ++i) {
+    BinaryArchive iar;
+    iar << handle.id_[i];
+    string message;
+    iar.release(&message);
+    request.set_message(message);
+
+    ParamServerResponse response;
+    if (0 != RPCAgent::send_to_one(request, &response, i)) {
+      LOG(FATAL) << "rpc call SPARSE_TABLE_VER1_SAVE_STATUS failed";
+    }
+    int tmp_ret = response.return_value();
+    if (ps::message::SNAPSHOT_IN_PROGRESS == tmp_ret) {
+      ret = tmp_ret;
+    } else if (ps::message::SUCCESS != tmp_ret) {
+      return tmp_ret;
+    }
+  }
+
+  return ret;
+}
+
+int SparseKVVer1TableClient::save(const string& path) const {
+  SnapshotHandle handle;
+
+  LOG(INFO) << "save sparse table: " << name_ << ", path = " << path;
+  int ret = save_async(path, &handle);
+  if (ps::message::SUCCESS == ret) {
+    ret = save_wait(handle);
+  }
+  LOG(INFO) << "finish save sparse table: " << name_ << ", path = " << path << ", ret = " << ret;
+
+  return ret;
+}
+
+int SparseKVVer1TableClient::save_delta(const string& path) const {
+  SnapshotHandle handle;
+
+  LOG(INFO) << "save delta of sparse table: " << name_ << ", path = " << path;
+  int ret = save_delta_async(path, &handle);
+  if (ps::message::SUCCESS == ret) {
+    ret = save_wait(handle);
+  }
+  LOG(INFO) << "finish save delta of sparse table: " << name_ << ", path = " << path << ", ret = " << ret;
+
+  return ret;
+}
+
+int SparseKVVer1TableClient::save_async(const string& path, SnapshotHandle *handle) const {
+  return start_save(name_, ps::message::SPARSE_TABLE_VER1_SAVE, path, handle);
+}
+
+int SparseKVVer1TableClient::save_delta_async(const string& path, SnapshotHandle *handle) const {
+  return start_save(name_, ps::message::SPARSE_TABLE_VER1_SAVE_DELTA, path, handle);
+}
+
+int SparseKVVer1TableClient::save_status(const SnapshotHandle& handle) const {
+  return query_save(name_, handle);
+}
+
+int SparseKVVer1TableClient::save_wait(const SnapshotHandle& handle) const {
+  int ret = ps::message::SUCCESS;
+  // rank 0 waits on the servers, the other workers on rank 0.
+  if (MPIAgent::mpi_rank_group() == 0) {
+    int64_t poll_us = kSaveFirstPollUs;
+    while (ps::message::SNAPSHOT_IN_PROGRESS == (ret = query_save(name_, handle))) {
+      bthread_usleep(poll_us);
+      poll_us = std::min(poll_us * 2, kSaveMaxPollUs);
+    }
+  }
+  MPIAgent::mpi_bcast_group(&ret, 1, 0);
+  return ret;
+}
+
+static void handle_async_load_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id, bthread::CountdownEvent *count) {
   // std::unique_ptr makes sure response will be deleted before returning.
   unique_ptr<brpc::Controller> cntl_guard(cntl);
   unique_ptr<ParamServerResponse> response_guard(response);
@@ -610,46 +2114,76 @@ static void handle_async_save_response(brpc::Controller *cntl, ParamServerRespon
     }
   }
   if (NULL != count) {
-    --(*count);
+    count->signal();
   }
 
   return;
 }
 
-int SparseKVVer1TableClient::save(const string& path) const {
+int SparseKVVer1TableClient::load(const string& path) const {
   int ret = 0;
 
-  LOG(INFO) << "save sparse table: " << name_ << ", path = " << path;
+  LOG(INFO) << "load sparse table: " << name_ << ", path = " << path;
   if (MPIAgent::mpi_rank_group() == 0) {
     size_t mpi_size = MPIAgent::mpi_size_group();
-    atomic<int> count(mpi_size);
+    bthread::CountdownEvent count(mpi_size);
 
     ParamServerRequest request;
-    request.set_message_type(ps::message::SPARSE_TABLE_VER1_SAVE);
+    request.set_message_type(ps::message::SPARSE_TABLE_VER1_LOAD);
     request.set_table_name(name_);
     request.set_message(path);
 
     for (size_t i = 0; i < mpi_size; ++i) {
       ParamServerResponse *response = new ParamServerResponse();
       brpc::Controller *cntl = new brpc::Controller();
-      google::protobuf::Closure *done = brpc::NewCallback(&handle_async_save_response, cntl, response, i, &count);
+      google::protobuf::Closure *done = brpc::NewCallback(&handle_async_load_response, cntl, response, i, &count);
 
       ret = RPCAgent::send_to_one_async(request, response, i, cntl, done);
       if (0 != ret) {
-        LOG(FATAL) << "rpc call SPARSE_TABLE_VER1_SAVE, ret = " << ret;
+        LOG(FATAL) << "rpc call SPARSE_TABLE_VER1_LOAD, ret = " << ret;
         continue;
       }
     }
 
-    while (count > 0) {
-      usleep(5000);
-    }
+    count.wait();
   }
-  LOG(INFO) << "finish save sparse table: " << name_ << ", path = " << path;
+  LOG(INFO) << "finish load sparse table: " << name_ << ", path = " << path;
+
+  return ret;
+}
+
+int SparseKVVer1TableClient::compact(const vector<string>& chain, const string& out) const {
+  LOG(INFO) << "compact sparse table: " << name_ << ", " << chain.size() << " snapshots into " << out;
+  int ret = snapshot_compact<SparseValueVer1>(chain, out, SNAPSHOT_SPARSE_KV_VER1,
+                                              MPIAgent::mpi_rank_group(), MPIAgent::mpi_size_group());
+  LOG(INFO) << "finish compact sparse table: " << name_ << ", ret = " << ret;
 
   return ret;
 }
-static void handle_async_assign_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id) {
+
+// a push or assign waiting for its own requests, instead of the whole window.
+struct SparseKVVer1PushCall {
+  explicit SparseKVVer1PushCall(const int request_num) : done_(request_num), failed_(0) {}
+
+  bthread::CountdownEvent done_;
+  std::atomic<int> failed_;
+};
+
+// the request is accounted to call when it is not NULL, to window otherwise.
+static void release_push(SparseKVVer1PushWindow *window, SparseKVVer1PushCall *call, size_t server_id,
+  const bool failed) {
+  if (call != NULL) {
+    if (failed) {
+      ++(call->failed_);
+    }
+    call->done_.signal();
+  } else {
+    window->release(server_id, failed);
+  }
+}
+
+static void handle_async_assign_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id,
+  SparseKVVer1PushWindow *window, SparseKVVer1PushCall *call) {
   // std::unique_ptr makes sure cntl/response will be deleted before returning.
   unique_ptr<brpc::Controller> cntl_guard(cntl);
   unique_ptr<ParamServerResponse> response_guard(response);
@@ -666,10 +2200,21 @@ static void handle_async_assign_response(brpc::Controller *cntl, ParamServerResp
                  << ", latency = " << cntl->latency_us() << "us";
     }
   }
+  release_push(window, call, server_id, cntl->Failed());
 
   return;
 }
 
+// waits for the requests of call and returns their status.
+static int wait_push(SparseKVVer1PushCall *call, const string& name) {
+  call->done_.wait();
+  if (0 != call->failed_) {
+    LOG(ERROR) << call->failed_ << " push/assign calls to sparse table " << name << " failed";
+    return ps::message::RPC_REMOTE_CALL_FAILED;
+  }
+  return ps::message::SUCCESS;
+}
+
 int SparseKVVer1TableClient::assign(const vector<SparseFeatureVer1>& key, const vector<SparseValueVer1>& value) const {
   int ret = 0;
   CHECK(key.size() == value.size());
@@ -683,13 +2228,26 @@ int SparseKVVer1TableClient::assign(const vector<SparseFeatureVer1>& key, const
   tmp_value.resize(mpi_size);
 
   for (size_t i = 0; i < key.size(); ++i) {
-    // size_t partition_id = absl::Hash<SparseKeyVer1>()(key[i].sign_) % mpi_size;
-    size_t partition_id = key[i].sign_ % mpi_size;
+    size_t partition_id = ring_.server_id(key[i].sign_);
     tmp_key[partition_id].push_back(key[i]);
     tmp_value[partition_id].push_back(value[i]);
   }
 
+  int window = ConfigManager::pick_push_window();
+  bool wait = window < 0;
+  int request_num = 0;
+  for (size_t i = 0; i < mpi_size; ++i) {
+    request_num += tmp_key[i].empty() ? 0 : 1;
+  }
+  SparseKVVer1PushCall call(wait ? request_num : 0);
   for (size_t i = 0; i < mpi_size; ++i) {
+    if (tmp_key[i].empty()) {
+      continue;
+    }
+    if (!wait) {
+      window_->acquire(i, window);
+    }
+
     ParamServerRequest request;
     ParamServerResponse *response = new ParamServerResponse();
     request.set_message_type(ps::message::SPARSE_TABLE_VER1_ASSIGN);
@@ -704,7 +2262,8 @@ int SparseKVVer1TableClient::assign(const vector<SparseFeatureVer1>& key, const
     request.set_message(message);
 
     brpc::Controller *cntl = new brpc::Controller();
-    google::protobuf::Closure *done = brpc::NewCallback(&handle_async_assign_response, cntl, response, i);
+    google::protobuf::Closure *done = brpc::NewCallback(&handle_async_assign_response, cntl, response, i,
+      window_.get(), wait ? &call : (SparseKVVer1PushCall *)NULL);
 
     ret = RPCAgent::send_to_one_async(request, response, i, cntl, done);
     if (0 != ret) {
@@ -712,11 +2271,33 @@ int SparseKVVer1TableClient::assign(const vector<SparseFeatureVer1>& key, const
       continue;
     }
   }
+  // call lives on this stack, so its callbacks are waited for even after a failed send.
+  if (wait) {
+    int wait_ret = wait_push(&call, name_);
+    ret = (0 == ret) ? wait_ret : ret;
+  }
 
   return ret;
 }
 
-static void handle_async_push_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id) {
+// uniq_key gets the distinct keys of key in first-seen order, uniq_index maps key[i] to its position there.
+static void dedup_keys(const vector<SparseFeatureVer1>& key, vector<SparseFeatureVer1> *uniq_key, vector<uint32_t> *uniq_index) {
+  absl::flat_hash_map<SparseKeyVer1, uint32_t> position;
+  position.reserve(key.size());
+  uniq_key->clear();
+  uniq_key->reserve(key.size());
+  uniq_index->resize(key.size());
+  for (size_t i = 0; i < key.size(); ++i) {
+    auto res = position.emplace(key[i].sign_, (uint32_t)uniq_key->size());
+    if (res.second) {
+      uniq_key->push_back(key[i]);
+    }
+    (*uniq_index)[i] = res.first->second;
+  }
+}
+
+static void handle_async_push_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id,
+  SparseKVVer1PushWindow *window, SparseKVVer1PushCall *call) {
   // std::unique_ptr makes sure cntl/response will be deleted before returning.
   unique_ptr<brpc::Controller> cntl_guard(cntl);
   unique_ptr<ParamServerResponse> response_guard(response);
@@ -733,44 +2314,82 @@ static void handle_async_push_response(brpc::Controller *cntl, ParamServerRespon
                  << ", latency = " << cntl->latency_us() << "us";
     }
   }
+  release_push(window, call, server_id, cntl->Failed());
 
   return;
 }
 
-int SparseKVVer1TableClient::push(const vector<SparseFeatureVer1>& key, const vector<SparseValueVer1>& value) const {
+int SparseKVVer1TableClient::push(const vector<SparseFeatureVer1>& key, const vector<SparseValueVer1Push>& value) const {
+  return send_push(key, value, ConfigManager::pick_push_window() < 0);
+}
+
+int SparseKVVer1TableClient::push_wait(const vector<SparseFeatureVer1>& key, const vector<SparseValueVer1Push>& value) const {
+  return send_push(key, value, true);
+}
+
+int SparseKVVer1TableClient::send_push(const vector<SparseFeatureVer1>& key, const vector<SparseValueVer1Push>& value,
+                                       const bool wait) const {
   int ret = 0;
 
   CHECK(key.size() == value.size());
   size_t mpi_size = MPIAgent::mpi_size_group();
 
   DLOG(INFO) << "push sparse table: " << name_;
-  vector<vector<SparseFeatureVer1> > tmp_key;
-  vector<vector<SparseValueVer1> > tmp_value;
-  tmp_key.resize(mpi_size);
-  tmp_value.resize(mpi_size);
-
+  // gradients of a key repeated in the batch are merged before they are sent.
+  vector<SparseFeatureVer1> uniq_key;
+  vector<uint32_t> uniq_index;
+  dedup_keys(key, &uniq_key, &uniq_index);
+  vector<SparseValueVer1Push> uniq_value(uniq_key.size());
+  vector<bool> is_set(uniq_key.size(), false);
   for (size_t i = 0; i < key.size(); ++i) {
-    // size_t partition_id = absl::Hash<SparseKeyVer1>()(key[i].sign_) % mpi_size;
-    size_t partition_id = key[i].sign_ % mpi_size;
-    tmp_key[partition_id].push_back(key[i]);
-    tmp_value[partition_id].push_back(value[i]);
+    uint32_t u = uniq_index[i];
+    if (!is_set[u]) {
+      uniq_value[u] = value[i];
+      is_set[u] = true;
+    } else {
+      ret = sparse_value_ver1_merge(&(uniq_value[u]), value[i], ConfigManager::pick_training_rule());
+    }
+  }
+
+  vector<vector<SparseFeatureVer1> > tmp_key(mpi_size);
+  vector<vector<SparseValueVer1Push> > tmp_value(mpi_size);
+  for (size_t i = 0; i < mpi_size; ++i) {
+    tmp_key[i].reserve(uniq_key.size() / mpi_size + 1);
+    tmp_value[i].reserve(uniq_key.size() / mpi_size + 1);
+  }
+
+  for (size_t i = 0; i < uniq_key.size(); ++i) {
+    size_t partition_id = ring_.server_id(uniq_key[i].sign_);
+    tmp_key[partition_id].push_back(uniq_key[i]);
+    tmp_value[partition_id].push_back(std::move(uniq_value[i]));
   }
 
+  int window = ConfigManager::pick_push_window();
+  int request_num = 0;
+  for (size_t i = 0; i < mpi_size; ++i) {
+    request_num += tmp_key[i].empty() ? 0 : 1;
+  }
+  SparseKVVer1PushCall call(wait ? request_num : 0);
   for (size_t i = 0; i < mpi_size; ++i) {
+    if (tmp_key[i].empty()) {
+      continue;
+    }
+    if (!wait) {
+      window_->acquire(i, window);
+    }
+
     ParamServerRequest request;
     ParamServerResponse *response = new ParamServerResponse();
     request.set_message_type(ps::message::SPARSE_TABLE_VER1_PUSH);
     request.set_table_name(name_);
 
-    BinaryArchive ar;
+    brpc::Controller *cntl = new brpc::Controller();
+    PayloadWriter ar;
     ar << tmp_key[i] << tmp_value[i];
+    ar.finish(&(cntl->request_attachment()));
 
-    string message;
-    ar.release(&message);
-    request.set_message(message);
-
-    brpc::Controller *cntl = new brpc::Controller();
-    google::protobuf::Closure *done = brpc::NewCallback(&handle_async_push_response, cntl, response, i);
+    google::protobuf::Closure *done = brpc::NewCallback(&handle_async_push_response, cntl, response, i,
+      window_.get(), wait ? &call : (SparseKVVer1PushCall *)NULL);
 
     ret = RPCAgent::send_to_one_async(request, response, i, cntl, done);
     if (0 != ret) {
@@ -778,12 +2397,26 @@ int SparseKVVer1TableClient::push(const vector<SparseFeatureVer1>& key, const ve
       continue;
     }
   }
+  // call lives on this stack, so its callbacks are waited for even after a failed send.
+  if (wait) {
+    int wait_ret = wait_push(&call, name_);
+    ret = (0 == ret) ? wait_ret : ret;
+  }
 
   return ret;
 }
 
+int SparseKVVer1TableClient::flush() const {
+  int failed = window_->wait_all();
+  if (0 != failed) {
+    LOG(ERROR) << failed << " push/assign calls to sparse table " << name_ << " failed since last flush";
+    return ps::message::RPC_REMOTE_CALL_FAILED;
+  }
+  return ps::message::SUCCESS;
+}
+
 static void handle_async_pull_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id,
-  vector<vector<uint32_t> > *tmp_mapping, vector<SparseValueVer1> *value, atomic<int> *count) {
+  vector<vector<uint32_t> > *tmp_mapping, vector<SparseValueVer1Pull> *value, bthread::CountdownEvent *count) {
   // std::unique_ptr makes sure response will be deleted before returning.
   unique_ptr<brpc::Controller> cntl_guard(cntl);
   unique_ptr<ParamServerResponse> response_guard(response);
@@ -799,61 +2432,63 @@ static void handle_async_pull_response(brpc::Controller *cntl, ParamServerRespon
                  << ": " << response->message() << " (attached = " << cntl->response_attachment() << ")"
                  << ", latency = " << cntl->latency_us() << "us";
 
-      vector<SparseValueVer1> tmp_value;
-      BinaryArchive oar;
-      oar.set_read_buffer(response->message());
-      oar >> tmp_value;
-
-      CHECK(tmp_value.size() == (*tmp_mapping)[server_id].size());
-      for (size_t i = 0; i < tmp_value.size(); ++i) {
-        (*value)[(*tmp_mapping)[server_id][i]] = tmp_value[i];
+      // values are read straight into their place in the caller's vector.
+      PayloadReader oar(cntl->response_attachment());
+      const vector<uint32_t>& mapping = (*tmp_mapping)[server_id];
+      CHECK(oar.get<size_t>() == mapping.size());
+      for (size_t i = 0; i < mapping.size(); ++i) {
+        oar >> (*value)[mapping[i]];
       }
     }
   }
   if (NULL != count) {
-    --(*count);
+    count->signal();
   }
 
   return;
 }
 
-int SparseKVVer1TableClient::pull(const vector<SparseFeatureVer1>&key, vector<SparseValueVer1> *value, const bool is_training) const {
+int SparseKVVer1TableClient::pull(const vector<SparseFeatureVer1>&key, vector<SparseValueVer1Pull> *value, const bool is_training) const {
   int ret = 0;
 
   value->resize(key.size());
   size_t mpi_size = MPIAgent::mpi_size_group();
-  atomic<int> count(mpi_size);
+  bthread::CountdownEvent count(mpi_size);
 
   DLOG(INFO) << "pull sparse table: " << name_;
-  vector<vector<SparseFeatureVer1> > tmp_key;
-  vector<vector<uint32_t> > tmp_mapping;
-  tmp_key.resize(mpi_size);
-  tmp_mapping.resize(mpi_size);
+  // every distinct key is pulled once and fanned back out by index.
+  vector<SparseFeatureVer1> uniq_key;
+  vector<uint32_t> uniq_index;
+  dedup_keys(key, &uniq_key, &uniq_index);
+  vector<SparseValueVer1Pull> uniq_value(uniq_key.size());
+
+  vector<vector<SparseFeatureVer1> > tmp_key(mpi_size);
+  vector<vector<uint32_t> > tmp_mapping(mpi_size);
+  for (size_t i = 0; i < mpi_size; ++i) {
+    tmp_key[i].reserve(uniq_key.size() / mpi_size + 1);
+    tmp_mapping[i].reserve(uniq_key.size() / mpi_size + 1);
+  }
 
-  for (size_t i = 0; i < key.size(); ++i) {
-    // size_t partition_id = absl::Hash<SparseKeyVer1>()(key[i].sign_) % mpi_size;
-    size_t partition_id = key[i].sign_ % mpi_size;
-    tmp_key[partition_id].push_back(key[i]);
+  for (size_t i = 0; i < uniq_key.size(); ++i) {
+    size_t partition_id = ring_.server_id(uniq_key[i].sign_);
+    tmp_key[partition_id].push_back(uniq_key[i]);
     tmp_mapping[partition_id].push_back(i);
   }
 
   for (size_t i = 0; i < mpi_size; ++i) {
-    BinaryArchive ar;
-    ar << tmp_key[i];
-
-    string message;
-    ar.release(&message);
-
     ParamServerRequest request;
     ParamServerResponse *response = new ParamServerResponse();
     request.set_message_type(ps::message::SPARSE_TABLE_VER1_PULL);
     request.set_table_name(name_);
-    request.set_message(message);
     request.set_is_training(is_training);
 
     brpc::Controller *cntl = new brpc::Controller();
+    PayloadWriter ar;
+    ar << tmp_key[i];
+    ar.finish(&(cntl->request_attachment()));
+
     google::protobuf::Closure *done = brpc::NewCallback(&handle_async_pull_response, cntl, response, i,
-      &tmp_mapping, value, &count);
+      &tmp_mapping, &uniq_value, &count);
 
     ret = RPCAgent::send_to_one_async(request, response, i, cntl,  done);
     if (0 != ret) {
@@ -862,14 +2497,16 @@ int SparseKVVer1TableClient::pull(const vector<SparseFeatureVer1>&key, vector<Sp
     }
   }
 
-  while (count > 0) {
-    usleep(5000);
+  count.wait();
+
+  for (size_t i = 0; i < key.size(); ++i) {
+    (*value)[i] = uniq_value[uniq_index[i]];
   }
 
   return ret;
 }
 
-static void handle_async_time_decay_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id, atomic<int> *count) {
+static void handle_async_time_decay_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id, bthread::CountdownEvent *count) {
   // std::unique_ptr makes sure response will be deleted before returning.
   unique_ptr<brpc::Controller> cntl_guard(cntl);
   unique_ptr<ParamServerResponse> response_guard(response);
@@ -887,7 +2524,7 @@ static void handle_async_time_decay_response(brpc::Controller *cntl, ParamServer
     }
   }
   if (NULL != count) {
-    --(*count);
+    count->signal();
   }
 
   return;
@@ -899,7 +2536,7 @@ int SparseKVVer1TableClient::time_decay() const {
   LOG(INFO) << "sparse table time decay: " << name_;
   if (MPIAgent::mpi_rank_group() == 0) {
     size_t mpi_size = MPIAgent::mpi_size_group();
-    atomic<int> count(mpi_size);
+    bthread::CountdownEvent count(mpi_size);
 
     ParamServerRequest request;
     request.set_message_type(ps::message::SPARSE_TABLE_VER1_TIME_DECAY);
@@ -917,16 +2554,14 @@ int SparseKVVer1TableClient::time_decay() const {
       }
     }
 
-    while (count > 0) {
-      usleep(5000);
-    }
+    count.wait();
   }
   LOG(INFO) << "finish sparse table time decay: " << name_;
 
   return ret;
 }
 
-static void handle_async_shrink_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id, atomic<int> *count) {
+static void handle_async_shrink_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id, bthread::CountdownEvent *count) {
   // std::unique_ptr makes sure response will be deleted before returning.
   unique_ptr<brpc::Controller> cntl_guard(cntl);
   unique_ptr<ParamServerResponse> response_guard(response);
@@ -944,7 +2579,7 @@ static void handle_async_shrink_response(brpc::Controller *cntl, ParamServerResp
     }
   }
   if (NULL != count) {
-    --(*count);
+    count->signal();
   }
 
   return;
@@ -956,7 +2591,7 @@ int SparseKVVer1TableClient::shrink() const {
   LOG(INFO) << "shrink sparse table: " << name_;
   if (MPIAgent::mpi_rank_group() == 0) {
     size_t mpi_size = MPIAgent::mpi_size_group();
-    atomic<int> count(mpi_size);
+    bthread::CountdownEvent count(mpi_size);
 
     ParamServerRequest request;
     request.set_message_type(ps::message::SPARSE_TABLE_VER1_SHRINK);
@@ -974,9 +2609,7 @@ int SparseKVVer1TableClient::shrink() const {
       }
     }
 
-    while (count > 0) {
-      usleep(5000);
-    }
+    count.wait();
   }
   LOG(INFO) << "finish shrink sparse table: " << name_;
 
@@ -2,10 +2,10 @@
 
 #include <stdio.h>
 #include <unistd.h>
-#include <atomic>
 #include <memory>
 #include <algorithm>
 #include <butil/logging.h>
+#include <bthread/countdown_event.h>
 #include "absl/strings/str_format.h"
 #include "message/types.h"
 #include "toolkit/archive.h"
@@ -16,7 +16,6 @@
 
 using std::vector;
 using std::string;
-using std::atomic;
 using std::unique_ptr;
 using std::shared_ptr;
 
@@ -24,6 +23,8 @@ using ps::ParamServerRequest;
 using ps::ParamServerResponse;
 
 using ps::toolkit::BinaryArchive;
+using ps::toolkit::PayloadReader;
+using ps::toolkit::PayloadWriter;
 using ps::toolkit::MPIAgent;
 using ps::toolkit::RPCAgent;
 
@@ -135,13 +136,13 @@ int SummaryValueVer1Shard::pull(vector<SummaryValueVer1> *value) {
 SummaryValueVer1Table::SummaryValueVer1Table() :
   name_(""),
   size_(0),
-  shard_(32) {
+  shard_(ConfigManager::pick_local_shard_num()) {
 }
 
 SummaryValueVer1Table::SummaryValueVer1Table(const string& name) :
   name_(name),
   size_(0),
-  shard_(32) {
+  shard_(ConfigManager::pick_local_shard_num()) {
 }
 
 SummaryValueVer1Table::~SummaryValueVer1Table() {
@@ -318,14 +319,12 @@ int SummaryValueVer1TableServer::assign(const ParamServerRequest& request, Param
   return ret;
 }
 
-int SummaryValueVer1TableServer::push(const ParamServerRequest& request, ParamServerResponse *response) {
+int SummaryValueVer1TableServer::push(const ParamServerRequest& request, ParamServerResponse *response, brpc::Controller *cntl) {
   int ret = ps::message::SUCCESS;
   const string& table_name = request.table_name();
   auto iter = tables_.find(table_name);
   if (iter != tables_.end()) {
-    string message = request.message();
-    BinaryArchive ar;
-    ar.set_read_buffer(message);
+    PayloadReader ar(cntl->request_attachment());
 
     vector<SummaryValueVer1> push_value;
     ar >> push_value;
@@ -339,7 +338,7 @@ int SummaryValueVer1TableServer::push(const ParamServerRequest& request, ParamSe
   return ret;
 }
 
-int SummaryValueVer1TableServer::pull(const ParamServerRequest& request, ParamServerResponse *response) {
+int SummaryValueVer1TableServer::pull(const ParamServerRequest& request, ParamServerResponse *response, brpc::Controller *cntl) {
   int ret = ps::message::SUCCESS;
   const string& table_name = request.table_name();
   auto iter = tables_.find(table_name);
@@ -349,13 +348,9 @@ int SummaryValueVer1TableServer::pull(const ParamServerRequest& request, ParamSe
     ret = iter->second->pull(&pull_value);
     if (ret == ps::message::SUCCESS) {
       CHECK(iter->second->size() == pull_value.size());
-      BinaryArchive oar;
+      PayloadWriter oar;
       oar << pull_value;
-
-      string message;
-      oar.release(&message);
-
-      response->set_message(message);
+      oar.finish(&(cntl->response_attachment()));
     }
   } else {
     ret = ps::message::PICK_NONEXISTENT_SUMMARY_TABLE;
@@ -454,7 +449,7 @@ int SummaryValueVer1TableClient::resize(const uint64_t size) {
   return ret;
 }
 
-static void handle_async_save_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id, atomic<int> *count) {
+static void handle_async_save_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id, bthread::CountdownEvent *count) {
   // std::unique_ptr makes sure response will be deleted before returning.
   unique_ptr<brpc::Controller> cntl_guard(cntl);
   unique_ptr<ParamServerResponse> response_guard(response);
@@ -472,7 +467,7 @@ static void handle_async_save_response(brpc::Controller *cntl, ParamServerRespon
     }
   }
   if (NULL != count) {
-    --(*count);
+    count->signal();
   }
 
   return;
@@ -484,7 +479,7 @@ int SummaryValueVer1TableClient::save(const string& path) const {
   LOG(INFO) << "save summary table: " << name_ << ", path = " << path;
   if (MPIAgent::mpi_rank_group() == 0) {
     size_t mpi_size = MPIAgent::mpi_size_group();
-    atomic<int> count(mpi_size);
+    bthread::CountdownEvent count(mpi_size);
 
     ParamServerRequest request;
     request.set_message_type(ps::message::SUMMARY_TABLE_VER1_SAVE);
@@ -503,16 +498,14 @@ int SummaryValueVer1TableClient::save(const string& path) const {
       }
     }
 
-    while (count > 0) {
-      usleep(5000);
-    }
+    count.wait();
   }
   LOG(INFO) << "finish save summary table: " << name_ << ", path = " << path;
 
   return ret;
 }
 
-static void handle_async_assign_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id, atomic<int> *count) {
+static void handle_async_assign_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id, bthread::CountdownEvent *count) {
   // std::unique_ptr makes sure cntl/response will be deleted before returning.
   unique_ptr<brpc::Controller> cntl_guard(cntl);
   unique_ptr<ParamServerResponse> response_guard(response);
@@ -530,7 +523,7 @@ static void handle_async_assign_response(brpc::Controller *cntl, ParamServerResp
     }
   }
   if (NULL != count) {
-    --(*count);
+    count->signal();
   }
 
   return;
@@ -544,7 +537,7 @@ int SummaryValueVer1TableClient::assign(const vector<SummaryValueVer1>& value) c
     CHECK(size_ == (uint64_t)value.size());
 
     size_t mpi_size = MPIAgent::mpi_size_group();
-    atomic<int> count(mpi_size);
+    bthread::CountdownEvent count(mpi_size);
 
     for (size_t i = 0; i < mpi_size; ++i) {
       ParamServerRequest request;
@@ -572,9 +565,7 @@ int SummaryValueVer1TableClient::assign(const vector<SummaryValueVer1>& value) c
       }
     }
 
-    while (count > 0) {
-      usleep(5000);
-    }
+    count.wait();
   }
 
   return ret;
@@ -614,17 +605,14 @@ int SummaryValueVer1TableClient::push(const vector<SummaryValueVer1>& value) con
     request.set_message_type(ps::message::SUMMARY_TABLE_VER1_PUSH);
     request.set_table_name(name_);
 
-    vector<SummaryValueVer1> shard;
-    shard.assign(value.begin() + boundaries_[i], value.begin() + boundaries_[i + 1]);
-
-    BinaryArchive ar;
-    ar << shard;
-
-    string message;
-    ar.release(&message);
-    request.set_message(message);
-
+    // the shard is written straight from value, in the layout of a vector.
     brpc::Controller *cntl = new brpc::Controller();
+    PayloadWriter ar;
+    ar << (size_t)(boundaries_[i + 1] - boundaries_[i]);
+    for (uint64_t j = boundaries_[i]; j < boundaries_[i + 1]; ++j) {
+      ar << value[j];
+    }
+    ar.finish(&(cntl->request_attachment()));
     google::protobuf::Closure *done = brpc::NewCallback(&handle_async_push_response, cntl, response, i);
 
     ret = RPCAgent::send_to_one_async(request, response, i, cntl, done);
@@ -637,7 +625,7 @@ int SummaryValueVer1TableClient::push(const vector<SummaryValueVer1>& value) con
 }
 
 static void handle_async_pull_response(brpc::Controller *cntl, ParamServerResponse *response, size_t server_id,
-    vector<SummaryValueVer1>::iterator begin, vector<SummaryValueVer1>::iterator end, atomic<int> *count) {
+    vector<SummaryValueVer1>::iterator begin, vector<SummaryValueVer1>::iterator end, bthread::CountdownEvent *count) {
   // std::unique_ptr makes sure response will be deleted before returning.
   unique_ptr<brpc::Controller> cntl_guard(cntl);
   unique_ptr<ParamServerResponse> response_guard(response);
@@ -652,19 +640,15 @@ static void handle_async_pull_response(brpc::Controller *cntl, ParamServerRespon
       DLOG(INFO) << "Received response from " << cntl->remote_side()
                  << ": " << response->message() << " (attached = " << cntl->response_attachment() << ")"
                  << ", latency = " << cntl->latency_us() << "us";
-      vector<SummaryValueVer1> shard;
-      BinaryArchive ar;
-      ar.set_read_buffer(response->message());
-      ar >> shard;
-
-      CHECK(shard.size() == (size_t)(end - begin));
-      for (size_t i = 0; i < shard.size(); ++i) {
-        *(begin + i) = shard[i];
+      PayloadReader ar(cntl->response_attachment());
+      CHECK(ar.get<size_t>() == (size_t)(end - begin));
+      for (auto iter = begin; iter != end; ++iter) {
+        ar >> *iter;
       }
     }
   }
   if (NULL != count) {
-    --(*count);
+    count->signal();
   }
 
   return;
@@ -674,7 +658,7 @@ int SummaryValueVer1TableClient::pull(vector<SummaryValueVer1> *value) const {
 
   value->resize(size_);
   size_t mpi_size = MPIAgent::mpi_size_group();
-  atomic<int> count(mpi_size);
+  bthread::CountdownEvent count(mpi_size);
 
   DLOG(INFO) << "async pull summary table: " << name_;
   for (size_t i = 0; i < mpi_size; ++i) {
@@ -695,9 +679,7 @@ int SummaryValueVer1TableClient::pull(vector<SummaryValueVer1> *value) const {
     }
   }
 
-  while (count > 0) {
-    usleep(5000);
-  }
+  count.wait();
 
   return ret;
 }
@@ -1,6 +1,7 @@
 #include "runtime/config_manager.h"
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string>
 #include <butil/logging.h>
 #include "absl/strings/str_split.h"
@@ -27,6 +28,7 @@ static vector<struct RPCServerInfo> rpc_server_info_;
 static struct RuntimeConfig {
   int    local_thread_num_    = 0;
   int    write_thread_num_    = 0;
+  int    server_thread_num_   = 0;
   size_t disk_buffer_size_    = 0;
   size_t hdfs_buffer_size_    = 0;
   string hdfs_command_        = "";
@@ -39,6 +41,14 @@ static struct RuntimeConfig {
 static struct ResourceConfig {
   int global_shard_num_    = 0;
   int local_shard_num_     = 0;
+  int sparse_map_stripe_num_ = 1;
+  SparseTierRule sparse_tier_rule_;
+  SparseAdmissionRule sparse_admission_rule_;
+  SparseShrinkRule sparse_shrink_rule_;
+  SparseMemoryRule sparse_memory_rule_;
+  bool text_snapshot_      = false;
+  int push_window_         = 0;
+  int ring_vnode_num_      = 0;
   vector<ShardInfo> global_shard_info_;
   vector<ShardInfo> local_shard_info_;
 } resource_config_;
@@ -71,10 +81,80 @@ void ConfigManager::load_framework_conf(Config& conf) {
   regist_data_reader_default_capacity(conf["framework"]["read_from_default_capacity"].as<size_t>());
   regist_data_reader_default_block_size(conf["framework"]["read_from_default_block_size"].as<int>());
   regist_data_reader_default_thread_num(conf["framework"]["read_from_default_thread_num"].as<int>());
+  if (conf["framework"]["param_table"]["server_thread_num"].is_defined()) {
+    regist_server_thread_num(conf["framework"]["param_table"]["server_thread_num"].as<int>());
+  }
 
   // resources config
   regist_local_shard_num(conf["framework"]["param_table"]["local_shard_num"].as<int>());
   regist_shard_info(MPIAgent::mpi_size_group(), MPIAgent::mpi_rank_group());
+  if (conf["framework"]["param_table"]["sparse_map_type"].is_defined()
+      && conf["framework"]["param_table"]["sparse_map_type"].as<string>() == "striped") {
+    if (conf["framework"]["param_table"]["sparse_map_stripe_num"].is_defined()) {
+      regist_sparse_map_stripe_num(conf["framework"]["param_table"]["sparse_map_stripe_num"].as<int>());
+    } else {
+      regist_sparse_map_stripe_num(64);
+    }
+  }
+  if (conf["framework"]["param_table"]["cold_storage"].is_defined()) {
+    Config tier_conf = conf["framework"]["param_table"]["cold_storage"];
+    SparseTierRule rule;
+    rule.cold_path_ = tier_conf["path"].as<string>();
+    if (tier_conf["cold_after_silent_days"].is_defined()) {
+      rule.cold_after_silent_days_ = tier_conf["cold_after_silent_days"].as<int>();
+    }
+    if (tier_conf["keep_delta_score"].is_defined()) {
+      rule.keep_delta_score_ = tier_conf["keep_delta_score"].as<float>();
+    }
+    regist_sparse_tier_rule(rule);
+  }
+  if (conf["framework"]["param_table"]["feature_admission"].is_defined()) {
+    Config admission_conf = conf["framework"]["param_table"]["feature_admission"];
+    SparseAdmissionRule rule;
+    rule.show_threshold_ = admission_conf["show_threshold"].as<int>();
+    if (admission_conf["sketch_width"].is_defined()) {
+      rule.sketch_width_ = admission_conf["sketch_width"].as<size_t>();
+    }
+    regist_sparse_admission_rule(rule);
+  }
+  if (conf["framework"]["param_table"]["background_shrink"].is_defined()) {
+    Config shrink_conf = conf["framework"]["param_table"]["background_shrink"];
+    SparseShrinkRule rule;
+    rule.background_ = true;
+    if (shrink_conf["tick_ms"].is_defined()) {
+      rule.tick_ms_ = shrink_conf["tick_ms"].as<int>();
+    }
+    if (shrink_conf["tick_rows"].is_defined()) {
+      rule.tick_rows_ = shrink_conf["tick_rows"].as<size_t>();
+    }
+    regist_sparse_shrink_rule(rule);
+  }
+  if (conf["framework"]["param_table"]["memory_limit"].is_defined()) {
+    Config memory_conf = conf["framework"]["param_table"]["memory_limit"];
+    SparseMemoryRule rule;
+    rule.table_bytes_ = memory_conf["table_bytes"].as<size_t>();
+    if (memory_conf["high_watermark"].is_defined()) {
+      rule.high_watermark_ = memory_conf["high_watermark"].as<float>();
+    }
+    if (memory_conf["low_watermark"].is_defined()) {
+      rule.low_watermark_ = memory_conf["low_watermark"].as<float>();
+    }
+    if (memory_conf["sample_num"].is_defined()) {
+      rule.sample_num_ = memory_conf["sample_num"].as<int>();
+    }
+    regist_sparse_memory_rule(rule);
+  }
+  if (conf["framework"]["param_table"]["snapshot_format"].is_defined()) {
+    const string format = conf["framework"]["param_table"]["snapshot_format"].as<string>();
+    CHECK(format == "binary" || format == "text") << "unknown snapshot_format: " << format;
+    regist_text_snapshot(format == "text");
+  }
+  if (conf["framework"]["param_table"]["push_window"].is_defined()) {
+    regist_push_window(conf["framework"]["param_table"]["push_window"].as<int>());
+  }
+  if (conf["framework"]["param_table"]["ring_vnode_num"].is_defined()) {
+    regist_ring_vnode_num(conf["framework"]["param_table"]["ring_vnode_num"].as<int>());
+  }
 }
 
 void ConfigManager::load_plugins_conf(Config& conf) {
@@ -94,6 +174,13 @@ void ConfigManager::load_plugins_conf(Config& conf) {
   } else {
     training_rule_.sparse_.use_quantized_embedding_ = false;
   }
+  if (conf["plugins"]["quantization_embedding_bits"].is_defined()) {
+    training_rule_.sparse_.quantized_embedding_bits_ = conf["plugins"]["quantization_embedding_bits"].as<int>();
+    CHECK(training_rule_.sparse_.quantized_embedding_bits_ == 8 || training_rule_.sparse_.quantized_embedding_bits_ == 16)
+      << "quantization_embedding_bits must be 8 or 16.";
+  } else {
+    training_rule_.sparse_.quantized_embedding_bits_ = 16;
+  }
 
   // slots
   {
@@ -241,6 +328,31 @@ void ConfigManager::load_plugins_conf(Config& conf) {
     training_rule_.sparse_.wide_rule_.weight_upper_bound_ = bounds[1];
   }
 
+  // slot schema
+  if (conf["plugins"]["use_slot_schema"].is_defined()) {
+    training_rule_.sparse_.use_slot_schema_ = conf["plugins"]["use_slot_schema"].as<bool>();
+  } else {
+    training_rule_.sparse_.use_slot_schema_ = false;
+  }
+  {
+    const vector<int> *sub_model_slots[] = {
+      &(training_rule_.sparse_.fm_rule_.slots_),
+      &(training_rule_.sparse_.mf_rule_.slots_),
+      &(training_rule_.sparse_.wide_rule_.slots_),
+    };
+    vector<uint8_t>& schema = training_rule_.sparse_.slot_schema_;
+    schema.clear();
+    for (int m = 0; m < 3; ++m) {
+      for (int slot : *sub_model_slots[m]) {
+        CHECK(slot >= 0) << "invalid slot: " << slot;
+        if ((size_t)slot >= schema.size()) {
+          schema.resize(slot + 1, 0);
+        }
+        schema[slot] |= (1 << m);
+      }
+    }
+  }
+
   // dnn
   if (conf["plugins"]["dnn_plugin"].is_scalar()) {
     *conf["plugins"]["dnn_plugin"] = YAML::LoadFile(conf["plugins"]["dnn_plugin"].as<std::string>());
@@ -368,6 +480,26 @@ void ConfigManager::load_worker_conf(Config& conf) {
     worker_rule_.data_shuffler_rule_.delete_instance_with_out_slot_ = conf["data_shuffler"]["delete_instances_without_slot"].as<string>();
   }
 
+  if (conf["sparse_cache"].is_defined()) {
+    SparseCacheRule& rule = worker_rule_.sparse_cache_rule_;
+    rule.capacity_ = conf["sparse_cache"]["capacity"].as<size_t>();
+    if (conf["sparse_cache"]["max_stale_batches"].is_defined()) {
+      rule.max_stale_batches_ = conf["sparse_cache"]["max_stale_batches"].as<int>();
+    }
+    if (conf["sparse_cache"]["max_stale_ms"].is_defined()) {
+      rule.max_stale_ms_ = conf["sparse_cache"]["max_stale_ms"].as<int>();
+    }
+    CHECK(rule.max_stale_batches_ >= 0 && rule.max_stale_ms_ >= 0) << "sparse_cache staleness bounds must not be negative.";
+    CHECK(rule.capacity_ == 0 || rule.max_stale_batches_ > 0 || rule.max_stale_ms_ > 0)
+      << "sparse_cache needs max_stale_batches or max_stale_ms.";
+  }
+
+  worker_rule_.prefetch_depth_ = 0;
+  if (conf["prefetch_depth"].is_defined()) {
+    worker_rule_.prefetch_depth_ = conf["prefetch_depth"].as<int>();
+    CHECK(worker_rule_.prefetch_depth_ >= 0) << "prefetch_depth must not be negative.";
+  }
+
   worker_rule_.train_mode_ = conf["train_mode"].as<string>();
   if (conf["offline_runner"].is_defined()) {
     worker_rule_.offline_worker_rule_.shuffle_data_      = conf["offline_runner"]["shuffle_data"].as<bool>();
@@ -547,6 +679,9 @@ void ConfigManager::regist_local_thread_num(const int local_thread_num) {
 void ConfigManager::regist_write_thread_num(const int write_thread_num) {
   runtime_config_.write_thread_num_ = write_thread_num;
 }
+void ConfigManager::regist_server_thread_num(const int server_thread_num) {
+  runtime_config_.server_thread_num_ = server_thread_num;
+}
 void ConfigManager::regist_disk_buffer_size(const size_t disk_buffer_size) {
   runtime_config_.disk_buffer_size_ = disk_buffer_size;
 }
@@ -565,6 +700,9 @@ int ConfigManager::pick_local_thread_num() {
 int ConfigManager::pick_write_thread_num() {
   return runtime_config_.write_thread_num_;
 }
+int ConfigManager::pick_server_thread_num() {
+  return runtime_config_.server_thread_num_;
+}
 size_t ConfigManager::pick_disk_buffer_size() {
   return runtime_config_.disk_buffer_size_;
 }
@@ -602,6 +740,7 @@ void ConfigManager::regist_global_shard_num(const int global_shard_num) {
   resource_config_.global_shard_num_ = global_shard_num;
 }
 void ConfigManager::regist_local_shard_num(const int local_shard_num) {
+  CHECK(local_shard_num >= 1);
   resource_config_.local_shard_num_ = local_shard_num;
 }
 
@@ -618,6 +757,70 @@ void ConfigManager::regist_shard_info(const int mpi_size, const int mpi_rank) {
   }
 }
 
+void ConfigManager::regist_sparse_map_stripe_num(const int sparse_map_stripe_num) {
+  CHECK(sparse_map_stripe_num >= 1);
+  resource_config_.sparse_map_stripe_num_ = sparse_map_stripe_num;
+}
+const int ConfigManager::pick_sparse_map_stripe_num() {
+  return resource_config_.sparse_map_stripe_num_;
+}
+
+void ConfigManager::regist_sparse_tier_rule(const SparseTierRule& rule) {
+  resource_config_.sparse_tier_rule_ = rule;
+}
+const SparseTierRule& ConfigManager::pick_sparse_tier_rule() {
+  return resource_config_.sparse_tier_rule_;
+}
+
+void ConfigManager::regist_sparse_admission_rule(const SparseAdmissionRule& rule) {
+  CHECK(rule.show_threshold_ >= 0 && rule.show_threshold_ <= UINT8_MAX)
+    << "feature_admission show_threshold must be in [0, 255]: " << rule.show_threshold_;
+  resource_config_.sparse_admission_rule_ = rule;
+}
+const SparseAdmissionRule& ConfigManager::pick_sparse_admission_rule() {
+  return resource_config_.sparse_admission_rule_;
+}
+
+void ConfigManager::regist_sparse_shrink_rule(const SparseShrinkRule& rule) {
+  CHECK(rule.tick_ms_ > 0 && rule.tick_rows_ > 0) << "background_shrink tick_ms and tick_rows must be positive.";
+  resource_config_.sparse_shrink_rule_ = rule;
+}
+const SparseShrinkRule& ConfigManager::pick_sparse_shrink_rule() {
+  return resource_config_.sparse_shrink_rule_;
+}
+
+void ConfigManager::regist_sparse_memory_rule(const SparseMemoryRule& rule) {
+  CHECK(rule.low_watermark_ > 0.0f && rule.low_watermark_ <= rule.high_watermark_ && rule.high_watermark_ <= 1.0f)
+    << "memory_limit watermarks must satisfy 0 < low_watermark <= high_watermark <= 1.";
+  CHECK(rule.sample_num_ > 0) << "memory_limit sample_num must be positive: " << rule.sample_num_;
+  resource_config_.sparse_memory_rule_ = rule;
+}
+const SparseMemoryRule& ConfigManager::pick_sparse_memory_rule() {
+  return resource_config_.sparse_memory_rule_;
+}
+
+void ConfigManager::regist_text_snapshot(const bool text_snapshot) {
+  resource_config_.text_snapshot_ = text_snapshot;
+}
+const bool ConfigManager::pick_text_snapshot() {
+  return resource_config_.text_snapshot_;
+}
+
+void ConfigManager::regist_push_window(const int push_window) {
+  resource_config_.push_window_ = push_window;
+}
+const int ConfigManager::pick_push_window() {
+  return resource_config_.push_window_;
+}
+
+void ConfigManager::regist_ring_vnode_num(const int ring_vnode_num) {
+  CHECK(ring_vnode_num >= 0) << "ring_vnode_num must not be negative: " << ring_vnode_num;
+  resource_config_.ring_vnode_num_ = ring_vnode_num;
+}
+const int ConfigManager::pick_ring_vnode_num() {
+  return resource_config_.ring_vnode_num_;
+}
+
 const int ConfigManager::pick_global_shard_num() {
   return resource_config_.global_shard_num_;
 }
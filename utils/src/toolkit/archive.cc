@@ -1,8 +1,11 @@
 #include "toolkit/archive.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
 #include <string>
 #include <butil/logging.h>
+#include <brpc/policy/snappy_compress.h>
 
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
@@ -16,18 +19,24 @@ ArchiveBase::ArchiveBase() :
   buffer_(NULL),
   cursor_(NULL),
   finish_(NULL),
-  limit_(NULL) {
+  limit_(NULL),
+  source_(NULL),
+  sink_(NULL) {
 }
 
 ArchiveBase::ArchiveBase(ArchiveBase&& other) :
   buffer_(other.buffer_),
   cursor_(other.cursor_),
   finish_(other.finish_),
-  limit_(other.limit_) {
+  limit_(other.limit_),
+  source_(other.source_),
+  sink_(other.sink_) {
     other.buffer_ = NULL;
     other.cursor_ = NULL;
     other.finish_ = NULL;
     other.limit_  = NULL;
+    other.source_ = NULL;
+    other.sink_   = NULL;
 }
 
 ArchiveBase::~ArchiveBase() {
@@ -41,10 +50,14 @@ ArchiveBase& ArchiveBase::operator=(ArchiveBase&& other) {
     cursor_ = other.cursor_;
     finish_ = other.finish_;
     limit_  = other.limit_;
+    source_ = other.source_;
+    sink_   = other.sink_;
     other.buffer_ = NULL;
     other.cursor_ = NULL;
     other.finish_ = NULL;
     other.limit_  = NULL;
+    other.source_ = NULL;
+    other.sink_   = NULL;
   }
   return *this;
 }
@@ -190,6 +203,9 @@ void ArchiveBase::advance_finish(size_t offset) {
 
 void ArchiveBase::prepare_read(size_t size) {
   if (unlikely(!(size <= size_t(finish_ - cursor_)))) {
+    if (NULL != source_) {
+      refill(size);
+    }
     CHECK(size <= size_t(finish_ - cursor_))
       << "finish - cursor = " << finish_ - cursor_ << ", size = " << size;
   }
@@ -197,18 +213,107 @@ void ArchiveBase::prepare_read(size_t size) {
 
 void ArchiveBase::prepare_write(size_t size) {
   if (unlikely(size > size_t(limit_ - finish_))) {
+    if (NULL != sink_ && length() > 0) {
+      flush();
+      if (size <= capacity()) {
+        return;
+      }
+    }
     reserve(std::max(capacity() * 2, length() + size));
   }
 }
 
 void ArchiveBase::read(void *data, size_t size) {
   if (size > 0) {
+    if (NULL != source_ && size > size_t(finish_ - cursor_)) {
+      // large reads are copied block by block, straight into data.
+      char *out = static_cast<char *>(data);
+      size_t left = finish_ - cursor_;
+      if (left > 0) {
+        memcpy(out, cursor_, left);
+        cursor_ = finish_;
+      }
+      const void *block = NULL;
+      int n = 0;
+      while (left < size && source_->Next(&block, &n)) {
+        size_t take = std::min((size_t)n, size - left);
+        memcpy(out + left, block, take);
+        left += take;
+        if (take < (size_t)n) {
+          source_->BackUp(n - take);
+        }
+      }
+      CHECK(left == size) << "payload ends " << size - left << " bytes early";
+      return;
+    }
     prepare_read(size);
     memcpy(data, cursor_, size);
     advance_cursor(size);
   }
 }
 
+void ArchiveBase::set_source(butil::IOBufAsZeroCopyInputStream *source) {
+  source_ = source;
+}
+
+void ArchiveBase::set_sink(butil::IOBuf *sink) {
+  sink_ = sink;
+}
+
+void ArchiveBase::flush() {
+  CHECK(NULL != sink_);
+  sink_->append(buffer_, length());
+  clear();
+}
+
+// buffer_ and limit_ always bound the owned buffer, cursor_ and finish_ may point into a
+// block of source_ instead.
+void ArchiveBase::refill(size_t size) {
+  size_t left = finish_ - cursor_;
+  const void *block = NULL;
+  int n = 0;
+  if (left == 0) {
+    while (source_->Next(&block, &n) && n == 0) {
+    }
+    if (n <= 0) {
+      return;
+    }
+    if ((size_t)n >= size) {
+      cursor_ = static_cast<char *>(const_cast<void *>(block));
+      finish_ = cursor_ + n;
+      return;
+    }
+    source_->BackUp(n);
+  }
+
+  // a value across blocks is gathered in the owned buffer.
+  if (size > capacity()) {
+    char *newbuf = (char *)malloc(size);
+    CHECK(NULL != newbuf) << "can not allocate memory.";
+    if (left > 0) {
+      memcpy(newbuf, cursor_, left);
+    }
+    if (NULL != buffer_) {
+      free(buffer_);
+    }
+    buffer_ = newbuf;
+    limit_  = newbuf + size;
+  } else {
+    memmove(buffer_, cursor_, left);
+  }
+  cursor_ = buffer_;
+  finish_ = buffer_ + left;
+  while (left < size && source_->Next(&block, &n)) {
+    size_t take = std::min((size_t)n, size - left);
+    memcpy(finish_, block, take);
+    finish_ += take;
+    left += take;
+    if (take < (size_t)n) {
+      source_->BackUp(n - take);
+    }
+  }
+}
+
 void ArchiveBase::read_back(void *data, size_t size) {
   if (size > 0) {
     CHECK(size <= size_t(finish_ - cursor_))
@@ -240,6 +345,54 @@ BinaryArchive& operator>>(BinaryArchive& ar, std::string& s) {
   return ar;
 }
 
+static const char kPayloadPlain  = 0;
+static const char kPayloadSnappy = 1;
+// writers hand their buffer to the IOBuf whenever this much is written.
+static const size_t kPayloadBufferBytes = 64 * 1024;
+// smaller payloads are sent as they are.
+static const size_t kPayloadCompressBytes = 512;
+
+PayloadWriter::PayloadWriter() :
+  data_() {
+  reserve(kPayloadBufferBytes);
+  set_sink(&data_);
+}
+
+void PayloadWriter::finish(butil::IOBuf *payload) {
+  flush();
+  butil::IOBuf compressed;
+  if (data_.size() >= kPayloadCompressBytes && brpc::policy::SnappyCompress(data_, &compressed)
+      && compressed.size() < data_.size()) {
+    payload->push_back(kPayloadSnappy);
+    payload->append(compressed);
+  } else {
+    payload->push_back(kPayloadPlain);
+    payload->append(data_);
+  }
+  data_.clear();
+}
+
+static butil::IOBuf decode_payload(const butil::IOBuf& payload) {
+  butil::IOBuf data(payload);
+  char codec = kPayloadPlain;
+  bool has_codec = data.cut1(&codec);
+  CHECK(has_codec) << "empty payload";
+  if (codec == kPayloadPlain) {
+    return data;
+  }
+  CHECK(codec == kPayloadSnappy) << "unknown payload codec " << (int)codec;
+  butil::IOBuf plain;
+  bool is_valid = brpc::policy::SnappyDecompress(data, &plain);
+  CHECK(is_valid) << "fail to uncompress payload";
+  return plain;
+}
+
+PayloadReader::PayloadReader(const butil::IOBuf& payload) :
+  data_(decode_payload(payload)),
+  stream_(data_) {
+  set_source(&stream_);
+}
+
 } // namespace toolkit
 } // namespace ps
 
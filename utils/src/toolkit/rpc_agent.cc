@@ -52,6 +52,7 @@ int RPCAgent::initialize(const vector<RPCServerInfo>& servers) {
       stubs_[i] = new ParamServerService_Stub(channps_[i]);
     }
   }
+  // brpc leaves attachments as they are, table payloads compress themselves, see archive.h.
   compress_type_ = brpc::COMPRESS_TYPE_SNAPPY;
   is_inited_ = 1;
 
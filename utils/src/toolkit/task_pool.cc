@@ -0,0 +1,87 @@
+#include "toolkit/task_pool.h"
+
+#include <atomic>
+#include <algorithm>
+#include <bthread/bthread.h>
+#include <bthread/countdown_event.h>
+#include <butil/logging.h>
+
+using std::function;
+
+namespace ps {
+namespace toolkit {
+
+// lives on the stack of run(), which waits for every helper to signal done_.
+struct TaskPool::Batch {
+  explicit Batch(int helper_num) : done_(helper_num) {}
+
+  function<void (int)> func_;
+  int n_;
+  std::atomic<int> next_;
+  bthread::CountdownEvent done_;
+};
+
+TaskPool::TaskPool(int thread_num) :
+  thread_num_(0) {
+  set_thread_num(thread_num);
+}
+
+int TaskPool::thread_num() {
+  return thread_num_;
+}
+
+void TaskPool::set_thread_num(int thread_num) {
+  CHECK(thread_num >= 0);
+  thread_num_ = thread_num;
+}
+
+void TaskPool::run(int n, function<void (int)> func) {
+  if (n <= 0) {
+    return;
+  }
+  if (thread_num_ == 0 || n == 1) {
+    for (int i = 0; i < n; ++i) {
+      func(i);
+    }
+    return;
+  }
+
+  int helper_num = std::min(n - 1, thread_num_);
+  Batch batch(helper_num);
+  batch.func_ = std::move(func);
+  batch.n_ = n;
+  batch.next_ = 0;
+
+  for (int i = 0; i < helper_num; ++i) {
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, run_helper, &batch) != 0) {
+      LOG(WARNING) << "Fail to start bthread, the caller takes over its share.";
+      batch.done_.signal();
+    }
+  }
+
+  work(&batch);
+  batch.done_.wait();
+}
+
+void *TaskPool::run_helper(void *arg) {
+  Batch *batch = static_cast<Batch *>(arg);
+  work(batch);
+  batch->done_.signal();
+  return NULL;
+}
+
+void TaskPool::work(Batch *batch) {
+  int i = 0;
+  while (i = batch->next_++, i < batch->n_) {
+    batch->func_(i);
+  }
+}
+
+TaskPool& global_table_task_pool() {
+  static TaskPool p;
+  return p;
+}
+
+} // namespace toolkit
+} // namespace ps
@@ -0,0 +1,95 @@
+#include <math.h>
+#include <stdio.h>
+#include <random>
+#include <vector>
+#include <gtest/gtest.h>
+#include "param_table/data/adagrad_kernel.h"
+
+using std::vector;
+using ps::param_table::AdagradKernel;
+using ps::param_table::DecayedAdagradKernel;
+using ps::param_table::adagrad_kernel_of;
+using ps::param_table::decayed_adagrad_kernel_of;
+
+// lengths below, at and above both vector widths, with every kind of tail.
+static const int kLength[] = {1, 3, 7, 8, 9, 15, 16, 17, 23, 24, 25, 31, 32, 33, 40, 47, 64, 100, 129};
+static const char *kIsa[] = {"avx2", "avx512"};
+
+static void random_vector(std::mt19937 *rng, const int n, const float scale, vector<float> *x) {
+  std::normal_distribution<float> normal(0.0f, scale);
+  x->resize(n);
+  for (auto& v : *x) {
+    v = normal(*rng);
+  }
+}
+
+static void expect_near(const vector<float>& expected, const vector<float>& actual, const char *isa,
+                        const int n, const char *what) {
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_NEAR(expected[i], actual[i], 1e-5f * (1.0f + fabsf(expected[i])))
+      << isa << " n = " << n << " " << what << "[" << i << "]";
+  }
+}
+
+TEST(AdagradKernelTest, VectorPathsMatchScalar) {
+  AdagradKernel scalar = adagrad_kernel_of("scalar");
+  ASSERT_TRUE(scalar != NULL);
+  std::mt19937 rng(17);
+  for (const char *isa : kIsa) {
+    AdagradKernel kernel = adagrad_kernel_of(isa);
+    if (kernel == NULL) {
+      printf("%s is not supported by this cpu, skipped\n", isa);
+      continue;
+    }
+    for (int n : kLength) {
+      vector<float> w;
+      vector<float> g;
+      random_vector(&rng, n, 0.1f, &w);
+      random_vector(&rng, n, 1.0f, &g);
+      vector<float> w_scalar(w);
+      vector<float> w_vector(w);
+      // tight bounds, so some of the updates are clamped.
+      float sum_scalar = scalar(n, w_scalar.data(), g.data(), 0.5f, 0.05f, -0.15f, 0.15f);
+      float sum_vector = kernel(n, w_vector.data(), g.data(), 0.5f, 0.05f, -0.15f, 0.15f);
+      expect_near(w_scalar, w_vector, isa, n, "w");
+      EXPECT_NEAR(sum_scalar, sum_vector, 1e-5f * (1.0f + sum_scalar)) << isa << " n = " << n;
+    }
+  }
+}
+
+TEST(AdagradKernelTest, DecayedVectorPathsMatchScalar) {
+  DecayedAdagradKernel scalar = decayed_adagrad_kernel_of("scalar");
+  ASSERT_TRUE(scalar != NULL);
+  std::mt19937 rng(23);
+  for (const char *isa : kIsa) {
+    DecayedAdagradKernel kernel = decayed_adagrad_kernel_of(isa);
+    if (kernel == NULL) {
+      printf("%s is not supported by this cpu, skipped\n", isa);
+      continue;
+    }
+    for (int n : kLength) {
+      vector<float> w;
+      vector<float> g;
+      vector<float> g2sum;
+      random_vector(&rng, n, 0.1f, &w);
+      random_vector(&rng, n, 1.0f, &g);
+      random_vector(&rng, n, 1.0f, &g2sum);
+      for (auto& v : g2sum) {
+        v = fabsf(v);
+      }
+      vector<float> w_scalar(w);
+      vector<float> w_vector(w);
+      vector<float> g2sum_scalar(g2sum);
+      vector<float> g2sum_vector(g2sum);
+      scalar(n, w_scalar.data(), g2sum_scalar.data(), g.data(), 0.5f, 0.05f, 0.99f, 2.0f, 1e-8f, -0.15f, 0.15f);
+      kernel(n, w_vector.data(), g2sum_vector.data(), g.data(), 0.5f, 0.05f, 0.99f, 2.0f, 1e-8f, -0.15f, 0.15f);
+      expect_near(w_scalar, w_vector, isa, n, "w");
+      expect_near(g2sum_scalar, g2sum_vector, isa, n, "g2sum");
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,215 @@
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <random>
+#include <utility>
+#include <vector>
+#include <gtest/gtest.h>
+#include "param_table/data/quantization.h"
+
+using std::vector;
+using ps::param_table::quantize;
+using ps::param_table::dequantize;
+using ps::param_table::quantized_bytes;
+using ps::param_table::float_to_half;
+using ps::param_table::float_to_half_stochastic;
+using ps::param_table::half_to_float;
+
+static float round_trip(const float x, const int bits) {
+  vector<char> buf(quantized_bytes(bits, 1));
+  quantize(&x, 1, bits, buf.data());
+  float y = 0.0f;
+  dequantize(buf.data(), 1, bits, &y);
+  return y;
+}
+
+TEST(QuantizationTest, HalfStochasticPicksNeighbours) {
+  float lo = half_to_float(float_to_half(1.0f));
+  float hi = half_to_float(float_to_half(1.0f) + 1);
+  float x = lo + (hi - lo) * 0.25f;
+  EXPECT_EQ(lo, half_to_float(float_to_half_stochastic(x, 0.3f)));
+  EXPECT_EQ(hi, half_to_float(float_to_half_stochastic(x, 0.2f)));
+  EXPECT_EQ(-lo, half_to_float(float_to_half_stochastic(-x, 0.3f)));
+  EXPECT_EQ(-hi, half_to_float(float_to_half_stochastic(-x, 0.2f)));
+  EXPECT_EQ(lo, half_to_float(float_to_half_stochastic(lo, 0.0f)));
+  EXPECT_EQ(0x7bff, float_to_half_stochastic(65504.0f, 0.0f));
+  EXPECT_EQ(0x7bff, float_to_half_stochastic(65510.0f, 0.0f));
+}
+
+TEST(QuantizationTest, StochasticRoundingIsUnbiased) {
+  const int kRound = 20000;
+  for (int bits : {16, 8}) {
+    // the int8 scale comes from the row, a second element fixes it to 1 / 127.
+    float x[2] = {0.3f / 127.0f, 1.0f};
+    double sum = 0.0;
+    vector<char> buf(quantized_bytes(bits, 2));
+    for (int r = 0; r < kRound; ++r) {
+      float y[2];
+      quantize(x, 2, bits, buf.data());
+      dequantize(buf.data(), 2, bits, y);
+      sum += y[0];
+    }
+    EXPECT_NEAR(x[0], sum / kRound, x[0] * 0.05) << "bits = " << bits;
+  }
+}
+
+TEST(QuantizationTest, SmallUpdatesAccumulate) {
+  // every step is a tenth of an fp16 step around 1, nearest rounding would never move.
+  const int kStep = 10000;
+  const float delta = (half_to_float(float_to_half(1.0f) + 1) - 1.0f) * 0.1f;
+  float w = 1.0f;
+  for (int i = 0; i < kStep; ++i) {
+    w = round_trip(w + delta, 16);
+  }
+  EXPECT_NEAR(1.0f + kStep * delta, w, kStep * delta * 0.1f);
+}
+
+static double auc(const vector<std::pair<float, int> >& pred) {
+  vector<std::pair<float, int> > sorted(pred);
+  std::sort(sorted.begin(), sorted.end());
+  double rank_sum = 0.0;
+  double pos = 0.0;
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    if (sorted[i].second) {
+      rank_sum += i + 1;
+      pos += 1;
+    }
+  }
+  double neg = sorted.size() - pos;
+  return (rank_sum - pos * (pos + 1) / 2) / (pos * neg);
+}
+
+// slot 0 of a row is the linear weight, the rest is the fm embedding.
+static float fm_logit(const vector<vector<float> >& w, const vector<int>& fea) {
+  const size_t dim = w[fea[0]].size();
+  float logit = 0.0f;
+  for (int f : fea) {
+    logit += w[f][0];
+  }
+  for (size_t d = 1; d < dim; ++d) {
+    float sum = 0.0f;
+    float square = 0.0f;
+    for (int f : fea) {
+      sum += w[f][d];
+      square += w[f][d] * w[f][d];
+    }
+    logit += 0.5f * (sum * sum - square);
+  }
+  return logit;
+}
+
+// a factorization machine trained with adagrad, embeddings and g2sums stored like
+// sparse_embedding_ver1_pack does after every push. reports bytes per row and test auc.
+static double train_embedding_model(const int bits, size_t *row_bytes) {
+  const int kFea = 500;
+  const int kDim = 9;
+  const int kFeaPerIns = 6;
+  const int kTrain = 200000;
+  const int kTest = 20000;
+  const float kLearningRate = 0.05f;
+  const float kInitialG2sum = 3.0f;
+  const int g2sum_bits = (bits == 32) ? 32 : 16;
+
+  std::mt19937 rng(7);
+  std::normal_distribution<float> normal(0.0f, 1.0f);
+  vector<vector<float> > truth(kFea, vector<float>(kDim));
+  for (auto& v : truth) {
+    for (auto& x : v) {
+      x = normal(rng) * 0.4f;
+    }
+  }
+  std::uniform_int_distribution<int> pick(0, kFea - 1);
+  std::uniform_real_distribution<float> coin(0.0f, 1.0f);
+  auto sample = [&](vector<int> *fea) {
+    fea->resize(kFeaPerIns);
+    for (auto& f : *fea) {
+      f = pick(rng);
+    }
+    return coin(rng) < 1.0f / (1.0f + expf(-fm_logit(truth, *fea))) ? 1 : 0;
+  };
+
+  size_t emb_bytes = quantized_bytes(bits, kDim);
+  *row_bytes = emb_bytes + quantized_bytes(g2sum_bits, 1);
+  vector<vector<char> > stored(kFea, vector<char>(*row_bytes));
+  for (int f = 0; f < kFea; ++f) {
+    vector<float> w(kDim);
+    for (auto& x : w) {
+      x = normal(rng) * 0.1f;
+    }
+    float g2sum = 0.0f;
+    quantize(w.data(), kDim, bits, stored[f].data());
+    quantize(&g2sum, 1, g2sum_bits, stored[f].data() + emb_bytes);
+  }
+
+  // rows of the features of one instance, dequantized.
+  auto forward = [&](const vector<int>& fea, vector<vector<float> > *w, vector<float> *sum) {
+    w->assign(fea.size(), vector<float>(kDim));
+    sum->assign(kDim, 0.0f);
+    float logit = 0.0f;
+    for (size_t i = 0; i < fea.size(); ++i) {
+      dequantize(stored[fea[i]].data(), kDim, bits, (*w)[i].data());
+      logit += (*w)[i][0];
+      for (int d = 1; d < kDim; ++d) {
+        (*sum)[d] += (*w)[i][d];
+        logit -= 0.5f * (*w)[i][d] * (*w)[i][d];
+      }
+    }
+    for (int d = 1; d < kDim; ++d) {
+      logit += 0.5f * (*sum)[d] * (*sum)[d];
+    }
+    return 1.0f / (1.0f + expf(-logit));
+  };
+
+  vector<int> fea;
+  vector<vector<float> > w;
+  vector<float> sum;
+  for (int n = 0; n < kTrain; ++n) {
+    int label = sample(&fea);
+    float grad = label - forward(fea, &w, &sum);
+    for (size_t i = 0; i < fea.size(); ++i) {
+      float g2sum = 0.0f;
+      dequantize(stored[fea[i]].data() + emb_bytes, 1, g2sum_bits, &g2sum);
+      float step = kLearningRate * sqrtf(kInitialG2sum / (kInitialG2sum + g2sum));
+      float add_g2sum = 0.0f;
+      for (int d = 0; d < kDim; ++d) {
+        float g = (d == 0) ? grad : grad * (sum[d] - w[i][d]);
+        w[i][d] += step * g;
+        add_g2sum += g * g;
+      }
+      g2sum += add_g2sum / kDim;
+      quantize(w[i].data(), kDim, bits, stored[fea[i]].data());
+      quantize(&g2sum, 1, g2sum_bits, stored[fea[i]].data() + emb_bytes);
+    }
+  }
+
+  vector<std::pair<float, int> > pred;
+  for (int n = 0; n < kTest; ++n) {
+    int label = sample(&fea);
+    pred.push_back(std::make_pair(forward(fea, &w, &sum), label));
+  }
+  return auc(pred);
+}
+
+TEST(QuantizationTest, EmbeddingMemoryAndAuc) {
+  size_t bytes_32 = 0;
+  size_t bytes_16 = 0;
+  size_t bytes_8 = 0;
+  double auc_32 = train_embedding_model(32, &bytes_32);
+  double auc_16 = train_embedding_model(16, &bytes_16);
+  double auc_8 = train_embedding_model(8, &bytes_8);
+  printf("bits  row bytes  test auc\n");
+  printf("  32  %9zu  %.4f\n", bytes_32, auc_32);
+  printf("  16  %9zu  %.4f\n", bytes_16, auc_16);
+  printf("   8  %9zu  %.4f\n", bytes_8, auc_8);
+
+  EXPECT_GT(auc_32, 0.7);
+  EXPECT_LT(bytes_16, bytes_32);
+  EXPECT_LT(bytes_8, bytes_16);
+  EXPECT_GT(auc_16, auc_32 - 0.005);
+  EXPECT_GT(auc_8, auc_32 - 0.01);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+#include "runtime/config_manager.h"
+#include "param_table/sparse_kv_ver1_table.h"
+
+using std::vector;
+using std::unique_ptr;
+using ps::runtime::ConfigManager;
+using ps::param_table::SparseKVVer1Shard;
+using ps::param_table::SparseFeatureVer1;
+using ps::param_table::SparseValueVer1Pull;
+using ps::param_table::SparseValueVer1Push;
+using ps::param_table::SPARSE_FIELD_ALL;
+
+// a benchmark, not run by bazel test, test_sparse_map_stripes checks the results instead.
+static const size_t kKeyNum = 1 << 20;
+static const size_t kBatch = 256;
+static const size_t kBatchPerThread = 2000;
+
+static void random_batch(std::mt19937_64 *rng, vector<SparseFeatureVer1> *key) {
+  key->resize(kBatch);
+  for (auto& k : *key) {
+    k.sign_ = (*rng)() % kKeyNum;
+    k.slot_ = 0;
+  }
+}
+
+// a pull / push mix like the one of a training pass, 3 pulls for every push.
+static void run_worker(SparseKVVer1Shard *shard, const int thr_id) {
+  std::mt19937_64 rng(thr_id);
+  vector<SparseFeatureVer1> key;
+  vector<size_t> index(kBatch);
+  for (size_t i = 0; i < kBatch; ++i) {
+    index[i] = i;
+  }
+  vector<SparseValueVer1Pull> pull(kBatch);
+  vector<SparseValueVer1Push> push(kBatch);
+  for (auto& p : push) {
+    p.show_ = 1.0f;
+    p.clk_ = 0.0f;
+    p.lr_w_ = 0.01f;
+    p.fm_w_ = 0.01f;
+    p.fm_v_.assign(ConfigManager::pick_training_rule().sparse_.fm_rule_.dim_, 0.01f);
+    p.mf_w_ = 0.01f;
+    p.mf_v_.assign(ConfigManager::pick_training_rule().sparse_.mf_rule_.dim_, 0.01f);
+    p.wide_w_ = 0.01f;
+    p.fields_ = SPARSE_FIELD_ALL;
+  }
+  for (size_t b = 0; b < kBatchPerThread; ++b) {
+    random_batch(&rng, &key);
+    if (b % 4 == 3) {
+      for (size_t i = 0; i < kBatch; ++i) {
+        push[i].slot_ = key[i].slot_;
+      }
+      shard->push(key, index, push);
+    } else {
+      shard->pull(key, index, &pull, true);
+    }
+  }
+}
+
+// batches per second of thread_num workers on one shard of stripe_num stripes.
+static double measure(const int stripe_num, const int thread_num) {
+  ConfigManager::regist_sparse_map_stripe_num(stripe_num);
+  unique_ptr<SparseKVVer1Shard> shard(new SparseKVVer1Shard());
+
+  vector<SparseFeatureVer1> key(kKeyNum);
+  vector<size_t> index(kKeyNum);
+  for (size_t i = 0; i < kKeyNum; ++i) {
+    key[i].sign_ = i;
+    key[i].slot_ = 0;
+    index[i] = i;
+  }
+  vector<SparseValueVer1Pull> pull(kKeyNum);
+  shard->pull(key, index, &pull, true);
+  EXPECT_EQ(kKeyNum, shard->feature_num());
+
+  auto start = std::chrono::steady_clock::now();
+  vector<std::thread> thread(thread_num);
+  for (int t = 0; t < thread_num; ++t) {
+    thread[t] = std::thread(run_worker, shard.get(), t);
+  }
+  for (auto& t : thread) {
+    t.join();
+  }
+  std::chrono::duration<double> cost = std::chrono::steady_clock::now() - start;
+  return (double)thread_num * kBatchPerThread / cost.count();
+}
+
+TEST(SparseMapScalingTest, SingleLockVsStriped) {
+  printf("threads  1 stripe batch/s  64 stripes batch/s\n");
+  for (int thread_num = 1; thread_num <= 64; thread_num *= 2) {
+    double single = measure(1, thread_num);
+    double striped = measure(64, thread_num);
+    printf("%7d  %16.0f  %18.0f\n", thread_num, single, striped);
+  }
+  ConfigManager::regist_sparse_map_stripe_num(1);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,131 @@
+#include <memory>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+#include "runtime/config_manager.h"
+#include "param_table/sparse_kv_ver1_table.h"
+
+using std::vector;
+using std::unique_ptr;
+using ps::runtime::ConfigManager;
+using ps::param_table::SparseKVVer1Shard;
+using ps::param_table::SparseKeyVer1;
+using ps::param_table::SparseFeatureVer1;
+using ps::param_table::SparseValueVer1;
+using ps::param_table::SparseValueVer1Pull;
+using ps::param_table::SparseValueVer1Push;
+using ps::param_table::SPARSE_FIELD_ALL;
+
+static const size_t kKeyNum = 4096;
+static const int kThreadNum = 8;
+static const int kRound = 50;
+
+static SparseKVVer1Shard *new_shard(const int stripe_num) {
+  ConfigManager::regist_sparse_map_stripe_num(stripe_num);
+  SparseKVVer1Shard *shard = new SparseKVVer1Shard();
+  ConfigManager::regist_sparse_map_stripe_num(1);
+  return shard;
+}
+
+static void expect_equal(const SparseValueVer1Pull& a, const SparseValueVer1Pull& b) {
+  EXPECT_EQ(a.slot_, b.slot_);
+  EXPECT_EQ(a.show_, b.show_);
+  EXPECT_EQ(a.clk_, b.clk_);
+  EXPECT_EQ(a.lr_w_, b.lr_w_);
+  EXPECT_EQ(a.fm_w_, b.fm_w_);
+  EXPECT_EQ(a.fm_v_, b.fm_v_);
+  EXPECT_EQ(a.mf_w_, b.mf_w_);
+  EXPECT_EQ(a.mf_v_, b.mf_v_);
+  EXPECT_EQ(a.wide_w_, b.wide_w_);
+}
+
+// every thread pushes to its own keys, so their updates do not depend on the
+// interleaving, and pulls all keys in between to race with the other threads.
+static void run_worker(SparseKVVer1Shard *shard, const int thr_id, vector<SparseValueVer1Pull> *own_pull) {
+  vector<SparseFeatureVer1> own_key;
+  vector<SparseFeatureVer1> all_key(kKeyNum);
+  for (size_t i = 0; i < kKeyNum; ++i) {
+    all_key[i].sign_ = i;
+    all_key[i].slot_ = 0;
+    if ((int)(i % kThreadNum) == thr_id) {
+      own_key.push_back(all_key[i]);
+    }
+  }
+  vector<size_t> own_index(own_key.size());
+  for (size_t i = 0; i < own_index.size(); ++i) {
+    own_index[i] = i;
+  }
+  vector<size_t> all_index(kKeyNum);
+  for (size_t i = 0; i < kKeyNum; ++i) {
+    all_index[i] = i;
+  }
+
+  vector<SparseValueVer1Push> push(own_key.size());
+  vector<SparseValueVer1Pull> all_pull(kKeyNum);
+  for (int r = 0; r < kRound; ++r) {
+    for (size_t i = 0; i < push.size(); ++i) {
+      float g = 0.001f * (float)((own_key[i].sign_ + r) % 7) - 0.003f;
+      push[i].slot_ = 0;
+      push[i].show_ = 1.0f;
+      push[i].clk_ = (r % 3 == 0) ? 1.0f : 0.0f;
+      push[i].lr_w_ = g;
+      push[i].fm_w_ = g;
+      push[i].fm_v_.assign(ConfigManager::pick_training_rule().sparse_.fm_rule_.dim_, g);
+      push[i].mf_w_ = g;
+      push[i].mf_v_.assign(ConfigManager::pick_training_rule().sparse_.mf_rule_.dim_, g);
+      push[i].wide_w_ = g;
+      push[i].fields_ = SPARSE_FIELD_ALL;
+    }
+    EXPECT_EQ(ps::message::SUCCESS, shard->push(own_key, own_index, push));
+    EXPECT_EQ(ps::message::SUCCESS, shard->pull(all_key, all_index, &all_pull, false));
+  }
+  own_pull->resize(own_key.size());
+  EXPECT_EQ(ps::message::SUCCESS, shard->pull(own_key, own_index, own_pull, false));
+}
+
+static void run(SparseKVVer1Shard *shard, vector<vector<SparseValueVer1Pull> > *result) {
+  result->assign(kThreadNum, vector<SparseValueVer1Pull>());
+  vector<std::thread> thread(kThreadNum);
+  for (int t = 0; t < kThreadNum; ++t) {
+    thread[t] = std::thread(run_worker, shard, t, &((*result)[t]));
+  }
+  for (auto& t : thread) {
+    t.join();
+  }
+}
+
+TEST(SparseMapStripesTest, StripedMatchesSingleMap) {
+  unique_ptr<SparseKVVer1Shard> single(new_shard(1));
+  unique_ptr<SparseKVVer1Shard> striped(new_shard(16));
+
+  // both shards start from the same randomly initialized values.
+  vector<SparseKeyVer1> key(kKeyNum);
+  vector<SparseValueVer1> value(kKeyNum);
+  for (size_t i = 0; i < kKeyNum; ++i) {
+    key[i] = i;
+    sparse_value_ver1_init(&(value[i]), ConfigManager::pick_training_rule());
+    value[i].slot_ = 0;
+    sparse_value_ver1_apply_schema(&(value[i]), ConfigManager::pick_training_rule());
+  }
+  ASSERT_EQ(ps::message::SUCCESS, single->insert(key, value, 0));
+  ASSERT_EQ(ps::message::SUCCESS, striped->insert(key, value, 0));
+
+  vector<vector<SparseValueVer1Pull> > single_pull;
+  vector<vector<SparseValueVer1Pull> > striped_pull;
+  run(single.get(), &single_pull);
+  run(striped.get(), &striped_pull);
+
+  EXPECT_EQ(kKeyNum, single->feature_num());
+  EXPECT_EQ(kKeyNum, striped->feature_num());
+  for (int t = 0; t < kThreadNum; ++t) {
+    ASSERT_EQ(single_pull[t].size(), striped_pull[t].size());
+    for (size_t i = 0; i < single_pull[t].size(); ++i) {
+      expect_equal(single_pull[t][i], striped_pull[t][i]);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}